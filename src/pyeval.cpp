@@ -0,0 +1,5161 @@
+/*
+Copyright (C) 2015  Gaetan Guidet
+
+This file is part of MayaPyExpr.
+
+MayaPyExpr is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+MayaPyExpr is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "pyeval.h"
+#include <pythread.h>
+#include <marshal.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <list>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <sstream>
+#include <fstream>
+#include <map>
+#include <sys/stat.h>
+#include <cmath>
+#include <cerrno>
+
+#ifdef PYEVAL_WORKERS
+#  include <unistd.h>
+#  include <fcntl.h>
+#  include <poll.h>
+#  include <signal.h>
+#  include <spawn.h>
+#  include <sys/mman.h>
+#  include <sys/socket.h>
+#  include <sys/wait.h>
+#  ifdef __APPLE__
+#    include <crt_externs.h>
+#    define environ (*_NSGetEnviron())
+#  else
+extern char **environ;
+#  endif
+#endif
+
+// -----------------------------------------------------------------------------
+
+PyEvalResult::PyEvalResult()
+   : succeeded(false)
+   , timedOut(false)
+   , intOutput(0)
+   , doubleOutput(0.0)
+{
+}
+
+void PyEvalResult::reset()
+{
+   succeeded = false;
+   timedOut = false;
+   errorString = "";
+   intOutput = 0;
+   intArrayOutput.clear();
+   doubleOutput = 0.0;
+   doubleArrayOutput.clear();
+   stringOutput = "";
+   stringArrayOutput.clear();
+}
+
+PyEvalRequest::PyEvalRequest()
+   : outputType(PyEval_none)
+   , verbose(false)
+   , timeBudget(0.0)
+   , isolated(false)
+   , worker(false)
+   , trace(false)
+   , historySize(0)
+   , historyGap(0.0)
+   , time(0.0)
+{
+}
+
+// -----------------------------------------------------------------------------
+
+PyEvalGIL::PyEvalGIL()
+{
+   mState = PyGILState_Ensure();
+}
+
+PyEvalGIL::~PyEvalGIL()
+{
+   PyGILState_Release(mState);
+}
+
+PyEvalAllowThreads::PyEvalAllowThreads(bool release)
+   : mState(0)
+{
+   if (release && PyEvalHoldsGIL())
+   {
+      mState = PyEval_SaveThread();
+   }
+}
+
+PyEvalAllowThreads::~PyEvalAllowThreads()
+{
+   if (mState)
+   {
+      PyEval_RestoreThread(mState);
+   }
+}
+
+bool PyEvalHoldsGIL()
+{
+   if (!Py_IsInitialized())
+   {
+      return false;
+   }
+#if PY_VERSION_HEX >= 0x030D0000
+   // PyGILState_Check always succeeds once isolated interpreters were created,
+   //   the current thread state is only set while holding the GIL
+   return (PyThreadState_GetUnchecked() != 0);
+#elif PY_VERSION_HEX >= 0x030C0000
+   return (_PyThreadState_UncheckedGet() != 0);
+#elif PY_VERSION_HEX >= 0x03040000
+   return (PyGILState_Check() != 0);
+#else
+   PyThreadState *ts = PyGILState_GetThisThreadState();
+   return (ts != 0 && ts == _PyThreadState_Current);
+#endif
+}
+
+// -----------------------------------------------------------------------------
+
+#if PY_VERSION_HEX >= 0x03070000
+typedef unsigned long PyEvalThreadId;
+#else
+typedef long PyEvalThreadId;
+#endif
+
+static std::atomic<unsigned long> gTimedOutCount(0);
+
+// Interrupts evaluations running past their deadline by raising an exception
+//   in the evaluating thread. Arm and Disarm must be called with the GIL held
+// Evaluations in an isolated interpreter pass it along with the exception to
+//   raise, as both the GIL and exception classes are per interpreter
+class Watchdog
+{
+public:
+   
+   static unsigned long Arm(double ms, PyInterpreterState *interp=0, PyObject *error=0);
+   
+   // Returns true if the evaluation was interrupted
+   static bool Disarm(unsigned long token);
+   
+   static void Shutdown();
+   
+private:
+   
+   enum State
+   {
+      Armed = 0,
+      Expired,
+      Interrupted
+   };
+   
+   struct Entry
+   {
+      unsigned long token;
+      PyEvalThreadId threadId;
+      std::chrono::steady_clock::time_point deadline;
+      State state;
+      PyInterpreterState *interp;
+      PyObject *error;
+   };
+   
+   static void Run();
+   static void Interrupt(unsigned long token);
+   static void Raise(unsigned long token);
+   
+   static std::mutex msMutex;
+   static std::condition_variable msCond;
+   static std::list<Entry> msEntries;
+   static std::thread msThread;
+   static unsigned long msNextToken;
+   static bool msStop;
+   static PyObject *msTimeoutError;
+};
+
+std::mutex Watchdog::msMutex;
+std::condition_variable Watchdog::msCond;
+std::list<Watchdog::Entry> Watchdog::msEntries;
+std::thread Watchdog::msThread;
+unsigned long Watchdog::msNextToken = 1;
+bool Watchdog::msStop = false;
+PyObject *Watchdog::msTimeoutError = 0;
+
+// Not an Exception subclass so that expressions can't swallow it by accident
+static PyObject* NewTimeoutError()
+{
+   return PyErr_NewException((char*) "pyexpr.EvaluationTimeout", PyExc_BaseException, NULL);
+}
+
+unsigned long Watchdog::Arm(double ms, PyInterpreterState *interp, PyObject *error)
+{
+   if (!interp && !msTimeoutError)
+   {
+      msTimeoutError = NewTimeoutError();
+   }
+   
+   Entry entry;
+   
+   entry.threadId = (PyEvalThreadId) PyThread_get_thread_ident();
+   entry.deadline = std::chrono::steady_clock::now() + std::chrono::microseconds((long long)(ms * 1000.0));
+   entry.state = Armed;
+   entry.interp = interp;
+   entry.error = (interp ? error : msTimeoutError);
+   
+   std::lock_guard<std::mutex> lock(msMutex);
+   
+   entry.token = msNextToken++;
+   
+   msEntries.push_back(entry);
+   
+   if (!msThread.joinable())
+   {
+      msStop = false;
+      msThread = std::thread(Run);
+   }
+   
+   msCond.notify_one();
+   
+   return entry.token;
+}
+
+bool Watchdog::Disarm(unsigned long token)
+{
+   bool interrupted = false;
+   PyEvalThreadId threadId = 0;
+   
+   {
+      std::lock_guard<std::mutex> lock(msMutex);
+      
+      for (std::list<Entry>::iterator it = msEntries.begin(); it != msEntries.end(); ++it)
+      {
+         if (it->token == token)
+         {
+            interrupted = (it->state == Interrupted);
+            threadId = it->threadId;
+            msEntries.erase(it);
+            break;
+         }
+      }
+   }
+   
+   if (interrupted)
+   {
+      // The exception may still be pending if the evaluation returned right
+      //   after it was set
+      PyThreadState_SetAsyncExc(threadId, NULL);
+   }
+   
+   return interrupted;
+}
+
+void Watchdog::Interrupt(unsigned long token)
+{
+   PyInterpreterState *interp = 0;
+   
+   {
+      std::lock_guard<std::mutex> lock(msMutex);
+      
+      for (std::list<Entry>::iterator it = msEntries.begin(); it != msEntries.end(); ++it)
+      {
+         if (it->token == token)
+         {
+            interp = it->interp;
+            break;
+         }
+      }
+   }
+   
+   // The GIL must be acquired before msMutex, see Arm and Disarm
+   if (interp)
+   {
+      // The interpreter is alive as long as the entry is armed: interpreters
+      //   are only stopped once the watchdog is shut down
+      PyThreadState *ts = PyThreadState_New(interp);
+      PyEval_AcquireThread(ts);
+      Raise(token);
+      PyThreadState_Clear(ts);
+      PyThreadState_DeleteCurrent();
+   }
+   else
+   {
+      PyEvalGIL gil;
+      Raise(token);
+   }
+}
+
+void Watchdog::Raise(unsigned long token)
+{
+   std::lock_guard<std::mutex> lock(msMutex);
+   
+   for (std::list<Entry>::iterator it = msEntries.begin(); it != msEntries.end(); ++it)
+   {
+      if (it->token == token)
+      {
+         if (it->state == Expired)
+         {
+            PyThreadState_SetAsyncExc(it->threadId, it->error);
+            it->state = Interrupted;
+         }
+         break;
+      }
+   }
+}
+
+void Watchdog::Run()
+{
+   std::unique_lock<std::mutex> lock(msMutex);
+   
+   while (!msStop)
+   {
+      std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+      std::chrono::steady_clock::time_point next = now + std::chrono::seconds(3600);
+      std::vector<unsigned long> expired;
+      
+      for (std::list<Entry>::iterator it = msEntries.begin(); it != msEntries.end(); ++it)
+      {
+         if (it->state != Armed)
+         {
+            continue;
+         }
+         
+         if (it->deadline <= now)
+         {
+            it->state = Expired;
+            expired.push_back(it->token);
+         }
+         else if (it->deadline < next)
+         {
+            next = it->deadline;
+         }
+      }
+      
+      if (expired.size() > 0)
+      {
+         lock.unlock();
+         
+         for (size_t i=0; i<expired.size(); ++i)
+         {
+            Interrupt(expired[i]);
+         }
+         
+         lock.lock();
+      }
+      else
+      {
+         msCond.wait_until(lock, next);
+      }
+   }
+}
+
+void Watchdog::Shutdown()
+{
+   {
+      std::lock_guard<std::mutex> lock(msMutex);
+      msStop = true;
+      msCond.notify_one();
+   }
+   
+   if (msThread.joinable())
+   {
+      // The watchdog may be waiting for the GIL
+      PyEvalAllowThreads allowThreads;
+      
+      msThread.join();
+   }
+}
+
+unsigned long PyEvalTimedOutCount()
+{
+   return gTimedOutCount;
+}
+
+void PyEvalResetTimedOutCount()
+{
+   gTimedOutCount = 0;
+}
+
+
+// -----------------------------------------------------------------------------
+
+static bool AsString(PyObject *obj, std::string &out)
+{
+#if PY_MAJOR_VERSION >= 3
+   PyObject *str = PyObject_Str(obj);
+   
+   if (!str)
+   {
+      return false;
+   }
+   
+   const char *s = PyUnicode_AsUTF8(str);
+   
+   if (s)
+   {
+      out = s;
+   }
+   
+   Py_DECREF(str);
+   
+   return (s != 0);
+#else
+   PyObject *str = (PyUnicode_Check(obj) ? PyUnicode_AsUTF8String(obj) : PyObject_Str(obj));
+   
+   if (!str)
+   {
+      return false;
+   }
+   
+   out = PyString_AsString(str);
+   
+   Py_DECREF(str);
+   
+   return true;
+#endif
+}
+
+static bool AsInt(PyObject *obj, int &out)
+{
+   PyObject *num = PyNumber_Long(obj);
+   
+   if (!num)
+   {
+      return false;
+   }
+   
+   out = (int) PyLong_AsLong(num);
+   
+   Py_DECREF(num);
+   
+   return (PyErr_Occurred() == 0);
+}
+
+static bool AsDouble(PyObject *obj, double &out)
+{
+   out = PyFloat_AsDouble(obj);
+   
+   return (PyErr_Occurred() == 0);
+}
+
+template <typename T>
+static bool AsArray(PyObject *obj, std::vector<T> &out, bool (*asItem)(PyObject*, T&))
+{
+   PyObject *seq = PySequence_Fast(obj, "expected a sequence");
+   
+   if (!seq)
+   {
+      return false;
+   }
+   
+   Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+   
+   out.resize(n);
+   
+   for (Py_ssize_t i=0; i<n; ++i)
+   {
+      if (!asItem(PySequence_Fast_GET_ITEM(seq, i), out[i]))
+      {
+         Py_DECREF(seq);
+         out.clear();
+         return false;
+      }
+   }
+   
+   Py_DECREF(seq);
+   
+   return true;
+}
+
+static bool AsPoints(PyObject *obj, std::vector<double> &out)
+{
+   out.clear();
+   
+   if (obj == Py_None)
+   {
+      return true;
+   }
+   
+   PyObject *seq = PySequence_Fast(obj, "expected a sequence of points");
+   
+   if (!seq)
+   {
+      return false;
+   }
+   
+   Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+   
+   out.reserve(3 * n);
+   
+   for (Py_ssize_t i=0; i<n; ++i)
+   {
+      PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+      
+      if (PyNumber_Check(item))
+      {
+         double v = 0.0;
+         
+         if (!AsDouble(item, v))
+         {
+            Py_DECREF(seq);
+            return false;
+         }
+         
+         out.push_back(v);
+      }
+      else
+      {
+         std::vector<double> pnt;
+         
+         if (!AsArray(item, pnt, AsDouble) || pnt.size() < 3)
+         {
+            if (!PyErr_Occurred())
+            {
+               PyErr_SetString(PyExc_ValueError, "points must have at least 3 coordinates");
+            }
+            Py_DECREF(seq);
+            return false;
+         }
+         
+         out.insert(out.end(), pnt.begin(), pnt.begin() + 3);
+      }
+   }
+   
+   Py_DECREF(seq);
+   
+   return true;
+}
+
+static bool Convert(PyObject *obj, short outputType, PyEvalResult &result)
+{
+   switch (outputType)
+   {
+   case PyEval_points:
+      return AsPoints(obj, result.doubleArrayOutput);
+   case PyEval_int:
+      return AsInt(obj, result.intOutput);
+   case PyEval_int_array:
+      return AsArray(obj, result.intArrayOutput, AsInt);
+   case PyEval_double:
+      return AsDouble(obj, result.doubleOutput);
+   case PyEval_double_array:
+      return AsArray(obj, result.doubleArrayOutput, AsDouble);
+   case PyEval_string:
+      return AsString(obj, result.stringOutput);
+   case PyEval_string_array:
+      return AsArray(obj, result.stringArrayOutput, AsString);
+   default:
+      return true;
+   }
+}
+
+static std::atomic<PyEvalErrorHandler> gErrorHandler(0);
+
+void PyEvalSetErrorHandler(PyEvalErrorHandler handler)
+{
+   gErrorHandler.store(handler);
+}
+
+// Print the current python error with its traceback and clear it, the GIL must
+//   be held. Goes to the error handler when one is set, stderr otherwise
+static void PrintError()
+{
+   PyEvalErrorHandler handler = gErrorHandler.load();
+   
+   if (!handler)
+   {
+      PyErr_Print();
+      return;
+   }
+   
+   PyObject *type = 0, *value = 0, *tb = 0;
+   
+   PyErr_Fetch(&type, &value, &tb);
+   PyErr_NormalizeException(&type, &value, &tb);
+   
+   if (!type)
+   {
+      return;
+   }
+   
+   std::string message;
+   PyObject *traceback = PyImport_ImportModule("traceback");
+   PyObject *lines = (traceback ? PyObject_CallMethod(traceback, (char*) "format_exception", (char*) "OOO",
+                                                      type, (value ? value : Py_None), (tb ? tb : Py_None)) : 0);
+   
+   if (lines && PyList_Check(lines))
+   {
+      for (Py_ssize_t i=0; i<PyList_Size(lines); ++i)
+      {
+         std::string line;
+         
+         if (AsString(PyList_GetItem(lines, i), line))
+         {
+            message += line;
+         }
+      }
+   }
+   
+   Py_XDECREF(lines);
+   Py_XDECREF(traceback);
+   PyErr_Clear();
+   
+   if (message.empty() && value)
+   {
+      // traceback failed, keep the exception itself
+      AsString(value, message);
+   }
+   
+   // Without the trailing newline, handlers add their own
+   while (message.length() > 0 && message[message.length() - 1] == '\n')
+   {
+      message.erase(message.length() - 1);
+   }
+   
+   Py_XDECREF(type);
+   Py_XDECREF(value);
+   Py_XDECREF(tb);
+   
+   handler(message);
+}
+
+// Format the current python error as 'ExceptionClass: message' and clear it
+//   In verbose mode, the error is also printed with its traceback
+static void FetchError(bool verbose, std::string &errorString)
+{
+   PyObject *type = 0, *value = 0, *tb = 0;
+   
+   PyErr_Fetch(&type, &value, &tb);
+   PyErr_NormalizeException(&type, &value, &tb);
+   
+   errorString = "";
+   
+   if (type)
+   {
+      PyObject *name = PyObject_GetAttrString(type, "__name__");
+      
+      if (!name || !AsString(name, errorString))
+      {
+         errorString = "Exception";
+      }
+      
+      Py_XDECREF(name);
+      
+      std::string msg;
+      
+      if (value && AsString(value, msg))
+      {
+         errorString += ": " + msg;
+      }
+      
+      PyErr_Clear();
+   }
+   
+   if (verbose && type)
+   {
+      PyErr_Restore(type, value, tb);
+      PrintError();
+   }
+   else
+   {
+      Py_XDECREF(type);
+      Py_XDECREF(value);
+      Py_XDECREF(tb);
+   }
+}
+
+// -----------------------------------------------------------------------------
+
+static size_t CodeHash(const std::string &source, const std::vector<std::string> &params)
+{
+   std::string key = source;
+   
+   for (size_t i=0; i<params.size(); ++i)
+   {
+      key += '\0';
+      key += params[i];
+   }
+   
+   return std::hash<std::string>()(key);
+}
+
+PyEvalCode::PyEvalCode(const std::string &source, const std::vector<std::string> &params,
+                       const std::string &modulePath, const std::string &entryPoint, double moduleTime)
+   : mSource(source)
+   , mParams(params)
+   , mModulePath(modulePath)
+   , mEntryPoint(entryPoint)
+   , mModuleTime(moduleTime)
+   , mHash(CodeHash(source, params))
+   , mFunction(0)
+   , mFailed(false)
+   , mBytes(source.size())
+   , mDynamic(false)
+   , mAnalysed(false)
+{
+}
+
+PyEvalCode::~PyEvalCode()
+{
+   if (mFunction && Py_IsInitialized())
+   {
+      PyEvalGIL gil;
+      Py_DECREF(mFunction);
+   }
+}
+
+bool PyEvalCode::matches(const std::string &source, const std::vector<std::string> &params) const
+{
+   return (mSource == source && mParams == params);
+}
+
+// Declare the _pyexpr_eval function in the current interpreter
+// Returns a new reference to the function, or 0 with error set
+static PyObject* CompileFunction(const std::string &source, bool verbose, std::string &error)
+{
+   // The function is declared with __main__ as its globals, as it used to be
+   //   when declared using MGlobal::executePythonCommand
+   PyObject *mainModule = PyImport_AddModule("__main__");
+   PyObject *globals = PyModule_GetDict(mainModule);
+   PyObject *locals = PyDict_New();
+   PyObject *function = 0;
+   
+   PyObject *rv = PyRun_String(source.c_str(), Py_file_input, globals, locals);
+   
+   if (rv)
+   {
+      Py_DECREF(rv);
+      
+      function = PyDict_GetItemString(locals, "_pyexpr_eval");
+      Py_XINCREF(function);
+   }
+   
+   Py_DECREF(locals);
+   
+   if (!function)
+   {
+      if (PyErr_Occurred())
+      {
+         FetchError(verbose, error);
+      }
+      else
+      {
+         error = "NameError: _pyexpr_eval function not declared";
+      }
+   }
+   
+   return function;
+}
+
+// Modules loaded from files by path, see PyEvalGetModuleCode. Main interpreter
+//   only, accessed with the GIL held
+struct LoadedModule
+{
+   double time;
+   PyObject *module;
+};
+
+static std::map<std::string, LoadedModule> gLoadedModules;
+
+// Borrowed reference to the module for the file at path, loaded again if it was
+//   modified since (time differs)
+static PyObject* LoadModule(const std::string &path, double time, bool verbose, std::string &error)
+{
+   std::map<std::string, LoadedModule>::iterator it = gLoadedModules.find(path);
+   
+   if (it != gLoadedModules.end() && it->second.time == time)
+   {
+      return it->second.module;
+   }
+   
+   std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+   
+   if (!in)
+   {
+      error = "IOError: could not read '" + path + "'";
+      return 0;
+   }
+   
+   std::ostringstream content;
+   content << in.rdbuf();
+   
+   // Private to pyexpr, not registered in sys.modules
+   std::string name = path.substr(path.find_last_of("/\\") + 1);
+   name = "pyexpr_" + name.substr(0, name.rfind('.'));
+   
+   PyObject *module = PyModule_New(name.c_str());
+   PyObject *globals = PyModule_GetDict(module);
+   
+   PyDict_SetItemString(globals, "__builtins__", PyEval_GetBuiltins());
+   
+#if PY_MAJOR_VERSION >= 3
+   PyObject *file = PyUnicode_FromString(path.c_str());
+#else
+   PyObject *file = PyString_FromString(path.c_str());
+#endif
+   PyDict_SetItemString(globals, "__file__", file);
+   Py_DECREF(file);
+   
+   // Compiled with the file name so that tracebacks point into it
+   PyObject *code = Py_CompileString(content.str().c_str(), path.c_str(), Py_file_input);
+   PyObject *rv = 0;
+   
+   if (code)
+   {
+#if PY_MAJOR_VERSION >= 3
+      rv = PyEval_EvalCode(code, globals, globals);
+#else
+      rv = PyEval_EvalCode((PyCodeObject*) code, globals, globals);
+#endif
+      Py_DECREF(code);
+   }
+   
+   if (!rv)
+   {
+      FetchError(verbose, error);
+      Py_DECREF(module);
+      return 0;
+   }
+   
+   Py_DECREF(rv);
+   
+   if (it != gLoadedModules.end())
+   {
+      // Still referenced by the functions of the codes compiled from it
+      Py_DECREF(it->second.module);
+      it->second.time = time;
+      it->second.module = module;
+   }
+   else
+   {
+      LoadedModule loaded;
+      loaded.time = time;
+      loaded.module = module;
+      gLoadedModules[path] = loaded;
+   }
+   
+   return module;
+}
+
+static PyObject* CompileModuleFunction(const std::string &source, const std::string &path, const std::string &entryPoint,
+                                       double time, bool verbose, std::string &error)
+{
+   if (time < 0.0)
+   {
+      error = "IOError: could not find '" + path + "'";
+      return 0;
+   }
+   
+   PyObject *module = LoadModule(path, time, verbose, error);
+   
+   if (!module)
+   {
+      return 0;
+   }
+   
+   PyObject *entry = PyObject_GetAttrString(module, entryPoint.c_str());
+   
+   if (!entry)
+   {
+      PyErr_Clear();
+      error = "AttributeError: '" + path + "' has no function '" + entryPoint + "'";
+      return 0;
+   }
+   
+   PyObject *globals = PyDict_New();
+   PyObject *function = 0;
+   
+   PyDict_SetItemString(globals, "__builtins__", PyEval_GetBuiltins());
+   PyDict_SetItemString(globals, "_pyexpr_entry", entry);
+   Py_DECREF(entry);
+   
+   PyObject *rv = PyRun_String(source.c_str(), Py_file_input, globals, globals);
+   
+   if (rv)
+   {
+      Py_DECREF(rv);
+      
+      function = PyDict_GetItemString(globals, "_pyexpr_eval");
+      Py_XINCREF(function);
+   }
+   else
+   {
+      FetchError(verbose, error);
+   }
+   
+   Py_DECREF(globals);
+   
+   return function;
+}
+
+bool PyEvalCode::compile(bool verbose)
+{
+   if (mFunction || mFailed)
+   {
+      return (mFunction != 0);
+   }
+   
+   PyEvalSpan span("compile");
+   
+   mFunction = (isModule() ? CompileModuleFunction(mSource, mModulePath, mEntryPoint, mModuleTime, verbose, mError)
+                           : CompileFunction(mSource, verbose, mError));
+   
+   if (mFunction)
+   {
+      PyObject *code = PyObject_GetAttrString(mFunction, "__code__");
+      PyObject *bytecode = (code ? PyObject_GetAttrString(code, "co_code") : 0);
+      
+      if (bytecode)
+      {
+         Py_ssize_t n = PyObject_Size(bytecode);
+         if (n > 0)
+         {
+            mBytes += size_t(n);
+         }
+      }
+      
+      Py_XDECREF(bytecode);
+      Py_XDECREF(code);
+      PyErr_Clear();
+   }
+   else
+   {
+      mFailed = true;
+   }
+   
+   return (mFunction != 0);
+}
+
+// Free names used by the body of the function declared in source, and the top
+//   level modules it imports ('*' when it calls __import__ or import_module)
+//   Nested functions and comprehensions may read parameters too, all names of
+//   the body are collected rather than only the module level ones
+static const char *AnalyserSource =
+   "import ast\n"
+   "_dynamic_names = set(['locals', 'vars', 'eval', 'exec', 'execfile', '_getframe'])\n"
+   "_import_names = set(['__import__', 'import_module'])\n"
+   "def _pyexpr_names(source):\n"
+   "  names = set()\n"
+   "  imports = set()\n"
+   "  dynamic = False\n"
+   "  for stmt in ast.parse(source).body[0].body:\n"
+   "    for node in ast.walk(stmt):\n"
+   "      if isinstance(node, ast.Name):\n"
+   "        names.add(node.id)\n"
+   "        dynamic = dynamic or node.id in _dynamic_names\n"
+   "        if node.id in _import_names:\n"
+   "          imports.add('*')\n"
+   "      elif isinstance(node, ast.Attribute):\n"
+   "        dynamic = dynamic or node.attr in _dynamic_names\n"
+   "        if node.attr in _import_names:\n"
+   "          imports.add('*')\n"
+   "      elif isinstance(node, ast.Import):\n"
+   "        imports.update(alias.name.split('.')[0] for alias in node.names)\n"
+   "      elif isinstance(node, ast.ImportFrom):\n"
+   "        imports.add((node.module or '').split('.')[0])\n"
+   "      elif type(node).__name__ == 'Exec':\n"
+   "        dynamic = True\n"
+   "  return (list(names), dynamic, list(imports))\n";
+
+// Analyser function, declared in a private namespace of the main interpreter
+static PyObject* Analyser()
+{
+   static PyObject *analyser = 0;
+   static bool failed = false;
+   
+   if (!analyser && !failed)
+   {
+      PyObject *globals = PyDict_New();
+      
+      PyDict_SetItemString(globals, "__builtins__", PyEval_GetBuiltins());
+      
+      PyObject *rv = PyRun_String(AnalyserSource, Py_file_input, globals, globals);
+      
+      if (rv)
+      {
+         Py_DECREF(rv);
+         analyser = PyDict_GetItemString(globals, "_pyexpr_names");
+         Py_XINCREF(analyser);
+      }
+      else
+      {
+         PrintError();
+      }
+      
+      failed = (analyser == 0);
+      
+      // The function keeps its globals alive
+      Py_DECREF(globals);
+   }
+   
+   return analyser;
+}
+
+void PyEvalCode::analyse()
+{
+   if (mAnalysed)
+   {
+      return;
+   }
+   
+   std::vector<bool> referenced(mParams.size(), true);
+   bool dynamic = true;
+   std::vector<std::string> imports;
+   
+   PyObject *analyser = Analyser();
+   PyObject *rv = (analyser ? PyObject_CallFunction(analyser, (char*) "s", mSource.c_str()) : 0);
+   
+   if (rv)
+   {
+      PyObject *names = PyTuple_GetItem(rv, 0);
+      
+      dynamic = (PyObject_IsTrue(PyTuple_GetItem(rv, 1)) != 0);
+      
+      PyObject *modules = PyTuple_GetItem(rv, 2);
+      
+      for (Py_ssize_t i=0; i<PyList_Size(modules); ++i)
+      {
+         std::string name;
+         
+         if (AsString(PyList_GetItem(modules, i), name))
+         {
+            imports.push_back(name);
+         }
+      }
+      
+      if (!dynamic)
+      {
+         std::vector<std::string> used;
+         
+         for (Py_ssize_t i=0; i<PyList_Size(names); ++i)
+         {
+            std::string name;
+            
+            if (AsString(PyList_GetItem(names, i), name))
+            {
+               used.push_back(name);
+            }
+         }
+         
+         for (size_t i=0; i<mParams.size(); ++i)
+         {
+            referenced[i] = (std::find(used.begin(), used.end(), mParams[i]) != used.end());
+         }
+      }
+      
+      Py_DECREF(rv);
+   }
+   
+   // Syntax errors are reported when compiling
+   PyErr_Clear();
+   
+   // The GIL may have been handed to another thread analysing the same code
+   //   while the analyser ran
+   if (mAnalysed)
+   {
+      return;
+   }
+   
+   mReferenced = referenced;
+   mDynamic = dynamic;
+   mImports = imports;
+   mAnalysed = true;
+}
+
+bool PyEvalCode::isReferenced(size_t param) const
+{
+   return (!mAnalysed || param >= mReferenced.size() || mReferenced[param]);
+}
+
+bool PyEvalCode::isReferenced(const std::string &param) const
+{
+   if (!mAnalysed)
+   {
+      return true;
+   }
+   
+   for (size_t i=0; i<mParams.size(); ++i)
+   {
+      if (mParams[i] == param)
+      {
+         return mReferenced[i];
+      }
+   }
+   
+   // Not a parameter of this code, the attributes may have changed since
+   return true;
+}
+
+bool PyEvalCode::isDynamic() const
+{
+   return (!mAnalysed || mDynamic);
+}
+
+bool PyEvalCode::imports(const std::string &module) const
+{
+   if (!mAnalysed || mDynamic)
+   {
+      return true;
+   }
+   
+   return (std::find(mImports.begin(), mImports.end(), module) != mImports.end() ||
+           std::find(mImports.begin(), mImports.end(), "*") != mImports.end());
+}
+
+PyEvalScope::PyEvalScope(const std::string &setup)
+   : mSetup(setup)
+   , mGlobals(0)
+   , mFailed(false)
+   , mBound(0)
+{
+}
+
+PyEvalScope::~PyEvalScope()
+{
+   if ((mGlobals || mBound) && Py_IsInitialized())
+   {
+      PyEvalGIL gil;
+      Py_XDECREF(mBound);
+      if (mGlobals)
+      {
+         // Break reference cycles through functions declared by the setup
+         PyDict_Clear(mGlobals);
+         Py_DECREF(mGlobals);
+      }
+   }
+}
+
+bool PyEvalScope::setup(bool verbose)
+{
+   if (mGlobals || mFailed)
+   {
+      return (mGlobals != 0);
+   }
+   
+   PyEvalSpan span("setup");
+   
+   PyObject *globals = PyDict_New();
+   
+   PyDict_SetItemString(globals, "__builtins__", PyEval_GetBuiltins());
+   
+#if PY_MAJOR_VERSION >= 3
+   PyObject *name = PyUnicode_FromString("__pyexpr__");
+#else
+   PyObject *name = PyString_FromString("__pyexpr__");
+#endif
+   PyDict_SetItemString(globals, "__name__", name);
+   Py_DECREF(name);
+   
+   PyObject *rv = PyRun_String(mSetup.c_str(), Py_file_input, globals, globals);
+   
+   if (rv)
+   {
+      Py_DECREF(rv);
+      mGlobals = globals;
+   }
+   else
+   {
+      mFailed = true;
+      FetchError(verbose, mError);
+      PyDict_Clear(globals);
+      Py_DECREF(globals);
+   }
+   
+   return (mGlobals != 0);
+}
+
+bool PyEvalScope::run(const std::string &source, bool verbose)
+{
+   if (!mGlobals || source.length() == 0)
+   {
+      return true;
+   }
+   
+   PyObject *rv = PyRun_String(source.c_str(), Py_file_input, mGlobals, mGlobals);
+   
+   if (!rv)
+   {
+      std::string error;
+      FetchError(verbose, error);
+      return false;
+   }
+   
+   Py_DECREF(rv);
+   
+   return true;
+}
+
+PyObject* PyEvalScope::bind(const PyEvalCodePtr &code)
+{
+   if (!mGlobals || !code || !code->isCompiled())
+   {
+      return 0;
+   }
+   
+   // A node only uses one code at a time, rebind when it changes
+   if (!mBound || mBoundCode.lock() != code)
+   {
+      Py_XDECREF(mBound);
+      
+      mBound = PyFunction_New(PyFunction_GetCode(code->function()), mGlobals);
+      mBoundCode = code;
+   }
+   
+   return mBound;
+}
+
+// -----------------------------------------------------------------------------
+
+// Named tuple type of history entries (borrowed reference)
+static PyObject* HistoryEntryType()
+{
+   static PyObject *sType = 0;
+   
+   if (!sType)
+   {
+      PyObject *collections = PyImport_ImportModule("collections");
+      
+      if (collections)
+      {
+         sType = PyObject_CallMethod(collections, (char*) "namedtuple", (char*) "ss", "HistoryEntry", "time inputs result");
+         Py_DECREF(collections);
+      }
+      
+      if (!sType)
+      {
+         PyErr_Clear();
+      }
+   }
+   
+   return sType;
+}
+
+// Copy of value keeping only what can be written as a python literal, new reference
+static PyObject* HistoryLiteral(PyObject *value)
+{
+   if (value == Py_None || PyBool_Check(value) || PyLong_Check(value) || PyFloat_Check(value) ||
+#if PY_MAJOR_VERSION < 3
+       PyInt_Check(value) ||
+#endif
+       PyBytes_Check(value) || PyUnicode_Check(value))
+   {
+      Py_INCREF(value);
+      return value;
+   }
+   
+   if (PyTuple_Check(value) || PyList_Check(value))
+   {
+      Py_ssize_t n = PySequence_Size(value);
+      PyObject *copy = PyTuple_New(n);
+      
+      for (Py_ssize_t i=0; i<n; ++i)
+      {
+         PyObject *item = (PyTuple_Check(value) ? PyTuple_GetItem(value, i) : PyList_GetItem(value, i));
+         PyTuple_SetItem(copy, i, HistoryLiteral(item));
+      }
+      
+      return copy;
+   }
+   
+   Py_INCREF(Py_None);
+   return Py_None;
+}
+
+// Values of a typed buffer as a list, new reference or 0. ctypes formats carry
+//   a byte order that memoryview.tolist doesn't support
+static PyObject* BufferValues(PyObject *obj)
+{
+   Py_buffer view;
+   
+   if (PyObject_GetBuffer(obj, &view, PyBUF_RECORDS_RO) != 0)
+   {
+      return 0;
+   }
+   
+   std::string format = (view.format ? view.format : "B");
+   bool contiguous = (PyBuffer_IsContiguous(&view, 'C') != 0);
+   
+   PyBuffer_Release(&view);
+   
+   format.erase(0, format.find_first_not_of("@=<>!"));
+   
+   if (format.length() != 1 || !contiguous)
+   {
+      return 0;
+   }
+   
+   PyObject *raw = PyMemoryView_FromObject(obj);
+   PyObject *bytes = (raw ? PyObject_CallMethod(raw, (char*) "cast", (char*) "s", "B") : 0);
+   PyObject *typed = (bytes ? PyObject_CallMethod(bytes, (char*) "cast", (char*) "s", format.c_str()) : 0);
+   PyObject *values = (typed ? PyObject_CallMethod(typed, (char*) "tolist", NULL) : 0);
+   
+   Py_XDECREF(typed);
+   Py_XDECREF(bytes);
+   Py_XDECREF(raw);
+   
+   return values;
+}
+
+// Copy of value that doesn't reference memory owned by the evaluation, new
+//   reference. Buffers (see the prelude buffer helper) wrap mesh data and
+//   argument buffers released or reused once the evaluation is done, they are
+//   copied to tuples of values
+static PyObject* HistoryResult(PyObject *value)
+{
+   if (PyTuple_Check(value) || PyList_Check(value))
+   {
+      bool isList = (PyList_Check(value) != 0);
+      Py_ssize_t n = (isList ? PyList_Size(value) : PyTuple_Size(value));
+      PyObject *copy = (isList ? PyList_New(n) : PyTuple_New(n));
+      
+      for (Py_ssize_t i=0; i<n; ++i)
+      {
+         PyObject *item = HistoryResult(isList ? PyList_GetItem(value, i) : PyTuple_GetItem(value, i));
+         
+         if (isList)
+         {
+            PyList_SetItem(copy, i, item);
+         }
+         else
+         {
+            PyTuple_SetItem(copy, i, item);
+         }
+      }
+      
+      return copy;
+   }
+   
+   if (PyDict_Check(value))
+   {
+      PyObject *copy = PyDict_New();
+      PyObject *key = 0;
+      PyObject *item = 0;
+      Py_ssize_t pos = 0;
+      
+      while (PyDict_Next(value, &pos, &key, &item))
+      {
+         PyObject *detached = HistoryResult(item);
+         PyDict_SetItem(copy, key, detached);
+         Py_DECREF(detached);
+      }
+      
+      return copy;
+   }
+   
+   if (!strcmp(Py_TYPE(value)->tp_name, "_pyexpr_geometry"))
+   {
+      // Same type, with copies of its members
+      PyObject *dict = PyObject_GetAttrString(value, "__dict__");
+      PyObject *copy = PyObject_CallMethod((PyObject*) Py_TYPE(value), (char*) "__new__", (char*) "(O)", (PyObject*) Py_TYPE(value));
+      PyObject *members = (dict ? HistoryResult(dict) : 0);
+      
+      if (!copy || !members || PyObject_SetAttrString(copy, "__dict__", members) != 0)
+      {
+         PyErr_Clear();
+         Py_XDECREF(copy);
+         Py_INCREF(Py_None);
+         copy = Py_None;
+      }
+      
+      Py_XDECREF(members);
+      Py_XDECREF(dict);
+      
+      return copy;
+   }
+   
+   if (PyObject_CheckBuffer(value) && !PyBytes_Check(value) && !PyByteArray_Check(value))
+   {
+      PyObject *values = BufferValues(value);
+      
+      if (!values)
+      {
+         // No memoryview.cast (python 2), ctypes arrays are sequences
+         PyErr_Clear();
+         values = PySequence_List(value);
+      }
+      
+      PyObject *copy = (values ? HistoryResult(values) : 0);
+      
+      Py_XDECREF(values);
+      
+      if (copy && PyList_Check(copy))
+      {
+         PyObject *tuple = PyList_AsTuple(copy);
+         Py_DECREF(copy);
+         copy = tuple;
+      }
+      
+      if (!copy)
+      {
+         PyErr_Clear();
+         Py_INCREF(Py_None);
+         copy = Py_None;
+      }
+      
+      return copy;
+   }
+   
+   // Other objects are owned by python
+   Py_INCREF(value);
+   return value;
+}
+
+PyEvalHistory::PyEvalHistory()
+   : mEntries(0)
+   , mCapacity(0)
+   , mLastTime(0.0)
+{
+}
+
+PyEvalHistory::~PyEvalHistory()
+{
+   if (mEntries && Py_IsInitialized())
+   {
+      PyEvalGIL gil;
+      Py_DECREF(mEntries);
+   }
+}
+
+void PyEvalHistory::reserve(size_t capacity)
+{
+   if (mEntries && capacity == mCapacity)
+   {
+      return;
+   }
+   
+   PyObject *collections = PyImport_ImportModule("collections");
+   PyObject *entries = 0;
+   
+   if (collections)
+   {
+      PyObject *previous = (mEntries ? mEntries : PyTuple_New(0));
+      
+      // Keeps the most recent entries when shrinking
+      entries = PyObject_CallMethod(collections, (char*) "deque", (char*) "On", previous, Py_ssize_t(capacity));
+      
+      if (!mEntries)
+      {
+         Py_DECREF(previous);
+      }
+      Py_DECREF(collections);
+   }
+   
+   if (entries)
+   {
+      Py_XDECREF(mEntries);
+      mEntries = entries;
+      mCapacity = capacity;
+   }
+   else
+   {
+      PyErr_Clear();
+   }
+}
+
+void PyEvalHistory::begin(double time, size_t capacity, double gap, PyObject *&history, PyObject *&prev)
+{
+   reserve(capacity);
+   
+   prev = 0;
+   
+   if (mEntries && PySequence_Size(mEntries) > 0)
+   {
+      if (time < mLastTime || (gap > 0.0 && time - mLastTime > gap))
+      {
+         clear();
+      }
+      else if (time == mLastTime)
+      {
+         PyObject *rv = PyObject_CallMethod(mEntries, (char*) "pop", NULL);
+         Py_XDECREF(rv);
+      }
+      
+      if (PySequence_Size(mEntries) > 0)
+      {
+         PyObject *last = PySequence_GetItem(mEntries, -1);
+         
+         if (last)
+         {
+            prev = PySequence_GetItem(last, 2);
+            Py_DECREF(last);
+         }
+      }
+      
+      PyErr_Clear();
+   }
+   
+   history = (mEntries ? mEntries : Py_None);
+   Py_INCREF(history);
+   
+   if (!prev)
+   {
+      prev = Py_None;
+      Py_INCREF(prev);
+   }
+}
+
+void PyEvalHistory::end(double time, PyObject *inputs, PyObject *result)
+{
+   PyObject *type = HistoryEntryType();
+   
+   if (!mEntries || !type)
+   {
+      return;
+   }
+   
+   PyObject *values = HistoryLiteral(inputs);
+   PyObject *detached = HistoryResult(result);
+   PyObject *entry = PyObject_CallFunction(type, (char*) "dOO", time, values, detached);
+   
+   if (entry)
+   {
+      PyObject *rv = PyObject_CallMethod(mEntries, (char*) "append", (char*) "(O)", entry);
+      Py_XDECREF(rv);
+      Py_DECREF(entry);
+      
+      mLastTime = time;
+   }
+   
+   Py_DECREF(values);
+   Py_DECREF(detached);
+   
+   PyErr_Clear();
+}
+
+void PyEvalHistory::clear()
+{
+   if (mEntries)
+   {
+      PyObject *rv = PyObject_CallMethod(mEntries, (char*) "clear", NULL);
+      Py_XDECREF(rv);
+      PyErr_Clear();
+   }
+}
+
+size_t PyEvalHistory::size() const
+{
+   return (mEntries ? size_t(PySequence_Size(mEntries)) : 0);
+}
+
+std::string PyEvalHistory::save() const
+{
+   std::string data;
+   
+   if (!mEntries || PySequence_Size(mEntries) == 0)
+   {
+      return data;
+   }
+   
+   PyObject *entries = HistoryLiteral(mEntries);
+   
+   if (!PyTuple_Check(entries))
+   {
+      // deque is not a tuple or list, copy entries one by one
+      Py_DECREF(entries);
+      
+      PyObject *list = PySequence_List(mEntries);
+      entries = (list ? HistoryLiteral(list) : 0);
+      Py_XDECREF(list);
+   }
+   
+   PyObject *repr = (entries ? PyObject_Repr(entries) : 0);
+   
+   if (repr)
+   {
+#if PY_MAJOR_VERSION >= 3
+      const char *str = PyUnicode_AsUTF8(repr);
+#else
+      const char *str = PyString_AsString(repr);
+#endif
+      if (str)
+      {
+         data = str;
+      }
+      Py_DECREF(repr);
+   }
+   
+   Py_XDECREF(entries);
+   
+   PyErr_Clear();
+   
+   return data;
+}
+
+bool PyEvalHistory::load(const std::string &data)
+{
+   PyObject *type = HistoryEntryType();
+   PyObject *ast = PyImport_ImportModule("ast");
+   PyObject *entries = (ast ? PyObject_CallMethod(ast, (char*) "literal_eval", (char*) "s", data.c_str()) : 0);
+   
+   Py_XDECREF(ast);
+   
+   bool loaded = (type && entries && PyTuple_Check(entries));
+   
+   if (loaded)
+   {
+      reserve(std::max(mCapacity, size_t(PyTuple_Size(entries))));
+      clear();
+      
+      for (Py_ssize_t i=0; i<PyTuple_Size(entries) && loaded; ++i)
+      {
+         PyObject *item = PyTuple_GetItem(entries, i);
+         PyObject *entry = (PyTuple_Check(item) ? PyObject_Call(type, item, NULL) : 0);
+         
+         if (entry)
+         {
+            PyObject *rv = PyObject_CallMethod(mEntries, (char*) "append", (char*) "(O)", entry);
+            Py_XDECREF(rv);
+            
+            mLastTime = PyFloat_AsDouble(PyTuple_GetItem(entry, 0));
+            
+            Py_DECREF(entry);
+         }
+         else
+         {
+            loaded = false;
+         }
+      }
+      
+      if (!loaded)
+      {
+         clear();
+      }
+   }
+   
+   Py_XDECREF(entries);
+   
+   PyErr_Clear();
+   
+   return loaded;
+}
+
+// -----------------------------------------------------------------------------
+
+// pyexpr.Inputs, see PyEvalInputs
+struct InputsObject
+{
+   PyObject_HEAD
+   // Reset once the evaluation is done
+   PyEvalInputs *source;
+   PyObject *cache;
+};
+
+static PyTypeObject* InputsType();
+
+// New reference to the value of input name, 0 with KeyError set if there is no such input
+static PyObject* InputsLookup(InputsObject *self, PyObject *key)
+{
+   PyObject *value = PyDict_GetItem(self->cache, key);
+   
+   if (value)
+   {
+      Py_INCREF(value);
+      return value;
+   }
+   
+   if (!self->source)
+   {
+      PyErr_SetString(PyExc_RuntimeError, "inputs can only be read during the evaluation");
+      return 0;
+   }
+   
+#if PY_MAJOR_VERSION >= 3
+   const char *name = (PyUnicode_Check(key) ? PyUnicode_AsUTF8(key) : 0);
+#else
+   const char *name = (PyString_Check(key) ? PyString_AsString(key) : 0);
+#endif
+   
+   std::string expr;
+   
+   if (!name || !self->source->value(name, expr))
+   {
+      PyErr_Clear();
+      PyErr_SetObject(PyExc_KeyError, key);
+      return 0;
+   }
+   
+   PyEvalSpan span("input", name);
+   
+   PyObject *globals = PyModule_GetDict(PyImport_AddModule("__main__"));
+   
+   value = PyRun_String(expr.c_str(), Py_eval_input, globals, globals);
+   
+   if (value)
+   {
+      PyDict_SetItem(self->cache, key, value);
+   }
+   
+   return value;
+}
+
+static PyObject* InputsGetAttr(PyObject *self, PyObject *name)
+{
+   PyObject *value = InputsLookup((InputsObject*) self, name);
+   
+   if (!value && PyErr_ExceptionMatches(PyExc_KeyError))
+   {
+      // Not an input, keys() and python internals
+      PyErr_Clear();
+      return PyObject_GenericGetAttr(self, name);
+   }
+   
+   return value;
+}
+
+static PyObject* InputsGetItem(PyObject *self, PyObject *key)
+{
+   return InputsLookup((InputsObject*) self, key);
+}
+
+static PyObject* InputsKeys(PyObject *self, PyObject *)
+{
+   InputsObject *inputs = (InputsObject*) self;
+   
+   std::vector<std::string> names;
+   
+   if (inputs->source)
+   {
+      inputs->source->names(names);
+   }
+   
+   PyObject *keys = PyList_New(Py_ssize_t(names.size()));
+   
+   for (size_t i=0; i<names.size(); ++i)
+   {
+#if PY_MAJOR_VERSION >= 3
+      PyList_SetItem(keys, Py_ssize_t(i), PyUnicode_FromString(names[i].c_str()));
+#else
+      PyList_SetItem(keys, Py_ssize_t(i), PyString_FromString(names[i].c_str()));
+#endif
+   }
+   
+   return keys;
+}
+
+static int InputsContains(PyObject *self, PyObject *key)
+{
+   PyObject *keys = InputsKeys(self, 0);
+   int rv = PySequence_Contains(keys, key);
+   Py_DECREF(keys);
+   return rv;
+}
+
+static void InputsDealloc(PyObject *self)
+{
+   Py_XDECREF(((InputsObject*) self)->cache);
+   PyObject_Del(self);
+}
+
+static PyMethodDef InputsMethods[] =
+{
+   {"keys", InputsKeys, METH_NOARGS, "Names of the inputs"},
+   {NULL, NULL, 0, NULL}
+};
+
+static PyMappingMethods InputsMapping;
+static PySequenceMethods InputsSequence;
+
+static PyTypeObject* InputsType()
+{
+   static PyTypeObject sType;
+   static bool sReady = false;
+   
+   if (!sReady)
+   {
+      memset(&sType, 0, sizeof(PyTypeObject));
+      memset(&InputsMapping, 0, sizeof(PyMappingMethods));
+      memset(&InputsSequence, 0, sizeof(PySequenceMethods));
+      
+      InputsMapping.mp_subscript = InputsGetItem;
+      InputsSequence.sq_contains = InputsContains;
+      
+#if PY_VERSION_HEX >= 0x03090000
+      Py_SET_REFCNT((PyObject*) &sType, 1);
+#else
+      Py_REFCNT(&sType) = 1;
+#endif
+      sType.tp_name = "pyexpr.Inputs";
+      sType.tp_basicsize = sizeof(InputsObject);
+      sType.tp_dealloc = InputsDealloc;
+      sType.tp_getattro = InputsGetAttr;
+      sType.tp_as_mapping = &InputsMapping;
+      sType.tp_as_sequence = &InputsSequence;
+      sType.tp_flags = Py_TPFLAGS_DEFAULT;
+      sType.tp_doc = "Node inputs, read when accessed as inputs.name or inputs[\"name\"]";
+      sType.tp_methods = InputsMethods;
+      
+      if (PyType_Ready(&sType) < 0)
+      {
+         PyErr_Clear();
+         return 0;
+      }
+      
+      sReady = true;
+   }
+   
+   return &sType;
+}
+
+// New reference
+static PyObject* NewInputs(PyEvalInputs *source)
+{
+   PyTypeObject *type = InputsType();
+   
+   InputsObject *inputs = (type ? PyObject_New(InputsObject, type) : 0);
+   
+   if (!inputs)
+   {
+      PyErr_Clear();
+      Py_INCREF(Py_None);
+      return Py_None;
+   }
+   
+   inputs->source = source;
+   inputs->cache = PyDict_New();
+   
+   return (PyObject*) inputs;
+}
+
+// Values read through inputs can't be refreshed after the evaluation
+static void ReleaseInputs(PyObject *inputs)
+{
+   if (inputs && Py_TYPE(inputs) == InputsType())
+   {
+      ((InputsObject*) inputs)->source = 0;
+      PyDict_Clear(((InputsObject*) inputs)->cache);
+   }
+}
+
+// -----------------------------------------------------------------------------
+
+std::string PyEvalDeclareFunction(const std::vector<std::string> &params, const std::string &body)
+{
+   std::string decl = "def _pyexpr_eval(";
+   
+   for (size_t i=0; i<params.size(); ++i)
+   {
+      decl += (i > 0 ? ", " : "");
+      decl += params[i];
+   }
+   
+   decl += "):\n";
+   
+   size_t pos = 0;
+   
+   while (pos < body.length())
+   {
+      size_t eol = body.find('\n', pos);
+      size_t end = (eol == std::string::npos ? body.length() : eol + 1);
+      
+      decl += "  " + body.substr(pos, end - pos);
+      
+      pos = end;
+   }
+   
+   // Keep the declaration valid for empty expressions
+   decl += "\n  pass\n";
+   
+   return decl;
+}
+
+// Codes are keyed by a hash of their source and parameters, entries only hold
+//   weak references so that the codes die with the last node using them
+typedef std::unordered_multimap<size_t, std::weak_ptr<PyEvalCode> > CodeRegistry;
+
+static std::mutex gCodeRegistryMutex;
+static CodeRegistry gCodeRegistry;
+
+// Remove entries whose code was released, gCodeRegistryMutex must be held
+static void PurgeCodeRegistry()
+{
+   CodeRegistry::iterator it = gCodeRegistry.begin();
+   
+   while (it != gCodeRegistry.end())
+   {
+      if (it->second.expired())
+      {
+         it = gCodeRegistry.erase(it);
+      }
+      else
+      {
+         ++it;
+      }
+   }
+}
+
+static PyEvalCodePtr RegisterCode(const std::string &source, const std::vector<std::string> &params,
+                                  const std::string &modulePath, const std::string &entryPoint, double moduleTime)
+{
+   size_t h = CodeHash(source, params);
+   
+   std::lock_guard<std::mutex> lock(gCodeRegistryMutex);
+   
+   std::pair<CodeRegistry::iterator, CodeRegistry::iterator> range = gCodeRegistry.equal_range(h);
+   
+   CodeRegistry::iterator it = range.first;
+   
+   while (it != range.second)
+   {
+      PyEvalCodePtr code = it->second.lock();
+      
+      if (!code)
+      {
+         it = gCodeRegistry.erase(it);
+      }
+      else if (code->matches(source, params))
+      {
+         return code;
+      }
+      else
+      {
+         ++it;
+      }
+   }
+   
+   PyEvalCodePtr code(new PyEvalCode(source, params, modulePath, entryPoint, moduleTime));
+   
+   gCodeRegistry.insert(std::make_pair(h, std::weak_ptr<PyEvalCode>(code)));
+   
+   return code;
+}
+
+PyEvalCodePtr PyEvalGetCode(const std::string &source, const std::vector<std::string> &params)
+{
+   return RegisterCode(source, params, "", "", 0.0);
+}
+
+// Module files by path as given to PyEvalGetModuleCode
+struct ModuleFile
+{
+   std::string resolved;
+   // Modification time, -1 if the file doesn't exist
+   double time;
+};
+
+static std::mutex gModuleFilesMutex;
+static std::map<std::string, ModuleFile> gModuleFiles;
+
+static bool IsAbsolutePath(const std::string &path)
+{
+   return (path.length() > 0 && (path[0] == '/' || path[0] == '\\' || (path.length() > 1 && path[1] == ':')));
+}
+
+static double ModificationTime(const std::string &path)
+{
+   struct stat st;
+   
+   if (path.empty() || stat(path.c_str(), &st) != 0)
+   {
+      return -1.0;
+   }
+   
+#if defined(__APPLE__)
+   return double(st.st_mtimespec.tv_sec) + double(st.st_mtimespec.tv_nsec) * 1e-9;
+#elif defined(_WIN32)
+   return double(st.st_mtime);
+#else
+   return double(st.st_mtim.tv_sec) + double(st.st_mtim.tv_nsec) * 1e-9;
+#endif
+}
+
+static std::string ResolveModulePath(const std::string &path)
+{
+   if (IsAbsolutePath(path))
+   {
+      return path;
+   }
+   
+   const char *dirs = getenv("PYEXPR_MODULE_PATH");
+   
+   if (dirs)
+   {
+#ifdef _WIN32
+      const char sep = ';';
+#else
+      const char sep = ':';
+#endif
+      std::string remaining = dirs;
+      
+      while (remaining.length() > 0)
+      {
+         size_t p = remaining.find(sep);
+         std::string dir = remaining.substr(0, p);
+         
+         remaining = (p == std::string::npos ? "" : remaining.substr(p + 1));
+         
+         if (dir.length() > 0 && ModificationTime(dir + "/" + path) >= 0.0)
+         {
+            return dir + "/" + path;
+         }
+      }
+   }
+   
+   return path;
+}
+
+PyEvalCodePtr PyEvalGetModuleCode(const std::string &path, const std::string &entryPoint, const std::vector<std::string> &params)
+{
+   std::string resolved;
+   double time = -1.0;
+   
+   {
+      std::lock_guard<std::mutex> lock(gModuleFilesMutex);
+      
+      std::map<std::string, ModuleFile>::iterator it = gModuleFiles.find(path);
+      
+      // Known files are only checked again by PyEvalCheckModuleFiles
+      if (it == gModuleFiles.end())
+      {
+         ModuleFile &file = gModuleFiles[path];
+         
+         file.resolved = ResolveModulePath(path);
+         file.time = ModificationTime(file.resolved);
+         
+         it = gModuleFiles.find(path);
+      }
+      
+      resolved = it->second.resolved;
+      time = it->second.time;
+   }
+   
+   // The file and its modification time are part of the source, so that codes
+   //   are only shared by nodes calling the same version of the module
+   std::ostringstream oss;
+   
+   // Nanoseconds, files saved within the same microsecond still differ
+   oss.precision(9);
+   oss << "# " << resolved << ":" << entryPoint << " " << std::fixed << time << "\n";
+   oss << "def _pyexpr_eval(";
+   
+   for (size_t i=0; i<params.size(); ++i)
+   {
+      oss << (i > 0 ? ", " : "") << params[i];
+   }
+   
+   oss << "):\n   return _pyexpr_entry(";
+   
+   for (size_t i=0; i<params.size(); ++i)
+   {
+      oss << (i > 0 ? ", " : "") << params[i] << "=" << params[i];
+   }
+   
+   oss << ")\n";
+   
+   return RegisterCode(oss.str(), params, resolved, entryPoint, time);
+}
+
+size_t PyEvalCheckModuleFiles(std::vector<std::string> &changed)
+{
+   std::vector<std::string> paths;
+   
+   {
+      std::lock_guard<std::mutex> lock(gModuleFilesMutex);
+      
+      for (std::map<std::string, ModuleFile>::iterator it = gModuleFiles.begin(); it != gModuleFiles.end(); ++it)
+      {
+         paths.push_back(it->first);
+      }
+   }
+   
+   size_t count = 0;
+   
+   for (size_t i=0; i<paths.size(); ++i)
+   {
+      // Files are stat'ed without the lock, evaluations don't wait on the disk
+      std::string resolved = ResolveModulePath(paths[i]);
+      double time = ModificationTime(resolved);
+      
+      std::lock_guard<std::mutex> lock(gModuleFilesMutex);
+      
+      ModuleFile &file = gModuleFiles[paths[i]];
+      
+      if (file.resolved != resolved || file.time != time)
+      {
+         file.resolved = resolved;
+         file.time = time;
+         
+         changed.push_back(paths[i]);
+         ++count;
+      }
+   }
+   
+   return count;
+}
+
+void PyEvalGetCodeStats(PyEvalCodeStats &stats)
+{
+   stats.entries = 0;
+   stats.references = 0;
+   stats.bytes = 0;
+   
+   std::lock_guard<std::mutex> lock(gCodeRegistryMutex);
+   
+   PurgeCodeRegistry();
+   
+   for (CodeRegistry::iterator it = gCodeRegistry.begin(); it != gCodeRegistry.end(); ++it)
+   {
+      PyEvalCodePtr code = it->second.lock();
+      
+      if (code)
+      {
+         stats.entries += 1;
+         // don't count the reference held by this function
+         stats.references += size_t(code.use_count() - 1);
+         stats.bytes += code->bytes();
+      }
+   }
+}
+
+// -----------------------------------------------------------------------------
+
+void PyEvalAnalyse(const PyEvalCodePtr &code)
+{
+   if (!code || code->isAnalysed())
+   {
+      return;
+   }
+   
+   PyEvalGIL gil;
+   
+   code->analyse();
+}
+
+size_t PyEvalCompile(const std::vector<PyEvalCodePtr> &codes, bool verbose)
+{
+   size_t failed = 0;
+   
+   PyEvalGIL gil;
+   
+   for (size_t i=0; i<codes.size(); ++i)
+   {
+      if (codes[i] && !codes[i]->compile(verbose))
+      {
+         ++failed;
+      }
+   }
+   
+   return failed;
+}
+
+// -----------------------------------------------------------------------------
+
+// Evaluation trace writer, see PyEvalStartTrace for the format
+// Records are appended to a buffer with the GIL held and written to the file by
+//   a background thread, so that evaluations never wait on disk
+class Tracer
+{
+public:
+   
+   static bool Start(const std::string &path, std::string &error);
+   static size_t Stop();
+   static std::string File();
+   
+   static inline bool Active() { return msActive.load(std::memory_order_relaxed); }
+   
+   // Record an evaluation of code, the GIL must be held and no error set
+   //   rv is the value returned by the code function, 0 if it raised
+   static void Record(const PyEvalCode &code, const PyEvalRequest &request, PyObject *args,
+                      PyObject *rv, const PyEvalResult &result, unsigned long long duration);
+   
+private:
+   
+   static void Write();
+   
+   static std::atomic<bool> msActive;
+   static std::mutex msMutex;
+   static std::condition_variable msCond;
+   static std::thread msThread;
+   static FILE *msFile;
+   static std::string msPath;
+   static std::string msBuffer;
+   static std::unordered_set<size_t> msCodes;
+   static size_t msRecords;
+   static size_t msDropped;
+   static bool msStop;
+};
+
+// Buffer size triggering a write, and maximum size before records are dropped
+static const size_t TraceFlushSize = 1 << 20;
+static const size_t TraceMaxSize = 64 << 20;
+
+std::atomic<bool> Tracer::msActive(false);
+std::mutex Tracer::msMutex;
+std::condition_variable Tracer::msCond;
+std::thread Tracer::msThread;
+FILE *Tracer::msFile = 0;
+std::string Tracer::msPath;
+std::string Tracer::msBuffer;
+std::unordered_set<size_t> Tracer::msCodes;
+size_t Tracer::msRecords = 0;
+size_t Tracer::msDropped = 0;
+bool Tracer::msStop = false;
+
+static void PutU8(std::string &out, unsigned int value)
+{
+   out += char(value & 0xFF);
+}
+
+static void PutU32(std::string &out, unsigned long value)
+{
+   for (int i=0; i<4; ++i)
+   {
+      out += char((value >> (8 * i)) & 0xFF);
+   }
+}
+
+static void PutU64(std::string &out, unsigned long long value)
+{
+   for (int i=0; i<8; ++i)
+   {
+      out += char((value >> (8 * i)) & 0xFF);
+   }
+}
+
+static void PutBytes(std::string &out, const std::string &bytes)
+{
+   PutU32(out, (unsigned long) bytes.size());
+   out += bytes;
+}
+
+// Replace values marshal doesn't support by their repr, new reference
+static PyObject* Marshallable(PyObject *obj)
+{
+   PyObject *data = PyMarshal_WriteObjectToString(obj, Py_MARSHAL_VERSION);
+   
+   if (data)
+   {
+      Py_DECREF(data);
+      Py_INCREF(obj);
+      return obj;
+   }
+   
+   PyErr_Clear();
+   
+   if (PyTuple_Check(obj) || PyList_Check(obj))
+   {
+      bool isList = (PyList_Check(obj) != 0);
+      Py_ssize_t n = (isList ? PyList_Size(obj) : PyTuple_Size(obj));
+      PyObject *items = PyList_New(n);
+      
+      for (Py_ssize_t i=0; i<n; ++i)
+      {
+         PyObject *item = (isList ? PyList_GetItem(obj, i) : PyTuple_GetItem(obj, i));
+         PyList_SetItem(items, i, Marshallable(item));
+      }
+      
+      if (isList)
+      {
+         return items;
+      }
+      
+      PyObject *tuple = PyList_AsTuple(items);
+      Py_DECREF(items);
+      return tuple;
+   }
+   
+   PyObject *repr = PyObject_Repr(obj);
+   
+   if (!repr)
+   {
+      PyErr_Clear();
+      Py_INCREF(Py_None);
+      return Py_None;
+   }
+   
+   return repr;
+}
+
+// Marshal obj to out, leaves out empty on failure. Unless strict is set, the
+//   values marshal doesn't support are written as their repr
+static void Marshal(PyObject *obj, std::string &out, bool strict=false)
+{
+   out.clear();
+   
+   if (!obj)
+   {
+      return;
+   }
+   
+   PyObject *data = PyMarshal_WriteObjectToString(obj, Py_MARSHAL_VERSION);
+   
+   if (!data)
+   {
+      PyErr_Clear();
+      
+      if (strict)
+      {
+         return;
+      }
+      
+      PyObject *portable = Marshallable(obj);
+      data = PyMarshal_WriteObjectToString(portable, Py_MARSHAL_VERSION);
+      Py_DECREF(portable);
+      
+      if (!data)
+      {
+         PyErr_Clear();
+         return;
+      }
+   }
+   
+   char *bytes = 0;
+   Py_ssize_t size = 0;
+   
+   if (PyBytes_AsStringAndSize(data, &bytes, &size) == 0)
+   {
+      out.assign(bytes, size_t(size));
+   }
+   else
+   {
+      PyErr_Clear();
+   }
+   
+   Py_DECREF(data);
+}
+
+// Arguments as recorded: marshal would save typed buffers (see the prelude
+//   buffer helper) as raw bytes, they are saved as lists of values instead
+//   Returns a new reference
+static PyObject* TraceArguments(PyObject *args)
+{
+   Py_ssize_t n = PyTuple_Size(args);
+   PyObject *items = 0;
+   
+   for (Py_ssize_t i=0; i<n; ++i)
+   {
+      PyObject *item = PyTuple_GetItem(args, i);
+      
+      if (!PyMemoryView_Check(item))
+      {
+         continue;
+      }
+      
+      PyObject *values = PyObject_CallMethod(item, (char*) "tolist", NULL);
+      
+      if (!values)
+      {
+         PyErr_Clear();
+         continue;
+      }
+      
+      if (!items)
+      {
+         items = PySequence_List(args);
+      }
+      
+      PyList_SetItem(items, i, values);
+   }
+   
+   if (!items)
+   {
+      Py_INCREF(args);
+      return args;
+   }
+   
+   PyObject *traced = PyList_AsTuple(items);
+   Py_DECREF(items);
+   
+   return traced;
+}
+
+bool Tracer::Start(const std::string &path, std::string &error)
+{
+   Stop();
+   
+   FILE *file = fopen(path.c_str(), "wb");
+   
+   if (!file)
+   {
+      error = "Could not open '" + path + "' for writing";
+      return false;
+   }
+   
+   std::lock_guard<std::mutex> lock(msMutex);
+   
+   msFile = file;
+   msPath = path;
+   msBuffer = "PYEXTRC1";
+   PutU32(msBuffer, (unsigned long) PY_VERSION_HEX);
+   PutU32(msBuffer, (unsigned long) Py_MARSHAL_VERSION);
+   msCodes.clear();
+   msRecords = 0;
+   msDropped = 0;
+   msStop = false;
+   msThread = std::thread(Write);
+   msActive = true;
+   
+   return true;
+}
+
+size_t Tracer::Stop()
+{
+   {
+      std::lock_guard<std::mutex> lock(msMutex);
+      
+      if (!msFile)
+      {
+         return 0;
+      }
+      
+      msActive = false;
+      msStop = true;
+      msCond.notify_one();
+   }
+   
+   // The writer never needs the GIL
+   msThread.join();
+   
+   std::lock_guard<std::mutex> lock(msMutex);
+   
+   fclose(msFile);
+   msFile = 0;
+   msPath = "";
+   msCodes.clear();
+   
+   if (msDropped > 0)
+   {
+      fprintf(stderr, "[pyexpr] %lu trace record(s) dropped, the disk couldn't keep up\n", (unsigned long) msDropped);
+   }
+   
+   return msRecords;
+}
+
+std::string Tracer::File()
+{
+   std::lock_guard<std::mutex> lock(msMutex);
+   
+   return msPath;
+}
+
+void Tracer::Record(const PyEvalCode &code, const PyEvalRequest &request, PyObject *args,
+                    PyObject *rv, const PyEvalResult &result, unsigned long long duration)
+{
+   // Marshal outside of the lock, only the GIL is needed
+   std::string margs, mrv;
+   
+   PyObject *traced = TraceArguments(args);
+   Marshal(traced, margs);
+   Py_DECREF(traced);
+   
+   Marshal(rv, mrv);
+   
+   std::string record;
+   
+   PutU8(record, PyEvalTrace_eval);
+   PutU64(record, (unsigned long long) code.hash());
+   PutU8(record, (unsigned int) request.outputType);
+   PutU8(record, (result.succeeded ? PyEvalTrace_succeeded : 0) | (result.timedOut ? PyEvalTrace_timedOut : 0));
+   PutU64(record, duration);
+   PutBytes(record, margs);
+   PutBytes(record, mrv);
+   PutBytes(record, result.errorString);
+   
+   std::lock_guard<std::mutex> lock(msMutex);
+   
+   if (!msFile || msStop)
+   {
+      return;
+   }
+   
+   if (msBuffer.size() + record.size() > TraceMaxSize)
+   {
+      ++msDropped;
+      return;
+   }
+   
+   if (msCodes.insert(code.hash()).second)
+   {
+      std::string decl;
+      
+      PutU8(decl, PyEvalTrace_code);
+      PutU64(decl, (unsigned long long) code.hash());
+      PutU32(decl, (unsigned long) code.params().size());
+      for (size_t i=0; i<code.params().size(); ++i)
+      {
+         PutBytes(decl, code.params()[i]);
+      }
+      PutBytes(decl, code.source());
+      
+      PutU32(msBuffer, (unsigned long) decl.size());
+      msBuffer += decl;
+   }
+   
+   PutU32(msBuffer, (unsigned long) record.size());
+   msBuffer += record;
+   
+   ++msRecords;
+   
+   if (msBuffer.size() >= TraceFlushSize)
+   {
+      msCond.notify_one();
+   }
+}
+
+void Tracer::Write()
+{
+   std::string pending;
+   
+   std::unique_lock<std::mutex> lock(msMutex);
+   
+   while (true)
+   {
+      // Also flush periodically so that an interrupted session leaves a
+      //   usable trace
+      msCond.wait_for(lock, std::chrono::milliseconds(500));
+      
+      pending.swap(msBuffer);
+      
+      bool stop = msStop;
+      FILE *file = msFile;
+      
+      lock.unlock();
+      
+      if (pending.size() > 0)
+      {
+         fwrite(pending.data(), 1, pending.size(), file);
+         fflush(file);
+         pending.clear();
+      }
+      
+      lock.lock();
+      
+      if (stop)
+      {
+         break;
+      }
+   }
+}
+
+bool PyEvalStartTrace(const std::string &path, std::string &error)
+{
+   return Tracer::Start(path, error);
+}
+
+size_t PyEvalStopTrace()
+{
+   return Tracer::Stop();
+}
+
+std::string PyEvalTraceFile()
+{
+   return Tracer::File();
+}
+
+// -----------------------------------------------------------------------------
+
+// Span or marker recorded in a thread ring buffer
+struct TimelineEvent
+{
+   const char *name;
+   // Nanoseconds since the timeline was started
+   long long start;
+   // -1 for markers
+   long long duration;
+   double value;
+   char arg[64];
+};
+
+// Events of a thread, written by that thread only and read once recording
+//   is stopped
+struct TimelineRing
+{
+   std::vector<TimelineEvent> events;
+   std::atomic<size_t> head;
+   size_t track;
+   const char *threadName;
+};
+
+class Timeline
+{
+public:
+   
+   static void Start(size_t eventsPerThread);
+   static bool Stop(const std::string &path, std::string &error);
+   static void Shutdown();
+   
+   static inline bool Active() { return msActive.load(std::memory_order_relaxed); }
+   
+   static long long Now();
+   static void Record(const char *name, long long start, long long duration, double value, const char *arg);
+   
+   static thread_local const char *tThreadName;
+   
+private:
+   
+   static TimelineRing* Ring();
+   
+   static std::atomic<bool> msActive;
+   static std::atomic<unsigned int> msSession;
+   static std::mutex msMutex;
+   static std::vector<std::unique_ptr<TimelineRing> > msRings;
+   static std::vector<std::unique_ptr<TimelineRing> > msRetired;
+   static size_t msCapacity;
+   static std::chrono::steady_clock::time_point msOrigin;
+   
+   static thread_local unsigned int tSession;
+   static thread_local TimelineRing *tRing;
+};
+
+std::atomic<bool> Timeline::msActive(false);
+std::atomic<unsigned int> Timeline::msSession(0);
+std::mutex Timeline::msMutex;
+std::vector<std::unique_ptr<TimelineRing> > Timeline::msRings;
+std::vector<std::unique_ptr<TimelineRing> > Timeline::msRetired;
+size_t Timeline::msCapacity = 0;
+std::chrono::steady_clock::time_point Timeline::msOrigin;
+thread_local const char *Timeline::tThreadName = 0;
+thread_local unsigned int Timeline::tSession = 0;
+thread_local TimelineRing *Timeline::tRing = 0;
+
+void Timeline::Start(size_t eventsPerThread)
+{
+   std::lock_guard<std::mutex> lock(msMutex);
+   
+   msActive = false;
+   
+   // Threads register a new ring on their next event. A thread may still be
+   //   recording an event in its previous ring, rings are only released
+   //   once another session started
+   msRetired.swap(msRings);
+   msRings.clear();
+   msCapacity = std::max(size_t(1), eventsPerThread);
+   msOrigin = std::chrono::steady_clock::now();
+   msSession.fetch_add(1, std::memory_order_release);
+   
+   msActive = true;
+}
+
+long long Timeline::Now()
+{
+   return (long long) std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - msOrigin).count();
+}
+
+TimelineRing* Timeline::Ring()
+{
+   unsigned int session = msSession.load(std::memory_order_acquire);
+   
+   if (tSession != session || !tRing)
+   {
+      std::lock_guard<std::mutex> lock(msMutex);
+      
+      TimelineRing *ring = new TimelineRing();
+      ring->events.resize(msCapacity);
+      ring->head = 0;
+      ring->track = msRings.size() + 1;
+      ring->threadName = tThreadName;
+      
+      msRings.push_back(std::unique_ptr<TimelineRing>(ring));
+      
+      tRing = ring;
+      tSession = session;
+   }
+   
+   return tRing;
+}
+
+void Timeline::Record(const char *name, long long start, long long duration, double value, const char *arg)
+{
+   if (!Active())
+   {
+      return;
+   }
+   
+   TimelineRing *ring = Ring();
+   
+   size_t index = ring->head.load(std::memory_order_relaxed);
+   
+   TimelineEvent &event = ring->events[index % ring->events.size()];
+   
+   event.name = name;
+   event.start = start;
+   event.duration = duration;
+   event.value = value;
+   strncpy(event.arg, (arg ? arg : ""), sizeof(event.arg) - 1);
+   event.arg[sizeof(event.arg) - 1] = '\0';
+   
+   ring->head.store(index + 1, std::memory_order_release);
+}
+
+static void WriteJSONString(FILE *file, const char *str)
+{
+   fputc('"', file);
+   
+   for (const char *c = str; *c; ++c)
+   {
+      if (*c == '"' || *c == '\\')
+      {
+         fputc('\\', file);
+         fputc(*c, file);
+      }
+      else if ((unsigned char)(*c) < 0x20)
+      {
+         fprintf(file, "\\u%04x", (unsigned int)(unsigned char)(*c));
+      }
+      else
+      {
+         fputc(*c, file);
+      }
+   }
+   
+   fputc('"', file);
+}
+
+bool Timeline::Stop(const std::string &path, std::string &error)
+{
+   msActive = false;
+   
+   std::lock_guard<std::mutex> lock(msMutex);
+   
+   FILE *file = fopen(path.c_str(), "w");
+   
+   if (!file)
+   {
+      error = "Could not open '" + path + "' for writing";
+      return false;
+   }
+   
+   fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+   
+   bool first = true;
+   
+   for (size_t i=0; i<msRings.size(); ++i)
+   {
+      const TimelineRing &ring = *(msRings[i]);
+      
+      size_t head = ring.head.load(std::memory_order_acquire);
+      size_t capacity = ring.events.size();
+      size_t begin = 0;
+      
+      if (head > capacity)
+      {
+         // The oldest slot may be overwritten by an event that was being
+         //   recorded when the timeline stopped
+         begin = head - capacity + 1;
+      }
+      
+      fprintf(file, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %lu, \"args\": {\"name\": ",
+              (first ? "" : ",\n"), (unsigned long) ring.track);
+      WriteJSONString(file, (ring.threadName ? ring.threadName : "thread"));
+      fprintf(file, "}}");
+      
+      first = false;
+      
+      for (size_t j=begin; j<head; ++j)
+      {
+         const TimelineEvent &event = ring.events[j % capacity];
+         
+         fprintf(file, ",\n{\"name\": ");
+         WriteJSONString(file, event.name);
+         
+         if (event.duration < 0)
+         {
+            fprintf(file, ", \"cat\": \"pyexpr\", \"ph\": \"i\", \"s\": \"g\", \"ts\": %.3f, \"pid\": 1, \"tid\": %lu, \"args\": {\"value\": %g}}",
+                    double(event.start) / 1000.0, (unsigned long) ring.track, event.value);
+         }
+         else
+         {
+            fprintf(file, ", \"cat\": \"pyexpr\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %lu",
+                    double(event.start) / 1000.0, double(event.duration) / 1000.0, (unsigned long) ring.track);
+            
+            if (event.arg[0] != '\0')
+            {
+               fprintf(file, ", \"args\": {\"node\": ");
+               WriteJSONString(file, event.arg);
+               fprintf(file, "}");
+            }
+            
+            fprintf(file, "}");
+         }
+      }
+   }
+   
+   fprintf(file, "\n]}\n");
+   
+   bool failed = (ferror(file) != 0);
+   
+   fclose(file);
+   
+   if (failed)
+   {
+      error = "Could not write '" + path + "'";
+   }
+   
+   return !failed;
+}
+
+void Timeline::Shutdown()
+{
+   msActive = false;
+}
+
+PyEvalSpan::PyEvalSpan(const char *name, const char *arg)
+   : mName(0)
+   , mStart(0)
+{
+   if (Timeline::Active())
+   {
+      mName = name;
+      mStart = Timeline::Now();
+      mArg[0] = '\0';
+      
+      if (arg)
+      {
+         setArg(arg);
+      }
+   }
+}
+
+PyEvalSpan::~PyEvalSpan()
+{
+   end();
+}
+
+void PyEvalSpan::end()
+{
+   if (mName)
+   {
+      Timeline::Record(mName, mStart, Timeline::Now() - mStart, 0.0, mArg);
+      mName = 0;
+   }
+}
+
+void PyEvalSpan::setArg(const char *arg)
+{
+   if (mName)
+   {
+      strncpy(mArg, arg, sizeof(mArg) - 1);
+      mArg[sizeof(mArg) - 1] = '\0';
+   }
+}
+
+void PyEvalStartTimeline(size_t eventsPerThread)
+{
+   Timeline::Start(eventsPerThread);
+}
+
+bool PyEvalStopTimeline(const std::string &path, std::string &error)
+{
+   return Timeline::Stop(path, error);
+}
+
+bool PyEvalTimelineActive()
+{
+   return Timeline::Active();
+}
+
+void PyEvalTimelineThreadName(const char *name)
+{
+   Timeline::tThreadName = name;
+}
+
+void PyEvalTimelineMarker(const char *name, double value)
+{
+   if (Timeline::Active())
+   {
+      Timeline::Record(name, Timeline::Now(), -1, value, 0);
+   }
+}
+
+// -----------------------------------------------------------------------------
+
+// Replace the linked arguments by the given values (new references, stolen)
+//   The evaluated tuple may be a shared constant, a new one is always built
+static PyObject* LinkArguments(PyObject *args, const std::vector<PyEvalLink> &links, std::vector<PyObject*> &values)
+{
+   Py_ssize_t n = PyTuple_Size(args);
+   
+   PyObject *linked = PyTuple_New(n);
+   
+   for (Py_ssize_t i=0; i<n; ++i)
+   {
+      PyObject *item = PyTuple_GetItem(args, i);
+      Py_INCREF(item);
+      PyTuple_SetItem(linked, i, item);
+   }
+   
+   for (size_t i=0; i<links.size(); ++i)
+   {
+      if (Py_ssize_t(links[i].argument) < n && values[i])
+      {
+         PyTuple_SetItem(linked, Py_ssize_t(links[i].argument), values[i]);
+      }
+      else
+      {
+         Py_XDECREF(values[i]);
+      }
+      values[i] = 0;
+   }
+   
+   Py_DECREF(args);
+   
+   return linked;
+}
+
+// Python value of a step result for a linked argument, new reference
+static PyObject* LinkValue(const PyEvalResult &result, short outputType, short type)
+{
+   bool succeeded = result.succeeded;
+   
+   switch (type)
+   {
+   case PyEval_int:
+      return PyLong_FromLong(succeeded && outputType == PyEval_int ? result.intOutput : 0);
+   case PyEval_double:
+      if (succeeded && outputType == PyEval_int)
+      {
+         return PyFloat_FromDouble(double(result.intOutput));
+      }
+      return PyFloat_FromDouble(succeeded && outputType == PyEval_double ? result.doubleOutput : 0.0);
+   default:
+      {
+         const char *str = (succeeded && outputType == PyEval_string ? result.stringOutput.c_str() : "");
+#if PY_MAJOR_VERSION >= 3
+         return PyUnicode_FromString(str);
+#else
+         return PyString_FromString(str);
+#endif
+      }
+   }
+}
+
+// Call function with args (stolen reference) and convert its result, in the
+//   current interpreter. interp and timeoutError are only set for isolated
+//   interpreters
+static bool Call(PyObject *function, const PyEvalRequest &request, PyEvalResult &result, PyObject *args,
+                 PyInterpreterState *interp, PyObject *timeoutError)
+{
+   PyObject *inputs = 0;
+   
+   if (request.history && PyTuple_Size(args) >= 2)
+   {
+      // The two last arguments are placeholders for history and prev
+      Py_ssize_t n = PyTuple_Size(args) - 2;
+      
+      inputs = PyTuple_GetSlice(args, 0, n);
+      
+      PyObject *history = 0;
+      PyObject *prev = 0;
+      
+      request.history->begin(request.time, request.historySize, request.historyGap, history, prev);
+      
+      PyObject *tail = Py_BuildValue("(NN)", history, prev);
+      
+      Py_DECREF(args);
+      args = PySequence_Concat(inputs, tail);
+      Py_DECREF(tail);
+   }
+   
+   PyObject *lazyInputs = 0;
+   
+   if (request.inputs && PyTuple_Size(args) >= 1)
+   {
+      lazyInputs = NewInputs(request.inputs.get());
+      
+      PyObject *rest = PyTuple_GetSlice(args, 1, PyTuple_Size(args));
+      PyObject *head = Py_BuildValue("(O)", lazyInputs);
+      
+      Py_DECREF(args);
+      args = PySequence_Concat(head, rest);
+      Py_DECREF(head);
+      Py_DECREF(rest);
+   }
+   
+   bool trace = (request.trace && Tracer::Active());
+   
+   std::chrono::steady_clock::time_point start;
+   
+   if (trace)
+   {
+      start = std::chrono::steady_clock::now();
+   }
+   
+   unsigned long watchdog = (request.timeBudget > 0.0 ? Watchdog::Arm(request.timeBudget, interp, timeoutError) : 0);
+   
+   PyObject *rv = 0;
+   
+   {
+      PyEvalSpan span("execute");
+      
+      rv = PyObject_Call(function, args, NULL);
+   }
+   
+   unsigned long long duration = 0;
+   
+   if (trace)
+   {
+      duration = (unsigned long long) std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+   }
+   
+   if (watchdog != 0 && Watchdog::Disarm(watchdog) && !rv)
+   {
+      std::ostringstream oss;
+      oss << "EvaluationTimeout: evaluation exceeded its " << request.timeBudget << " ms budget";
+      
+      PyErr_Clear();
+      result.reset();
+      result.timedOut = true;
+      result.errorString = oss.str();
+      
+      ++gTimedOutCount;
+   }
+   else
+   {
+      if (rv)
+      {
+         PyEvalSpan span("convert");
+         
+         result.succeeded = Convert(rv, request.outputType, result);
+      }
+      
+      if (!result.succeeded)
+      {
+         FetchError(request.verbose, result.errorString);
+         
+         // Keep partially converted outputs consistent with a failed evaluation
+         std::string errorString = result.errorString;
+         result.reset();
+         result.errorString = errorString;
+      }
+   }
+   
+   if (trace)
+   {
+      Tracer::Record(*(request.code), request, args, rv, result, duration);
+   }
+   
+   if (inputs)
+   {
+      if (result.succeeded)
+      {
+         request.history->end(request.time, inputs, rv);
+      }
+      Py_DECREF(inputs);
+   }
+   
+   if (lazyInputs)
+   {
+      ReleaseInputs(lazyInputs);
+      Py_DECREF(lazyInputs);
+   }
+   
+   Py_XDECREF(rv);
+   Py_DECREF(args);
+   
+   return result.succeeded;
+}
+
+static bool Evaluate(PyObject *function, const PyEvalRequest &request, PyEvalResult &result,
+                     PyInterpreterState *interp, PyObject *timeoutError,
+                     const std::vector<PyEvalLink> *links=0, std::vector<PyObject*> *values=0)
+{
+   // Both borrowed references
+   PyObject *mainModule = PyImport_AddModule("__main__");
+   PyObject *globals = PyModule_GetDict(mainModule);
+   
+   PyObject *args = 0;
+   
+   {
+      PyEvalSpan span("arguments");
+      
+      args = PyRun_String(request.args.c_str(), Py_eval_input, globals, globals);
+   }
+   
+   if (!args || !PyTuple_Check(args))
+   {
+      if (args)
+      {
+         Py_DECREF(args);
+         PyErr_SetString(PyExc_TypeError, "arguments must be a tuple");
+      }
+      FetchError(request.verbose, result.errorString);
+      return false;
+   }
+   
+   if (links && links->size() > 0)
+   {
+      args = LinkArguments(args, *links, *values);
+   }
+   
+   return Call(function, request, result, args, interp, timeoutError);
+}
+
+// -----------------------------------------------------------------------------
+
+static std::mutex gPreludeMutex;
+static std::string gPrelude;
+
+void PyEvalSetPrelude(const std::string &source)
+{
+   std::lock_guard<std::mutex> lock(gPreludeMutex);
+   gPrelude = source;
+}
+
+#ifdef PYEVAL_INTERPRETERS
+
+// Pool of isolated interpreters, each owned by a worker thread that holds its
+//   GIL while evaluating. Requests are queued and picked up by the first idle
+//   worker, the submitting thread waits for their results
+class InterpreterPool
+{
+public:
+   
+   struct Job
+   {
+      const PyEvalRequest *request;
+      PyEvalResult *result;
+      bool done;
+   };
+   
+   static size_t Start(size_t count);
+   static void Stop();
+   static size_t Size();
+   
+   // Queue all the jobs at once so that they are evaluated concurrently, the
+   //   vector must not change until Wait returns. Returns false, without
+   //   queuing them, if no interpreter is running
+   static bool Submit(std::vector<Job> &jobs);
+   
+   // Wait for the jobs queued by Submit
+   static void Wait(std::vector<Job> &jobs);
+   
+   // Returns false if no interpreter is running
+   static bool Run(const PyEvalRequest &request, PyEvalResult &result);
+   
+private:
+   
+   struct Worker
+   {
+      std::thread thread;
+      bool ready;
+      bool failed;
+   };
+   
+   // Code compiled in a worker interpreter, the weak reference detects codes
+   //   released since (and their address being reused)
+   struct Replica
+   {
+      std::weak_ptr<PyEvalCode> code;
+      PyObject *function;
+      std::string error;
+   };
+   
+   typedef std::unordered_map<const PyEvalCode*, Replica> Replicas;
+   
+   static void Work(Worker *worker);
+   static void Process(Job *job, Replicas &replicas, PyInterpreterState *interp, PyObject *timeoutError);
+   
+   static std::mutex msMutex;
+   static std::condition_variable msJobCond;
+   static std::condition_variable msDoneCond;
+   static std::deque<Job*> msJobs;
+   static std::list<Worker> msWorkers;
+   static bool msStop;
+};
+
+std::mutex InterpreterPool::msMutex;
+std::condition_variable InterpreterPool::msJobCond;
+std::condition_variable InterpreterPool::msDoneCond;
+std::deque<InterpreterPool::Job*> InterpreterPool::msJobs;
+std::list<InterpreterPool::Worker> InterpreterPool::msWorkers;
+bool InterpreterPool::msStop = false;
+
+size_t InterpreterPool::Start(size_t count)
+{
+   Stop();
+   
+   if (count == 0)
+   {
+      return 0;
+   }
+   
+   // Workers need the main interpreter GIL to create their own
+   PyEvalAllowThreads allowThreads;
+   
+   std::unique_lock<std::mutex> lock(msMutex);
+   
+   msStop = false;
+   
+   for (size_t i=0; i<count; ++i)
+   {
+      msWorkers.push_back(Worker());
+      Worker &worker = msWorkers.back();
+      worker.ready = false;
+      worker.failed = false;
+      worker.thread = std::thread(Work, &worker);
+   }
+   
+   size_t running = 0;
+   
+   for (std::list<Worker>::iterator it = msWorkers.begin(); it != msWorkers.end();)
+   {
+      while (!it->ready)
+      {
+         msDoneCond.wait(lock);
+      }
+      
+      if (it->failed)
+      {
+         it->thread.join();
+         it = msWorkers.erase(it);
+      }
+      else
+      {
+         ++running;
+         ++it;
+      }
+   }
+   
+   return running;
+}
+
+void InterpreterPool::Stop()
+{
+   // An interrupt could still be about to enter a stopped interpreter
+   Watchdog::Shutdown();
+   
+   PyEvalAllowThreads allowThreads;
+   
+   {
+      std::lock_guard<std::mutex> lock(msMutex);
+      msStop = true;
+      msJobCond.notify_all();
+   }
+   
+   // Workers finish the queued jobs before exiting
+   for (std::list<Worker>::iterator it = msWorkers.begin(); it != msWorkers.end(); ++it)
+   {
+      it->thread.join();
+   }
+   
+   std::lock_guard<std::mutex> lock(msMutex);
+   
+   msWorkers.clear();
+}
+
+size_t InterpreterPool::Size()
+{
+   std::lock_guard<std::mutex> lock(msMutex);
+   
+   return msWorkers.size();
+}
+
+bool InterpreterPool::Submit(std::vector<Job> &jobs)
+{
+   std::lock_guard<std::mutex> lock(msMutex);
+   
+   if (msWorkers.size() == 0 || msStop)
+   {
+      return false;
+   }
+   
+   for (size_t i=0; i<jobs.size(); ++i)
+   {
+      jobs[i].done = false;
+      msJobs.push_back(&(jobs[i]));
+   }
+   
+   msJobCond.notify_all();
+   
+   return true;
+}
+
+void InterpreterPool::Wait(std::vector<Job> &jobs)
+{
+   if (jobs.size() == 0)
+   {
+      return;
+   }
+   
+   // Don't keep other threads out of the main interpreter while waiting
+   PyEvalAllowThreads allowThreads;
+   
+   std::unique_lock<std::mutex> lock(msMutex);
+   
+   for (size_t i=0; i<jobs.size(); ++i)
+   {
+      while (!jobs[i].done)
+      {
+         msDoneCond.wait(lock);
+      }
+   }
+}
+
+bool InterpreterPool::Run(const PyEvalRequest &request, PyEvalResult &result)
+{
+   std::vector<Job> jobs(1);
+   
+   jobs[0].request = &request;
+   jobs[0].result = &result;
+   
+   if (!Submit(jobs))
+   {
+      return false;
+   }
+   
+   Wait(jobs);
+   
+   return true;
+}
+
+void InterpreterPool::Work(Worker *worker)
+{
+   PyEvalTimelineThreadName("pyexpr interpreter");
+   
+   PyGILState_STATE state = PyGILState_Ensure();
+   PyThreadState *mainState = PyThreadState_Get();
+   
+   PyInterpreterConfig config;
+   config.use_main_obmalloc = 0;
+   config.allow_fork = 0;
+   config.allow_exec = 0;
+   config.allow_threads = 1;
+   config.allow_daemon_threads = 0;
+   config.check_multi_interp_extensions = 1;
+   config.gil = PyInterpreterConfig_OWN_GIL;
+   
+   PyThreadState *ts = 0;
+   
+   // On success, the main interpreter GIL is released and the new one is held
+   PyStatus status = Py_NewInterpreterFromConfig(&ts, &config);
+   
+   if (PyStatus_Exception(status) || !ts)
+   {
+      PyGILState_Release(state);
+      
+      std::lock_guard<std::mutex> lock(msMutex);
+      worker->failed = true;
+      worker->ready = true;
+      msDoneCond.notify_all();
+      return;
+   }
+   
+   PyInterpreterState *interp = PyThreadState_GetInterpreter(ts);
+   PyObject *timeoutError = NewTimeoutError();
+   Replicas replicas;
+   
+   {
+      std::string prelude;
+      {
+         std::lock_guard<std::mutex> lock(gPreludeMutex);
+         prelude = gPrelude;
+      }
+      
+      if (prelude.length() > 0)
+      {
+         PyObject *globals = PyModule_GetDict(PyImport_AddModule("__main__"));
+         PyObject *rv = PyRun_String(prelude.c_str(), Py_file_input, globals, globals);
+         
+         if (rv)
+         {
+            Py_DECREF(rv);
+         }
+         else
+         {
+            PrintError();
+         }
+      }
+   }
+   
+   PyThreadState *saved = PyEval_SaveThread();
+   
+   {
+      std::lock_guard<std::mutex> lock(msMutex);
+      worker->ready = true;
+      msDoneCond.notify_all();
+   }
+   
+   while (true)
+   {
+      Job *job = 0;
+      
+      {
+         std::unique_lock<std::mutex> lock(msMutex);
+         
+         while (!msStop && msJobs.empty())
+         {
+            msJobCond.wait(lock);
+         }
+         
+         if (msJobs.empty())
+         {
+            break;
+         }
+         
+         job = msJobs.front();
+         msJobs.pop_front();
+      }
+      
+      PyEval_RestoreThread(saved);
+      
+      Process(job, replicas, interp, timeoutError);
+      
+      saved = PyEval_SaveThread();
+      
+      std::lock_guard<std::mutex> lock(msMutex);
+      job->done = true;
+      msDoneCond.notify_all();
+   }
+   
+   PyEval_RestoreThread(saved);
+   
+   for (Replicas::iterator it = replicas.begin(); it != replicas.end(); ++it)
+   {
+      Py_XDECREF(it->second.function);
+   }
+   replicas.clear();
+   
+   Py_XDECREF(timeoutError);
+   
+   Py_EndInterpreter(ts);
+   
+   PyEval_RestoreThread(mainState);
+   PyGILState_Release(state);
+}
+
+void InterpreterPool::Process(Job *job, Replicas &replicas, PyInterpreterState *interp, PyObject *timeoutError)
+{
+   const PyEvalRequest &request = *(job->request);
+   PyEvalResult &result = *(job->result);
+   
+   result.reset();
+   
+   // The request keeps its code alive, no need to lock the weak references
+   //   (which would also risk releasing the code from this interpreter)
+   const PyEvalCode *key = request.code.get();
+   
+   Replicas::iterator it = replicas.find(key);
+   
+   if (it == replicas.end() || it->second.code.expired())
+   {
+      // Drop replicas of released codes
+      for (Replicas::iterator rit = replicas.begin(); rit != replicas.end();)
+      {
+         if (rit->second.code.expired())
+         {
+            Py_XDECREF(rit->second.function);
+            rit = replicas.erase(rit);
+         }
+         else
+         {
+            ++rit;
+         }
+      }
+      
+      PyEvalSpan span("compile");
+      
+      Replica replica;
+      replica.code = request.code;
+      replica.function = CompileFunction(request.code->source(), request.verbose, replica.error);
+      
+      it = replicas.insert(std::make_pair(key, replica)).first;
+   }
+   
+   if (!it->second.function)
+   {
+      result.errorString = it->second.error;
+      return;
+   }
+   
+   Evaluate(it->second.function, request, result, interp, timeoutError);
+}
+
+#endif
+
+size_t PyEvalSetInterpreters(size_t count)
+{
+#ifdef PYEVAL_INTERPRETERS
+   return InterpreterPool::Start(count);
+#else
+   (void) count;
+   return 0;
+#endif
+}
+
+size_t PyEvalInterpreters()
+{
+#ifdef PYEVAL_INTERPRETERS
+   return InterpreterPool::Size();
+#else
+   return 0;
+#endif
+}
+
+#ifdef PYEVAL_WORKERS
+
+// Loop run by worker processes. Messages are described by 'kind offset length
+//   size' lines on stdin, the mapping of the shared file being resized to size
+//   first. P messages hold the prelude source, E messages the marshalled code
+//   hash, source, arguments and verbosity. Replies are marshalled (ok, value)
+//   tuples written after the message, described the same way on stdout
+//   Standard output is redirected to standard error for the expressions
+static const char *WorkerScript =
+   "import sys, os, mmap, marshal, ctypes, traceback\n"
+   "\n"
+   "def _pyexpr_worker(path):\n"
+   "  out = os.fdopen(os.dup(1), 'wb', 0)\n"
+   "  inp = os.fdopen(os.dup(0), 'rb')\n"
+   "  os.dup2(2, 1)\n"
+   "  os.dup2(os.open(os.devnull, os.O_RDONLY), 0)\n"
+   "  fd = os.open(path, os.O_RDWR)\n"
+   "  state = {'map': None, 'stale': []}\n"
+   "  def remap(size):\n"
+   "    m = state['map']\n"
+   "    if m is not None and len(m) >= size:\n"
+   "      return m\n"
+   "    if m is not None:\n"
+   "      try:\n"
+   "        m.close()\n"
+   "      except BufferError:\n"
+   "        # Still exported by a buffer an expression kept\n"
+   "        state['stale'].append(m)\n"
+   "    if os.fstat(fd).st_size < size:\n"
+   "      os.ftruncate(fd, size)\n"
+   "    m = state['map'] = mmap.mmap(fd, size)\n"
+   "    return m\n"
+   "  cast = hasattr(memoryview, 'cast')\n"
+   "  ctypesByFormat = dict((t._type_, t) for t in (ctypes.c_double, ctypes.c_float, ctypes.c_int, ctypes.c_uint,\n"
+   "                                                ctypes.c_long, ctypes.c_ulong, ctypes.c_longlong, ctypes.c_ulonglong,\n"
+   "                                                ctypes.c_short, ctypes.c_ushort, ctypes.c_byte, ctypes.c_ubyte, ctypes.c_bool))\n"
+   "  g = sys.modules['__main__'].__dict__\n"
+   "  def unpack(v, m, views):\n"
+   "    if type(v) is tuple:\n"
+   "      if len(v) == 6 and v[0] == '__pyexpr_buffer__':\n"
+   "        offset, fmt, count, nbytes, writable = v[1:]\n"
+   "        if not cast:\n"
+   "          return (ctypesByFormat[fmt] * count).from_buffer(m, offset)\n"
+   "        buf = memoryview(m)[offset:offset+nbytes]\n"
+   "        views.append(buf)\n"
+   "        buf = buf.cast(fmt)\n"
+   "        views.append(buf)\n"
+   "        if not writable and hasattr(buf, 'toreadonly'):\n"
+   "          buf = buf.toreadonly()\n"
+   "          views.append(buf)\n"
+   "        return buf\n"
+   "      if len(v) == 2 and v[0] == '__pyexpr_geometry__':\n"
+   "        attrs = dict((k, unpack(a, m, views)) for k, a in v[1].items())\n"
+   "        geometry = g['_pyexpr_geometry'].__new__(g['_pyexpr_geometry'])\n"
+   "        geometry.__dict__.update(attrs)\n"
+   "        return geometry\n"
+   "      return tuple(unpack(a, m, views) for a in v)\n"
+   "    if type(v) is list:\n"
+   "      return [unpack(a, m, views) for a in v]\n"
+   "    return v\n"
+   "  def plain(v):\n"
+   "    if isinstance(v, (list, tuple, ctypes.Array)):\n"
+   "      return [plain(a) for a in v]\n"
+   "    if hasattr(v, 'tolist'):\n"
+   "      return v.tolist()\n"
+   "    if hasattr(v, '__index__'):\n"
+   "      return v.__index__()\n"
+   "    if hasattr(v, '__float__'):\n"
+   "      return float(v)\n"
+   "    return v if isinstance(v, (str, type(u''))) else str(v)\n"
+   "  def error(e):\n"
+   "    msg = str(e)\n"
+   "    return type(e).__name__ + (': ' + msg if msg else '')\n"
+   "  codes = {}\n"
+   "  out.write(('ready %x\\n' % sys.hexversion).encode('ascii'))\n"
+   "  while True:\n"
+   "    line = inp.readline()\n"
+   "    if not line:\n"
+   "      break\n"
+   "    kind, offset, length, size = line.split()\n"
+   "    offset, length = int(offset), int(length)\n"
+   "    m = remap(int(size))\n"
+   "    views = []\n"
+   "    verbose = True\n"
+   "    try:\n"
+   "      if kind == b'P':\n"
+   "        exec(compile(m[offset:offset+length].decode('utf-8'), '<pyexpr prelude>', 'exec'), g)\n"
+   "        rv = None\n"
+   "      else:\n"
+   "        key, source, args, verbose = marshal.loads(m[offset:offset+length])\n"
+   "        func = codes.get(key)\n"
+   "        if func is None:\n"
+   "          scope = {}\n"
+   "          exec(source, g, scope)\n"
+   "          func = codes[key] = scope['_pyexpr_eval']\n"
+   "        rv = func(*unpack(args, m, views))\n"
+   "        if isinstance(rv, (memoryview, ctypes.Array)):\n"
+   "          rv = plain(rv)\n"
+   "      try:\n"
+   "        data = marshal.dumps((True, rv))\n"
+   "      except ValueError:\n"
+   "        data = marshal.dumps((True, plain(rv)))\n"
+   "    except BaseException as e:\n"
+   "      if verbose:\n"
+   "        traceback.print_exc()\n"
+   "      data = marshal.dumps((False, error(e)))\n"
+   "    rv = None\n"
+   "    for buf in reversed(views):\n"
+   "      try:\n"
+   "        buf.release()\n"
+   "      except BufferError:\n"
+   "        pass\n"
+   "    del views\n"
+   "    offset = (offset + length + 15) & ~15\n"
+   "    m = remap(offset + len(data))\n"
+   "    m[offset:offset+len(data)] = data\n"
+   "    out.write(('R %d %d %d\\n' % (offset, len(data), len(m))).encode('ascii'))\n"
+   "\n"
+   "_pyexpr_worker(sys.argv[1])\n";
+
+// Typed buffer copied to a worker shared mapping
+struct WorkerBuffer
+{
+   Py_buffer view;
+   size_t offset;
+   bool writable;
+};
+
+// Worker arguments: typed buffers are replaced by ('__pyexpr_buffer__',
+//   offset, format, count, nbytes, writable) and geometry objects (see the
+//   prelude) by ('__pyexpr_geometry__', attributes). Buffers offsets in the
+//   shared mapping are allocated from offset. Returns a new reference
+static PyObject* WorkerArguments(PyObject *obj, std::vector<WorkerBuffer> &buffers, size_t &offset)
+{
+   if (PyFloat_CheckExact(obj) || PyLong_CheckExact(obj) || PyBytes_CheckExact(obj) || PyUnicode_CheckExact(obj))
+   {
+      Py_INCREF(obj);
+      return obj;
+   }
+   
+   if (PyTuple_Check(obj) || PyList_Check(obj))
+   {
+      bool isList = (PyList_Check(obj) != 0);
+      Py_ssize_t n = (isList ? PyList_Size(obj) : PyTuple_Size(obj));
+      PyObject *items = (isList ? PyList_New(n) : PyTuple_New(n));
+      
+      for (Py_ssize_t i=0; i<n; ++i)
+      {
+         PyObject *item = WorkerArguments(isList ? PyList_GetItem(obj, i) : PyTuple_GetItem(obj, i), buffers, offset);
+         
+         if (isList)
+         {
+            PyList_SetItem(items, i, item);
+         }
+         else
+         {
+            PyTuple_SetItem(items, i, item);
+         }
+      }
+      
+      return items;
+   }
+   
+   if (!strcmp(Py_TYPE(obj)->tp_name, "_pyexpr_geometry"))
+   {
+      PyObject *dict = PyObject_GetAttrString(obj, "__dict__");
+      
+      if (dict && PyDict_Check(dict))
+      {
+         PyObject *attrs = PyDict_New();
+         PyObject *key = 0;
+         PyObject *value = 0;
+         Py_ssize_t pos = 0;
+         
+         while (PyDict_Next(dict, &pos, &key, &value))
+         {
+            PyObject *item = WorkerArguments(value, buffers, offset);
+            PyDict_SetItem(attrs, key, item);
+            Py_DECREF(item);
+         }
+         
+         Py_DECREF(dict);
+         
+         return Py_BuildValue("(sN)", "__pyexpr_geometry__", attrs);
+      }
+      
+      Py_XDECREF(dict);
+      PyErr_Clear();
+   }
+   
+   if (PyObject_CheckBuffer(obj) && !PyByteArray_Check(obj))
+   {
+      WorkerBuffer buffer;
+      
+      buffer.writable = true;
+      
+      if (PyObject_GetBuffer(obj, &(buffer.view), PyBUF_RECORDS) != 0)
+      {
+         PyErr_Clear();
+         
+         buffer.writable = false;
+         
+         if (PyObject_GetBuffer(obj, &(buffer.view), PyBUF_RECORDS_RO) != 0)
+         {
+            PyErr_Clear();
+            Py_INCREF(obj);
+            return obj;
+         }
+      }
+      
+      // ctypes formats carry the byte order
+      const char *format = (buffer.view.format ? buffer.view.format : "B");
+      
+      while (*format && strchr("@=<>!", *format))
+      {
+         ++format;
+      }
+      
+      if (strlen(format) == 1 && buffer.view.itemsize > 0 && PyBuffer_IsContiguous(&(buffer.view), 'C'))
+      {
+         buffer.offset = offset;
+         offset = (offset + size_t(buffer.view.len) + 15) & ~size_t(15);
+         buffers.push_back(buffer);
+         
+         return Py_BuildValue("(snsnnO)", "__pyexpr_buffer__", Py_ssize_t(buffer.offset), format,
+                              buffer.view.len / buffer.view.itemsize, buffer.view.len,
+                              buffer.writable ? Py_True : Py_False);
+      }
+      
+      PyBuffer_Release(&(buffer.view));
+      
+      PyObject *values = PyObject_CallMethod(obj, (char*) "tolist", NULL);
+      
+      if (values)
+      {
+         return values;
+      }
+      
+      PyErr_Clear();
+   }
+   
+   Py_INCREF(obj);
+   return obj;
+}
+
+// Pool of python processes. Workers are handed out to one request at a time,
+//   several requests of a batch being sent to different workers at once
+class WorkerPool
+{
+public:
+   
+   static size_t Start(size_t count, const std::string &python, std::string &error);
+   static void Stop();
+   static size_t Size();
+   static unsigned long Restarts();
+   
+   // Returns false if no worker is running. Requests that couldn't be sent
+   //   because the pool was stopped meanwhile are evaluated locally
+   static bool Run(const std::vector<const PyEvalRequest*> &requests, const std::vector<PyEvalResult*> &results);
+   
+private:
+   
+   struct Worker
+   {
+      Worker()
+         : pid(0)
+         , socket(-1)
+         , file(-1)
+         , map(0)
+         , mapSize(0)
+         , busy(false)
+      {
+      }
+      
+      pid_t pid;
+      int socket;
+      // Shared file, its path is only kept until the worker opened it
+      int file;
+      std::string path;
+      char *map;
+      size_t mapSize;
+      bool busy;
+   };
+   
+   struct Job
+   {
+      const PyEvalRequest *request;
+      PyEvalResult *result;
+      std::string message;
+      std::vector<WorkerBuffer> buffers;
+      size_t messageOffset;
+      Worker *worker;
+      std::chrono::steady_clock::time_point sent;
+      std::string reply;
+      // Arguments or sending failed, result error is set
+      bool failed;
+      // No worker was available or the arguments can't be marshalled, evaluated locally
+      bool skipped;
+   };
+   
+   static bool Launch(Worker &worker, std::string &error);
+   static bool Handshake(Worker &worker, std::string &error);
+   static void Kill(Worker &worker, std::string *reason);
+   static bool Map(Worker &worker, size_t size);
+   static bool Send(Worker &worker, char kind, size_t offset, size_t length);
+   static bool Receive(Worker &worker, int timeout, size_t &offset, size_t &length, std::string &error);
+   
+   static Worker* Acquire(bool wait);
+   static void Release(Worker *worker);
+   
+   static void Submit(Job &job, Worker *worker);
+   static void Collect(Job &job);
+   static void Dispatch(std::vector<Job> &jobs);
+   
+   static std::mutex msMutex;
+   static std::condition_variable msIdleCond;
+   static std::vector<Worker*> msWorkers;
+   static std::string msPython;
+   static bool msStop;
+   static std::atomic<unsigned long> msRestarts;
+   static std::atomic<unsigned long> msFiles;
+};
+
+std::mutex WorkerPool::msMutex;
+std::condition_variable WorkerPool::msIdleCond;
+std::vector<WorkerPool::Worker*> WorkerPool::msWorkers;
+std::string WorkerPool::msPython;
+bool WorkerPool::msStop = false;
+std::atomic<unsigned long> WorkerPool::msRestarts(0);
+std::atomic<unsigned long> WorkerPool::msFiles(0);
+
+// Python executable for the workers when none is given, maya's executable
+//   isn't a python one but mayapy lives next to it. The GIL must be held
+static std::string DefaultWorkerPython()
+{
+   std::string executable;
+   
+   PyObject *obj = PySys_GetObject((char*) "executable");
+   
+   if (obj)
+   {
+      AsString(obj, executable);
+   }
+   
+   size_t sep = executable.rfind('/');
+   std::string dir = (sep == std::string::npos ? std::string("") : executable.substr(0, sep + 1));
+   std::string name = executable.substr(dir.length());
+   
+   if (name.find("python") != std::string::npos || name.find("mayapy") != std::string::npos)
+   {
+      return executable;
+   }
+   
+   struct stat st;
+   
+   if (dir.length() > 0 && stat((dir + "mayapy").c_str(), &st) == 0)
+   {
+      return dir + "mayapy";
+   }
+   
+   return (PY_MAJOR_VERSION >= 3 ? "python3" : "python");
+}
+
+size_t WorkerPool::Start(size_t count, const std::string &python, std::string &error)
+{
+   Stop();
+   
+   error = "";
+   
+   if (count == 0)
+   {
+      return 0;
+   }
+   
+   std::string executable = python;
+   
+   if (executable.empty())
+   {
+      PyEvalGIL gil;
+      executable = DefaultWorkerPython();
+   }
+   
+   PyEvalAllowThreads allowThreads;
+   
+   std::lock_guard<std::mutex> lock(msMutex);
+   
+   msPython = executable;
+   msStop = false;
+   
+   std::vector<Worker*> workers;
+   
+   // Let all the interpreters start at once
+   for (size_t i=0; i<count; ++i)
+   {
+      Worker *worker = new Worker();
+      
+      if (Launch(*worker, error))
+      {
+         workers.push_back(worker);
+      }
+      else
+      {
+         delete worker;
+      }
+   }
+   
+   for (size_t i=0; i<workers.size(); ++i)
+   {
+      if (Handshake(*(workers[i]), error))
+      {
+         msWorkers.push_back(workers[i]);
+      }
+      else
+      {
+         delete workers[i];
+      }
+   }
+   
+   return msWorkers.size();
+}
+
+void WorkerPool::Stop()
+{
+   PyEvalAllowThreads allowThreads;
+   
+   std::unique_lock<std::mutex> lock(msMutex);
+   
+   msStop = true;
+   
+   // Let running evaluations finish
+   for (size_t i=0; i<msWorkers.size(); ++i)
+   {
+      while (msWorkers[i]->busy)
+      {
+         msIdleCond.wait(lock);
+      }
+   }
+   
+   for (size_t i=0; i<msWorkers.size(); ++i)
+   {
+      Kill(*(msWorkers[i]), 0);
+      delete msWorkers[i];
+   }
+   
+   msWorkers.clear();
+   
+   // Wake up requests waiting for a worker
+   msIdleCond.notify_all();
+}
+
+size_t WorkerPool::Size()
+{
+   std::lock_guard<std::mutex> lock(msMutex);
+   
+   return msWorkers.size();
+}
+
+unsigned long WorkerPool::Restarts()
+{
+   return msRestarts;
+}
+
+// Start worker process with a new shared file
+bool WorkerPool::Launch(Worker &worker, std::string &error)
+{
+   struct stat st;
+   
+   // Prefer memory backed files
+   const char *tmp = getenv("TMPDIR");
+   std::string dir = (stat("/dev/shm", &st) == 0 && S_ISDIR(st.st_mode) ? "/dev/shm" : (tmp ? tmp : "/tmp"));
+   
+   std::ostringstream oss;
+   oss << dir << "/pyexpr-worker-" << getpid() << "-" << (++msFiles);
+   
+   worker.path = oss.str();
+   worker.file = open(worker.path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+   
+   if (worker.file < 0)
+   {
+      error = "IOError: could not create '" + worker.path + "'";
+      worker.path = "";
+      return false;
+   }
+   
+   fcntl(worker.file, F_SETFD, FD_CLOEXEC);
+   
+   int sockets[2] = {-1, -1};
+   
+   if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0)
+   {
+      error = "OSError: could not create worker socket";
+      Kill(worker, 0);
+      return false;
+   }
+   
+   fcntl(sockets[0], F_SETFD, FD_CLOEXEC);
+   fcntl(sockets[1], F_SETFD, FD_CLOEXEC);
+
+#ifdef SO_NOSIGPIPE
+   int on = 1;
+   setsockopt(sockets[0], SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+   
+   worker.socket = sockets[0];
+   
+   // The worker end is both its stdin and stdout
+   posix_spawn_file_actions_t actions;
+   posix_spawn_file_actions_init(&actions);
+   posix_spawn_file_actions_adddup2(&actions, sockets[1], 0);
+   posix_spawn_file_actions_adddup2(&actions, sockets[1], 1);
+   
+   char *argv[] = {(char*) msPython.c_str(), (char*) "-c", (char*) WorkerScript, (char*) worker.path.c_str(), 0};
+   
+   int rv = posix_spawnp(&(worker.pid), msPython.c_str(), &actions, 0, argv, environ);
+   
+   posix_spawn_file_actions_destroy(&actions);
+   close(sockets[1]);
+   
+   if (rv != 0)
+   {
+      error = "OSError: could not run '" + msPython + "'";
+      worker.pid = 0;
+      Kill(worker, 0);
+      return false;
+   }
+   
+   if (!Map(worker, 1 << 20))
+   {
+      error = "OSError: could not map '" + worker.path + "'";
+      Kill(worker, 0);
+      return false;
+   }
+   
+   return true;
+}
+
+bool WorkerPool::Handshake(Worker &worker, std::string &error)
+{
+   char line[64];
+   size_t n = 0;
+   
+   // Interpreter start up may take a while
+   while (n + 1 < sizeof(line))
+   {
+      pollfd fd = {worker.socket, POLLIN, 0};
+      
+      if (poll(&fd, 1, 30000) <= 0 || recv(worker.socket, line + n, 1, 0) != 1)
+      {
+         break;
+      }
+      
+      if (line[n++] == '\n')
+      {
+         break;
+      }
+   }
+   
+   line[n] = '\0';
+   
+   // The worker opened the file before replying, nothing is left behind if
+   //   either process ends
+   unlink(worker.path.c_str());
+   worker.path = "";
+   
+   unsigned long version = 0;
+   
+   if (sscanf(line, "ready %lx", &version) != 1)
+   {
+      error = "RuntimeError: worker '" + msPython + "' failed to start";
+      Kill(worker, 0);
+      return false;
+   }
+   
+   if ((version >> 16) != ((unsigned long) PY_VERSION_HEX >> 16))
+   {
+      std::ostringstream oss;
+      oss << "RuntimeError: worker '" << msPython << "' runs python " << (version >> 24) << "." << ((version >> 16) & 0xFF)
+          << ", " << PY_MAJOR_VERSION << "." << PY_MINOR_VERSION << " is required";
+      error = oss.str();
+      Kill(worker, 0);
+      return false;
+   }
+   
+   std::string prelude;
+   {
+      std::lock_guard<std::mutex> lock(gPreludeMutex);
+      prelude = gPrelude;
+   }
+   
+   if (prelude.length() > 0)
+   {
+      size_t offset = 0;
+      size_t length = 0;
+      
+      bool sent = Map(worker, prelude.length());
+      
+      if (sent)
+      {
+         memcpy(worker.map, prelude.data(), prelude.length());
+         sent = Send(worker, 'P', 0, prelude.length());
+      }
+      
+      // Prelude errors are printed by the worker
+      if (!sent || !Receive(worker, 30000, offset, length, error))
+      {
+         error = "RuntimeError: worker '" + msPython + "' failed to run the prelude";
+         Kill(worker, 0);
+         return false;
+      }
+   }
+   
+   return true;
+}
+
+// Terminate worker process and release its resources. If reason is set, it
+//   receives why the process ended on its own
+void WorkerPool::Kill(Worker &worker, std::string *reason)
+{
+   if (worker.socket >= 0)
+   {
+      close(worker.socket);
+      worker.socket = -1;
+   }
+   
+   if (worker.pid != 0)
+   {
+      int status = 0;
+      pid_t rv = 0;
+      
+      if (reason)
+      {
+         rv = waitpid(worker.pid, &status, 0);
+      }
+      else
+      {
+         // Workers exit when their socket closes
+         for (int i=0; i<100 && rv == 0; ++i)
+         {
+            rv = waitpid(worker.pid, &status, WNOHANG);
+            
+            if (rv == 0)
+            {
+               std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+         }
+         
+         if (rv == 0)
+         {
+            kill(worker.pid, SIGKILL);
+            waitpid(worker.pid, &status, 0);
+         }
+      }
+      
+      if (reason)
+      {
+         std::ostringstream oss;
+         
+         if (rv == worker.pid && WIFSIGNALED(status))
+         {
+            oss << "RuntimeError: worker process killed by signal " << WTERMSIG(status);
+         }
+         else if (rv == worker.pid && WIFEXITED(status))
+         {
+            oss << "RuntimeError: worker process exited with status " << WEXITSTATUS(status);
+         }
+         else
+         {
+            oss << "RuntimeError: worker process terminated";
+         }
+         
+         *reason = oss.str();
+      }
+      
+      worker.pid = 0;
+   }
+   
+   if (worker.map)
+   {
+      munmap(worker.map, worker.mapSize);
+      worker.map = 0;
+   }
+   
+   worker.mapSize = 0;
+   
+   if (worker.file >= 0)
+   {
+      close(worker.file);
+      worker.file = -1;
+   }
+   
+   if (worker.path.length() > 0)
+   {
+      unlink(worker.path.c_str());
+      worker.path = "";
+   }
+}
+
+// Map at least size bytes of the worker shared file, growing it if needed
+bool WorkerPool::Map(Worker &worker, size_t size)
+{
+   if (worker.map && worker.mapSize >= size)
+   {
+      return true;
+   }
+   
+   struct stat st;
+   
+   if (fstat(worker.file, &st) != 0)
+   {
+      return false;
+   }
+   
+   // The worker may have grown it for a reply
+   size_t fileSize = size_t(st.st_size);
+   
+   if (fileSize < size)
+   {
+      fileSize = std::max(size, 2 * worker.mapSize);
+      fileSize = (fileSize + 0xFFFF) & ~size_t(0xFFFF);
+      
+      if (ftruncate(worker.file, off_t(fileSize)) != 0)
+      {
+         return false;
+      }
+   }
+   
+   if (worker.map)
+   {
+      munmap(worker.map, worker.mapSize);
+      worker.map = 0;
+      worker.mapSize = 0;
+   }
+   
+   void *map = mmap(0, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, worker.file, 0);
+   
+   if (map == MAP_FAILED)
+   {
+      return false;
+   }
+   
+   worker.map = (char*) map;
+   worker.mapSize = fileSize;
+   
+   return true;
+}
+
+bool WorkerPool::Send(Worker &worker, char kind, size_t offset, size_t length)
+{
+   char line[96];
+   
+   int n = snprintf(line, sizeof(line), "%c %lu %lu %lu\n", kind, (unsigned long) offset, (unsigned long) length,
+                    (unsigned long) worker.mapSize);
+
+#ifdef MSG_NOSIGNAL
+   int flags = MSG_NOSIGNAL;
+#else
+   int flags = 0;
+#endif
+   
+   return (send(worker.socket, line, size_t(n), flags) == ssize_t(n));
+}
+
+// Wait timeout milliseconds (-1 for ever) for a reply, returns false with
+//   error set if the worker ended or didn't reply in time
+bool WorkerPool::Receive(Worker &worker, int timeout, size_t &offset, size_t &length, std::string &error)
+{
+   char line[96];
+   size_t n = 0;
+   
+   while (n + 1 < sizeof(line))
+   {
+      pollfd fd = {worker.socket, POLLIN, 0};
+      
+      int rv = poll(&fd, 1, timeout);
+      
+      if (rv == 0)
+      {
+         error = "timeout";
+         return false;
+      }
+      
+      if (rv < 0 && errno == EINTR)
+      {
+         continue;
+      }
+      
+      if (rv < 0 || recv(worker.socket, line + n, 1, 0) != 1)
+      {
+         Kill(worker, &error);
+         return false;
+      }
+      
+      if (line[n++] == '\n')
+      {
+         break;
+      }
+   }
+   
+   line[n] = '\0';
+   
+   unsigned long values[3] = {0, 0, 0};
+   
+   if (sscanf(line, "R %lu %lu %lu", &values[0], &values[1], &values[2]) != 3 || !Map(worker, size_t(values[2])) ||
+       size_t(values[0] + values[1]) > worker.mapSize)
+   {
+      error = "RuntimeError: invalid worker reply";
+      Kill(worker, 0);
+      return false;
+   }
+   
+   offset = size_t(values[0]);
+   length = size_t(values[1]);
+   
+   return true;
+}
+
+WorkerPool::Worker* WorkerPool::Acquire(bool wait)
+{
+   std::unique_lock<std::mutex> lock(msMutex);
+   
+   while (!msStop && msWorkers.size() > 0)
+   {
+      for (size_t i=0; i<msWorkers.size(); ++i)
+      {
+         if (!msWorkers[i]->busy)
+         {
+            msWorkers[i]->busy = true;
+            return msWorkers[i];
+         }
+      }
+      
+      if (!wait)
+      {
+         break;
+      }
+      
+      msIdleCond.wait(lock);
+   }
+   
+   return 0;
+}
+
+void WorkerPool::Release(Worker *worker)
+{
+   std::lock_guard<std::mutex> lock(msMutex);
+   
+   worker->busy = false;
+   
+   msIdleCond.notify_all();
+}
+
+void WorkerPool::Submit(Job &job, Worker *worker)
+{
+   std::string error;
+   
+   if (worker->pid == 0)
+   {
+      // Crashed or timed out previously
+      if (!Launch(*worker, error) || !Handshake(*worker, error))
+      {
+         job.result->errorString = error;
+         job.failed = true;
+         return;
+      }
+      
+      ++msRestarts;
+   }
+   
+   if (!Map(*worker, job.messageOffset + job.message.size()))
+   {
+      job.result->errorString = "MemoryError: could not grow worker shared file";
+      job.failed = true;
+      return;
+   }
+   
+   for (size_t i=0; i<job.buffers.size(); ++i)
+   {
+      const WorkerBuffer &buffer = job.buffers[i];
+      
+      memcpy(worker->map + buffer.offset, buffer.view.buf, size_t(buffer.view.len));
+   }
+   
+   memcpy(worker->map + job.messageOffset, job.message.data(), job.message.size());
+   
+   job.sent = std::chrono::steady_clock::now();
+   
+   if (!Send(*worker, 'E', job.messageOffset, job.message.size()))
+   {
+      Kill(*worker, &(job.result->errorString));
+      job.failed = true;
+      return;
+   }
+   
+   job.worker = worker;
+}
+
+void WorkerPool::Collect(Job &job)
+{
+   Worker &worker = *(job.worker);
+   
+   size_t offset = 0;
+   size_t length = 0;
+   
+   std::string error;
+   
+   if (!Receive(worker, -1, offset, length, error))
+   {
+      job.result->errorString = error;
+      job.failed = true;
+      return;
+   }
+   
+   for (size_t i=0; i<job.buffers.size(); ++i)
+   {
+      const WorkerBuffer &buffer = job.buffers[i];
+      
+      if (buffer.writable)
+      {
+         memcpy(buffer.view.buf, worker.map + buffer.offset, size_t(buffer.view.len));
+      }
+   }
+   
+   job.reply.assign(worker.map + offset, length);
+}
+
+// Send jobs to idle workers as they become available and collect their replies
+//   Called without the GIL
+void WorkerPool::Dispatch(std::vector<Job> &jobs)
+{
+   PyEvalSpan span("workers");
+   
+   std::vector<Job*> running;
+   size_t next = 0;
+   
+   while (next < jobs.size() || running.size() > 0)
+   {
+      while (next < jobs.size())
+      {
+         Job &job = jobs[next];
+         
+         if (job.failed)
+         {
+            ++next;
+            continue;
+         }
+         
+         // Only block when no reply is awaited
+         Worker *worker = Acquire(running.empty());
+         
+         if (!worker)
+         {
+            if (running.empty())
+            {
+               // Stopped meanwhile
+               for (; next < jobs.size(); ++next)
+               {
+                  jobs[next].skipped = (jobs[next].skipped || !jobs[next].failed);
+               }
+            }
+            break;
+         }
+         
+         ++next;
+         
+         Submit(job, worker);
+         
+         if (job.worker)
+         {
+            running.push_back(&job);
+         }
+         else
+         {
+            Release(worker);
+         }
+      }
+      
+      if (running.empty())
+      {
+         continue;
+      }
+      
+      std::vector<pollfd> fds(running.size());
+      int timeout = -1;
+      
+      std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+      
+      for (size_t i=0; i<running.size(); ++i)
+      {
+         fds[i].fd = running[i]->worker->socket;
+         fds[i].events = POLLIN;
+         fds[i].revents = 0;
+         
+         if (running[i]->request->timeBudget > 0.0)
+         {
+            double elapsed = std::chrono::duration<double, std::milli>(now - running[i]->sent).count();
+            int remaining = std::max(0, int(std::ceil(running[i]->request->timeBudget - elapsed)));
+            
+            timeout = (timeout < 0 ? remaining : std::min(timeout, remaining));
+         }
+      }
+      
+      // Check for idle workers from time to time when some jobs are pending
+      if (next < jobs.size())
+      {
+         timeout = (timeout < 0 ? 10 : std::min(timeout, 10));
+      }
+      
+      if (poll(&fds[0], nfds_t(fds.size()), timeout) < 0 && errno != EINTR)
+      {
+         // The replies can't be waited for anymore: the workers are killed and
+         //   released so that Acquire and Stop don't wait on them forever
+         std::string error = std::string("RuntimeError: could not wait for worker replies: ") + strerror(errno);
+         
+         for (size_t i=0; i<running.size(); ++i)
+         {
+            Job &job = *(running[i]);
+            
+            kill(job.worker->pid, SIGKILL);
+            Kill(*(job.worker), 0);
+            
+            job.result->errorString = error;
+            job.failed = true;
+            
+            Release(job.worker);
+            job.worker = 0;
+         }
+         
+         // Jobs not sent yet are evaluated locally
+         for (; next < jobs.size(); ++next)
+         {
+            jobs[next].skipped = (jobs[next].skipped || !jobs[next].failed);
+         }
+         
+         break;
+      }
+      
+      now = std::chrono::steady_clock::now();
+      
+      std::vector<Job*> remaining;
+      
+      for (size_t i=0; i<running.size(); ++i)
+      {
+         Job &job = *(running[i]);
+         
+         if (fds[i].revents != 0)
+         {
+            Collect(job);
+         }
+         else if (job.request->timeBudget > 0.0 &&
+                  std::chrono::duration<double, std::milli>(now - job.sent).count() >= job.request->timeBudget)
+         {
+            // Python code can't always be interrupted, the process can
+            std::ostringstream oss;
+            oss << "EvaluationTimeout: evaluation exceeded its " << job.request->timeBudget << " ms budget";
+            
+            kill(job.worker->pid, SIGKILL);
+            Kill(*(job.worker), 0);
+            
+            job.result->timedOut = true;
+            job.result->errorString = oss.str();
+            job.failed = true;
+            
+            ++gTimedOutCount;
+         }
+         else
+         {
+            remaining.push_back(&job);
+            continue;
+         }
+         
+         Release(job.worker);
+         job.worker = 0;
+      }
+      
+      running.swap(remaining);
+   }
+}
+
+bool WorkerPool::Run(const std::vector<const PyEvalRequest*> &requests, const std::vector<PyEvalResult*> &results)
+{
+   if (Size() == 0)
+   {
+      return false;
+   }
+   
+   PyEvalGIL gil;
+   
+   std::vector<Job> jobs(requests.size());
+   
+   PyObject *globals = PyModule_GetDict(PyImport_AddModule("__main__"));
+   
+   for (size_t i=0; i<requests.size(); ++i)
+   {
+      Job &job = jobs[i];
+      const PyEvalRequest &request = *(requests[i]);
+      
+      job.request = &request;
+      job.result = results[i];
+      job.messageOffset = 0;
+      job.worker = 0;
+      job.failed = true;
+      job.skipped = false;
+      
+      job.result->reset();
+      
+      // Compilation errors are reported as for local evaluations
+      if (!request.code->compile(request.verbose))
+      {
+         job.result->errorString = request.code->error();
+         continue;
+      }
+      
+      PyObject *args = 0;
+      
+      {
+         PyEvalSpan span("arguments");
+         
+         args = PyRun_String(request.args.c_str(), Py_eval_input, globals, globals);
+      }
+      
+      if (!args || !PyTuple_Check(args))
+      {
+         if (args)
+         {
+            Py_DECREF(args);
+            PyErr_SetString(PyExc_TypeError, "arguments must be a tuple");
+         }
+         FetchError(request.verbose, job.result->errorString);
+         continue;
+      }
+      
+      PyObject *packed = WorkerArguments(args, job.buffers, job.messageOffset);
+      PyObject *message = Py_BuildValue("(nsNO)", Py_ssize_t(request.code->hash()), request.code->source().c_str(),
+                                        packed, request.verbose ? Py_True : Py_False);
+      
+      // Worker arguments must keep their values
+      Marshal(message, job.message, true);
+      
+      Py_XDECREF(message);
+      Py_DECREF(args);
+      
+      if (job.message.empty())
+      {
+         // Arguments marshal can't write are evaluated locally, like the jobs
+         //   no worker was available for
+         PyErr_Clear();
+         job.skipped = true;
+         continue;
+      }
+      
+      job.failed = false;
+   }
+   
+   {
+      PyEvalAllowThreads allowThreads;
+      
+      Dispatch(jobs);
+   }
+   
+   for (size_t i=0; i<jobs.size(); ++i)
+   {
+      Job &job = jobs[i];
+      PyEvalResult &result = *(job.result);
+      
+      for (size_t j=0; j<job.buffers.size(); ++j)
+      {
+         PyBuffer_Release(&(job.buffers[j].view));
+      }
+      
+      if (job.skipped)
+      {
+         PyEvalRequest request = *(job.request);
+         request.worker = false;
+         PyEvalRun(request, result);
+         continue;
+      }
+      
+      if (job.failed)
+      {
+         continue;
+      }
+      
+      PyEvalSpan span("convert");
+      
+      PyObject *reply = PyMarshal_ReadObjectFromString((char*) job.reply.data(), Py_ssize_t(job.reply.size()));
+      
+      if (!reply || !PyTuple_Check(reply) || PyTuple_Size(reply) != 2)
+      {
+         PyErr_Clear();
+         result.errorString = "RuntimeError: invalid worker reply";
+      }
+      else if (PyObject_IsTrue(PyTuple_GetItem(reply, 0)))
+      {
+         result.succeeded = Convert(PyTuple_GetItem(reply, 1), job.request->outputType, result);
+         
+         if (!result.succeeded)
+         {
+            FetchError(job.request->verbose, result.errorString);
+            
+            std::string errorString = result.errorString;
+            result.reset();
+            result.errorString = errorString;
+         }
+      }
+      else
+      {
+         AsString(PyTuple_GetItem(reply, 1), result.errorString);
+      }
+      
+      Py_XDECREF(reply);
+   }
+   
+   return true;
+}
+
+// Requests the workers can evaluate, the others need the main interpreter state
+static bool WorkerRequest(const PyEvalRequest &request)
+{
+   return (request.worker && request.code && !request.scope && !request.history && !request.inputs && !request.code->isModule());
+}
+
+#endif
+
+size_t PyEvalStartWorkers(size_t count, const std::string &python, std::string &error)
+{
+#ifdef PYEVAL_WORKERS
+   return WorkerPool::Start(count, python, error);
+#else
+   (void) python;
+   error = (count > 0 ? "RuntimeError: worker processes are not supported on this platform" : "");
+   return 0;
+#endif
+}
+
+size_t PyEvalWorkers()
+{
+#ifdef PYEVAL_WORKERS
+   return WorkerPool::Size();
+#else
+   return 0;
+#endif
+}
+
+unsigned long PyEvalWorkerRestarts()
+{
+#ifdef PYEVAL_WORKERS
+   return WorkerPool::Restarts();
+#else
+   return 0;
+#endif
+}
+
+void PyEvalShutdown()
+{
+#ifdef PYEVAL_INTERPRETERS
+   InterpreterPool::Stop();
+#endif
+#ifdef PYEVAL_WORKERS
+   WorkerPool::Stop();
+#endif
+   Watchdog::Shutdown();
+   Tracer::Stop();
+   Timeline::Shutdown();
+   
+   if (Py_IsInitialized())
+   {
+      PyEvalGIL gil;
+      
+      for (std::map<std::string, LoadedModule>::iterator it = gLoadedModules.begin(); it != gLoadedModules.end(); ++it)
+      {
+         Py_DECREF(it->second.module);
+      }
+   }
+   
+   gLoadedModules.clear();
+}
+
+// -----------------------------------------------------------------------------
+
+// Function to call for request in the main interpreter, compiling its code and
+//   running its scope setup if needed. Returns a borrowed reference, or 0 with
+//   the result error set. The GIL must be held
+static PyObject* RequestFunction(const PyEvalRequest &request, PyEvalResult &result)
+{
+   if (!request.code)
+   {
+      result.errorString = "RuntimeError: no code to evaluate";
+      return 0;
+   }
+   
+   if (!request.code->compile(request.verbose))
+   {
+      result.errorString = request.code->error();
+      return 0;
+   }
+   
+   if (!request.scope || request.code->isModule())
+   {
+      // Module functions keep the module as globals, the setup still runs
+      if (request.scope && !request.scope->setup(request.verbose))
+      {
+         result.errorString = request.scope->error();
+         return 0;
+      }
+      
+      return request.code->function();
+   }
+   
+   if (!request.scope->setup(request.verbose))
+   {
+      result.errorString = request.scope->error();
+      return 0;
+   }
+   
+   return request.scope->bind(request.code);
+}
+
+#ifdef PYEVAL_INTERPRETERS
+
+// Requests the isolated interpreters can evaluate
+static bool IsolatedRequest(const PyEvalRequest &request)
+{
+   return (request.isolated && request.code && !request.scope && !request.history && !request.inputs && !request.code->isModule());
+}
+
+// Queue the isolated requests not done yet, so that they run concurrently with
+//   the others, and flag them done. Those the worker processes will evaluate
+//   are left out. Returns the jobs to wait for
+static void SubmitIsolated(const std::vector<PyEvalRequest> &requests, std::vector<PyEvalResult> &results,
+                           std::vector<InterpreterPool::Job> &jobs, std::vector<bool> &done)
+{
+   std::vector<size_t> indices;
+   
+   for (size_t i=0; i<requests.size(); ++i)
+   {
+#ifdef PYEVAL_WORKERS
+      if (WorkerRequest(requests[i]) && WorkerPool::Size() > 0)
+      {
+         continue;
+      }
+#endif
+      if (!done[i] && IsolatedRequest(requests[i]))
+      {
+         indices.push_back(i);
+      }
+   }
+   
+   jobs.resize(indices.size());
+   
+   for (size_t i=0; i<indices.size(); ++i)
+   {
+      jobs[i].request = &(requests[indices[i]]);
+      jobs[i].result = &(results[indices[i]]);
+   }
+   
+   if (!InterpreterPool::Submit(jobs))
+   {
+      jobs.clear();
+      return;
+   }
+   
+   for (size_t i=0; i<indices.size(); ++i)
+   {
+      done[indices[i]] = true;
+   }
+}
+
+#endif
+
+bool PyEvalRun(const PyEvalRequest &request, PyEvalResult &result)
+{
+#ifdef PYEVAL_WORKERS
+   if (WorkerRequest(request))
+   {
+      std::vector<const PyEvalRequest*> requests(1, &request);
+      std::vector<PyEvalResult*> results(1, &result);
+      
+      if (WorkerPool::Run(requests, results))
+      {
+         return result.succeeded;
+      }
+   }
+#endif
+   
+#ifdef PYEVAL_INTERPRETERS
+   if (IsolatedRequest(request) && InterpreterPool::Run(request, result))
+   {
+      return result.succeeded;
+   }
+#endif
+   
+   PyEvalGIL gil;
+   
+   result.reset();
+   
+   PyObject *function = RequestFunction(request, result);
+   
+   if (!function)
+   {
+      return false;
+   }
+   
+   return Evaluate(function, request, result, 0, 0);
+}
+
+void PyEvalRunAll(const std::vector<PyEvalRequest> &requests, std::vector<PyEvalResult> &results)
+{
+   results.resize(requests.size());
+   
+   std::vector<bool> done(requests.size(), false);
+   
+#ifdef PYEVAL_INTERPRETERS
+   std::vector<InterpreterPool::Job> jobs;
+   
+   SubmitIsolated(requests, results, jobs, done);
+#endif
+   
+   {
+      // PyEvalRun acquires the GIL again, which is only a counter increment
+      PyEvalGIL gil;
+      
+      for (size_t i=0; i<requests.size(); ++i)
+      {
+         if (!done[i])
+         {
+            PyEvalRun(requests[i], results[i]);
+         }
+      }
+   }
+   
+#ifdef PYEVAL_INTERPRETERS
+   InterpreterPool::Wait(jobs);
+#endif
+}
+
+// Requests whose arguments can be evaluated along with others', history and
+//   lazy inputs are set up per request by PyEvalRun
+static bool BatchRequest(const PyEvalRequest &request)
+{
+   return (request.code && !request.history && !request.inputs);
+}
+
+// Evaluate the requests not done in the main interpreter, in a single call for
+//   those sharing the code and scope of the first batchable one
+static void RunMainBatch(const std::vector<PyEvalRequest> &requests, std::vector<PyEvalResult> &results, std::vector<bool> &done)
+{
+   PyEvalGIL gil;
+   
+   PyEvalSpan span("batch");
+   
+   size_t count = size_t(std::count(done.begin(), done.end(), false));
+   
+   if (count == 0)
+   {
+      return;
+   }
+   
+   if (span.active())
+   {
+      span.setArg(std::to_string(count).c_str());
+   }
+   
+   size_t index = 0;
+   
+   while (index < requests.size() && (done[index] || !BatchRequest(requests[index])))
+   {
+      ++index;
+   }
+   
+   for (size_t i=0; i<results.size(); ++i)
+   {
+      if (!done[i])
+      {
+         results[i].reset();
+      }
+   }
+   
+   PyObject *function = (index < requests.size() ? RequestFunction(requests[index], results[index]) : 0);
+   
+   // Arguments of all the requests sharing the first one code and scope, as a
+   //   single tuple
+   std::vector<size_t> members;
+   size_t length = 2;
+   
+   for (size_t i=index; i<requests.size() && function; ++i)
+   {
+      if (!done[i] && BatchRequest(requests[i]) && requests[i].code == requests[index].code && requests[i].scope == requests[index].scope)
+      {
+         members.push_back(i);
+         length += requests[i].args.length() + 2;
+      }
+   }
+   
+   PyObject *batch = 0;
+   
+   if (members.size() > 1)
+   {
+      std::string args;
+      
+      args.reserve(length);
+      args += "(";
+      
+      for (size_t i=0; i<members.size(); ++i)
+      {
+         args += requests[members[i]].args;
+         args += ", ";
+      }
+      
+      args += ")";
+      
+      PyObject *globals = PyModule_GetDict(PyImport_AddModule("__main__"));
+      
+      {
+         PyEvalSpan argsSpan("arguments");
+         
+         batch = PyRun_String(args.c_str(), Py_eval_input, globals, globals);
+      }
+      
+      bool valid = (batch && PyTuple_Check(batch) && size_t(PyTuple_Size(batch)) == members.size());
+      
+      for (size_t i=0; valid && i<members.size(); ++i)
+      {
+         valid = (PyTuple_Check(PyTuple_GetItem(batch, Py_ssize_t(i))) != 0);
+      }
+      
+      if (!valid)
+      {
+         // One of the requests arguments is invalid, evaluate them one by one
+         //   so that only it fails
+         PyErr_Clear();
+         Py_XDECREF(batch);
+         batch = 0;
+      }
+   }
+   
+   if (batch)
+   {
+      for (size_t i=0; i<members.size(); ++i)
+      {
+         PyObject *args = PyTuple_GetItem(batch, Py_ssize_t(i));
+         
+         Py_INCREF(args);
+         
+         Call(function, requests[members[i]], results[members[i]], args, 0, 0);
+         
+         done[members[i]] = true;
+      }
+      
+      Py_DECREF(batch);
+   }
+   
+   for (size_t i=0; i<requests.size(); ++i)
+   {
+      if (!done[i])
+      {
+         PyEvalRun(requests[i], results[i]);
+         done[i] = true;
+      }
+   }
+}
+
+void PyEvalRunBatch(const std::vector<PyEvalRequest> &requests, std::vector<PyEvalResult> &results)
+{
+   results.resize(requests.size());
+   
+   if (requests.size() == 0)
+   {
+      return;
+   }
+   
+   // Requests evaluated outside of the main interpreter
+   std::vector<bool> done(requests.size(), false);
+   
+#ifdef PYEVAL_INTERPRETERS
+   std::vector<InterpreterPool::Job> jobs;
+   
+   SubmitIsolated(requests, results, jobs, done);
+#endif
+   
+#ifdef PYEVAL_WORKERS
+   // Worker requests are all sent at once, spreading them over the workers
+   std::vector<const PyEvalRequest*> remote;
+   std::vector<PyEvalResult*> remoteResults;
+   std::vector<size_t> remoteIndices;
+   
+   for (size_t i=0; i<requests.size(); ++i)
+   {
+      if (!done[i] && WorkerRequest(requests[i]))
+      {
+         remote.push_back(&(requests[i]));
+         remoteResults.push_back(&(results[i]));
+         remoteIndices.push_back(i);
+      }
+   }
+   
+   if (remote.size() > 0 && WorkerPool::Run(remote, remoteResults))
+   {
+      for (size_t i=0; i<remoteIndices.size(); ++i)
+      {
+         done[remoteIndices[i]] = true;
+      }
+   }
+#endif
+   
+   RunMainBatch(requests, results, done);
+   
+#ifdef PYEVAL_INTERPRETERS
+   InterpreterPool::Wait(jobs);
+#endif
+}
+
+void PyEvalRunChain(const std::vector<PyEvalChainStep> &steps, std::vector<PyEvalResult> &results)
+{
+   results.resize(steps.size());
+   
+   PyEvalGIL gil;
+   
+   for (size_t i=0; i<steps.size(); ++i)
+   {
+      const PyEvalChainStep &step = steps[i];
+      PyEvalResult &result = results[i];
+      
+      result.reset();
+      
+      PyObject *function = RequestFunction(step.request, result);
+      
+      if (!function)
+      {
+         continue;
+      }
+      
+      std::vector<PyObject*> values(step.links.size(), (PyObject*)0);
+      
+      for (size_t j=0; j<step.links.size(); ++j)
+      {
+         const PyEvalLink &link = step.links[j];
+         
+         if (link.step < i)
+         {
+            values[j] = LinkValue(results[link.step], steps[link.step].request.outputType, link.type);
+         }
+      }
+      
+      Evaluate(function, step.request, result, 0, 0, &step.links, &values);
+      
+      // Only left when the arguments failed to evaluate
+      for (size_t j=0; j<values.size(); ++j)
+      {
+         Py_XDECREF(values[j]);
+      }
+   }
+}
@@ -0,0 +1,531 @@
+/*
+Copyright (C) 2015  Gaetan Guidet
+
+This file is part of MayaPyExpr.
+
+MayaPyExpr is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+MayaPyExpr is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef __pyexpr_pyeval_h__
+#define __pyexpr_pyeval_h__
+
+// Python evaluation core, independent of the maya API so that it can be used
+//   from any thread
+
+#include <Python.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+
+// Isolated interpreters with their own GIL are only available from python 3.12
+#if PY_VERSION_HEX >= 0x030C0000
+#  define PYEVAL_INTERPRETERS
+#endif
+
+// Worker processes rely on posix process, socket and file mapping functions
+#ifndef _WIN32
+#  define PYEVAL_WORKERS
+#endif
+
+// Output types, values match PyExpr::OutputType
+enum PyEvalOutputType
+{
+   PyEval_int = 0,
+   PyEval_int_array,
+   PyEval_double,
+   PyEval_double_array,
+   PyEval_string,
+   PyEval_string_array,
+   PyEval_none,
+   // None, or a flat sequence of coordinates or a sequence of 3-tuples,
+   //   returned flattened in doubleArrayOutput
+   PyEval_points
+};
+
+struct PyEvalResult
+{
+   PyEvalResult();
+   
+   void reset();
+   
+   bool succeeded;
+   bool timedOut;
+   std::string errorString;
+   int intOutput;
+   std::vector<int> intArrayOutput;
+   double doubleOutput;
+   std::vector<double> doubleArrayOutput;
+   std::string stringOutput;
+   std::vector<std::string> stringArrayOutput;
+};
+
+// Expression compiled to a python function taking the node inputs as arguments
+//   Compilation is deferred until first use (or PyEvalCompile), the function
+//   is then kept for all subsequent evaluations
+class PyEvalCode
+{
+public:
+   
+   // source must declare a function named _pyexpr_eval (see DeclareFunction
+   //   in pyexpr.cpp) with the given parameters
+   // When modulePath is set, source is the declaration of the function calling
+   //   _pyexpr_entry, bound to the entryPoint function of the module (see
+   //   PyEvalGetModuleCode)
+   PyEvalCode(const std::string &source, const std::vector<std::string> &params,
+              const std::string &modulePath="", const std::string &entryPoint="", double moduleTime=0.0);
+   ~PyEvalCode();
+   
+   bool matches(const std::string &source, const std::vector<std::string> &params) const;
+   
+   inline const std::string& source() const { return mSource; }
+   inline const std::vector<std::string>& params() const { return mParams; }
+   inline const std::string& modulePath() const { return mModulePath; }
+   inline const std::string& entryPoint() const { return mEntryPoint; }
+   inline bool isModule() const { return !mModulePath.empty(); }
+   // Hash of source and parameters, identifies the code in traces
+   inline size_t hash() const { return mHash; }
+   
+   // Following methods require the GIL
+   bool compile(bool verbose);
+   inline bool isCompiled() const { return (mFunction != 0); }
+   inline PyObject* function() const { return mFunction; }
+   inline const std::string& error() const { return mError; }
+   // Approximate memory used by the source and compiled bytecode
+   inline size_t bytes() const { return mBytes; }
+   
+   // Collect the names the function body uses, requires the GIL
+   // Expressions calling locals(), vars(), eval or exec are flagged as dynamic
+   void analyse();
+   
+   // Whether the function body uses the parameter, can be called without the
+   //   GIL. All parameters are used until the code is analysed, or if the
+   //   expression is dynamic
+   inline bool isAnalysed() const { return mAnalysed; }
+   bool isReferenced(size_t param) const;
+   bool isReferenced(const std::string &param) const;
+   bool isDynamic() const;
+   
+   // Whether the function body may import the top level module, can be called
+   //   without the GIL. Any module may be imported until the code is analysed,
+   //   or if it is dynamic or calls __import__ or importlib.import_module
+   bool imports(const std::string &module) const;
+   
+private:
+   
+   PyEvalCode(const PyEvalCode&);
+   PyEvalCode& operator=(const PyEvalCode&);
+   
+   std::string mSource;
+   std::vector<std::string> mParams;
+   std::string mModulePath;
+   std::string mEntryPoint;
+   double mModuleTime;
+   size_t mHash;
+   PyObject *mFunction;
+   bool mFailed;
+   std::string mError;
+   size_t mBytes;
+   std::vector<bool> mReferenced;
+   bool mDynamic;
+   std::vector<std::string> mImports;
+   // Set once mReferenced, mDynamic and mImports are filled
+   std::atomic<bool> mAnalysed;
+};
+
+typedef std::shared_ptr<PyEvalCode> PyEvalCodePtr;
+
+// Node private python namespace, initialized by running a setup code once
+//   Code functions evaluated with a scope use it as their globals instead of
+//   __main__, so that they see the objects created by the setup
+class PyEvalScope
+{
+public:
+   
+   PyEvalScope(const std::string &setup);
+   ~PyEvalScope();
+   
+   inline const std::string& setupSource() const { return mSetup; }
+   
+   // Following methods require the GIL
+   
+   // Run the setup code on first call
+   bool setup(bool verbose);
+   inline const std::string& error() const { return mError; }
+   
+   // Run given code in the namespace, if the setup was run
+   bool run(const std::string &source, bool verbose);
+   
+   // code function rebound to the namespace (borrowed reference)
+   PyObject* bind(const PyEvalCodePtr &code);
+   
+private:
+   
+   PyEvalScope(const PyEvalScope&);
+   PyEvalScope& operator=(const PyEvalScope&);
+   
+   std::string mSetup;
+   PyObject *mGlobals;
+   bool mFailed;
+   std::string mError;
+   std::weak_ptr<PyEvalCode> mBoundCode;
+   PyObject *mBound;
+};
+
+typedef std::shared_ptr<PyEvalScope> PyEvalScopePtr;
+
+// Past evaluations of a node, passed to requests code function as its two last
+//   arguments: history, a deque of (time, inputs, result) named tuples, oldest
+//   first, and prev, the last result or None. Inputs python can't write as
+//   literals (buffers, geometry) are kept as None
+class PyEvalHistory
+{
+public:
+   
+   PyEvalHistory();
+   ~PyEvalHistory();
+   
+   // Following methods require the GIL
+   
+   // Start an evaluation at time, returning new references to the history and
+   //   prev arguments. Entries are discarded when time moves backwards or
+   //   forward by more than gap (if positive), an evaluation at the time of the
+   //   last entry replaces it
+   void begin(double time, size_t capacity, double gap, PyObject *&history, PyObject *&prev);
+   
+   // Record the result of a successful evaluation started by begin, buffers in
+   //   result are stored as tuples of their values
+   void end(double time, PyObject *inputs, PyObject *result);
+   
+   void clear();
+   size_t size() const;
+   
+   // Entries as a python literal, to be saved with the scene, and back
+   std::string save() const;
+   bool load(const std::string &data);
+   
+private:
+   
+   PyEvalHistory(const PyEvalHistory&);
+   PyEvalHistory& operator=(const PyEvalHistory&);
+   
+   void reserve(size_t capacity);
+   
+   PyObject *mEntries;
+   size_t mCapacity;
+   double mLastTime;
+};
+
+typedef std::shared_ptr<PyEvalHistory> PyEvalHistoryPtr;
+
+// Inputs read on demand, when the code function accesses them through the
+//   pyexpr.Inputs object passed as its first argument (inputs.name or
+//   inputs["name"]). Values are cached for the rest of the evaluation, and the
+//   object can't be used once the function returned
+class PyEvalInputs
+{
+public:
+   
+   virtual ~PyEvalInputs() {}
+   
+   // Python expression evaluating to the value of input name, false if there is
+   //   no such input. Called from the evaluating thread with the GIL held
+   virtual bool value(const std::string &name, std::string &expr) = 0;
+   
+   virtual void names(std::vector<std::string> &names) = 0;
+};
+
+typedef std::shared_ptr<PyEvalInputs> PyEvalInputsPtr;
+
+// Source declaring the _pyexpr_eval function, with the expression body indented
+//   under the declaration of the given parameters
+std::string PyEvalDeclareFunction(const std::vector<std::string> &params, const std::string &body);
+
+// Get the code for given source and parameters from the plugin wide registry
+//   Nodes using identical expressions share the same code (and compiled function)
+//   An entry is released when the last reference to its code is dropped
+PyEvalCodePtr PyEvalGetCode(const std::string &source, const std::vector<std::string> &params);
+
+// Get the code calling function entryPoint of the python file at path, with
+//   the parameters passed as keyword arguments. Relative paths are searched in
+//   the PYEXPR_MODULE_PATH directories. A file is loaded once per session as a
+//   module private to pyexpr and shared by all the codes calling into it. Once
+//   PyEvalCheckModuleFiles saw it change, a new code loading the file again is
+//   returned
+// Module codes are evaluated in the main interpreter, their functions use the
+//   module as globals even when the request has a scope
+PyEvalCodePtr PyEvalGetModuleCode(const std::string &path, const std::string &entryPoint, const std::vector<std::string> &params);
+
+// Check the modification time of the files loaded by PyEvalGetModuleCode, the
+//   paths (as given to it) of those that changed since are appended to changed
+// Returns the number of changed files
+size_t PyEvalCheckModuleFiles(std::vector<std::string> &changed);
+
+struct PyEvalCodeStats
+{
+   // Number of distinct codes alive
+   size_t entries;
+   // Number of references to those codes
+   size_t references;
+   // Approximate memory used by those codes
+   size_t bytes;
+};
+
+void PyEvalGetCodeStats(PyEvalCodeStats &stats);
+
+struct PyEvalRequest
+{
+   PyEvalRequest();
+   
+   PyEvalCodePtr code;
+   // Namespace to evaluate code function in, __main__ if null
+   //   Scoped requests are always evaluated in the main interpreter
+   PyEvalScopePtr scope;
+   // Python expression evaluating to the tuple of arguments for code function
+   std::string args;
+   short outputType;
+   bool verbose;
+   // Maximum evaluation time in milliseconds, 0 for no limit
+   double timeBudget;
+   // Evaluate in one of the isolated interpreters if any is running (see
+   //   PyEvalSetInterpreters), the main interpreter is used otherwise
+   bool isolated;
+   // Evaluate in one of the worker processes if any is running (see
+   //   PyEvalStartWorkers), the main interpreter is used otherwise
+   //   Scoped, history, inputs and module requests never are
+   bool worker;
+   // Record the evaluation if a trace is open (see PyEvalStartTrace)
+   bool trace;
+   // Pass history and prev as the two last arguments (see PyEvalHistory)
+   //   Requests with a history are always evaluated in the main interpreter
+   PyEvalHistoryPtr history;
+   size_t historySize;
+   double historyGap;
+   double time;
+   // Replace the first argument with a pyexpr.Inputs object (see PyEvalInputs)
+   //   Requests with inputs are always evaluated in the main interpreter
+   PyEvalInputsPtr inputs;
+};
+
+// Acquire the GIL for the lifetime of the object, from any thread
+class PyEvalGIL
+{
+public:
+   PyEvalGIL();
+   ~PyEvalGIL();
+   
+private:
+   PyEvalGIL(const PyEvalGIL&);
+   PyEvalGIL& operator=(const PyEvalGIL&);
+   
+   PyGILState_STATE mState;
+};
+
+// Release the GIL for the lifetime of the object if the calling thread holds it
+//   and release is set. Use before blocking on work that may need the GIL on
+//   another thread
+class PyEvalAllowThreads
+{
+public:
+   explicit PyEvalAllowThreads(bool release=true);
+   ~PyEvalAllowThreads();
+   
+private:
+   PyEvalAllowThreads(const PyEvalAllowThreads&);
+   PyEvalAllowThreads& operator=(const PyEvalAllowThreads&);
+   
+   PyThreadState *mState;
+};
+
+bool PyEvalHoldsGIL();
+
+// Analyse code if it wasn't yet, see PyEvalCode::analyse. Acquires the GIL
+void PyEvalAnalyse(const PyEvalCodePtr &code);
+
+// Compile all given codes in a single interpreter session
+// Acquires the GIL, returns the number of codes that failed to compile
+size_t PyEvalCompile(const std::vector<PyEvalCodePtr> &codes, bool verbose);
+
+// Call the request code function with its arguments, compiling it if needed
+// Acquires the GIL, can be called from any thread
+// When the request time budget is exceeded, a pyexpr.EvaluationTimeout exception
+//   (derived from BaseException) is raised in the evaluating thread. It can only
+//   interrupt python code: a blocking call into an extension module is
+//   interrupted after it returns
+bool PyEvalRun(const PyEvalRequest &request, PyEvalResult &result);
+
+// Chained evaluations: the result of a step is passed to an argument of a
+//   following step function, as a python object
+struct PyEvalLink
+{
+   // Index of the argument in the step arguments tuple
+   size_t argument;
+   // Index of the step providing the value, must be a previous one
+   size_t step;
+   // Type of the argument, one of PyEval_int, PyEval_double or PyEval_string
+   //   The step result is converted to it as maya would when the step output
+   //   is connected to the argument attribute
+   short type;
+};
+
+struct PyEvalChainStep
+{
+   PyEvalRequest request;
+   std::vector<PyEvalLink> links;
+};
+
+// Evaluate steps in order in a single interpreter session, results are returned
+//   in the same order. A failed step passes a default value (0 or empty string)
+//   to the following ones. Acquires the GIL
+void PyEvalRunChain(const std::vector<PyEvalChainStep> &steps, std::vector<PyEvalResult> &results);
+
+// Evaluate all requests in a single interpreter session, results are returned
+//   in the same order. Acquires the GIL
+void PyEvalRunAll(const std::vector<PyEvalRequest> &requests, std::vector<PyEvalResult> &results);
+
+// Evaluate requests sharing the same code in a single interpreter session: the
+//   arguments of all of them are evaluated at once and the code function is
+//   called for each, results are returned in the same order. A failing request
+//   doesn't affect the others. Requests with a different code or scope than
+//   the first one or arguments that fail to evaluate are run on their own.
+//   Acquires the GIL
+void PyEvalRunBatch(const std::vector<PyEvalRequest> &requests, std::vector<PyEvalResult> &results);
+
+// Number of evaluations interrupted for exceeding their time budget
+unsigned long PyEvalTimedOutCount();
+void PyEvalResetTimedOutCount();
+
+// Receives the tracebacks printed for verbose evaluations and the errors that
+//   can't be reported in a result, instead of python's stderr. Called from any
+//   thread evaluating python, with the GIL held
+typedef void (*PyEvalErrorHandler)(const std::string &message);
+void PyEvalSetErrorHandler(PyEvalErrorHandler handler);
+
+// Python code run in each isolated interpreter when it is created, to declare
+//   the helpers used by requests arguments
+void PyEvalSetPrelude(const std::string &source);
+
+// Start count isolated interpreters, each running on its own thread, stopping
+//   the previously running ones. Isolated requests are evaluated concurrently
+//   and each code is compiled again in every interpreter that evaluates it
+// Returns the number of interpreters actually running, always 0 when python
+//   doesn't support isolated interpreters (see PYEVAL_INTERPRETERS)
+size_t PyEvalSetInterpreters(size_t count);
+size_t PyEvalInterpreters();
+
+// Start count python processes evaluating worker requests, stopping the
+//   previously running ones. python must run the same python version, the
+//   mayapy (or python) executable next to the current one is used if empty
+// The arguments of a request are evaluated in the calling process, the code
+//   source and marshalled arguments are then handed to the first idle worker
+//   through a shared file mapping. Typed buffers (see the prelude buffer
+//   helper) are copied to the mapping as raw memory and wrapped again without
+//   copy in the worker, writable ones are copied back once evaluated
+// A worker that crashes or exceeds the request time budget is killed, the
+//   request fails and the worker is started again for the next one
+// Worker evaluations are not recorded to the trace
+// Returns the number of workers actually running, with error set if fewer
+//   could be started. Always 0 when not supported (see PYEVAL_WORKERS)
+size_t PyEvalStartWorkers(size_t count, const std::string &python, std::string &error);
+size_t PyEvalWorkers();
+// Number of workers started again after crashing or timing out
+unsigned long PyEvalWorkerRestarts();
+
+// Evaluation trace, for replaying evaluations outside of maya (see
+//   tools/pyexprreplay.cpp). Records are buffered and written by a background
+//   thread. The file starts with a header:
+//     char[8] "PYEXTRC1", uint32 PY_VERSION_HEX, uint32 marshal version
+//   followed by records, each prefixed by its uint32 size and starting with
+//   its uint8 kind. Integers are little endian, bytes are a uint32 size
+//   followed by the data
+//     PyEvalTrace_code: uint64 hash, uint32 count, bytes params[count], bytes source
+//       Written before the first evaluation of a code
+//     PyEvalTrace_eval: uint64 hash, uint8 outputType, uint8 flags, uint64 duration
+//       (nanoseconds), bytes arguments, bytes result, bytes error
+//       Arguments and result are marshalled python objects, values marshal
+//       doesn't support are replaced by their repr
+enum PyEvalTraceRecord
+{
+   PyEvalTrace_code = 1,
+   PyEvalTrace_eval = 2
+};
+
+enum PyEvalTraceFlags
+{
+   PyEvalTrace_succeeded = 0x01,
+   PyEvalTrace_timedOut = 0x02
+};
+
+// Start recording evaluations of requests with trace set to path, closing the
+//   previous trace if any. Returns false with error set if the file can't be
+//   created
+bool PyEvalStartTrace(const std::string &path, std::string &error);
+
+// Flush and close the trace, returns the number of evaluations written
+size_t PyEvalStopTrace();
+
+// Path of the open trace, empty if none
+std::string PyEvalTraceFile();
+
+// Timeline of the evaluation phases, exported as chrome trace event JSON
+//   (chrome://tracing, perfetto). Each thread records its spans in its own
+//   ring buffer, without locking. When the timeline is off, a span costs a
+//   single atomic load
+// Start recording, keeping the last eventsPerThread events of each thread
+void PyEvalStartTimeline(size_t eventsPerThread);
+
+// Stop recording and write the events to path. Returns false with error set
+//   if the file can't be written
+bool PyEvalStopTimeline(const std::string &path, std::string &error);
+
+bool PyEvalTimelineActive();
+
+// Name of the calling thread track, name must be a string literal
+void PyEvalTimelineThreadName(const char *name);
+
+// Instant event visible across all tracks, i.e. a frame change
+void PyEvalTimelineMarker(const char *name, double value);
+
+// Record the lifetime of the object as a span of the calling thread track
+//   name must be a string literal, arg (i.e. a node name) is copied
+class PyEvalSpan
+{
+public:
+   
+   PyEvalSpan(const char *name, const char *arg=0);
+   ~PyEvalSpan();
+   
+   inline bool active() const { return (mName != 0); }
+   
+   void setArg(const char *arg);
+   
+   // Record the span now rather than when the object is destroyed
+   void end();
+   
+private:
+   
+   PyEvalSpan(const PyEvalSpan&);
+   PyEvalSpan& operator=(const PyEvalSpan&);
+   
+   const char *mName;
+   long long mStart;
+   char mArg[64];
+};
+
+// Stop the time budget watchdog thread, isolated interpreters and worker
+//   processes, close the trace and stop the timeline, call before unloading
+void PyEvalShutdown();
+
+#endif
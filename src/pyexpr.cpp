@@ -18,6 +18,7 @@ License along with this library; if not, write to the Free Software
 Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 */
 
+#include "pyeval.h"
 #include <maya/MPxNode.h>
 #include <maya/MFnPlugin.h>
 #include <maya/MPlug.h>
@@ -29,6 +30,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include <maya/MFnEnumAttribute.h>
 #include <maya/MFnMessageAttribute.h>
 #include <maya/MFnMatrixAttribute.h>
+#include <maya/MFnCompoundAttribute.h>
 #include <maya/MDataBlock.h>
 #include <maya/MDataHandle.h>
 #include <maya/MArrayDataHandle.h>
@@ -37,6 +39,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include <maya/MStringArray.h>
 #include <maya/MNodeMessage.h>
 #include <maya/MFnMatrixData.h>
+#include <maya/MFnMatrixArrayData.h>
+#include <maya/MMatrixArray.h>
 #include <maya/MFnNumericData.h>
 #include <maya/MFnStringData.h>
 #include <maya/MArrayDataBuilder.h>
@@ -56,533 +60,4770 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include <maya/MVector.h>
 #include <maya/MDagPath.h>
 #include <maya/MDGMessage.h>
+#include <maya/MDagMessage.h>
+#include <maya/MObjectHandle.h>
+#include <maya/MCallbackIdArray.h>
+#include <maya/MPxDeformerNode.h>
+#include <maya/MItGeometry.h>
+#include <maya/MFnMesh.h>
+#include <maya/MFnNurbsCurve.h>
+#include <maya/MFnNurbsSurface.h>
+#include <maya/MPointArray.h>
+#include <maya/MObjectArray.h>
+#include <maya/MPxCommand.h>
+#include <maya/MSyntax.h>
+#include <maya/MSelectionList.h>
+#include <maya/MArgList.h>
+#include <maya/MArgDatabase.h>
+#include <maya/MSceneMessage.h>
+#include <maya/MConditionMessage.h>
+#include <maya/MTimerMessage.h>
+#include <maya/MItDependencyNodes.h>
+#include <maya/MDGContext.h>
+#include <maya/MFileIO.h>
+#include <maya/MDGModifier.h>
+#include <maya/MAnimControl.h>
+#include <maya/MTypes.h>
+#if MAYA_API_VERSION >= 20190000
+#  include <maya/MDGContextGuard.h>
+#endif
 #include <sstream>
 #include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <set>
+#include <cmath>
+#include <limits>
+#include <ctime>
+#include <atomic>
+#include <fstream>
 
 // -----------------------------------------------------------------------------
 
-template <typename FnAttribute>
-struct ToStream
+// Names of the nodes connected to a node message inputs, as passed to python
+//   All caches are invalidated whenever a connection, a node name or the DAG
+//   hierarchy changes anywhere in the scene, as any of those can change a
+//   partial path name
+class MessageNameCache
 {
-   static void OutputSingle(MPlug &plug, std::ostringstream &, bool verbose)
+public:
+   
+   MessageNameCache()
+      : mGeneration(0)
    {
-      if (verbose)
+   }
+   
+   bool find(const MPlug &plug, std::string &name)
+   {
+      if (mGeneration != msGeneration)
       {
-         MGlobal::displayWarning("[pyexpr] ToStream not implemented for attribute \"" + plug.partialName(false, false, false, false, false, true) + "\"");
+         mEntries.clear();
+         mGeneration = msGeneration;
+         return false;
       }
+      
+      std::map<Key, Entry>::iterator it = mEntries.find(MakeKey(plug));
+      
+      if (it == mEntries.end() || !(it->second.attr == plug.attribute()))
+      {
+         return false;
+      }
+      
+      name = it->second.name;
+      
+      return true;
    }
-};
-
-template <> struct ToStream<MFnMessageAttribute>
-{
-   static void OutputSingle(MPlug &plug, std::ostringstream &oss, bool)
+   
+   void insert(const MPlug &plug, const std::string &name)
    {
-      MPlugArray srcs;
+      Entry &entry = mEntries[MakeKey(plug)];
       
-      if (plug.connectedTo(srcs, true, false) && srcs.length() == 1)
+      entry.attr = plug.attribute();
+      entry.name = name;
+   }
+   
+   static void AddCallbacks()
+   {
+      MObject oNull;
+      
+      msCallbacks.append(MDGMessage::addConnectionCallback(ConnectionChanged));
+      msCallbacks.append(MDGMessage::addNodeAddedCallback(NodeChanged));
+      msCallbacks.append(MDGMessage::addNodeRemovedCallback(NodeChanged));
+      msCallbacks.append(MNodeMessage::addNameChangedCallback(oNull, NameChanged));
+      msCallbacks.append(MDagMessage::addParentAddedCallback(ParentChanged));
+      msCallbacks.append(MDagMessage::addParentRemovedCallback(ParentChanged));
+   }
+   
+   static void RemoveCallbacks()
+   {
+      MMessage::removeCallbacks(msCallbacks);
+      msCallbacks.clear();
+   }
+   
+private:
+   
+   // Attribute hash and logical indices of the plug and its ancestors
+   typedef std::pair<unsigned int, std::vector<unsigned int> > Key;
+   
+   struct Entry
+   {
+      MObject attr;
+      std::string name;
+   };
+   
+   static Key MakeKey(const MPlug &plug)
+   {
+      Key key(MObjectHandle(plug.attribute()).hashCode(), std::vector<unsigned int>());
+      
+      MPlug p(plug);
+      
+      while (true)
       {
-         MStatus stat;
-         MObject srcNode = srcs[0].node();
-         
-         MFnDagNode dag(srcNode, &stat);
-         
-         if (stat != MS::kSuccess)
+         if (p.isElement())
          {
-            MFnDependencyNode dep(srcNode);
-            
-            oss << "'" << dep.name().asChar() << "'";
+            key.second.push_back(p.logicalIndex());
+            p = p.array();
+         }
+         else if (p.isChild())
+         {
+            p = p.parent();
          }
          else
          {
-            MDagPath path;
-            
-            dag.getPath(path);
-            oss << "'" << path.partialPathName().asChar() << "'";
+            break;
          }
       }
-      else
-      {
-         oss << "''";
-      }
+      
+      return key;
+   }
+   
+   static void ConnectionChanged(MPlug &, MPlug &, bool, void *)
+   {
+      ++msGeneration;
+   }
+   
+   static void NodeChanged(MObject &, void *)
+   {
+      ++msGeneration;
    }
+   
+   static void NameChanged(MObject &, const MString &, void *)
+   {
+      ++msGeneration;
+   }
+   
+   static void ParentChanged(MDagPath &, MDagPath &, void *)
+   {
+      ++msGeneration;
+   }
+   
+   unsigned long mGeneration;
+   std::map<Key, Entry> mEntries;
+   
+   static unsigned long msGeneration;
+   static MCallbackIdArray msCallbacks;
 };
 
-template <> struct ToStream<MFnUnitAttribute>
+// Start at 1 so that new caches are out of date
+unsigned long MessageNameCache::msGeneration = 1;
+MCallbackIdArray MessageNameCache::msCallbacks;
+
+// -----------------------------------------------------------------------------
+
+// Plugin wide diagnostic messages, see PyExprLogCmd
+// Messages can be written from any thread during evaluation: they are copied to
+//   a fixed size ring buffer without locking nor allocating, and written to the
+//   script editor (or the log file) by the main thread when maya is idle. The
+//   same message from the same node is written at most once per Interval
+//   seconds, the following ones being counted and reported once the interval
+//   has passed, and each node writes at most Rate messages per second. Messages
+//   over the rate, or that don't fit in the buffer until the next flush, are
+//   dropped
+class Log
 {
-   static void OutputSingle(MPlug &plug, std::ostringstream &oss, bool verbose)
+public:
+   
+   enum Level
    {
-      MFnUnitAttribute fnAttr(plug.attribute());
+      L_info = 0,
+      L_warning,
+      L_error
+   };
+   
+   // Flushed messages kept for pyexprLog -messages
+   struct Line
+   {
+      Level level;
+      double time;
+      std::string node;
+      std::string text;
+      unsigned int repeats;
+   };
+   
+   static void Write(Level level, const MObject &node, const MString &text);
+   
+   static inline void Info(const MObject &node, const MString &text) { Write(L_info, node, text); }
+   static inline void Warning(const MObject &node, const MString &text) { Write(L_warning, node, text); }
+   static inline void Error(const MObject &node, const MString &text) { Write(L_error, node, text); }
+   
+   // Main thread only
+   static void Flush();
+   // Whether repeated messages wait to be reported, see Flush
+   static inline bool Repeating() { return msRepeating.load(); }
+   static void Clear();
+   static bool SetFile(const MString &path);
+   static inline const MString& File() { return msFilePath; }
+   static inline const std::deque<Line>& Lines() { return msLines; }
+   static inline unsigned long long Dropped() { return msDroppedTotal + msDropped.load(); }
+   static MString Format(const Line &line, bool withTime);
+   
+   // Seconds during which a repeated message is only counted, 0 to disable
+   static std::atomic<double> Interval;
+   
+   // Maximum number of messages written per second by a node, 0 for no limit
+   static std::atomic<int> Rate;
+   
+private:
+   
+   // Last time a message was written and number of times it was repeated since
+   struct Key
+   {
+      std::atomic<size_t> hash;
+      std::atomic<long long> last;
+      std::atomic<unsigned int> repeats;
+   };
+   
+   // Second during which a node last wrote and number of messages written then
+   struct Source
+   {
+      std::atomic<size_t> hash;
+      std::atomic<long long> second;
+      std::atomic<int> count;
+   };
+   
+   struct Entry
+   {
+      // Index of the message plus one once written
+      std::atomic<unsigned long long> seq;
+      Level level;
+      unsigned int repeats;
+      double time;
+      // Named when flushed, so that writing doesn't query maya
+      MObjectHandle node;
+      // Counts the repeats of the message, 0 when they aren't
+      Key *key;
+      char text[2048];
+   };
+   
+   static const unsigned long long Capacity = 256;
+   static const size_t KeyCount = 1024;
+   
+   static size_t Hash(const char *text);
+   template <class T> static T* FindKey(T *keys, size_t hash);
+   static void Copy(char *dst, size_t size, const char *src);
+   static void Output(const Line &line);
+   
+   static Entry msEntries[Capacity];
+   // Next message to write and to flush
+   static std::atomic<unsigned long long> msHead;
+   static std::atomic<unsigned long long> msTail;
+   static Key msKeys[KeyCount];
+   static Source msSources[KeyCount];
+   // Last message flushed for each key, written again with its late repeats
+   static std::map<Key*, Line> msRepeated;
+   static std::atomic<bool> msRepeating;
+   static std::atomic<unsigned long long> msDropped;
+   static unsigned long long msDroppedTotal;
+   static std::atomic<bool> msFlushQueued;
+   static std::deque<Line> msLines;
+   static MString msFilePath;
+   static std::ofstream msFile;
+};
+
+std::atomic<double> Log::Interval(1.0);
+std::atomic<int> Log::Rate(20);
+Log::Entry Log::msEntries[Log::Capacity];
+std::atomic<unsigned long long> Log::msHead(0);
+std::atomic<unsigned long long> Log::msTail(0);
+Log::Key Log::msKeys[Log::KeyCount];
+Log::Source Log::msSources[Log::KeyCount];
+std::map<Log::Key*, Log::Line> Log::msRepeated;
+std::atomic<bool> Log::msRepeating(false);
+std::atomic<unsigned long long> Log::msDropped(0);
+unsigned long long Log::msDroppedTotal = 0;
+std::atomic<bool> Log::msFlushQueued(false);
+std::deque<Log::Line> Log::msLines;
+MString Log::msFilePath;
+std::ofstream Log::msFile;
+
+size_t Log::Hash(const char *text)
+{
+   // FNV-1a, over the message bytes so that writing doesn't allocate
+   unsigned long long hash = 14695981039346656037ULL;
+   
+   for (; *text; ++text)
+   {
+      hash = (hash ^ (unsigned char) *text) * 1099511628211ULL;
+   }
+   
+   return size_t(hash);
+}
+
+template <class T>
+T* Log::FindKey(T *keys, size_t hash)
+{
+   // Keys are never removed, once the table is full new messages aren't
+   //   deduplicated nor rate limited anymore
+   for (size_t i=0; i<8; ++i)
+   {
+      T &key = keys[(hash + i) % KeyCount];
+      size_t current = key.hash.load();
       
-      switch (fnAttr.unitType())
+      if (current == 0 && key.hash.compare_exchange_strong(current, hash))
       {
-      case MFnUnitAttribute::kAngle:
-         oss << plug.asMAngle().as(MAngle::uiUnit());
-         break;
-         
-      case MFnUnitAttribute::kDistance:
-         oss << plug.asMDistance().as(MDistance::uiUnit());
-         break;
-         
-      case MFnUnitAttribute::kTime:
-         oss << plug.asMTime().as(MTime::uiUnit());
-         break;
-         
-      default:
-         if (verbose)
-         {
-            MGlobal::displayWarning("[pyexpr] Unsupported unit type for attribute \"" + fnAttr.name() + "\"");
-         }
+         return &key;
+      }
+      
+      // current holds the hash of the key that was set concurrently on failure
+      if (current == hash)
+      {
+         return &key;
       }
    }
-};
+   
+   return 0;
+}
 
-template <> struct ToStream<MFnEnumAttribute>
+void Log::Copy(char *dst, size_t size, const char *src)
 {
-   static void OutputSingle(MPlug &plug, std::ostringstream &oss, bool)
+   size_t len = strlen(src);
+   
+   if (len < size)
    {
-      MFnEnumAttribute fnAttr(plug.attribute());
-      
-      oss << fnAttr.fieldName(plug.asShort()).asChar();
+      memcpy(dst, src, len + 1);
    }
-};
+   else
+   {
+      memcpy(dst, src, size - 4);
+      strcpy(dst + size - 4, "...");
+   }
+}
 
-template <> struct ToStream<MFnMatrixAttribute>
+void Log::Write(Level level, const MObject &node, const MString &text)
 {
-   static void OutputSingle(MPlug &plug, std::ostringstream &oss, bool)
+   long long now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+   
+   // Messages that aren't about a node share the same rate
+   size_t source = (node.isNull() ? 0 : size_t(MObjectHandle(node).hashCode())) * 2 + 1;
+   
+   size_t hash = Hash(text.asChar());
+   if (!node.isNull())
    {
-      MObject oData = plug.asMObject();
-      MFnMatrixData fnData(oData);
+      hash = hash * 31 + source;
+   }
+   hash = (hash * 31 + size_t(level)) | 1;
+   
+   double interval = Interval.load();
+   int rate = Rate.load();
+   
+   unsigned int repeats = 0;
+   Key *key = (interval > 0.0 ? FindKey(msKeys, hash) : 0);
+   
+   if (key)
+   {
+      long long last = key->last.load();
       
-      MMatrix M = fnData.matrix();
+      if ((last != 0 && double(now - last) < 1000.0 * interval) || !key->last.compare_exchange_strong(last, now))
+      {
+         key->repeats.fetch_add(1);
+         msRepeating.store(true);
+         return;
+      }
       
-      oss << "((" << M[0][0] << ", " << M[0][1] << ", " << M[0][2] << ", " << M[0][3] << "),";
-      oss << " (" << M[1][0] << ", " << M[1][1] << ", " << M[1][2] << ", " << M[1][3] << "),";
-      oss << " (" << M[2][0] << ", " << M[2][1] << ", " << M[2][2] << ", " << M[2][3] << "),";
-      oss << " (" << M[3][0] << ", " << M[3][1] << ", " << M[3][2] << ", " << M[3][3] << "))";
+      repeats = key->repeats.exchange(0);
    }
-};
+   
+   Source *src = (rate > 0 ? FindKey(msSources, source) : 0);
+   
+   if (src)
+   {
+      long long second = now / 1000;
+      long long current = src->second.load();
+      
+      if (current != second && src->second.compare_exchange_strong(current, second))
+      {
+         src->count.store(0);
+      }
+      
+      if (src->count.fetch_add(1) >= rate)
+      {
+         msDropped.fetch_add(1);
+         return;
+      }
+   }
+   
+   // Entries are only reused once flushed, so that they have a single writer
+   unsigned long long index = msHead.load();
+   
+   do
+   {
+      if (index - msTail.load(std::memory_order_acquire) >= Capacity)
+      {
+         msDropped.fetch_add(1);
+         return;
+      }
+   }
+   while (!msHead.compare_exchange_weak(index, index + 1));
+   
+   Entry &entry = msEntries[index % Capacity];
+   
+   entry.level = level;
+   entry.repeats = repeats;
+   entry.time = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+   entry.node = node;
+   entry.key = key;
+   Copy(entry.text, sizeof(entry.text), text.asChar());
+   
+   entry.seq.store(index + 1, std::memory_order_release);
+   
+   if (!msFlushQueued.exchange(true))
+   {
+      MGlobal::executeCommandOnIdle("if (`exists pyexprLog`) pyexprLog -flush;");
+   }
+}
 
-template <> struct ToStream<MFnNumericAttribute>
+MString Log::Format(const Line &line, bool withTime)
 {
-   static void OutputSingle(MPlug &plug, std::ostringstream &oss, bool verbose)
+   MString rv;
+   
+   if (withTime)
    {
-      MFnNumericAttribute fnAttr(plug.attribute());
-      
-      MObject oData = plug.asMObject();
-      MFnNumericData fnData(oData);
+      char buffer[64];
+      time_t t = time_t(line.time);
+      strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S ", localtime(&t));
+      rv += buffer;
+      rv += (line.level == L_error ? "error " : (line.level == L_warning ? "warning " : "info "));
+   }
+   
+   rv += "[pyexpr] ";
+   
+   if (line.node.length() > 0)
+   {
+      rv += line.node.c_str();
+      rv += ": ";
+   }
+   
+   rv += line.text.c_str();
+   
+   if (line.repeats > 0)
+   {
+      rv += " (repeated ";
+      rv += line.repeats;
+      rv += " time(s))";
+   }
+   
+   return rv;
+}
+
+void Log::Output(const Line &line)
+{
+   if (msFile.is_open())
+   {
+      msFile << Format(line, true).asChar() << std::endl;
+   }
+   else if (line.level == L_error)
+   {
+      MGlobal::displayError(Format(line, false));
+   }
+   else if (line.level == L_warning)
+   {
+      MGlobal::displayWarning(Format(line, false));
+   }
+   else
+   {
+      MGlobal::displayInfo(Format(line, false));
+   }
+   
+   msLines.push_back(line);
+   
+   while (msLines.size() > 1000)
+   {
+      msLines.pop_front();
+   }
+}
+
+void Log::Flush()
+{
+   // Messages written from now on schedule a new flush
+   msFlushQueued.store(false);
+   
+   unsigned long long head = msHead.load();
+   unsigned long long tail = msTail.load();
+   
+   for (; tail < head; ++tail)
+   {
+      Entry &entry = msEntries[tail % Capacity];
       
-      switch (fnAttr.unitType())
+      if (entry.seq.load(std::memory_order_acquire) != tail + 1)
       {
-      case MFnNumericData::kBoolean:
-         oss << (plug.asBool() ? "True" : "False");
+         // Still being written, flushed when its writer schedules a new flush
          break;
+      }
+      
+      Line line;
+      
+      line.level = entry.level;
+      line.repeats = entry.repeats;
+      line.time = entry.time;
+      line.text = entry.text;
+      
+      if (entry.node.isValid())
+      {
+         line.node = MFnDependencyNode(entry.node.object()).name().asChar();
+      }
+      
+      if (entry.key)
+      {
+         msRepeated[entry.key] = line;
+      }
+      
+      msTail.store(tail + 1, std::memory_order_release);
+      
+      Output(line);
+   }
+   
+   // Repeats of the messages that weren't written again once their interval
+   //   passed. The line stands for the first repeat, as for a written message
+   if (msRepeating.exchange(false))
+   {
+      long long now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+      double interval = Interval.load();
+      
+      for (std::map<Key*, Line>::iterator it = msRepeated.begin(); it != msRepeated.end(); ++it)
+      {
+         Key *key = it->first;
          
-      case MFnNumericData::kChar:
-         oss << plug.asChar();
-         break;
+         if (key->repeats.load() == 0)
+         {
+            continue;
+         }
          
-      case MFnNumericData::kByte:
-      case MFnNumericData::kShort:
-         oss << plug.asShort();
-         break;
+         long long last = key->last.load();
          
-      case MFnNumericData::k2Short:
+         if (double(now - last) < 1000.0 * interval || !key->last.compare_exchange_strong(last, now))
+         {
+            // Checked again on the next flush
+            msRepeating.store(true);
+            continue;
+         }
+         
+         unsigned int repeats = key->repeats.exchange(0);
+         
+         if (repeats > 0)
+         {
+            Line line = it->second;
+            
+            line.repeats = repeats - 1;
+            line.time = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+            
+            Output(line);
+         }
+      }
+   }
+   
+   unsigned long long dropped = msDropped.exchange(0);
+   
+   if (dropped > 0)
+   {
+      Line line;
+      
+      line.level = L_warning;
+      line.repeats = 0;
+      line.time = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+      line.text = std::to_string(dropped) + " message(s) dropped";
+      
+      Output(line);
+      
+      msDroppedTotal += dropped;
+   }
+   
+   if (msFile.is_open())
+   {
+      msFile.flush();
+   }
+}
+
+void Log::Clear()
+{
+   Flush();
+   
+   msLines.clear();
+   msDroppedTotal = 0;
+   
+   msRepeated.clear();
+   msRepeating.store(false);
+   
+   for (size_t i=0; i<KeyCount; ++i)
+   {
+      msKeys[i].last.store(0);
+      msKeys[i].repeats.store(0);
+      msSources[i].second.store(0);
+      msSources[i].count.store(0);
+   }
+}
+
+bool Log::SetFile(const MString &path)
+{
+   Flush();
+   
+   if (msFile.is_open())
+   {
+      msFile.close();
+   }
+   
+   msFilePath = "";
+   
+   if (path.length() == 0)
+   {
+      return true;
+   }
+   
+   msFile.open(path.asChar(), std::ios::out | std::ios::app);
+   
+   if (!msFile.is_open())
+   {
+      return false;
+   }
+   
+   msFilePath = path;
+   
+   return true;
+}
+
+// -----------------------------------------------------------------------------
+
+// Layouts of point, vector and matrix array inputs, see the arrayLayout attribute
+enum ArrayLayout
+{
+   AL_tuples = 0,
+   AL_xyz,
+   AL_xyz_float,
+   AL_planar
+};
+
+// Buffers handed to python, owned by a node and reused across its evaluations
+//   A buffer is reused once the contexts of the evaluations it was handed to
+//   are released
+template <typename T>
+class BufferPool
+{
+public:
+   
+   typedef std::shared_ptr<std::vector<T> > Buffer;
+   
+   Buffer acquire(size_t size)
+   {
+      for (size_t i=0; i<mBuffers.size(); ++i)
+      {
+         if (mBuffers[i].use_count() == 1)
+         {
+            mBuffers[i]->resize(size);
+            return mBuffers[i];
+         }
+      }
+      
+      Buffer buffer(new std::vector<T>(size));
+      
+      mBuffers.push_back(buffer);
+      
+      return buffer;
+   }
+   
+   inline size_t size() const { return mBuffers.size(); }
+   
+   // Free the unused buffers beyond count, once evaluations that held many of
+   //   them at once are done
+   void trim(size_t count)
+   {
+      std::vector<Buffer> kept;
+      
+      for (size_t i=0; i<mBuffers.size(); ++i)
+      {
+         if (mBuffers[i].use_count() > 1 || kept.size() < count)
+         {
+            kept.push_back(mBuffers[i]);
+         }
+      }
+      
+      mBuffers.swap(kept);
+   }
+   
+private:
+   
+   std::vector<Buffer> mBuffers;
+};
+
+struct PackBuffers
+{
+   BufferPool<double> doubles;
+   BufferPool<float> floats;
+};
+
+// Calls fn(begin, end) on ranges of [0, count), on several threads when count
+//   exceeds grain. fn must not call into python, the GIL is released for large counts
+template <typename Fn>
+static void ParallelRanges(size_t count, size_t grain, const Fn &fn)
+{
+   size_t n = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), 8);
+   
+   n = std::min(n, count / grain);
+   
+   // Lazy inputs are repacked while the expression reads them, with the GIL
+   //   held: large arrays let other threads run python meanwhile
+   PyEvalAllowThreads allowThreads(count >= grain);
+   
+   if (n <= 1)
+   {
+      fn(0, count);
+      return;
+   }
+   
+   std::vector<std::thread> threads;
+   size_t step = (count + n - 1) / n;
+   
+   for (size_t begin=step; begin<count; begin+=step)
+   {
+      threads.push_back(std::thread(fn, begin, std::min(count, begin + step)));
+   }
+   
+   fn(0, step);
+   
+   for (size_t i=0; i<threads.size(); ++i)
+   {
+      threads[i].join();
+   }
+}
+
+// Elements at or above which repacking is split across threads
+static const size_t PackGrain = 1 << 16;
+
+// Copy the first width values of count elements stride values apart to dst
+//   The loops are simple enough for the compiler to vectorize them
+template <typename T>
+static void PackInterleaved(const double *src, size_t stride, size_t width, size_t count, T *dst)
+{
+   ParallelRanges(count, PackGrain, [=](size_t begin, size_t end)
+   {
+      const double * __restrict s = src + begin * stride;
+      T * __restrict d = dst + begin * width;
+      
+      if (width == 3)
+      {
+         for (size_t i=begin; i<end; ++i, s+=stride, d+=3)
+         {
+            d[0] = T(s[0]);
+            d[1] = T(s[1]);
+            d[2] = T(s[2]);
+         }
+      }
+      else
+      {
+         for (size_t i=begin; i<end; ++i, s+=stride, d+=width)
+         {
+            for (size_t j=0; j<width; ++j)
+            {
+               d[j] = T(s[j]);
+            }
+         }
+      }
+   });
+}
+
+// Split the xyz values of count elements stride values apart to x, y and z
+static void PackPlanar(const double *src, size_t stride, size_t count, double *x, double *y, double *z)
+{
+   ParallelRanges(count, PackGrain, [=](size_t begin, size_t end)
+   {
+      const double * __restrict s = src + begin * stride;
+      double * __restrict px = x;
+      double * __restrict py = y;
+      double * __restrict pz = z;
+      
+      for (size_t i=begin; i<end; ++i, s+=stride)
+      {
+         px[i] = s[0];
+         py[i] = s[1];
+         pz[i] = s[2];
+      }
+   });
+}
+
+// -----------------------------------------------------------------------------
+
+// Lets the evaluated node provide the value of a bound attribute itself rather
+//   than having it read from its plug, see PyExpr::appendChainStep
+struct StreamLinker
+{
+   virtual ~StreamLinker() {}
+   
+   // argument is the index of the attribute in DynamicAttributeNames order
+   // Returns true if the value is provided, None is then output in its place
+   virtual bool link(MPlug &plug, size_t argument) = 0;
+};
+
+// Per-evaluation state shared by the ToStream converters
+struct StreamContext
+{
+   StreamContext(bool v, MessageNameCache *names=0, PackBuffers *buffers=0, short layout=AL_tuples)
+      : verbose(v)
+      , messageNames(names)
+      , packBuffers(buffers)
+      , arrayLayout(layout)
+      , linker(0)
+      , code(0)
+   {
+   }
+   
+   void clear()
+   {
+      geometry.clear();
+      ints.clear();
+      doubles.clear();
+      packed.clear();
+   }
+   
+   bool verbose;
+   
+   // Owned by the evaluated node, may be null
+   MessageNameCache *messageNames;
+   PackBuffers *packBuffers;
+   // Layout of point, vector and matrix array inputs (ArrayLayout)
+   short arrayLayout;
+   StreamLinker *linker;
+   // Code the arguments are output for, those its expression doesn't
+   //   reference are output as None (see PyEvalCode::analyse)
+   const PyEvalCode *code;
+   
+   // Geometry is exposed to python as buffers pointing directly at this memory
+   //   (see _pyexpr_buffer in PythonPrelude), it must stay alive until the
+   //   expression function returns
+   MObjectArray geometry;
+   std::deque<std::vector<int> > ints;
+   std::deque<std::vector<double> > doubles;
+   // Buffers acquired from packBuffers
+   std::vector<std::shared_ptr<void> > packed;
+   
+   template <typename T>
+   T* acquire(BufferPool<T> *pool, size_t size)
+   {
+      typename BufferPool<T>::Buffer buffer = (pool ? pool->acquire(size) : typename BufferPool<T>::Buffer(new std::vector<T>(size)));
+      
+      packed.push_back(buffer);
+      
+      return (size > 0 ? &(*buffer)[0] : 0);
+   }
+};
+
+static void OutputAddress(std::ostringstream &oss, const void *ptr)
+{
+   oss << (unsigned long long)(size_t)ptr;
+}
+
+static void OutputBuffer(std::ostringstream &oss, const char *ctype, const void *ptr, unsigned int count, bool writable=false)
+{
+   oss << "_pyexpr_buffer(ctypes." << ctype << ", ";
+   OutputAddress(oss, ptr);
+   oss << ", " << count << (writable ? ", True)" : ")");
+}
+
+static void OutputBuffer(std::ostringstream &oss, StreamContext &ctx, const MIntArray &ary)
+{
+   ctx.ints.push_back(std::vector<int>(ary.length()));
+   
+   std::vector<int> &buffer = ctx.ints.back();
+   
+   for (unsigned int i=0; i<ary.length(); ++i)
+   {
+      buffer[i] = ary[i];
+   }
+   
+   OutputBuffer(oss, "c_int", (buffer.size() > 0 ? &buffer[0] : 0), (unsigned int) buffer.size());
+}
+
+static void OutputBuffer(std::ostringstream &oss, StreamContext &ctx, const MDoubleArray &ary)
+{
+   ctx.doubles.push_back(std::vector<double>(ary.length()));
+   
+   std::vector<double> &buffer = ctx.doubles.back();
+   
+   for (unsigned int i=0; i<ary.length(); ++i)
+   {
+      buffer[i] = ary[i];
+   }
+   
+   OutputBuffer(oss, "c_double", (buffer.size() > 0 ? &buffer[0] : 0), (unsigned int) buffer.size());
+}
+
+static void OutputBuffer(std::ostringstream &oss, StreamContext &ctx, const MPointArray &ary)
+{
+   unsigned int count = ary.length();
+   double *buffer = ctx.acquire(ctx.packBuffers ? &(ctx.packBuffers->doubles) : 0, 3 * count);
+   
+   if (count > 0)
+   {
+      PackInterleaved(&(ary[0].x), 4, 3, count, buffer);
+   }
+   
+   OutputBuffer(oss, "c_double", buffer, 3 * count);
+}
+
+// Output count elements stride doubles apart, of which the first width are
+//   used, according to ctx.arrayLayout (planar is only used for xyz values)
+static void OutputPacked(std::ostringstream &oss, StreamContext &ctx, const double *src, unsigned int stride, unsigned int width, unsigned int count)
+{
+   PyEvalSpan span("repack");
+   
+   if (ctx.arrayLayout == AL_xyz_float)
+   {
+      float *buffer = ctx.acquire(ctx.packBuffers ? &(ctx.packBuffers->floats) : 0, width * count);
+      
+      PackInterleaved(src, stride, width, count, buffer);
+      
+      OutputBuffer(oss, "c_float", buffer, width * count);
+   }
+   else if (ctx.arrayLayout == AL_planar && width == 3)
+   {
+      BufferPool<double> *pool = (ctx.packBuffers ? &(ctx.packBuffers->doubles) : 0);
+      
+      double *x = ctx.acquire(pool, count);
+      double *y = ctx.acquire(pool, count);
+      double *z = ctx.acquire(pool, count);
+      
+      PackPlanar(src, stride, count, x, y, z);
+      
+      oss << "(";
+      OutputBuffer(oss, "c_double", x, count);
+      oss << ", ";
+      OutputBuffer(oss, "c_double", y, count);
+      oss << ", ";
+      OutputBuffer(oss, "c_double", z, count);
+      oss << ")";
+   }
+   else
+   {
+      double *buffer = ctx.acquire(ctx.packBuffers ? &(ctx.packBuffers->doubles) : 0, width * count);
+      
+      PackInterleaved(src, stride, width, count, buffer);
+      
+      OutputBuffer(oss, "c_double", buffer, width * count);
+   }
+}
+
+// -----------------------------------------------------------------------------
+
+template <typename FnAttribute>
+struct ToStream
+{
+   static void OutputSingle(MPlug &plug, std::ostringstream &oss, StreamContext &ctx)
+   {
+      if (ctx.verbose)
+      {
+         Log::Warning(plug.node(), "ToStream not implemented for attribute \"" + plug.partialName(false, false, false, false, false, true) + "\"");
+      }
+      oss << "None";
+   }
+};
+
+template <> struct ToStream<MFnMessageAttribute>
+{
+   static void OutputSingle(MPlug &plug, std::ostringstream &oss, StreamContext &ctx)
+   {
+      std::string name;
+      
+      if (ctx.messageNames && ctx.messageNames->find(plug, name))
+      {
+         oss << name;
+         return;
+      }
+      
+      MPlugArray srcs;
+      
+      if (plug.connectedTo(srcs, true, false) && srcs.length() == 1)
+      {
+         MStatus stat;
+         MObject srcNode = srcs[0].node();
+         
+         MFnDagNode dag(srcNode, &stat);
+         
+         if (stat != MS::kSuccess)
+         {
+            MFnDependencyNode dep(srcNode);
+            
+            name = std::string("'") + dep.name().asChar() + "'";
+         }
+         else
+         {
+            MDagPath path;
+            
+            dag.getPath(path);
+            name = std::string("'") + path.partialPathName().asChar() + "'";
+         }
+      }
+      else
+      {
+         name = "''";
+      }
+      
+      if (ctx.messageNames)
+      {
+         ctx.messageNames->insert(plug, name);
+      }
+      
+      oss << name;
+   }
+};
+
+template <> struct ToStream<MFnUnitAttribute>
+{
+   static void OutputSingle(MPlug &plug, std::ostringstream &oss, StreamContext &ctx)
+   {
+      MFnUnitAttribute fnAttr(plug.attribute());
+      
+      switch (fnAttr.unitType())
+      {
+      case MFnUnitAttribute::kAngle:
+         oss << plug.asMAngle().as(MAngle::uiUnit());
+         break;
+         
+      case MFnUnitAttribute::kDistance:
+         oss << plug.asMDistance().as(MDistance::uiUnit());
+         break;
+         
+      case MFnUnitAttribute::kTime:
+         oss << plug.asMTime().as(MTime::uiUnit());
+         break;
+         
+      default:
+         if (ctx.verbose)
+         {
+            Log::Warning(plug.node(), "Unsupported unit type for attribute \"" + fnAttr.name() + "\"");
+         }
+         oss << "None";
+      }
+   }
+};
+
+template <> struct ToStream<MFnEnumAttribute>
+{
+   static void OutputSingle(MPlug &plug, std::ostringstream &oss, StreamContext &)
+   {
+      MFnEnumAttribute fnAttr(plug.attribute());
+      
+      oss << fnAttr.fieldName(plug.asShort()).asChar();
+   }
+};
+
+template <> struct ToStream<MFnMatrixAttribute>
+{
+   static void OutputSingle(MPlug &plug, std::ostringstream &oss, StreamContext &)
+   {
+      MObject oData = plug.asMObject();
+      MFnMatrixData fnData(oData);
+      
+      MMatrix M = fnData.matrix();
+      
+      oss << "((" << M[0][0] << ", " << M[0][1] << ", " << M[0][2] << ", " << M[0][3] << "),";
+      oss << " (" << M[1][0] << ", " << M[1][1] << ", " << M[1][2] << ", " << M[1][3] << "),";
+      oss << " (" << M[2][0] << ", " << M[2][1] << ", " << M[2][2] << ", " << M[2][3] << "),";
+      oss << " (" << M[3][0] << ", " << M[3][1] << ", " << M[3][2] << ", " << M[3][3] << "))";
+   }
+};
+
+template <> struct ToStream<MFnNumericAttribute>
+{
+   static void OutputSingle(MPlug &plug, std::ostringstream &oss, StreamContext &ctx)
+   {
+      MFnNumericAttribute fnAttr(plug.attribute());
+      
+      MObject oData = plug.asMObject();
+      MFnNumericData fnData(oData);
+      
+      switch (fnAttr.unitType())
+      {
+      case MFnNumericData::kBoolean:
+         oss << (plug.asBool() ? "True" : "False");
+         break;
+         
+      case MFnNumericData::kChar:
+         oss << plug.asChar();
+         break;
+         
+      case MFnNumericData::kByte:
+      case MFnNumericData::kShort:
+         oss << plug.asShort();
+         break;
+         
+      case MFnNumericData::k2Short:
          {
             short v0, v1;
             fnData.getData(v0, v1);
             oss << "(" << v0 << ", " << v1 << ")";
          }
          break;
-         
-      case MFnNumericData::k3Short:
+         
+      case MFnNumericData::k3Short:
+         {
+            short v0, v1, v2;
+            fnData.getData(v0, v1, v2);
+            oss << "(" << v0 << ", " << v1 << ", " << v2 << ")";
+         }
+         break;
+         
+      case MFnNumericData::kLong:
+      //case MFnNumericData::kInt:
+         oss << plug.asInt();
+         break;
+         
+      case MFnNumericData::k2Long:
+      //case MFnNumericData::k2Int:
+         {
+            int v0, v1;
+            fnData.getData(v0, v1);
+            oss << "(" << v0 << ", " << v1 << ")";
+         }
+         break;
+      case MFnNumericData::k3Long:
+      //case MFnNumericData::k3Int:
+         {
+            int v0, v1, v2;
+            fnData.getData(v0, v1, v2);
+            oss << "(" << v0 << ", " << v1 << ", " << v2 << ")";
+         }
+         break;
+         
+      case MFnNumericData::kFloat:
+         oss << plug.asFloat();
+         break;
+         
+      case MFnNumericData::k2Float:
+         {
+            float v0, v1;
+            fnData.getData(v0, v1);
+            oss << "(" << v0 << ", " << v1 << ")";
+         }
+         break;
+         
+      case MFnNumericData::k3Float:
+         {
+            float v0, v1, v2;
+            fnData.getData(v0, v1, v2);
+            oss << "(" << v0 << ", " << v1 << ", " << v2 << ")";
+         }
+         break;
+         
+      case MFnNumericData::kDouble:
+         oss << plug.asDouble();
+         break;
+         
+      case MFnNumericData::k2Double:
+         {
+            double v0, v1;
+            fnData.getData(v0, v1);
+            oss << "(" << v0 << ", " << v1 << ")";
+         }
+         break;
+         
+      case MFnNumericData::k3Double:
+         {
+            double v0, v1, v2;
+            fnData.getData(v0, v1, v2);
+            oss << "(" << v0 << ", " << v1 << ", " << v2 << ")";
+         }
+         break;
+         
+      case MFnNumericData::k4Double:
+         {
+            double v0, v1, v2, v3;
+            fnData.getData(v0, v1, v2, v3);
+            oss << "(" << v0 << ", " << v1 << ", " << v2 << ", " << v3 << ")";
+         }
+         break;
+         
+      default:
+         if (ctx.verbose)
+         {
+            Log::Warning(plug.node(), "Unsupported numeric type for attribute \"" + fnAttr.name() + "\"");
+         }
+         oss << "None";
+      }
+   }
+};
+
+template <> struct ToStream<MFnTypedAttribute>
+{
+   static void OutputSingle(MPlug &plug, std::ostringstream &oss, StreamContext &ctx)
+   {
+      MStatus stat;
+      MFnTypedAttribute fnAttr(plug.attribute());
+      
+      switch (fnAttr.attrType())
+      {
+      case MFnData::kNumeric:
+         {
+            ToStream<MFnNumericAttribute>::OutputSingle(plug, oss, ctx);
+         }
+         break;
+         
+      case MFnData::kString:
+         oss << "'" << plug.asString().asChar() << "'";
+         break;
+         
+      case MFnData::kMatrix:
+         {
+            MObject oData = plug.asMObject();
+            MFnMatrixData fnData(oData);
+            
+            MMatrix M = fnData.matrix();
+            
+            oss << "((" << M[0][0] << ", " << M[0][1] << ", " << M[0][2] << ", " << M[0][3] << "),";
+            oss << " (" << M[1][0] << ", " << M[1][1] << ", " << M[1][2] << ", " << M[1][3] << "),";
+            oss << " (" << M[2][0] << ", " << M[2][1] << ", " << M[2][2] << ", " << M[2][3] << "),";
+            oss << " (" << M[3][0] << ", " << M[3][1] << ", " << M[3][2] << ", " << M[3][3] << "))";
+         }
+         break;
+         
+      case MFnData::kStringArray:
+         {
+            MObject oData = plug.asMObject();
+            MFnStringArrayData fnData(oData);
+            
+            unsigned int count = fnData.length();
+            
+            oss << "[";
+            
+            for (unsigned int i=0; i<count; ++i)
+            {
+               oss << "'" << fnData[i].asChar() << "'";
+               
+               if (i + 1 < count)
+               {
+                  oss << ", ";
+               }
+            }
+            
+            oss << "]";
+         }
+         break;
+         
+      case MFnData::kDoubleArray:
+         {
+            MObject oData = plug.asMObject();
+            MFnDoubleArrayData fnData(oData);
+            
+            unsigned int count = fnData.length();
+            
+            oss << "[";
+            
+            for (unsigned int i=0; i<count; ++i)
+            {
+               oss << fnData[i];
+               
+               if (i + 1 < count)
+               {
+                  oss << ", ";
+               }
+            }
+            
+            oss << "]";
+         }
+         break;
+         
+      case MFnData::kIntArray:
+         {
+            MObject oData = plug.asMObject();
+            MFnIntArrayData fnData(oData);
+            
+            unsigned int count = fnData.length();
+            
+            oss << "[";
+            
+            for (unsigned int i=0; i<count; ++i)
+            {
+               oss << fnData[i];
+               
+               if (i + 1 < count)
+               {
+                  oss << ", ";
+               }
+            }
+            
+            oss << "]";
+         }
+         break;
+         
+      case MFnData::kPointArray:
+         {
+            MObject oData = plug.asMObject();
+            MFnPointArrayData fnData(oData);
+            
+            unsigned int count = fnData.length();
+            
+            if (ctx.arrayLayout != AL_tuples)
+            {
+               MPointArray ary = fnData.array();
+               
+               OutputPacked(oss, ctx, (count > 0 ? &(ary[0].x) : 0), 4, 3, count);
+               break;
+            }
+            
+            oss << "[";
+            
+            for (unsigned int i=0; i<count; ++i)
+            {
+               MPoint pnt = fnData[i];
+               
+               oss << "(" << pnt.x << ", " << pnt.y << ", " << pnt.z << ")";
+               
+               if (i + 1 < count)
+               {
+                  oss << ", ";
+               }
+            }
+            
+            oss << "]";
+         }
+         break;
+         
+      case MFnData::kVectorArray:
+         {
+            MObject oData = plug.asMObject();
+            MFnVectorArrayData fnData(oData);
+            
+            unsigned int count = fnData.length();
+            
+            if (ctx.arrayLayout != AL_tuples)
+            {
+               MVectorArray ary = fnData.array();
+               
+               OutputPacked(oss, ctx, (count > 0 ? &(ary[0].x) : 0), 3, 3, count);
+               break;
+            }
+            
+            oss << "[";
+            
+            for (unsigned int i=0; i<count; ++i)
+            {
+               MVector vec = fnData[i];
+               
+               oss << "(" << vec.x << ", " << vec.y << ", " << vec.z << ")";
+               
+               if (i + 1 < count)
+               {
+                  oss << ", ";
+               }
+            }
+            
+            oss << "]";
+         }
+         break;
+         
+      case MFnData::kMatrixArray:
+         {
+            MObject oData = plug.asMObject();
+            MFnMatrixArrayData fnData(oData);
+            
+            MMatrixArray ary = fnData.array();
+            unsigned int count = ary.length();
+            
+            if (ctx.arrayLayout != AL_tuples)
+            {
+               // Row major, 16 values per matrix
+               OutputPacked(oss, ctx, (count > 0 ? &(ary[0].matrix[0][0]) : 0), 16, 16, count);
+               break;
+            }
+            
+            oss << "[";
+            
+            for (unsigned int i=0; i<count; ++i)
+            {
+               const MMatrix &M = ary[i];
+               
+               oss << "((" << M[0][0] << ", " << M[0][1] << ", " << M[0][2] << ", " << M[0][3] << "),";
+               oss << " (" << M[1][0] << ", " << M[1][1] << ", " << M[1][2] << ", " << M[1][3] << "),";
+               oss << " (" << M[2][0] << ", " << M[2][1] << ", " << M[2][2] << ", " << M[2][3] << "),";
+               oss << " (" << M[3][0] << ", " << M[3][1] << ", " << M[3][2] << ", " << M[3][3] << "))";
+               
+               if (i + 1 < count)
+               {
+                  oss << ", ";
+               }
+            }
+            
+            oss << "]";
+         }
+         break;
+         
+      case MFnData::kMesh:
+         {
+            MObject oData = plug.asMObject();
+            MFnMesh fnMesh(oData, &stat);
+            
+            if (stat != MS::kSuccess)
+            {
+               oss << "None";
+               break;
+            }
+            
+            // Points and normals are read in place, only topology is copied
+            const float *points = fnMesh.getRawPoints(&stat);
+            const float *normals = fnMesh.getRawNormals(&stat);
+            
+            MIntArray faceCounts, faceIndices, normalCounts, normalIds;
+            fnMesh.getVertices(faceCounts, faceIndices);
+            fnMesh.getNormalIds(normalCounts, normalIds);
+            
+            ctx.geometry.append(oData);
+            
+            oss << "_pyexpr_geometry('mesh'";
+            oss << ", numPoints=" << fnMesh.numVertices();
+            oss << ", points=";
+            OutputBuffer(oss, "c_float", points, 3 * fnMesh.numVertices());
+            oss << ", numNormals=" << fnMesh.numNormals();
+            oss << ", normals=";
+            OutputBuffer(oss, "c_float", normals, 3 * fnMesh.numNormals());
+            oss << ", numFaces=" << fnMesh.numPolygons();
+            oss << ", faceCounts=";
+            OutputBuffer(oss, ctx, faceCounts);
+            oss << ", faceIndices=";
+            OutputBuffer(oss, ctx, faceIndices);
+            oss << ", normalIds=";
+            OutputBuffer(oss, ctx, normalIds);
+            oss << ")";
+         }
+         break;
+         
+      case MFnData::kNurbsCurve:
+         {
+            MObject oData = plug.asMObject();
+            MFnNurbsCurve fnCurve(oData, &stat);
+            
+            if (stat != MS::kSuccess)
+            {
+               oss << "None";
+               break;
+            }
+            
+            MPointArray cvs;
+            MDoubleArray knots;
+            fnCurve.getCVs(cvs);
+            fnCurve.getKnots(knots);
+            
+            oss << "_pyexpr_geometry('nurbsCurve'";
+            oss << ", degree=" << fnCurve.degree();
+            oss << ", form=" << int(fnCurve.form());
+            oss << ", numPoints=" << cvs.length();
+            oss << ", points=";
+            OutputBuffer(oss, ctx, cvs);
+            oss << ", knots=";
+            OutputBuffer(oss, ctx, knots);
+            oss << ")";
+         }
+         break;
+         
+      case MFnData::kNurbsSurface:
+         {
+            MObject oData = plug.asMObject();
+            MFnNurbsSurface fnSurface(oData, &stat);
+            
+            if (stat != MS::kSuccess)
+            {
+               oss << "None";
+               break;
+            }
+            
+            MPointArray cvs;
+            MDoubleArray knotsU, knotsV;
+            fnSurface.getCVs(cvs);
+            fnSurface.getKnotsInU(knotsU);
+            fnSurface.getKnotsInV(knotsV);
+            
+            oss << "_pyexpr_geometry('nurbsSurface'";
+            oss << ", degreeU=" << fnSurface.degreeU();
+            oss << ", degreeV=" << fnSurface.degreeV();
+            oss << ", numPointsU=" << fnSurface.numCVsInU();
+            oss << ", numPointsV=" << fnSurface.numCVsInV();
+            oss << ", numPoints=" << cvs.length();
+            oss << ", points=";
+            OutputBuffer(oss, ctx, cvs);
+            oss << ", knotsU=";
+            OutputBuffer(oss, ctx, knotsU);
+            oss << ", knotsV=";
+            OutputBuffer(oss, ctx, knotsV);
+            oss << ")";
+         }
+         break;
+         
+      default:
+         if (ctx.verbose)
+         {
+            Log::Warning(plug.node(), "Unsupported type for attribute \"" + fnAttr.name() + "\"");
+         }
+         oss << "None";
+      }
+   }
+};
+
+template <typename FnAttribute>
+void Output(MObject &node, MObject &attr, std::ostringstream &oss, StreamContext &ctx)
+{
+   MPlug plug(node, attr);
+   
+   if (plug.isArray())
+   {
+      unsigned int count = plug.numElements();
+      
+      oss << "[";
+      
+      for (unsigned int i=0; i<count; ++i)
+      {
+         MPlug elem = plug[i];
+         
+         ToStream<FnAttribute>::OutputSingle(elem, oss, ctx);
+         
+         if (i + 1 < count)
+         {
+            oss << ", ";
+         }
+      }
+      
+      oss << "]";
+   }
+   else
+   {
+      ToStream<FnAttribute>::OutputSingle(plug, oss, ctx);
+   }
+}
+
+// Dynamic attributes are bound to the expression function parameters of the same name
+static bool IsBoundAttribute(const MObject &oAttr)
+{
+   MFnAttribute fnAttr(oAttr);
+   
+   if (!fnAttr.isDynamic())
+   {
+      return false;
+   }
+   
+   return (oAttr.hasFn(MFn::kMessageAttribute) ||
+           oAttr.hasFn(MFn::kUnitAttribute) ||
+           oAttr.hasFn(MFn::kEnumAttribute) ||
+           oAttr.hasFn(MFn::kMatrixAttribute) ||
+           oAttr.hasFn(MFn::kNumericAttribute) ||
+           oAttr.hasFn(MFn::kTypedAttribute));
+}
+
+void DynamicAttributeNames(MObject &node, std::vector<std::string> &names)
+{
+   MFnDependencyNode nNode(node);
+   
+   unsigned int count = nNode.attributeCount();
+   
+   for (unsigned int i=0; i<count; ++i)
+   {
+      MObject oAttr = nNode.attribute(i);
+      
+      if (IsBoundAttribute(oAttr))
+      {
+         MPlug plug(node, oAttr);
+         names.push_back(plug.partialName(false, false, false, false, false, true).asChar());
+      }
+   }
+}
+
+// Output the value of a bound attribute (see IsBoundAttribute)
+void OutputAttribute(MObject &node, MObject &oAttr, std::ostringstream &oss, StreamContext &ctx)
+{
+   if (oAttr.hasFn(MFn::kMessageAttribute))
+   {
+      Output<MFnMessageAttribute>(node, oAttr, oss, ctx);
+   }
+   else if (oAttr.hasFn(MFn::kUnitAttribute))
+   {
+      Output<MFnUnitAttribute>(node, oAttr, oss, ctx);
+   }
+   else if (oAttr.hasFn(MFn::kEnumAttribute))
+   {
+      Output<MFnEnumAttribute>(node, oAttr, oss, ctx);
+   }
+   else if (oAttr.hasFn(MFn::kMatrixAttribute))
+   {
+      Output<MFnMatrixAttribute>(node, oAttr, oss, ctx);
+   }
+   else if (oAttr.hasFn(MFn::kNumericAttribute))
+   {
+      Output<MFnNumericAttribute>(node, oAttr, oss, ctx);
+   }
+   else
+   {
+      Output<MFnTypedAttribute>(node, oAttr, oss, ctx);
+   }
+}
+
+// Dynamic attributes read when the expression accesses them (lazyInputs), in
+//   the context the request was prepared in. ctx must outlive the evaluation
+class LazyInputs : public PyEvalInputs
+{
+public:
+   
+   LazyInputs(MObject &node, StreamContext &ctx)
+      : mNode(node)
+      , mCtx(ctx)
+#if MAYA_API_VERSION >= 20190000
+      , mContext(MDGContext::current())
+#endif
+   {
+   }
+   
+   virtual bool value(const std::string &name, std::string &expr)
+   {
+      MObject oNode = mNode.object();
+      MFnDependencyNode nNode(oNode);
+      MStatus stat;
+      
+      MObject oAttr = nNode.attribute(MString(name.c_str()), &stat);
+      
+      if (stat != MS::kSuccess || !IsBoundAttribute(oAttr))
+      {
+         return false;
+      }
+      
+#if MAYA_API_VERSION >= 20190000
+      MDGContextGuard guard(mContext);
+#endif
+      
+      std::ostringstream oss;
+      
+      OutputAttribute(oNode, oAttr, oss, mCtx);
+      
+      expr = oss.str();
+      
+      return true;
+   }
+   
+   virtual void names(std::vector<std::string> &names)
+   {
+      MObject oNode = mNode.object();
+      
+      DynamicAttributeNames(oNode, names);
+   }
+   
+private:
+   
+   MObjectHandle mNode;
+   StreamContext &mCtx;
+#if MAYA_API_VERSION >= 20190000
+   MDGContext mContext;
+#endif
+};
+
+// Output comma separated values of the dynamic attributes, in DynamicAttributeNames order
+void OutputDynamicAttributes(MObject &node, std::ostringstream &oss, StreamContext &ctx)
+{
+   MFnDependencyNode nNode(node);
+   
+   unsigned int count = nNode.attributeCount();
+   size_t argument = 0;
+   
+   for (unsigned int i=0; i<count; ++i)
+   {
+      MObject oAttr = nNode.attribute(i);
+      MFnAttribute fnAttr(oAttr);
+      
+      if (!fnAttr.isDynamic())
+      {
+         continue;
+      }
+      
+      if (!IsBoundAttribute(oAttr))
+      {
+         if (ctx.verbose)
+         {
+            Log::Warning(node, "Unsupported type for attribute \"" + fnAttr.name()  + "\"");
+         }
+         continue;
+      }
+      
+      if (ctx.code && !ctx.code->isReferenced(argument))
+      {
+         oss << "None, ";
+         ++argument;
+         continue;
+      }
+      
+      if (ctx.linker)
+      {
+         MPlug plug(node, oAttr);
+         
+         if (!plug.isArray() && ctx.linker->link(plug, argument))
+         {
+            oss << "None, ";
+            ++argument;
+            continue;
+         }
+      }
+      
+      ++argument;
+      
+      OutputAttribute(node, oAttr, oss, ctx);
+      
+      oss << ", ";
+   }
+}
+
+// Wrap the expression body in a function taking the bound attributes as parameters
+// The function is compiled once and called on every evaluation (see PyEvalCode)
+MString DeclareFunction(const std::vector<std::string> &params, const MString &body)
+{
+   return MString(PyEvalDeclareFunction(params, body.asChar()).c_str());
+}
+
+// Time of the context being evaluated, falls back to the current time when
+//   the context is not timed
+MTime ContextTime()
+{
+#if MAYA_API_VERSION >= 20190000
+   MTime time;
+   
+   if (MDGContext::current().getTime(time) == MS::kSuccess)
+   {
+      return time;
+   }
+#endif
+   
+   return MAnimControl::currentTime();
+}
+
+// Python helpers shared by all nodes, declared once when the plugin is loaded
+static const char *PythonPrelude =
+   "import ctypes\n"
+   "\n"
+   "class _pyexpr_geometry(object):\n"
+   "  def __init__(self, type, **kwargs):\n"
+   "    self.type = type\n"
+   "    self.__dict__.update(kwargs)\n"
+   "  def __repr__(self):\n"
+   "    return '<pyexpr %s geometry, %d point(s)>' % (self.type, self.numPoints)\n"
+   "\n"
+   "def _pyexpr_buffer(ctype, addr, count, writable=False):\n"
+   "  # Wrap memory owned by the plugin without copying it, only valid during evaluation\n"
+   "  if count <= 0 or addr == 0:\n"
+   "    arr = (ctype * 0)()\n"
+   "  else:\n"
+   "    arr = (ctype * count).from_address(addr)\n"
+   "  try:\n"
+   "    buf = memoryview(arr).cast('B').cast(ctype._type_)\n"
+   "  except (AttributeError, TypeError):\n"
+   "    # No memoryview.cast (python 2), the ctypes array is indexable as is\n"
+   "    return arr\n"
+   "  if not writable and hasattr(buf, 'toreadonly'):\n"
+   "    buf = buf.toreadonly()\n"
+   "  return buf\n";
+
+// -----------------------------------------------------------------------------
+
+// Plugin wide settings, see PyExprSettingsCmd
+struct Settings
+{
+   static void Init();
+   
+   // Default evaluation time budget in milliseconds for nodes that don't set
+   //   their own, 0 for no limit
+   static double TimeBudget;
+   
+   // Compile all pyexpr nodes expressions once a scene is opened
+   static bool WarmUp;
+   
+   // Number of isolated interpreters evaluating nodes with isolated on
+   static int Interpreters;
+   
+   // Number of python processes evaluating nodes with outOfProcess on, and the
+   //   python executable they run (mayapy next to maya if empty)
+   static int Workers;
+   static MString WorkerPython;
+   
+   // Evaluate dirty upstream pyexpr nodes along with their consumers
+   static bool FuseChains;
+   
+   // Evaluate dirty pyexpr nodes sharing an expression function together
+   static bool BatchNodes;
+   
+   // Record evaluations of all nodes to the trace file, not only the ones with
+   //   recordTrace on (see pyexprSettings -traceFile)
+   static bool TraceAll;
+   
+   // Time in milliseconds pyexpr nodes may spend evaluating per frame during
+   //   interactive playback, 0 for no limit (see FrameScheduler)
+   static double FrameBudget;
+   
+   // Frames after which a node kept stale by the frame budget is evaluated
+   //   regardless, 0 to keep it stale until playback stops
+   static int MaxStaleFrames;
+};
+
+double Settings::TimeBudget = 0.0;
+bool Settings::WarmUp = true;
+int Settings::Interpreters = 0;
+int Settings::Workers = 0;
+MString Settings::WorkerPython;
+bool Settings::FuseChains = true;
+bool Settings::BatchNodes = true;
+bool Settings::TraceAll = false;
+double Settings::FrameBudget = 0.0;
+int Settings::MaxStaleFrames = 4;
+
+void Settings::Init()
+{
+   // Let render farms enforce a budget without changing the scenes
+   const char *timeBudget = getenv("PYEXPR_TIME_BUDGET");
+   
+   if (timeBudget)
+   {
+      TimeBudget = atof(timeBudget);
+   }
+   
+   const char *logFile = getenv("PYEXPR_LOG_FILE");
+   
+   if (logFile)
+   {
+      Log::SetFile(logFile);
+   }
+   
+   const char *interpreters = getenv("PYEXPR_INTERPRETERS");
+   
+   if (interpreters)
+   {
+      Interpreters = std::max(0, atoi(interpreters));
+   }
+   
+   const char *workers = getenv("PYEXPR_WORKERS");
+   
+   if (workers)
+   {
+      Workers = std::max(0, atoi(workers));
+   }
+   
+   const char *workerPython = getenv("PYEXPR_WORKER_PYTHON");
+   
+   if (workerPython)
+   {
+      WorkerPython = workerPython;
+   }
+}
+
+static void StartInterpreters()
+{
+   size_t count = PyEvalSetInterpreters(size_t(Settings::Interpreters));
+   
+   if (count < size_t(Settings::Interpreters))
+   {
+#ifdef PYEVAL_INTERPRETERS
+      MString msg = "[pyexpr] Only ";
+      msg += (unsigned int) count;
+      msg += " isolated interpreter(s) could be started";
+      MGlobal::displayWarning(msg);
+#else
+      MGlobal::displayWarning("[pyexpr] Isolated interpreters require python 3.12 or later");
+#endif
+   }
+}
+
+static void StartWorkers()
+{
+   std::string error;
+   
+   size_t count = PyEvalStartWorkers(size_t(Settings::Workers), Settings::WorkerPython.asChar(), error);
+   
+   if (count < size_t(Settings::Workers))
+   {
+      MString msg = "[pyexpr] Only ";
+      msg += (unsigned int) count;
+      msg += " worker process(es) could be started";
+      if (error.length() > 0)
+      {
+         msg += " (";
+         msg += error.c_str();
+         msg += ")";
+      }
+      MGlobal::displayWarning(msg);
+   }
+}
+
+// -----------------------------------------------------------------------------
+
+// Asynchronous evaluation state of a node, shared with the worker thread so
+//   that it remains valid if the node is deleted while an evaluation runs
+struct AsyncState
+{
+   AsyncState()
+      : queued(false)
+      , running(false)
+      , hasPending(false)
+      , hasResult(false)
+      , hasDelivered(false)
+   {
+   }
+   
+   std::mutex mutex;
+   bool queued;
+   bool running;
+   
+   // Latest request, replaced by newer ones until the worker picks it up
+   bool hasPending;
+   PyEvalRequest pending;
+   std::shared_ptr<StreamContext> pendingContext;
+   std::shared_ptr<StreamContext> runningContext;
+   
+   // Only accessed from the main thread, the node name is resolved when its
+   //   outputs get dirtied so that renaming it while it evaluates is fine
+   MObjectHandle node;
+   
+   // Output plugs, relative to the node, to dirty once a result is ready
+   std::vector<std::string> dirtyPlugs;
+   
+   // Latest completed result, not yet fetched by the node
+   bool hasResult;
+   PyEvalResult result;
+   
+   // Previous completed result, the outputs changed since are dirtied when
+   //   the next one completes (see AppendDirtyPlugs)
+   bool hasDelivered;
+   PyEvalResult delivered;
+};
+
+// Array output elements above which the whole array is dirtied
+static const size_t MaxDirtyElements = 1024;
+
+// Append the plug of an array output to plugs, or only the plugs of its
+//   elements whose value changed from previous when they are few enough
+template <typename T>
+static void AppendDirtyPlugs(std::vector<std::string> &plugs, const std::string &plug, const std::vector<T> *previous, const std::vector<T> &current)
+{
+   if (previous && previous->size() == current.size())
+   {
+      std::vector<size_t> changed;
+      
+      for (size_t i=0; i<current.size() && changed.size()<=MaxDirtyElements; ++i)
+      {
+         if (!((*previous)[i] == current[i]))
+         {
+            changed.push_back(i);
+         }
+      }
+      
+      if (changed.size() <= MaxDirtyElements && changed.size() * 4 <= current.size())
+      {
+         for (size_t i=0; i<changed.size(); ++i)
+         {
+            plugs.push_back(plug + "[" + std::to_string(changed[i]) + "]");
+         }
+         return;
+      }
+   }
+   
+   plugs.push_back(plug);
+}
+
+// Append the outputs of a node to dirty for result to plugs. Array outputs are
+//   diffed against the previous result, if any, so that only the connections
+//   of their changed elements are dirtied
+static void AppendDirtyPlugs(std::vector<std::string> &plugs, const PyEvalResult *previous, const PyEvalResult &result)
+{
+   if (previous && !(previous->succeeded && result.succeeded))
+   {
+      // Failed evaluations set empty arrays
+      previous = 0;
+   }
+   
+   plugs.push_back("outInt");
+   plugs.push_back("outDouble");
+   plugs.push_back("outString");
+   plugs.push_back("succeeded");
+   plugs.push_back("errorString");
+   plugs.push_back("stale");
+   
+   AppendDirtyPlugs(plugs, "outInts", (previous ? &previous->intArrayOutput : 0), result.intArrayOutput);
+   AppendDirtyPlugs(plugs, "outDoubles", (previous ? &previous->doubleArrayOutput : 0), result.doubleArrayOutput);
+   AppendDirtyPlugs(plugs, "outStrings", (previous ? &previous->stringArrayOutput : 0), result.stringArrayOutput);
+}
+
+// Single worker thread running the python step of asynchronous evaluations
+//   The GIL is only held while the request runs (see PyEvalRun)
+class AsyncEvaluator
+{
+public:
+   
+   static void Submit(const std::shared_ptr<AsyncState> &state, const PyEvalRequest &request,
+                      const std::shared_ptr<StreamContext> &ctx);
+   
+   static bool Fetch(const std::shared_ptr<AsyncState> &state, PyEvalResult &result);
+   
+   // The node outputs were set by another evaluation, the next result dirties
+   //   them all
+   static void Invalidate(const std::shared_ptr<AsyncState> &state);
+   
+   // Dirty the outputs of the nodes whose result is ready, from the main thread
+   static void Notify();
+   
+   static void Shutdown();
+   
+private:
+   
+   static void Run();
+   
+   static std::mutex msMutex;
+   static std::condition_variable msCond;
+   static std::deque<std::shared_ptr<AsyncState> > msQueue;
+   static std::thread msThread;
+   static bool msStop;
+   // States with a result ready, guarded by msMutex
+   static std::vector<std::shared_ptr<AsyncState> > msReady;
+};
+
+std::mutex AsyncEvaluator::msMutex;
+std::condition_variable AsyncEvaluator::msCond;
+std::deque<std::shared_ptr<AsyncState> > AsyncEvaluator::msQueue;
+std::thread AsyncEvaluator::msThread;
+bool AsyncEvaluator::msStop = false;
+std::vector<std::shared_ptr<AsyncState> > AsyncEvaluator::msReady;
+
+void AsyncEvaluator::Submit(const std::shared_ptr<AsyncState> &state, const PyEvalRequest &request,
+                            const std::shared_ptr<StreamContext> &ctx)
+{
+   bool enqueue = false;
+   
+   {
+      std::lock_guard<std::mutex> lock(state->mutex);
+      
+      // Coalesce with any request not yet started
+      state->hasPending = true;
+      state->pending = request;
+      state->pendingContext = ctx;
+      
+      if (!state->queued && !state->running)
+      {
+         state->queued = true;
+         enqueue = true;
+      }
+   }
+   
+   if (enqueue)
+   {
+      std::lock_guard<std::mutex> lock(msMutex);
+      
+      if (!msThread.joinable())
+      {
+         msStop = false;
+         msThread = std::thread(Run);
+      }
+      
+      msQueue.push_back(state);
+      msCond.notify_one();
+   }
+}
+
+bool AsyncEvaluator::Fetch(const std::shared_ptr<AsyncState> &state, PyEvalResult &result)
+{
+   std::lock_guard<std::mutex> lock(state->mutex);
+   
+   if (!state->hasResult)
+   {
+      return false;
+   }
+   
+   std::swap(result, state->result);
+   state->hasResult = false;
+   
+   return true;
+}
+
+void AsyncEvaluator::Invalidate(const std::shared_ptr<AsyncState> &state)
+{
+   std::lock_guard<std::mutex> lock(state->mutex);
+   
+   state->hasDelivered = false;
+}
+
+void AsyncEvaluator::Notify()
+{
+   std::vector<std::shared_ptr<AsyncState> > ready;
+   
+   {
+      std::lock_guard<std::mutex> lock(msMutex);
+      
+      std::swap(ready, msReady);
+   }
+   
+   for (size_t i=0; i<ready.size(); ++i)
+   {
+      std::vector<std::string> plugs;
+      
+      {
+         std::lock_guard<std::mutex> lock(ready[i]->mutex);
+         
+         std::swap(plugs, ready[i]->dirtyPlugs);
+      }
+      
+      if (!ready[i]->node.isAlive() || !ready[i]->node.isValid())
+      {
+         // Node deleted while it was evaluated
+         continue;
+      }
+      
+      MString name = MFnDependencyNode(ready[i]->node.object()).name();
+      
+      // Only outputs are dirtied so that the node doesn't schedule a new evaluation
+      MString cmd = "dgdirty";
+      
+      for (size_t j=0; j<plugs.size(); ++j)
+      {
+         cmd += " " + name + "." + plugs[j].c_str();
+      }
+      
+      MGlobal::executeCommand(cmd + ";");
+   }
+}
+
+void AsyncEvaluator::Shutdown()
+{
+   {
+      std::lock_guard<std::mutex> lock(msMutex);
+      msStop = true;
+      msQueue.clear();
+      msReady.clear();
+      msCond.notify_one();
+   }
+   
+   if (msThread.joinable())
+   {
+      // The worker may be waiting for the GIL
+      PyEvalAllowThreads allowThreads;
+      
+      msThread.join();
+   }
+}
+
+void AsyncEvaluator::Run()
+{
+   PyEvalTimelineThreadName("pyexpr async");
+   
+   while (true)
+   {
+      std::shared_ptr<AsyncState> state;
+      
+      {
+         std::unique_lock<std::mutex> lock(msMutex);
+         
+         while (!msStop && msQueue.empty())
+         {
+            msCond.wait(lock);
+         }
+         
+         if (msStop)
+         {
+            return;
+         }
+         
+         state = msQueue.front();
+         msQueue.pop_front();
+      }
+      
+      PyEvalRequest request;
+      bool notify = false;
+      
+      {
+         std::lock_guard<std::mutex> lock(state->mutex);
+         
+         request = state->pending;
+         state->runningContext = state->pendingContext;
+         state->pendingContext.reset();
+         state->hasPending = false;
+         state->queued = false;
+         state->running = true;
+      }
+      
+      PyEvalResult result;
+      
+      PyEvalRun(request, result);
+      
+      {
+         std::lock_guard<std::mutex> lock(state->mutex);
+         
+         // Plugs not dirtied yet are kept, along with the ones of this result
+         notify = state->dirtyPlugs.empty();
+         
+         AppendDirtyPlugs(state->dirtyPlugs, (state->hasDelivered ? &state->delivered : 0), result);
+         
+         state->delivered = result;
+         state->hasDelivered = true;
+         
+         std::swap(state->result, result);
+         state->hasResult = true;
+         state->running = false;
+         
+         // Release the arguments, geometry included, as soon as possible
+         state->runningContext.reset();
+         
+         if (state->hasPending)
+         {
+            // Requests received while running were coalesced into a single one
+            state->queued = true;
+            
+            std::lock_guard<std::mutex> qlock(msMutex);
+            msQueue.push_back(state);
+         }
+      }
+      
+      if (notify)
+      {
+         bool queue = false;
+         
+         {
+            std::lock_guard<std::mutex> lock(msMutex);
+            
+            queue = msReady.empty();
+            msReady.push_back(state);
+         }
+         
+         if (queue)
+         {
+            MGlobal::executeCommandOnIdle("if (`exists pyexprStats`) pyexprStats -notifyAsync;");
+         }
+      }
+   }
+}
+
+// -----------------------------------------------------------------------------
+
+// Run the teardown expression in scope namespace and release it
+static void Teardown(PyEvalScopePtr &scope, const MString &teardown, bool verbose)
+{
+   if (!scope)
+   {
+      return;
+   }
+   
+   if (teardown.length() > 0 && Py_IsInitialized())
+   {
+      PyEvalGIL gil;
+      
+      if (!scope->run(teardown.asChar(), verbose))
+      {
+         Log::Warning(MObject::kNullObj, "Teardown expression failed");
+      }
+   }
+   
+   scope.reset();
+}
+
+// Keep a node scope in sync with its setup expression, the previous scope is
+//   torn down when the setup changes. The setup itself is run on the first
+//   evaluation using the scope
+static PyEvalScopePtr UpdateScope(PyEvalScopePtr &scope, const MString &setup, const MString &teardown, bool verbose)
+{
+   if (scope && scope->setupSource() != setup.asChar())
+   {
+      Teardown(scope, teardown, verbose);
+   }
+   
+   if (!scope && setup.length() > 0)
+   {
+      scope.reset(new PyEvalScope(setup.asChar()));
+   }
+   
+   return scope;
+}
+
+// -----------------------------------------------------------------------------
+
+class PyExpr;
+
+// Per node evaluation cost and staleness, see FrameScheduler
+struct ScheduleState
+{
+   ScheduleState()
+      : cost(-1.0)
+      , stale(false)
+      , staleSince(0)
+      , refusedAt(0)
+   {
+   }
+   
+   // Moving average of the evaluation time in milliseconds, negative until the
+   //   node is first evaluated
+   double cost;
+   // Outputs hold the result of a previous evaluation
+   bool stale;
+   // Frame index at which the node became stale
+   unsigned long staleSince;
+   // Frame index at which the node last kept its result
+   unsigned long refusedAt;
+};
+
+// Keeps interactive playback real time: once the evaluations of a frame used
+//   up the frame budget (pyexprSettings -frameBudget), nodes keep their last
+//   result and set their stale output instead of evaluating. The stale nodes
+//   pulled in the previous frame get the budget first, oldest first, the other
+//   nodes only use what they leave. A node stale for Settings::MaxStaleFrames
+//   frames is evaluated regardless, and all stale nodes are refreshed, oldest
+//   first, once maya is idle and playback has stopped. Nodes aren't MP safe,
+//   their computes never run concurrently
+class FrameScheduler
+{
+public:
+   
+   // Returns false if the node should keep its last result
+   static bool Admit(PyExpr *node, ScheduleState &state);
+   // Whether evaluating a node ahead of it being pulled, along with others
+   //   costing pending ms, stays within the frame budget. Unlike Admit, the
+   //   node isn't flagged stale when it doesn't
+   static bool Fits(const ScheduleState &state, double pending);
+   // Record the evaluation of a node, ms being the time it took
+   static void Evaluated(PyExpr *node, ScheduleState &state, double ms);
+   static void Remove(PyExpr *node);
+   static inline size_t StaleCount() { return msStale.size(); }
+   // Dirty the outputs of the stale nodes so that they are evaluated again
+   static void Refresh();
+   
+private:
+   
+   // Whether the budget applies, starting a new frame when the time changed
+   static bool Budgeted();
+   // Budget kept for the stale nodes evaluated ahead of the node with state
+   static double Reserved(const ScheduleState &state);
+   
+   static double msFrame;
+   static unsigned long msFrameIndex;
+   static double msSpent;
+   static bool msRefreshQueued;
+   static std::map<PyExpr*, ScheduleState*> msStale;
+};
+
+double FrameScheduler::msFrame = 0.0;
+unsigned long FrameScheduler::msFrameIndex = 0;
+double FrameScheduler::msSpent = 0.0;
+bool FrameScheduler::msRefreshQueued = false;
+std::map<PyExpr*, ScheduleState*> FrameScheduler::msStale;
+
+bool FrameScheduler::Budgeted()
+{
+   // Renders and batch sessions always evaluate
+   if (Settings::FrameBudget <= 0.0 || MGlobal::mayaState() != MGlobal::kInteractive || !MAnimControl::isPlaying())
+   {
+      return false;
+   }
+   
+   double frame = MAnimControl::currentTime().as(MTime::uiUnit());
+   
+   if (frame != msFrame)
+   {
+      msFrame = frame;
+      msFrameIndex += 1;
+      msSpent = 0.0;
+   }
+   
+   return true;
+}
+
+double FrameScheduler::Reserved(const ScheduleState &state)
+{
+   std::vector<std::pair<unsigned long, ScheduleState*> > ahead;
+   
+   for (std::map<PyExpr*, ScheduleState*>::iterator it = msStale.begin(); it != msStale.end(); ++it)
+   {
+      ScheduleState *other = it->second;
+      
+      // Only nodes refused in the previous frame are expected to be pulled again,
+      //   those refused or evaluated in this one already were
+      if (other != &state && other->cost >= 0.0 && other->refusedAt + 1 == msFrameIndex &&
+          (!state.stale || other->staleSince < state.staleSince))
+      {
+         ahead.push_back(std::make_pair(other->staleSince, other));
+      }
+   }
+   
+   std::sort(ahead.begin(), ahead.end());
+   
+   double reserved = 0.0;
+   
+   for (size_t i=0; i<ahead.size(); ++i)
+   {
+      if (msSpent + reserved + ahead[i].second->cost > Settings::FrameBudget)
+      {
+         break;
+      }
+      
+      reserved += ahead[i].second->cost;
+   }
+   
+   return reserved;
+}
+
+bool FrameScheduler::Fits(const ScheduleState &state, double pending)
+{
+   if (!Budgeted())
+   {
+      return true;
+   }
+   
+   return (state.cost < 0.0 || msSpent + pending + Reserved(state) + state.cost <= Settings::FrameBudget);
+}
+
+bool FrameScheduler::Admit(PyExpr *node, ScheduleState &state)
+{
+   if (!Budgeted())
+   {
+      return true;
+   }
+   
+   if (state.cost < 0.0 || msSpent + Reserved(state) + state.cost <= Settings::FrameBudget ||
+       (state.stale && Settings::MaxStaleFrames > 0 && msFrameIndex - state.staleSince >= (unsigned long) Settings::MaxStaleFrames))
+   {
+      return true;
+   }
+   
+   state.refusedAt = msFrameIndex;
+   
+   if (!state.stale)
+   {
+      state.stale = true;
+      state.staleSince = msFrameIndex;
+      msStale[node] = &state;
+   }
+   
+   if (!msRefreshQueued)
+   {
+      msRefreshQueued = true;
+      MGlobal::executeCommandOnIdle("if (`exists pyexprStats`) pyexprStats -refreshStale;");
+   }
+   
+   return false;
+}
+
+void FrameScheduler::Evaluated(PyExpr *node, ScheduleState &state, double ms)
+{
+   state.cost = (state.cost < 0.0 ? ms : 0.7 * state.cost + 0.3 * ms);
+   
+   msSpent += ms;
+   
+   if (state.stale)
+   {
+      state.stale = false;
+      msStale.erase(node);
+   }
+}
+
+void FrameScheduler::Remove(PyExpr *node)
+{
+   msStale.erase(node);
+}
+
+// -----------------------------------------------------------------------------
+
+static void NodePreRemoval(MObject &node, void *clientData);
+
+class PyExpr : public MPxNode
+{
+public:
+   
+   static void *Create();
+   static MStatus Initialize();
+   
+   static MTypeId Id;
+   
+   static MObject aExpression;
+   static MObject aSetupExpression;
+   static MObject aTeardownExpression;
+   static MObject aOutputType;
+   static MObject aExpressionFile;
+   static MObject aEntryPoint;
+   static MObject aEvalOnTimeChanged;
+   static MObject aTime;
+   static MObject aVerbose;
+   static MObject aAsync;
+   static MObject aIsolated;
+   static MObject aOutOfProcess;
+   static MObject aRecordTrace;
+   static MObject aSampleOffsets;
+   static MObject aTimeBudget;
+   static MObject aLazyInputs;
+   static MObject aArrayLayout;
+   static MObject aHistorySize;
+   static MObject aHistoryGap;
+   static MObject aSaveHistory;
+   static MObject aHistoryData;
+   
+   static MObject aIntOutput;
+   static MObject aIntArrayOutput;
+   static MObject aDoubleOutput;
+   static MObject aDoubleArrayOutput;
+   static MObject aStringOutput;
+   static MObject aStringArrayOutput;
+   static MObject aSucceeded;
+   static MObject aErrorString;
+   static MObject aStale;
+   
+   enum OutputType
+   {
+      OT_int = 0,
+      OT_int_array,
+      OT_double,
+      OT_double_array,
+      OT_string,
+      OT_string_array,
+      OT_undefined
+   };
+   
+   // Evaluation results converted to maya types
+   struct Outputs
+   {
+      Outputs();
+      
+      bool succeeded;
+      MString errorString;
+      int intOutput;
+      MIntArray intArrayOutput;
+      double doubleOutput;
+      MDoubleArray doubleArrayOutput;
+      MString stringOutput;
+      MStringArray stringArrayOutput;
+   };
+   
+   // Evaluation parameters read from the node inputs in compute
+   struct EvalParams
+   {
+      MString expr;
+      MString setup;
+      MString teardown;
+      MString file;
+      MString entryPoint;
+      short outputType;
+      bool verbose;
+      bool async;
+      double timeBudget;
+      bool isolated;
+      bool worker;
+      bool trace;
+      bool lazyInputs;
+      short arrayLayout;
+      int historySize;
+      double historyGap;
+      MDoubleArray sampleOffsets;
+   };
+
+public:
+   
+   PyExpr();
+   virtual ~PyExpr();
+   
+   virtual MStatus setDependentsDirty(const MPlug &plug, MPlugArray &plugArray);
+   virtual MStatus compute(const MPlug &plug, MDataBlock &block);
+   virtual void postConstructor();
+   
+   virtual bool getInternalValueInContext(const MPlug &plug, MDataHandle &hdl, MDGContext &ctx);
+   virtual bool setInternalValueInContext(const MPlug &plug, const MDataHandle &hdl, MDGContext &ctx);
+   virtual void copyInternalData(MPxNode *other);
+   
+   // Expression function for the current expression and dynamic attributes
+   PyEvalCodePtr prepareCode();
+   
+   // Store the history in historyData if saveHistory is set
+   void storeHistory();
+   
+   // Run the teardown expression if the setup was run, see NodePreRemoval
+   void teardown();
+   
+   // Command dirtying the node outputs, without dirtying its inputs
+   MString notifyCommand();
+   
+   // Evaluate nodes at frames without changing the current time. values
+   //   receives the scalar output of each node at each frame, node major, NaN
+   //   for failed evaluations. Nodes whose output type isn't int or double
+   //   aren't evaluated, their indices are added to unsupported and their
+   //   values left NaN. Returns the number of failed evaluations (see
+   //   PyExprEvalBatchCmd)
+   static size_t EvalBatch(const std::vector<PyExpr*> &nodes, const std::vector<double> &frames, std::vector<double> &values, std::vector<size_t> &unsupported);
+   
+private:
+   
+   bool evalExpression(const EvalParams &params);
+   
+   // Connected pyexpr nodes evaluated at once, see appendChainStep
+   struct Chain
+   {
+      std::deque<StreamContext> contexts;
+      std::vector<PyEvalChainStep> steps;
+      std::vector<PyExpr*> nodes;
+      std::vector<PyExpr*> visiting;
+      // Time spent preparing each step request, in milliseconds
+      std::vector<double> costs;
+      // Expected cost of the nodes already in the chain (see FrameScheduler::Fits)
+      double pending;
+   };
+   
+   struct ChainLinker;
+   
+   // Both return the time spent evaluating other nodes, in milliseconds
+   double evalChain(const EvalParams &params);
+   double evalBatch(const PyEvalRequest &request, PyEvalResult &result, bool verbose);
+   size_t appendChainStep(const EvalParams &params, Chain &chain);
+   bool chainParams(EvalParams &params);
+   bool evalSamples(const EvalParams &params, const MDGContext &context, Outputs &outputs);
+   PyEvalCodePtr prepareCode(const EvalParams &params, bool verbose);
+   void setCode(const PyEvalCodePtr &code);
+   bool referencesInput(const MPlug &plug) const;
+   void prepareRequest(const EvalParams &params, StreamContext &ctx, PyEvalRequest &request);
+   static void SetOutputs(const PyEvalResult &result, Outputs &outputs);
+   
+private:
+   
+   bool mEval;
+   
+   Outputs mOutputs;
+   
+   struct Sample
+   {
+      Outputs outputs;
+      // Value of mSampleClock when last used
+      unsigned long used;
+   };
+   
+   // Results of evaluations in non normal contexts, by time (see SampleKey)
+   //   The least recently used ones are dropped past MaxSamples entries
+   std::map<long long, Sample> mSamples;
+   unsigned long mSampleClock;
+   MessageNameCache mMessageNames;
+   PackBuffers mPackBuffers;
+   PyEvalScopePtr mScope;
+   MString mTeardown;
+   MCallbackId mPreRemovalCB;
+   std::shared_ptr<struct AsyncState> mAsync;
+   PyEvalCodePtr mCode;
+   PyEvalHistoryPtr mHistory;
+   bool mHistoryLoaded;
+   ScheduleState mSchedule;
+   
+   // Nodes by expression function (see evalBatch)
+   static std::map<const PyEvalCode*, std::set<PyExpr*> > msPeers;
+};
+
+// -----------------------------------------------------------------------------
+
+void FrameScheduler::Refresh()
+{
+   msRefreshQueued = false;
+   
+   if (MAnimControl::isPlaying())
+   {
+      // Queued again when playback stops, see PlaybackChanged
+      return;
+   }
+   
+   std::vector<std::pair<unsigned long, PyExpr*> > nodes;
+   
+   for (std::map<PyExpr*, ScheduleState*>::iterator it = msStale.begin(); it != msStale.end(); ++it)
+   {
+      nodes.push_back(std::make_pair(it->second->staleSince, it->first));
+   }
+   
+   std::sort(nodes.begin(), nodes.end());
+   
+   // Nodes stay stale until they are evaluated
+   for (size_t i=0; i<nodes.size(); ++i)
+   {
+      MGlobal::executeCommand(nodes[i].second->notifyCommand());
+   }
+}
+
+static MCallbackId gPlaybackCB = 0;
+
+static void PlaybackChanged(bool playing, void *)
+{
+   if (!playing && FrameScheduler::StaleCount() > 0)
+   {
+      MGlobal::executeCommandOnIdle("if (`exists pyexprStats`) pyexprStats -refreshStale;");
+   }
+}
+
+// -----------------------------------------------------------------------------
+
+// Connect the node time input to the scene time, or disconnect it
+static MStatus ConnectTimeInput(MObject &node, bool connect)
+{
+   MPlug pTime(node, PyExpr::aTime);
+   MDGModifier dgmod;
+   
+   if (pTime.isDestination())
+   {
+      if (connect)
+      {
+         return MS::kSuccess;
+      }
+      
+      MPlugArray sources;
+      pTime.connectedTo(sources, true, false);
+      
+      for (unsigned int i=0; i<sources.length(); ++i)
+      {
+         dgmod.disconnect(sources[i], pTime);
+      }
+   }
+   else if (connect)
+   {
+      MItDependencyNodes it(MFn::kTime);
+      
+      if (it.isDone())
+      {
+         return MS::kFailure;
+      }
+      
+      MFnDependencyNode nTime(it.thisNode());
+      
+      dgmod.connect(nTime.findPlug("outTime"), pTime);
+   }
+   
+   return dgmod.doIt();
+}
+
+// Nodes with evalOnTimeChanged set in a scene being read, connected once it is
+//   loaded
+static std::vector<MObjectHandle> gPendingTimeInputs;
+
+static void ConnectPendingTimeInputs(void *)
+{
+   std::vector<MObjectHandle> pending;
+   
+   pending.swap(gPendingTimeInputs);
+   
+   for (size_t i=0; i<pending.size(); ++i)
+   {
+      if (pending[i].isValid())
+      {
+         MObject oNode = pending[i].object();
+         
+         if (ConnectTimeInput(oNode, true) != MS::kSuccess)
+         {
+            MGlobal::displayWarning("[pyexpr] Failed to connect time input of " + MFnDependencyNode(oNode).name());
+         }
+      }
+   }
+}
+
+// Store the history of pyexpr nodes with saveHistory set in the scene
+void StoreHistory(void *)
+{
+   MItDependencyNodes it(MFn::kPluginDependNode);
+   
+   for (; !it.isDone(); it.next())
+   {
+      MFnDependencyNode node(it.thisNode());
+      
+      if (node.typeId() == PyExpr::Id)
+      {
+         PyExpr *pyexpr = (PyExpr*) node.userNode();
+         
+         if (pyexpr)
+         {
+            pyexpr->storeHistory();
+         }
+      }
+   }
+}
+
+// Tracebacks of verbose evaluations share the rate limit of the other messages
+void LogPythonError(const std::string &message)
+{
+   Log::Error(MObject::kNullObj, MString(message.c_str()));
+}
+
+// Report the repeated messages even when nothing else is written, see Log::Flush
+void FlushLogRepeats(float, float, void *)
+{
+   if (Log::Repeating())
+   {
+      Log::Flush();
+   }
+}
+
+// Dirty the nodes calling into expression files saved since they were loaded,
+//   so that they update without waiting for another input to change
+void CheckModuleFiles(float, float, void *)
+{
+   std::vector<std::string> changed;
+   
+   if (PyEvalCheckModuleFiles(changed) == 0)
+   {
+      return;
+   }
+   
+   MString cmd;
+   
+   MItDependencyNodes it(MFn::kPluginDependNode);
+   
+   for (; !it.isDone(); it.next())
+   {
+      MObject oNode = it.thisNode();
+      MFnDependencyNode node(oNode);
+      
+      if (node.typeId() != PyExpr::Id)
+      {
+         continue;
+      }
+      
+      MString file = MPlug(oNode, PyExpr::aExpressionFile).asString();
+      
+      if (file.length() > 0 && std::find(changed.begin(), changed.end(), file.asChar()) != changed.end())
+      {
+         // The input is dirtied so that the node evaluates again
+         cmd += " " + node.name() + ".expressionFile";
+      }
+   }
+   
+   if (cmd.length() > 0)
+   {
+      MGlobal::executeCommand("dgdirty" + cmd + ";");
+   }
+}
+
+// Compile all pyexpr nodes expressions in a single interpreter session so that
+//   the first evaluated frame doesn't pay for it
+void WarmUp(void *)
+{
+   if (!Settings::WarmUp)
+   {
+      return;
+   }
+   
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+   
+   std::vector<PyEvalCodePtr> codes;
+   
+   MItDependencyNodes it(MFn::kPluginDependNode);
+   
+   for (; !it.isDone(); it.next())
+   {
+      MFnDependencyNode node(it.thisNode());
+      
+      if (node.typeId() == PyExpr::Id)
+      {
+         PyExpr *pyexpr = (PyExpr*) node.userNode();
+         
+         if (pyexpr)
+         {
+            codes.push_back(pyexpr->prepareCode());
+         }
+      }
+   }
+   
+   if (codes.size() == 0)
+   {
+      return;
+   }
+   
+   size_t failed = PyEvalCompile(codes, false);
+   
+   double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+   
+   MString msg = "[pyexpr] Compiled ";
+   msg += (unsigned int) codes.size();
+   msg += " expression(s) in ";
+   msg += ms;
+   msg += " ms";
+   
+   if (failed > 0)
+   {
+      msg += " (";
+      msg += (unsigned int) failed;
+      msg += " failed)";
+   }
+   
+   MGlobal::displayInfo(msg);
+}
+
+// -----------------------------------------------------------------------------
+
+MTypeId PyExpr::Id(PYEXPR_ID);
+MObject PyExpr::aExpression;
+MObject PyExpr::aSetupExpression;
+MObject PyExpr::aTeardownExpression;
+MObject PyExpr::aOutputType;
+MObject PyExpr::aExpressionFile;
+MObject PyExpr::aEntryPoint;
+std::map<const PyEvalCode*, std::set<PyExpr*> > PyExpr::msPeers;
+
+MObject PyExpr::aEvalOnTimeChanged;
+MObject PyExpr::aTime;
+MObject PyExpr::aVerbose;
+MObject PyExpr::aAsync;
+MObject PyExpr::aIsolated;
+MObject PyExpr::aOutOfProcess;
+MObject PyExpr::aRecordTrace;
+MObject PyExpr::aSampleOffsets;
+MObject PyExpr::aTimeBudget;
+MObject PyExpr::aLazyInputs;
+MObject PyExpr::aArrayLayout;
+MObject PyExpr::aHistorySize;
+MObject PyExpr::aHistoryGap;
+MObject PyExpr::aSaveHistory;
+MObject PyExpr::aHistoryData;
+MObject PyExpr::aIntOutput;
+MObject PyExpr::aIntArrayOutput;
+MObject PyExpr::aDoubleOutput;
+MObject PyExpr::aDoubleArrayOutput;
+MObject PyExpr::aStringOutput;
+MObject PyExpr::aStringArrayOutput;
+MObject PyExpr::aSucceeded;
+MObject PyExpr::aErrorString;
+MObject PyExpr::aStale;
+
+// -----------------------------------------------------------------------------
+
+void* PyExpr::Create()
+{
+   return new PyExpr();
+}
+
+MStatus PyExpr::Initialize()
+{
+   MStatus stat;
+   MFnTypedAttribute tattr;
+   MFnNumericAttribute nattr;
+   MFnUnitAttribute uattr;
+   MFnEnumAttribute eattr;
+   
+   // --- Inputs ---
+   
+   aExpression = tattr.create("expression", "expr", MFnData::kString, MObject::kNullObj, &stat);
+   addAttribute(aExpression);
+   
+   // Run once in the node namespace before the expression is first evaluated
+   aSetupExpression = tattr.create("setupExpression", "sexp", MFnData::kString, MObject::kNullObj, &stat);
+   addAttribute(aSetupExpression);
+   
+   // Run in the node namespace when the node is deleted or its setup changes
+   aTeardownExpression = tattr.create("teardownExpression", "texp", MFnData::kString, MObject::kNullObj, &stat);
+   addAttribute(aTeardownExpression);
+   
+   aOutputType = eattr.create("outputType", "outt", 4, &stat);
+   eattr.addField("int", OT_int);
+   eattr.addField("int[]", OT_int_array);
+   eattr.addField("double", OT_double);
+   eattr.addField("double[]", OT_double_array);
+   eattr.addField("string", OT_string);
+   eattr.addField("string[]", OT_string_array);
+   addAttribute(aOutputType);
+   
+   // Python file whose entryPoint function is called instead of the expression,
+   //   relative paths are searched in PYEXPR_MODULE_PATH
+   aExpressionFile = tattr.create("expressionFile", "exfl", MFnData::kString, MObject::kNullObj, &stat);
+   tattr.setUsedAsFilename(true);
+   addAttribute(aExpressionFile);
+   
+   // Function called with the inputs as keyword arguments, main if empty
+   aEntryPoint = tattr.create("entryPoint", "entp", MFnData::kString, MObject::kNullObj, &stat);
+   addAttribute(aEntryPoint);
+   
+   // Connects or disconnects the time input, the connection being saved instead
+   aEvalOnTimeChanged = nattr.create("evalOnTimeChanged", "evltc", MFnNumericData::kBoolean, 0.0, &stat);
+   nattr.setInternal(true);
+   nattr.setStorable(false);
+   addAttribute(aEvalOnTimeChanged);
+   
+   // Makes the node time dependent when connected to time1.outTime
+   aTime = uattr.create("inTime", "itim", MFnUnitAttribute::kTime, 0.0, &stat);
+   uattr.setHidden(true);
+   addAttribute(aTime);
+   
+   aVerbose = nattr.create("verbose", "verb", MFnNumericData::kBoolean, 0.0, &stat);
+   addAttribute(aVerbose);
+   
+   aAsync = nattr.create("asyncEval", "aevl", MFnNumericData::kBoolean, 0.0, &stat);
+   addAttribute(aAsync);
+   
+   // Only used when isolated interpreters are running (pyexprSettings -interpreters)
+   aIsolated = nattr.create("isolated", "isol", MFnNumericData::kBoolean, 0.0, &stat);
+   addAttribute(aIsolated);
+   
+   // Only used when worker processes are running (pyexprSettings -workers)
+   aOutOfProcess = nattr.create("outOfProcess", "oopr", MFnNumericData::kBoolean, 0.0, &stat);
+   addAttribute(aOutOfProcess);
+   
+   // Only used when a trace file is open (pyexprSettings -traceFile)
+   aRecordTrace = nattr.create("recordTrace", "rtrc", MFnNumericData::kBoolean, 0.0, &stat);
+   addAttribute(aRecordTrace);
+   
+   // Motion blur sample times, in frames relative to the nearest whole frame
+   aSampleOffsets = tattr.create("sampleOffsets", "smpo", MFnData::kDoubleArray, MObject::kNullObj, &stat);
+   addAttribute(aSampleOffsets);
+   
+   // 0 uses the plugin wide budget (pyexprSettings -timeBudget), negative disables it
+   aTimeBudget = nattr.create("timeBudget", "tbgt", MFnNumericData::kDouble, 0.0, &stat);
+   addAttribute(aTimeBudget);
+   
+   // Pass the inputs as a single object reading them when accessed
+   aLazyInputs = nattr.create("lazyInputs", "lzin", MFnNumericData::kBoolean, 0.0, &stat);
+   addAttribute(aLazyInputs);
+   
+   // Point, vector and matrix arrays are passed as lists of tuples, or packed
+   //   in flat buffers (planar passing x, y and z buffers)
+   aArrayLayout = eattr.create("arrayLayout", "arly", AL_tuples, &stat);
+   eattr.addField("tuples", AL_tuples);
+   eattr.addField("xyz", AL_xyz);
+   eattr.addField("xyzFloat", AL_xyz_float);
+   eattr.addField("planar", AL_planar);
+   addAttribute(aArrayLayout);
+   
+   // Number of past evaluations passed to the expression as history and prev,
+   //   0 to disable
+   aHistorySize = nattr.create("historySize", "hsz", MFnNumericData::kLong, 0, &stat);
+   nattr.setMin(0);
+   addAttribute(aHistorySize);
+   
+   // History is reset when time moves forward by more frames, 0 for no limit
+   aHistoryGap = nattr.create("historyGap", "hgap", MFnNumericData::kDouble, 1.0, &stat);
+   nattr.setMin(0.0);
+   addAttribute(aHistoryGap);
+   
+   // Store the history in historyData when the scene is saved
+   aSaveHistory = nattr.create("saveHistory", "svh", MFnNumericData::kBoolean, 0.0, &stat);
+   addAttribute(aSaveHistory);
+   
+   aHistoryData = tattr.create("historyData", "hdat", MFnData::kString, MObject::kNullObj, &stat);
+   tattr.setHidden(true);
+   addAttribute(aHistoryData);
+   
+   // --- Outputs ---
+   
+   aIntOutput = nattr.create("outInt", "oint", MFnNumericData::kLong, 0, &stat);
+   nattr.setWritable(false);
+   nattr.setStorable(false);
+   addAttribute(aIntOutput);
+   
+   aIntArrayOutput = nattr.create("outInts", "oins", MFnNumericData::kLong, 0, &stat);
+   nattr.setArray(true);
+   nattr.setWritable(false);
+   nattr.setStorable(false);
+   nattr.setUsesArrayDataBuilder(true);
+   addAttribute(aIntArrayOutput);
+   
+   aDoubleOutput = nattr.create("outDouble", "odbl", MFnNumericData::kDouble, 0, &stat);
+   nattr.setWritable(false);
+   nattr.setStorable(false);
+   addAttribute(aDoubleOutput);
+   
+   aDoubleArrayOutput = nattr.create("outDoubles", "odbs", MFnNumericData::kDouble, 0, &stat);
+   nattr.setArray(true);
+   nattr.setWritable(false);
+   nattr.setStorable(false);
+   nattr.setUsesArrayDataBuilder(true);
+   addAttribute(aDoubleArrayOutput);
+   
+   aStringOutput = tattr.create("outString", "ostr", MFnData::kString, MObject::kNullObj, &stat);
+   tattr.setWritable(false);
+   tattr.setStorable(false);
+   addAttribute(aStringOutput);
+   
+   aStringArrayOutput = tattr.create("outStrings", "osts", MFnData::kString, MObject::kNullObj, &stat);
+   tattr.setArray(true);
+   tattr.setWritable(false);
+   tattr.setStorable(false);
+   nattr.setUsesArrayDataBuilder(true);
+   addAttribute(aStringArrayOutput);
+   
+   aSucceeded = nattr.create("succeeded", "succ", MFnNumericData::kBoolean, 1.0, &stat);
+   nattr.setWritable(false);
+   nattr.setStorable(false);
+   addAttribute(aSucceeded);
+   
+   aErrorString = tattr.create("errorString", "errs", MFnData::kString, MObject::kNullObj, &stat);
+   tattr.setWritable(false);
+   tattr.setStorable(false);
+   addAttribute(aErrorString);
+   
+   // Set when the outputs hold a previous result, see pyexprSettings -frameBudget
+   aStale = nattr.create("stale", "stal", MFnNumericData::kBoolean, 0.0, &stat);
+   nattr.setWritable(false);
+   nattr.setStorable(false);
+   addAttribute(aStale);
+   
+   attributeAffects(aExpression, aIntOutput);
+   attributeAffects(aExpression, aIntArrayOutput);
+   attributeAffects(aExpression, aDoubleOutput);
+   attributeAffects(aExpression, aDoubleArrayOutput);
+   attributeAffects(aExpression, aStringOutput);
+   attributeAffects(aExpression, aStringArrayOutput);
+   attributeAffects(aExpression, aSucceeded);
+   attributeAffects(aExpression, aErrorString);
+   attributeAffects(aExpression, aStale);
+   
+   attributeAffects(aSetupExpression, aIntOutput);
+   attributeAffects(aSetupExpression, aIntArrayOutput);
+   attributeAffects(aSetupExpression, aDoubleOutput);
+   attributeAffects(aSetupExpression, aDoubleArrayOutput);
+   attributeAffects(aSetupExpression, aStringOutput);
+   attributeAffects(aSetupExpression, aStringArrayOutput);
+   attributeAffects(aSetupExpression, aSucceeded);
+   attributeAffects(aSetupExpression, aErrorString);
+   attributeAffects(aSetupExpression, aStale);
+   
+   attributeAffects(aOutputType, aIntOutput);
+   attributeAffects(aOutputType, aIntArrayOutput);
+   attributeAffects(aOutputType, aDoubleOutput);
+   attributeAffects(aOutputType, aDoubleArrayOutput);
+   attributeAffects(aOutputType, aStringOutput);
+   attributeAffects(aOutputType, aStringArrayOutput);
+   attributeAffects(aOutputType, aSucceeded);
+   attributeAffects(aOutputType, aErrorString);
+   attributeAffects(aOutputType, aStale);
+   
+   attributeAffects(aTime, aIntOutput);
+   attributeAffects(aTime, aIntArrayOutput);
+   attributeAffects(aTime, aDoubleOutput);
+   attributeAffects(aTime, aDoubleArrayOutput);
+   attributeAffects(aTime, aStringOutput);
+   attributeAffects(aTime, aStringArrayOutput);
+   attributeAffects(aTime, aSucceeded);
+   attributeAffects(aTime, aErrorString);
+   attributeAffects(aTime, aStale);
+   
+   attributeAffects(aLazyInputs, aIntOutput);
+   attributeAffects(aLazyInputs, aIntArrayOutput);
+   attributeAffects(aLazyInputs, aDoubleOutput);
+   attributeAffects(aLazyInputs, aDoubleArrayOutput);
+   attributeAffects(aLazyInputs, aStringOutput);
+   attributeAffects(aLazyInputs, aStringArrayOutput);
+   attributeAffects(aLazyInputs, aSucceeded);
+   attributeAffects(aLazyInputs, aErrorString);
+   attributeAffects(aLazyInputs, aStale);
+   
+   attributeAffects(aArrayLayout, aIntOutput);
+   attributeAffects(aArrayLayout, aIntArrayOutput);
+   attributeAffects(aArrayLayout, aDoubleOutput);
+   attributeAffects(aArrayLayout, aDoubleArrayOutput);
+   attributeAffects(aArrayLayout, aStringOutput);
+   attributeAffects(aArrayLayout, aStringArrayOutput);
+   attributeAffects(aArrayLayout, aSucceeded);
+   attributeAffects(aArrayLayout, aErrorString);
+   attributeAffects(aArrayLayout, aStale);
+   
+   attributeAffects(aHistorySize, aIntOutput);
+   attributeAffects(aHistorySize, aIntArrayOutput);
+   attributeAffects(aHistorySize, aDoubleOutput);
+   attributeAffects(aHistorySize, aDoubleArrayOutput);
+   attributeAffects(aHistorySize, aStringOutput);
+   attributeAffects(aHistorySize, aStringArrayOutput);
+   attributeAffects(aHistorySize, aSucceeded);
+   attributeAffects(aHistorySize, aErrorString);
+   attributeAffects(aHistorySize, aStale);
+   
+   attributeAffects(aExpressionFile, aIntOutput);
+   attributeAffects(aExpressionFile, aIntArrayOutput);
+   attributeAffects(aExpressionFile, aDoubleOutput);
+   attributeAffects(aExpressionFile, aDoubleArrayOutput);
+   attributeAffects(aExpressionFile, aStringOutput);
+   attributeAffects(aExpressionFile, aStringArrayOutput);
+   attributeAffects(aExpressionFile, aSucceeded);
+   attributeAffects(aExpressionFile, aErrorString);
+   attributeAffects(aExpressionFile, aStale);
+   
+   attributeAffects(aEntryPoint, aIntOutput);
+   attributeAffects(aEntryPoint, aIntArrayOutput);
+   attributeAffects(aEntryPoint, aDoubleOutput);
+   attributeAffects(aEntryPoint, aDoubleArrayOutput);
+   attributeAffects(aEntryPoint, aStringOutput);
+   attributeAffects(aEntryPoint, aStringArrayOutput);
+   attributeAffects(aEntryPoint, aSucceeded);
+   attributeAffects(aEntryPoint, aErrorString);
+   attributeAffects(aEntryPoint, aStale);
+   
+   return MS::kSuccess;
+}
+
+// -----------------------------------------------------------------------------
+
+PyExpr::Outputs::Outputs()
+   : succeeded(false)
+   , intOutput(0)
+   , doubleOutput(0.0)
+{
+}
+
+PyExpr::PyExpr()
+   : MPxNode()
+   , mEval(true)
+   , mSampleClock(0)
+   , mPreRemovalCB(0)
+   , mAsync(new AsyncState())
+   , mHistory(new PyEvalHistory())
+   , mHistoryLoaded(false)
+{
+}
+
+PyExpr::~PyExpr()
+{
+   MMessage::removeCallback(mPreRemovalCB);
+   
+   FrameScheduler::Remove(this);
+   
+   setCode(PyEvalCodePtr());
+   
+   Teardown(mScope, mTeardown, false);
+}
+
+void PyExpr::postConstructor()
+{
+   setMPSafe(false);
+   
+   MObject oSelf = thisMObject();
+   
+   mPreRemovalCB = MNodeMessage::addNodePreRemovalCallback(oSelf, NodePreRemoval, (void*)this);
+   
+   mAsync->node = MObjectHandle(oSelf);
+}
+
+void PyExpr::teardown()
+{
+   MObject oSelf = thisMObject();
+   
+   mTeardown = MPlug(oSelf, aTeardownExpression).asString();
+   
+   // If the deletion is undone, the setup is run again on next evaluation
+   Teardown(mScope, mTeardown, MPlug(oSelf, aVerbose).asBool());
+}
+
+MStatus PyExpr::setDependentsDirty(const MPlug &plug, MPlugArray &affectedPlugs)
+{
+   PyEvalSpan span("dirty");
+   
+   if (span.active())
+   {
+      span.setArg(plug.name().asChar());
+   }
+   
+   MObject oAttr = plug.attribute();
+   
+   MFnAttribute fnAttr(oAttr);
+   
+   if (fnAttr.isDynamic())
+   {
+      if (!referencesInput(plug))
+      {
+         // Changing an input the expression doesn't use won't change its result
+         return MS::kSuccess;
+      }
+      
+      MObject oNode = thisMObject();
+      
+      MDataBlock block = forceCache();
+      
+      MDataHandle hOutputType = block.outputValue(aOutputType);
+      
+      switch (hOutputType.asShort())
+      {
+      case OT_int_array:
+         {
+            MPlug pIntArrayOutput(oNode, aIntArrayOutput);
+            affectedPlugs.append(pIntArrayOutput);
+            
+            unsigned int n = pIntArrayOutput.numElements();
+            for (unsigned int i=0; i<n; ++i)
+            {
+               MPlug pIntArrayElem = pIntArrayOutput.elementByPhysicalIndex(i);
+               affectedPlugs.append(pIntArrayElem);
+            }
+         }
+         break;
+      case OT_double_array:
          {
-            short v0, v1, v2;
-            fnData.getData(v0, v1, v2);
-            oss << "(" << v0 << ", " << v1 << ", " << v2 << ")";
+            MPlug pDoubleArrayOutput(oNode, aDoubleArrayOutput);
+            affectedPlugs.append(pDoubleArrayOutput);
+            
+            unsigned int n = pDoubleArrayOutput.numElements();
+            for (unsigned int i=0; i<n; ++i)
+            {
+               MPlug pDoubleArrayElem = pDoubleArrayOutput.elementByPhysicalIndex(i);
+               affectedPlugs.append(pDoubleArrayElem);
+            }
          }
          break;
-         
-      case MFnNumericData::kLong:
-      //case MFnNumericData::kInt:
-         oss << plug.asInt();
+      case OT_string_array:
+         {
+            MPlug pStringArrayOutput(oNode, aStringArrayOutput);
+            affectedPlugs.append(pStringArrayOutput);
+            
+            unsigned int n = pStringArrayOutput.numElements();
+            for (unsigned int i=0; i<n; ++i)
+            {
+               MPlug pStringArrayElem = pStringArrayOutput.elementByPhysicalIndex(i);
+               affectedPlugs.append(pStringArrayElem);
+            }
+         }
          break;
-         
-      case MFnNumericData::k2Long:
-      //case MFnNumericData::k2Int:
+      case OT_int:
          {
-            int v0, v1;
-            fnData.getData(v0, v1);
-            oss << "(" << v0 << ", " << v1 << ")";
+            MPlug pIntOutput(oNode, aIntOutput);
+            affectedPlugs.append(pIntOutput);
          }
          break;
-      case MFnNumericData::k3Long:
-      //case MFnNumericData::k3Int:
+      case OT_double:
+         {
+            MPlug pDoubleOutput(oNode, aDoubleOutput);
+            affectedPlugs.append(pDoubleOutput);
+         }
+         break;
+      case OT_string:
+      default:
+         {
+            MPlug pStringOutput(oNode, aStringOutput);
+            affectedPlugs.append(pStringOutput);
+         }
+         break;
+      }
+      
+      MPlug pSucceeded(oNode, aSucceeded);
+      affectedPlugs.append(pSucceeded);
+      
+      MPlug pStale(oNode, aStale);
+      affectedPlugs.append(pStale);
+      
+      mEval = true;
+      mSamples.clear();
+   }
+   else if (oAttr == aExpression || oAttr == aSetupExpression || oAttr == aOutputType || oAttr == aTime || oAttr == aHistorySize || oAttr == aLazyInputs ||
+            oAttr == aExpressionFile || oAttr == aEntryPoint || oAttr == aArrayLayout)
+   {
+      if (oAttr != aTime && mHistory)
+      {
+         // Past results of another expression are meaningless
+         PyEvalGIL gil;
+         mHistory->clear();
+      }
+      
+      mEval = true;
+      mSamples.clear();
+   }
+   else if (oAttr == aSampleOffsets)
+   {
+      mSamples.clear();
+   }
+   
+   return MS::kSuccess;
+}
+
+bool PyExpr::getInternalValueInContext(const MPlug &plug, MDataHandle &hdl, MDGContext &ctx)
+{
+   if (plug == aEvalOnTimeChanged)
+   {
+      hdl.set(MPlug(thisMObject(), aTime).isDestination());
+      return true;
+   }
+   else
+   {
+      return MPxNode::getInternalValueInContext(plug, hdl, ctx);
+   }
+}
+
+bool PyExpr::setInternalValueInContext(const MPlug &plug, const MDataHandle &hdl, MDGContext &ctx)
+{
+   if (plug == aEvalOnTimeChanged)
+   {
+      MObject oSelf = thisMObject();
+      
+      if (MFileIO::isReadingFile())
+      {
+         // Scenes saved before the time input, connected once loaded
+         if (hdl.asBool())
+         {
+            gPendingTimeInputs.push_back(MObjectHandle(oSelf));
+         }
+         
+         return true;
+      }
+      
+      return (ConnectTimeInput(oSelf, hdl.asBool()) == MS::kSuccess);
+   }
+   else
+   {
+      return MPxNode::setInternalValueInContext(plug, hdl, ctx);
+   }  
+}
+
+void PyExpr::copyInternalData(MPxNode *other)
+{
+   PyExpr *rhs = (PyExpr*) other;
+   
+   rhs->mEval = mEval;
+   rhs->mOutputs = mOutputs;
+}
+
+PyEvalCodePtr PyExpr::prepareCode(const EvalParams &params, bool verbose)
+{
+   MObject oSelf = thisMObject();
+   
+   std::vector<std::string> names;
+   
+   if (params.lazyInputs)
+   {
+      names.push_back("inputs");
+   }
+   else
+   {
+      DynamicAttributeNames(oSelf, names);
+   }
+   
+   if (params.historySize > 0)
+   {
+      const char *historyNames[] = {"history", "prev"};
+      
+      for (size_t i=0; i<2; ++i)
+      {
+         if (std::find(names.begin(), names.end(), historyNames[i]) != names.end())
+         {
+            // The history argument would shadow the attribute, fail every
+            //   evaluation until either is renamed
+            std::string message = std::string("attribute '") + historyNames[i] + "' clashes with the history argument of the same name, rename it or set historySize to 0";
+            std::vector<std::string> args(1, "*_pyexpr_args");
+            std::string source = DeclareFunction(args, MString(("raise NameError(\"" + message + "\")").c_str())).asChar();
+            
+            names.push_back("history");
+            names.push_back("prev");
+            
+            if (!mCode || !mCode->matches(source, names))
+            {
+               Log::Error(oSelf, MString(message.c_str()));
+               
+               setCode(PyEvalGetCode(source, names));
+            }
+            
+            return mCode;
+         }
+      }
+      
+      names.push_back("history");
+      names.push_back("prev");
+   }
+   
+   if (params.file.length() > 0)
+   {
+      // Module code is shared by all the nodes calling the same function with
+      //   the same inputs
+      PyEvalCodePtr code = PyEvalGetModuleCode(params.file.asChar(), (params.entryPoint.length() > 0 ? params.entryPoint.asChar() : "main"), names);
+      
+      if (code != mCode)
+      {
+         if (verbose)
          {
-            int v0, v1, v2;
-            fnData.getData(v0, v1, v2);
-            oss << "(" << v0 << ", " << v1 << ", " << v2 << ")";
+            Log::Info(oSelf, "Declare function:\n" + MString(code->source().c_str()));
          }
-         break;
          
-      case MFnNumericData::kFloat:
-         oss << plug.asFloat();
-         break;
+         setCode(code);
+      }
+      
+      return mCode;
+   }
+   
+   const MString &expr = params.expr;
+   
+   std::string source = DeclareFunction(names, expr).asChar();
+   
+   if (!mCode || !mCode->matches(source, names))
+   {
+      if (verbose)
+      {
+         Log::Info(thisMObject(), "Declare function:\n" + MString(source.c_str()));
+      }
+      
+      setCode(PyEvalGetCode(source, names));
+   }
+   
+   return mCode;
+}
+
+void PyExpr::setCode(const PyEvalCodePtr &code)
+{
+   if (mCode)
+   {
+      std::map<const PyEvalCode*, std::set<PyExpr*> >::iterator it = msPeers.find(mCode.get());
+      
+      if (it != msPeers.end())
+      {
+         it->second.erase(this);
          
-      case MFnNumericData::k2Float:
+         if (it->second.empty())
          {
-            float v0, v1;
-            fnData.getData(v0, v1);
-            oss << "(" << v0 << ", " << v1 << ")";
+            msPeers.erase(it);
          }
-         break;
-         
-      case MFnNumericData::k3Float:
+      }
+   }
+   
+   mCode = code;
+   
+   if (mCode)
+   {
+      msPeers[mCode.get()].insert(this);
+   }
+}
+
+// An attribute is used if the expression references its parameter, or the
+//   parameter of any of its parents or children (compound attributes)
+static bool IsReferencedAttribute(const PyEvalCode &code, MObject &node, const MObject &oAttr, bool parents, bool children)
+{
+   if (code.isReferenced(MPlug(node, oAttr).partialName(false, false, false, false, false, true).asChar()))
+   {
+      return true;
+   }
+   
+   MFnAttribute fnAttr(oAttr);
+   
+   if (parents)
+   {
+      MObject oParent = fnAttr.parent();
+      
+      if (!oParent.isNull() && IsReferencedAttribute(code, node, oParent, true, false))
+      {
+         return true;
+      }
+   }
+   
+   if (children && oAttr.hasFn(MFn::kCompoundAttribute))
+   {
+      MFnCompoundAttribute fnCompound(oAttr);
+      
+      for (unsigned int i=0; i<fnCompound.numChildren(); ++i)
+      {
+         if (IsReferencedAttribute(code, node, fnCompound.child(i), false, true))
          {
-            float v0, v1, v2;
-            fnData.getData(v0, v1, v2);
-            oss << "(" << v0 << ", " << v1 << ", " << v2 << ")";
+            return true;
          }
-         break;
-         
-      case MFnNumericData::kDouble:
-         oss << plug.asDouble();
-         break;
+      }
+   }
+   
+   return false;
+}
+
+bool PyExpr::referencesInput(const MPlug &plug) const
+{
+   if (!mCode || mCode->isDynamic())
+   {
+      return true;
+   }
+   
+   MObject oNode = const_cast<PyExpr*>(this)->thisMObject();
+   
+   return IsReferencedAttribute(*mCode, oNode, plug.attribute(), true, true);
+}
+
+PyEvalCodePtr PyExpr::prepareCode()
+{
+   EvalParams params;
+   
+   chainParams(params);
+   
+   return prepareCode(params, false);
+}
+
+void PyExpr::storeHistory()
+{
+   MObject oSelf = thisMObject();
+   
+   MPlug pHistoryData(oSelf, aHistoryData);
+   
+   std::string data;
+   
+   if (MPlug(oSelf, aSaveHistory).asBool())
+   {
+      PyEvalGIL gil;
+      data = mHistory->save();
+   }
+   
+   if (data != pHistoryData.asString().asChar())
+   {
+      pHistoryData.setValue(MString(data.c_str()));
+   }
+}
+
+void PyExpr::prepareRequest(const EvalParams &params, StreamContext &ctx, PyEvalRequest &request)
+{
+   short outputType = params.outputType;
+   
+   MObject oSelf = thisMObject();
+   
+   request.code = prepareCode(params, ctx.verbose);
+   
+   // Only marshal the inputs the expression uses
+   PyEvalAnalyse(request.code);
+   ctx.code = request.code.get();
+   
+   std::ostringstream oss;
+   
+   {
+      PyEvalSpan span("marshal");
+      
+      oss << "(";
+      if (params.lazyInputs)
+      {
+         // Replaced by the inputs object, see PyEvalInputs
+         oss << "None, ";
+         request.inputs = PyEvalInputsPtr(new LazyInputs(oSelf, ctx));
+      }
+      else
+      {
+         OutputDynamicAttributes(oSelf, oss, ctx);
+      }
+      if (params.historySize > 0)
+      {
+         // Replaced by history and prev, see PyEvalHistory
+         oss << "None, None, ";
+      }
+      oss << ")";
+   }
+   
+   if (params.historySize > 0 && (request.code->isReferenced("history") || request.code->isReferenced("prev")))
+   {
+      if (!mHistoryLoaded)
+      {
+         // History saved with the scene, for batch renders
+         MString data = MPlug(oSelf, aHistoryData).asString();
          
-      case MFnNumericData::k2Double:
+         if (data.length() > 0 && MPlug(oSelf, aSaveHistory).asBool())
          {
-            double v0, v1;
-            fnData.getData(v0, v1);
-            oss << "(" << v0 << ", " << v1 << ")";
+            PyEvalGIL gil;
+            
+            if (!mHistory->load(data.asChar()))
+            {
+               Log::Warning(oSelf, "Could not load saved history");
+            }
          }
-         break;
          
-      case MFnNumericData::k3Double:
+         mHistoryLoaded = true;
+      }
+      
+      request.history = mHistory;
+      request.historySize = size_t(params.historySize);
+      request.historyGap = params.historyGap;
+      request.time = ContextTime().as(MTime::uiUnit());
+   }
+   
+   if (outputType < OT_int || outputType > OT_string_array)
+   {
+      if (ctx.verbose)
+      {
+         Log::Warning(oSelf, "Default output type to 'string'");
+      }
+      outputType = OT_string;
+   }
+   
+   request.scope = UpdateScope(mScope, params.setup, params.teardown, ctx.verbose);
+   mTeardown = params.teardown;
+   request.args = oss.str();
+   request.outputType = outputType;
+   request.verbose = ctx.verbose;
+   request.timeBudget = (params.timeBudget == 0.0 ? Settings::TimeBudget : params.timeBudget);
+   request.trace = (params.trace || Settings::TraceAll);
+   
+   if (request.timeBudget < 0.0)
+   {
+      request.timeBudget = 0.0;
+   }
+   
+   // maya modules are only usable from the main interpreter, as are the history
+   //   and the modules loaded from expression files
+   bool usesMaya = (request.code->imports("maya") || request.code->imports("pymel"));
+   
+   request.isolated = (params.isolated && !request.history && !request.inputs && !request.code->isModule() && !usesMaya);
+   
+#if PY_VERSION_HEX < 0x030D0000
+   // Array and geometry inputs are wrapped using ctypes, which can't be imported
+   //   in isolated interpreters before python 3.13
+   if (ctx.geometry.length() > 0 || ctx.ints.size() > 0 || ctx.doubles.size() > 0)
+   {
+      request.isolated = false;
+   }
+#endif
+   
+   // Worker processes don't run maya either, nor share the main interpreter
+   //   state used by scopes
+   request.worker = (params.worker && !request.scope && !request.history && !request.inputs && !request.code->isModule() && !usesMaya);
+}
+
+void PyExpr::SetOutputs(const PyEvalResult &result, Outputs &outputs)
+{
+   PyEvalSpan span("writeback");
+   
+   outputs.succeeded = result.succeeded;
+   outputs.errorString = result.errorString.c_str();
+   outputs.intOutput = result.intOutput;
+   outputs.doubleOutput = result.doubleOutput;
+   outputs.stringOutput = result.stringOutput.c_str();
+   
+   outputs.intArrayOutput.setLength((unsigned int) result.intArrayOutput.size());
+   for (unsigned int i=0; i<outputs.intArrayOutput.length(); ++i)
+   {
+      outputs.intArrayOutput[i] = result.intArrayOutput[i];
+   }
+   
+   outputs.doubleArrayOutput.setLength((unsigned int) result.doubleArrayOutput.size());
+   for (unsigned int i=0; i<outputs.doubleArrayOutput.length(); ++i)
+   {
+      outputs.doubleArrayOutput[i] = result.doubleArrayOutput[i];
+   }
+   
+   outputs.stringArrayOutput.setLength((unsigned int) result.stringArrayOutput.size());
+   for (unsigned int i=0; i<outputs.stringArrayOutput.length(); ++i)
+   {
+      outputs.stringArrayOutput[i] = result.stringArrayOutput[i].c_str();
+   }
+}
+
+MString PyExpr::notifyCommand()
+{
+   MString name = MFnDependencyNode(thisMObject()).name();
+   
+   // Only outputs are dirtied so that the node doesn't schedule a new evaluation
+   return "if (`objExists " + name + "`) dgdirty " +
+          name + ".outInt " + name + ".outInts " + name + ".outDouble " + name + ".outDoubles " +
+          name + ".outString " + name + ".outStrings " + name + ".succeeded " + name + ".errorString " + name + ".stale;";
+}
+
+bool PyExpr::evalExpression(const EvalParams &params)
+{
+   if (mEval && !params.async && !FrameScheduler::Admit(this, mSchedule))
+   {
+      // Over the frame budget, mEval is kept so that it is evaluated later
+      return mOutputs.succeeded;
+   }
+   
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+   
+   if (mEval && !params.async && !params.isolated && !params.worker && Settings::FuseChains)
+   {
+      double others = evalChain(params);
+      
+      mEval = false;
+      
+      FrameScheduler::Evaluated(this, mSchedule, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() - others);
+   }
+   else if (mEval)
+   {
+      std::shared_ptr<StreamContext> ctx(new StreamContext(params.verbose, &mMessageNames, &mPackBuffers, params.arrayLayout));
+      PyEvalRequest request;
+      
+      prepareRequest(params, *ctx, request);
+      
+      if (params.async)
+      {
+         AsyncEvaluator::Submit(mAsync, request, ctx);
+      }
+      else
+      {
+         if (params.verbose)
          {
-            double v0, v1, v2;
-            fnData.getData(v0, v1, v2);
-            oss << "(" << v0 << ", " << v1 << ", " << v2 << ")";
+            Log::Info(thisMObject(), "Evaluating expression");
          }
-         break;
          
-      case MFnNumericData::k4Double:
-         {
-            double v0, v1, v2, v3;
-            fnData.getData(v0, v1, v2, v3);
-            oss << "(" << v0 << ", " << v1 << ", " << v2 << ", " << v3 << ")";
-         }
+         PyEvalResult result;
+         
+         double others = evalBatch(request, result, params.verbose);
+         
+         SetOutputs(result, mOutputs);
+         AsyncEvaluator::Invalidate(mAsync);
+         
+         FrameScheduler::Evaluated(this, mSchedule, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() - others);
+      }
+      
+      mEval = false;
+   }
+   
+   if (params.async)
+   {
+      PyEvalResult result;
+      
+      if (AsyncEvaluator::Fetch(mAsync, result))
+      {
+         SetOutputs(result, mOutputs);
+      }
+   }
+   
+   return mOutputs.succeeded;
+}
+
+// Type of the python value passed for plug, when its input can be linked
+static short LinkType(const MPlug &plug)
+{
+   MObject oAttr = plug.attribute();
+   
+   if (oAttr.hasFn(MFn::kNumericAttribute))
+   {
+      MFnNumericAttribute fnAttr(oAttr);
+      
+      switch (fnAttr.unitType())
+      {
+      case MFnNumericData::kByte:
+      case MFnNumericData::kShort:
+      case MFnNumericData::kLong:
+         return PyEval_int;
+      case MFnNumericData::kFloat:
+      case MFnNumericData::kDouble:
+         return PyEval_double;
+      default:
          break;
+      }
+   }
+   else if (oAttr.hasFn(MFn::kTypedAttribute))
+   {
+      MFnTypedAttribute fnAttr(oAttr);
+      
+      if (fnAttr.attrType() == MFnData::kString)
+      {
+         return PyEval_string;
+      }
+   }
+   
+   return -1;
+}
+
+// Links inputs driven by the scalar output of a pyexpr node that needs to be
+//   evaluated, adding that node to the chain
+struct PyExpr::ChainLinker : public StreamLinker
+{
+   ChainLinker(Chain &c)
+      : chain(c)
+   {
+   }
+   
+   virtual bool link(MPlug &plug, size_t argument)
+   {
+      MPlugArray srcs;
+      
+      if (!plug.connectedTo(srcs, true, false) || srcs.length() != 1)
+      {
+         return false;
+      }
+      
+      MObject oSrc = srcs[0].node();
+      MFnDependencyNode nSrc(oSrc);
+      
+      if (nSrc.typeId() != PyExpr::Id)
+      {
+         return false;
+      }
+      
+      PyExpr *upstream = (PyExpr*) nSrc.userNode();
+      
+      // Already evaluated upstream nodes just return their outputs, as do the
+      //   ones kept stale by the frame budget
+      if (!upstream || !upstream->mEval || upstream->mSchedule.stale ||
+          std::find(chain.visiting.begin(), chain.visiting.end(), upstream) != chain.visiting.end())
+      {
+         return false;
+      }
+      
+      MObject oOutput = srcs[0].attribute();
+      
+      short outputType = (oOutput == aIntOutput ? OT_int :
+                          (oOutput == aDoubleOutput ? OT_double :
+                           (oOutput == aStringOutput ? OT_string : OT_undefined)));
+      
+      short type = LinkType(plug);
+      
+      if (outputType == OT_undefined || (type != outputType && !(type == OT_double && outputType == OT_int)))
+      {
+         return false;
+      }
+      
+      PyEvalLink link;
+      
+      link.argument = argument;
+      link.type = type;
+      
+      std::vector<PyExpr*>::iterator it = std::find(chain.nodes.begin(), chain.nodes.end(), upstream);
+      
+      if (it != chain.nodes.end())
+      {
+         link.step = size_t(it - chain.nodes.begin());
+      }
+      else
+      {
+         EvalParams params;
          
-      default:
-         if (verbose)
+         // Upstream nodes over the frame budget are pulled on their own, and
+         //   admitted or kept stale by the scheduler
+         if (!FrameScheduler::Fits(upstream->mSchedule, chain.pending) ||
+             !upstream->chainParams(params) || params.outputType != outputType)
          {
-            MGlobal::displayWarning("[pyexpr] Unsupported numeric type for attribute \"" + fnAttr.name() + "\"");
+            return false;
          }
+         
+         chain.pending += std::max(0.0, upstream->mSchedule.cost);
+         
+         link.step = upstream->appendChainStep(params, chain);
       }
+      
+      links.push_back(link);
+      
+      return true;
    }
+   
+   Chain &chain;
+   std::vector<PyEvalLink> links;
 };
 
-template <> struct ToStream<MFnTypedAttribute>
+// Evaluate this node along with the dirty pyexpr nodes driving its inputs,
+//   entering python once. Intermediate values are passed to the expressions
+//   directly, and the upstream nodes outputs are set so that their compute
+//   is just a lookup. Only the upstream nodes that fit in the frame budget are
+//   linked, and each is charged its own share of the time
+double PyExpr::evalChain(const EvalParams &params)
 {
-   static void OutputSingle(MPlug &plug, std::ostringstream &oss, bool verbose)
+   PyEvalSpan span("chain");
+   
+   Chain chain;
+   
+   chain.pending = std::max(0.0, mSchedule.cost);
+   
+   appendChainStep(params, chain);
+   
+   std::vector<PyEvalResult> results;
+   double others = 0.0;
+   
+   if (params.verbose)
    {
-      MFnTypedAttribute fnAttr(plug.attribute());
+      MString msg = "Evaluating expression";
       
-      switch (fnAttr.attrType())
+      if (chain.steps.size() > 1)
       {
-      case MFnData::kNumeric:
-         {
-            ToStream<MFnNumericAttribute>::OutputSingle(plug, oss, verbose);
-         }
-         break;
-         
-      case MFnData::kString:
-         oss << "'" << plug.asString().asChar() << "'";
-         break;
-         
-      case MFnData::kMatrix:
-         {
-            MObject oData = plug.asMObject();
-            MFnMatrixData fnData(oData);
-            
-            MMatrix M = fnData.matrix();
-            
-            oss << "((" << M[0][0] << ", " << M[0][1] << ", " << M[0][2] << ", " << M[0][3] << "),";
-            oss << " (" << M[1][0] << ", " << M[1][1] << ", " << M[1][2] << ", " << M[1][3] << "),";
-            oss << " (" << M[2][0] << ", " << M[2][1] << ", " << M[2][2] << ", " << M[2][3] << "),";
-            oss << " (" << M[3][0] << ", " << M[3][1] << ", " << M[3][2] << ", " << M[3][3] << "))";
-         }
-         break;
-         
-      case MFnData::kStringArray:
+         msg += " with ";
+         msg += (unsigned int) (chain.steps.size() - 1);
+         msg += " upstream pyexpr node(s)";
+      }
+      
+      Log::Info(thisMObject(), msg);
+   }
+   
+   if (chain.steps.size() == 1)
+   {
+      results.resize(1);
+      others = evalBatch(chain.steps[0].request, results[0], params.verbose);
+   }
+   else
+   {
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      
+      PyEvalRunChain(chain.steps, results);
+      
+      double share = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / double(chain.nodes.size());
+      
+      // The evaluated node is last, after the steps it depends on
+      for (size_t i=0; i+1<chain.nodes.size(); ++i)
+      {
+         FrameScheduler::Evaluated(chain.nodes[i], chain.nodes[i]->mSchedule, chain.costs[i] + share);
+         others += chain.costs[i] + share;
+      }
+   }
+   
+   for (size_t i=0; i<chain.nodes.size(); ++i)
+   {
+      SetOutputs(results[i], chain.nodes[i]->mOutputs);
+      AsyncEvaluator::Invalidate(chain.nodes[i]->mAsync);
+      chain.nodes[i]->mEval = false;
+   }
+   
+   return others;
+}
+
+// Evaluate request along with the other dirty nodes sharing its expression
+//   function, in a single interpreter session. Their outputs are set for when
+//   they get pulled. Only the peers that fit in the frame budget are evaluated,
+//   and each is charged its own share of the time
+double PyExpr::evalBatch(const PyEvalRequest &request, PyEvalResult &result, bool verbose)
+{
+   std::vector<PyExpr*> peers;
+   
+   if (Settings::BatchNodes && request.code && !request.scope)
+   {
+      std::map<const PyEvalCode*, std::set<PyExpr*> >::iterator it = msPeers.find(request.code.get());
+      
+      if (it != msPeers.end())
+      {
+         for (std::set<PyExpr*>::iterator pit = it->second.begin(); pit != it->second.end(); ++pit)
          {
-            MObject oData = plug.asMObject();
-            MFnStringArrayData fnData(oData);
-            
-            unsigned int count = fnData.length();
-            
-            oss << "[";
-            
-            for (unsigned int i=0; i<count; ++i)
+            if (*pit != this && (*pit)->mEval)
             {
-               oss << "'" << fnData[i].asChar() << "'";
-               
-               if (i + 1 < count)
-               {
-                  oss << ", ";
-               }
+               peers.push_back(*pit);
             }
-            
-            oss << "]";
          }
-         break;
-         
-      case MFnData::kDoubleArray:
+      }
+   }
+   
+   if (peers.empty())
+   {
+      PyEvalRun(request, result);
+      return 0.0;
+   }
+   
+   // Contexts hold the data referenced by the requests arguments
+   std::deque<StreamContext> contexts;
+   std::vector<PyEvalRequest> requests(1, request);
+   std::vector<PyExpr*> nodes(1, this);
+   std::vector<double> costs(1, 0.0);
+   
+   double pending = std::max(0.0, mSchedule.cost);
+   
+   for (size_t i=0; i<peers.size(); ++i)
+   {
+      PyExpr *peer = peers[i];
+      EvalParams params;
+      
+      // Reading the inputs of a peer may have evaluated the following ones, or
+      //   changed their expression. Stale peers are only refreshed when pulled,
+      //   as are the ones over the frame budget
+      if (!peer->mEval || peer->mSchedule.stale || !FrameScheduler::Fits(peer->mSchedule, pending))
+      {
+         continue;
+      }
+      
+      // Out of process peers are batched so that they spread over the workers
+      if ((!peer->chainParams(params) && (params.async || !params.worker)) || peer->prepareCode(params, false) != request.code)
+      {
+         continue;
+      }
+      
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      
+      contexts.push_back(StreamContext(params.verbose, &(peer->mMessageNames), &(peer->mPackBuffers), params.arrayLayout));
+      
+      PyEvalRequest peerRequest;
+      
+      peer->prepareRequest(params, contexts.back(), peerRequest);
+      
+      requests.push_back(peerRequest);
+      nodes.push_back(peer);
+      costs.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+      
+      pending += std::max(0.0, peer->mSchedule.cost);
+   }
+   
+   if (verbose && nodes.size() > 1)
+   {
+      MString msg = "Evaluating expression with ";
+      msg += (unsigned int) (nodes.size() - 1);
+      msg += " other node(s) sharing it";
+      Log::Info(thisMObject(), msg);
+   }
+   
+   std::vector<PyEvalResult> results;
+   
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+   
+   PyEvalRunBatch(requests, results);
+   
+   double share = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / double(nodes.size());
+   double others = 0.0;
+   
+   std::swap(result, results[0]);
+   
+   for (size_t i=1; i<nodes.size(); ++i)
+   {
+      SetOutputs(results[i], nodes[i]->mOutputs);
+      AsyncEvaluator::Invalidate(nodes[i]->mAsync);
+      nodes[i]->mEval = false;
+      
+      FrameScheduler::Evaluated(nodes[i], nodes[i]->mSchedule, costs[i] + share);
+      others += costs[i] + share;
+   }
+   
+   return others;
+}
+
+// Steps are appended after the ones they depend on
+size_t PyExpr::appendChainStep(const EvalParams &params, Chain &chain)
+{
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+   
+   ChainLinker linker(chain);
+   
+   size_t first = chain.steps.size();
+   
+   chain.contexts.push_back(StreamContext(params.verbose, &mMessageNames, &mPackBuffers, params.arrayLayout));
+   
+   StreamContext &ctx = chain.contexts.back();
+   
+   // Deep chains are cut, the remaining nodes are evaluated on their own
+   ctx.linker = (chain.visiting.size() < 32 ? &linker : 0);
+   
+   PyEvalChainStep step;
+   
+   chain.visiting.push_back(this);
+   
+   prepareRequest(params, ctx, step.request);
+   
+   chain.visiting.pop_back();
+   
+   ctx.linker = 0;
+   
+   step.links = linker.links;
+   
+   // Steps appended while reading the inputs are charged their own time
+   double cost = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+   
+   for (size_t i=first; i<chain.costs.size(); ++i)
+   {
+      cost -= chain.costs[i];
+   }
+   
+   chain.steps.push_back(step);
+   chain.nodes.push_back(this);
+   chain.costs.push_back(std::max(0.0, cost));
+   
+   return (chain.steps.size() - 1);
+}
+
+// Evaluation parameters of an upstream node, read from its plugs
+// Returns false if the node can't be part of a chain
+bool PyExpr::chainParams(EvalParams &params)
+{
+   MObject oSelf = thisMObject();
+   
+   params.lazyInputs = MPlug(oSelf, aLazyInputs).asBool();
+   params.arrayLayout = MPlug(oSelf, aArrayLayout).asShort();
+   // Inputs are read from the node while the expression runs
+   params.async = (MPlug(oSelf, aAsync).asBool() && !params.lazyInputs);
+   params.isolated = (MPlug(oSelf, aIsolated).asBool() && !params.lazyInputs);
+   params.worker = (MPlug(oSelf, aOutOfProcess).asBool() && !params.lazyInputs);
+   params.file = MPlug(oSelf, aExpressionFile).asString();
+   params.entryPoint = MPlug(oSelf, aEntryPoint).asString();
+   params.expr = MPlug(oSelf, aExpression).asString();
+   params.setup = MPlug(oSelf, aSetupExpression).asString();
+   params.teardown = MPlug(oSelf, aTeardownExpression).asString();
+   params.outputType = MPlug(oSelf, aOutputType).asShort();
+   params.verbose = MPlug(oSelf, aVerbose).asBool();
+   params.timeBudget = MPlug(oSelf, aTimeBudget).asDouble();
+   params.trace = MPlug(oSelf, aRecordTrace).asBool();
+   params.historySize = MPlug(oSelf, aHistorySize).asInt();
+   params.historyGap = MPlug(oSelf, aHistoryGap).asDouble();
+   
+   return !(params.async || params.isolated || params.worker);
+}
+
+// Sample times are compared at a fixed precision
+static long long SampleKey(double frame)
+{
+   return (long long) floor(frame * 10000.0 + 0.5);
+}
+
+// Context evaluations cached per node, enough for the motion samples of a few
+//   frames. Exporting a frame range goes through them one frame at a time
+static const size_t MaxSamples = 64;
+
+bool PyExpr::evalSamples(const EvalParams &params, const MDGContext &context, Outputs &outputs)
+{
+   PyEvalSpan span("samples");
+   
+   MTime time;
+   
+   if (context.getTime(time) != MS::kSuccess)
+   {
+      return false;
+   }
+   
+   double frame = time.as(MTime::uiUnit());
+   long long key = SampleKey(frame);
+   
+   std::map<long long, Sample>::iterator it = mSamples.find(key);
+   
+   if (it == mSamples.end())
+   {
+      // When the requested time is one of the motion samples around the nearest
+      //   frame, all of them are evaluated at once and cached for the following
+      //   requests (renderers query them one after the other)
+      std::vector<double> frames;
+      
+#if MAYA_API_VERSION >= 20190000
+      double base = floor(frame + 0.5);
+      
+      for (unsigned int i=0; i<params.sampleOffsets.length(); ++i)
+      {
+         if (SampleKey(base + params.sampleOffsets[i]) == key)
          {
-            MObject oData = plug.asMObject();
-            MFnDoubleArrayData fnData(oData);
-            
-            unsigned int count = fnData.length();
-            
-            oss << "[";
-            
-            for (unsigned int i=0; i<count; ++i)
+            for (unsigned int j=0; j<params.sampleOffsets.length(); ++j)
             {
-               oss << fnData[i];
-               
-               if (i + 1 < count)
-               {
-                  oss << ", ";
-               }
+               frames.push_back(base + params.sampleOffsets[j]);
             }
-            
-            oss << "]";
+            break;
          }
-         break;
+      }
+#endif
+      
+      if (frames.size() == 0)
+      {
+         frames.push_back(frame);
+      }
+      
+      std::vector<StreamContext> contexts(frames.size(), StreamContext(params.verbose, &mMessageNames, &mPackBuffers, params.arrayLayout));
+      std::vector<PyEvalRequest> requests(frames.size());
+      std::vector<PyEvalResult> results;
+      
+      for (size_t i=0; i<frames.size(); ++i)
+      {
+#if MAYA_API_VERSION >= 20190000
+         // Inputs are read through plugs, in the current context
+         MDGContext sampleContext(MTime(frames[i], MTime::uiUnit()));
+         MDGContextGuard guard(sampleContext);
+#endif
+         prepareRequest(params, contexts[i], requests[i]);
          
-      case MFnData::kIntArray:
+         // Samples around a frame don't belong to its history
+         requests[i].history.reset();
+      }
+      
+      if (params.verbose)
+      {
+         MString msg = "Evaluating expression for ";
+         msg += (unsigned int) frames.size();
+         msg += " sample(s)";
+         Log::Info(thisMObject(), msg);
+      }
+      
+      PyEvalRunAll(requests, results);
+      
+      ++mSampleClock;
+      
+      for (size_t i=0; i<frames.size(); ++i)
+      {
+         Sample &sample = mSamples[SampleKey(frames[i])];
+         
+         SetOutputs(results[i], sample.outputs);
+         sample.used = mSampleClock;
+      }
+      
+      // The samples just evaluated are the most recently used ones
+      while (mSamples.size() > std::max(MaxSamples, frames.size()))
+      {
+         std::map<long long, Sample>::iterator oldest = mSamples.begin();
+         
+         for (std::map<long long, Sample>::iterator sit = mSamples.begin(); sit != mSamples.end(); ++sit)
          {
-            MObject oData = plug.asMObject();
-            MFnIntArrayData fnData(oData);
-            
-            unsigned int count = fnData.length();
-            
-            oss << "[";
-            
-            for (unsigned int i=0; i<count; ++i)
+            if (sit->second.used < oldest->second.used)
             {
-               oss << fnData[i];
-               
-               if (i + 1 < count)
-               {
-                  oss << ", ";
-               }
+               oldest = sit;
             }
-            
-            oss << "]";
          }
-         break;
          
-      case MFnData::kPointArray:
+         mSamples.erase(oldest);
+      }
+      
+      it = mSamples.find(key);
+   }
+   else
+   {
+      it->second.used = ++mSampleClock;
+   }
+   
+   outputs = it->second.outputs;
+   
+   return outputs.succeeded;
+}
+
+size_t PyExpr::EvalBatch(const std::vector<PyExpr*> &nodes, const std::vector<double> &frames, std::vector<double> &values, std::vector<size_t> &unsupported)
+{
+   PyEvalSpan span("evalBatch");
+   
+   values.assign(nodes.size() * frames.size(), std::numeric_limits<double>::quiet_NaN());
+   
+   size_t failed = 0;
+   
+#if MAYA_API_VERSION >= 20190000
+   std::vector<EvalParams> params(nodes.size());
+   std::vector<std::pair<size_t, size_t> > poolSizes(nodes.size());
+   std::vector<bool> scalar(nodes.size());
+   
+   for (size_t i=0; i<nodes.size(); ++i)
+   {
+      nodes[i]->chainParams(params[i]);
+      
+      scalar[i] = (params[i].outputType == OT_int || params[i].outputType == OT_double);
+      
+      if (!scalar[i])
+      {
+         unsupported.push_back(i);
+      }
+      
+      poolSizes[i] = std::make_pair(nodes[i]->mPackBuffers.doubles.size(), nodes[i]->mPackBuffers.floats.size());
+   }
+   
+   // Frames are evaluated in blocks to bound the memory held by the arguments
+   const size_t blockSize = 64;
+   
+   for (size_t first=0; first<frames.size(); first+=blockSize)
+   {
+      size_t last = std::min(frames.size(), first + blockSize);
+      
+      std::deque<StreamContext> contexts;
+      std::vector<PyEvalRequest> requests;
+      std::vector<PyEvalResult> results;
+      std::vector<size_t> cells;
+      
+      for (size_t f=first; f<last; ++f)
+      {
+         // Inputs are read through plugs, in the current context
+         MDGContext context(MTime(frames[f], MTime::uiUnit()));
+         MDGContextGuard guard(context);
+         
+         for (size_t i=0; i<nodes.size(); ++i)
          {
-            MObject oData = plug.asMObject();
-            MFnPointArrayData fnData(oData);
+            if (!scalar[i])
+            {
+               continue;
+            }
             
-            unsigned int count = fnData.length();
+            PyExpr *node = nodes[i];
             
-            oss << "[";
+            contexts.push_back(StreamContext(params[i].verbose, &(node->mMessageNames), &(node->mPackBuffers), params[i].arrayLayout));
             
-            for (unsigned int i=0; i<count; ++i)
-            {
-               MPoint pnt = fnData[i];
-               
-               oss << "(" << pnt.x << ", " << pnt.y << ", " << pnt.z << ")";
-               
-               if (i + 1 < count)
-               {
-                  oss << ", ";
-               }
-            }
+            PyEvalRequest request;
             
-            oss << "]";
-         }
-         break;
-         
-      case MFnData::kVectorArray:
-         {
-            MObject oData = plug.asMObject();
-            MFnVectorArrayData fnData(oData);
+            node->prepareRequest(params[i], contexts.back(), request);
             
-            unsigned int count = fnData.length();
+            // Exported frames don't belong to the history
+            request.history.reset();
             
-            oss << "[";
+            cells.push_back(i * frames.size() + f);
+            requests.push_back(request);
+            results.push_back(PyEvalResult());
             
-            for (unsigned int i=0; i<count; ++i)
+            if (request.inputs)
             {
-               MVector vec = fnData[i];
-               
-               oss << "(" << vec.x << ", " << vec.y << ", " << vec.z << ")";
-               
-               if (i + 1 < count)
-               {
-                  oss << ", ";
-               }
+               // Lazy inputs are read while evaluating, in this context
+               PyEvalRun(requests.back(), results.back());
+               requests.back().code.reset();
             }
-            
-            oss << "]";
          }
-         break;
+      }
+      
+      // Requests sharing an expression are evaluated in one batch
+      std::vector<std::pair<const PyEvalCode*, size_t> > order;
+      
+      for (size_t i=0; i<requests.size(); ++i)
+      {
+         if (requests[i].code)
+         {
+            order.push_back(std::make_pair(requests[i].code.get(), i));
+         }
+      }
+      
+      std::sort(order.begin(), order.end());
+      
+      for (size_t begin=0; begin<order.size();)
+      {
+         size_t end = begin + 1;
          
-      default:
-         if (verbose)
+         while (end < order.size() && order[end].first == order[begin].first)
+         {
+            ++end;
+         }
+         
+         std::vector<PyEvalRequest> group;
+         std::vector<PyEvalResult> groupResults;
+         
+         for (size_t i=begin; i<end; ++i)
+         {
+            group.push_back(requests[order[i].second]);
+         }
+         
+         PyEvalRunBatch(group, groupResults);
+         
+         for (size_t i=begin; i<end; ++i)
+         {
+            std::swap(results[order[i].second], groupResults[i - begin]);
+         }
+         
+         begin = end;
+      }
+      
+      for (size_t i=0; i<results.size(); ++i)
+      {
+         const PyEvalResult &result = results[i];
+         short outputType = params[cells[i] / frames.size()].outputType;
+         
+         if (result.succeeded && outputType == OT_int)
+         {
+            values[cells[i]] = double(result.intOutput);
+         }
+         else if (result.succeeded && outputType == OT_double)
          {
-            MGlobal::displayWarning("[pyexpr] Unsupported type for attribute \"" + fnAttr.name() + "\"");
+            values[cells[i]] = result.doubleOutput;
+         }
+         else
+         {
+            ++failed;
          }
       }
    }
-};
+   
+   // A block holds the buffers of all its frames, node pools go back to what
+   //   a single evaluation needs
+   for (size_t i=0; i<nodes.size(); ++i)
+   {
+      nodes[i]->mPackBuffers.doubles.trim(poolSizes[i].first);
+      nodes[i]->mPackBuffers.floats.trim(poolSizes[i].second);
+   }
+#else
+   failed = values.size();
+#endif
+   
+   return failed;
+}
 
-template <typename FnAttribute>
-void Output(MObject &node, MObject &attr, std::ostringstream &oss, bool verbose)
+static bool HasValue(const MDataHandle &hdl, int value)
 {
-   MPlug plug(node, attr);
-            
-   oss << plug.partialName(false, false, false, false, false, true).asChar() << " = ";
+   return (hdl.asInt() == value);
+}
+
+static bool HasValue(const MDataHandle &hdl, double value)
+{
+   return (hdl.asDouble() == value);
+}
+
+static bool HasValue(const MDataHandle &hdl, const MString &value)
+{
+   return (hdl.asString() == value);
+}
+
+// Set the first count values to the elements of an array output. When it has
+//   as many elements already, they are updated in place and only the ones
+//   whose value changed are written
+template <typename Array>
+static void SetArrayOutput(MDataBlock &block, const MObject &attr, const Array &values, unsigned int count)
+{
+   MArrayDataHandle hArray = block.outputArrayValue(attr);
    
-   if (plug.isArray())
+   bool inPlace = (count > 0 && hArray.elementCount() == count);
+   
+   for (unsigned int i=0; inPlace && i<count; ++i)
    {
-      unsigned int count = plug.numElements();
+      // Elements are always added at logical indices [0, count)
+      inPlace = (hArray.jumpToArrayElement(i) == MS::kSuccess && hArray.elementIndex() == i);
       
-      oss << "[";
+      if (inPlace)
+      {
+         MDataHandle hElem = hArray.outputValue();
+         
+         if (!HasValue(hElem, values[i]))
+         {
+            hElem.set(values[i]);
+         }
+      }
+   }
+   
+   if (!inPlace)
+   {
+      MArrayDataBuilder builder(&block, attr, count);
       
       for (unsigned int i=0; i<count; ++i)
       {
-         MPlug elem = plug[i];
-         
-         ToStream<FnAttribute>::OutputSingle(elem, oss, verbose);
-         
-         if (i + 1 < count)
+         MDataHandle hElem = builder.addElement(i);
+         hElem.set(values[i]);
+      }
+      
+      hArray.set(builder);
+   }
+   
+   hArray.setAllClean();
+}
+
+MStatus PyExpr::compute(const MPlug &plug, MDataBlock &block)
+{
+   PyEvalSpan span("compute");
+   
+   if (span.active())
+   {
+      span.setArg(plug.name().asChar());
+   }
+   
+   MDataHandle hExpression = block.inputValue(aExpression);
+   MDataHandle hSetupExpression = block.inputValue(aSetupExpression);
+   MDataHandle hTeardownExpression = block.inputValue(aTeardownExpression);
+   MDataHandle hOutputType = block.inputValue(aOutputType);
+   MDataHandle hVerbose = block.inputValue(aVerbose);
+   MDataHandle hAsync = block.inputValue(aAsync);
+   MDataHandle hTimeBudget = block.inputValue(aTimeBudget);
+   MDataHandle hIsolated = block.inputValue(aIsolated);
+   MDataHandle hRecordTrace = block.inputValue(aRecordTrace);
+   
+   // Only pulled so that the node is clean again for the current time
+   block.inputValue(aTime);
+   
+   EvalParams params;
+   
+   params.expr = hExpression.asString();
+   params.setup = hSetupExpression.asString();
+   params.teardown = hTeardownExpression.asString();
+   params.verbose = hVerbose.asBool();
+   params.lazyInputs = block.inputValue(aLazyInputs).asBool();
+   params.arrayLayout = block.inputValue(aArrayLayout).asShort();
+   // Inputs are read from the node while the expression runs
+   params.async = (hAsync.asBool() && !params.lazyInputs);
+   params.timeBudget = hTimeBudget.asDouble();
+   params.isolated = (hIsolated.asBool() && !params.lazyInputs);
+   params.worker = (block.inputValue(aOutOfProcess).asBool() && !params.lazyInputs);
+   params.trace = hRecordTrace.asBool();
+   params.historySize = block.inputValue(aHistorySize).asInt();
+   params.historyGap = block.inputValue(aHistoryGap).asDouble();
+   params.file = block.inputValue(aExpressionFile).asString();
+   params.entryPoint = block.inputValue(aEntryPoint).asString();
+   params.outputType = hOutputType.asShort();
+   
+   bool verbose = params.verbose;
+   short outputType = params.outputType;
+   
+   bool success = false;
+   
+   const MDGContext &context = block.context();
+   
+   Outputs sampleOutputs;
+   
+   if (context.isNormal())
+   {
+      success = evalExpression(params);
+   }
+   else
+   {
+      MDataHandle hSampleOffsets = block.inputValue(aSampleOffsets);
+      MObject oSampleOffsets = hSampleOffsets.data();
+      
+      if (!oSampleOffsets.isNull())
+      {
+         MFnDoubleArrayData sampleOffsetsData(oSampleOffsets);
+         params.sampleOffsets = sampleOffsetsData.array();
+      }
+      
+      success = evalSamples(params, context, sampleOutputs);
+   }
+   
+   const Outputs &outputs = (context.isNormal() ? mOutputs : sampleOutputs);
+   
+   PyEvalSpan outputsSpan("outputs");
+   
+   if (plug.attribute() == aIntOutput)
+   {
+      if (outputType != OT_int)
+      {
+         success = false;
+      }
+      
+      MDataHandle hIntOutput = block.outputValue(aIntOutput);
+      hIntOutput.set(success ? outputs.intOutput : 0);
+      
+      block.setClean(plug);
+      
+      return MS::kSuccess;
+   }
+   else if (plug.attribute() == aDoubleOutput)
+   {
+      if (outputType != OT_double)
+      {
+         if (verbose)
          {
-            oss << ", ";
+            Log::Warning(thisMObject(), "Querying wrong output type");
+         }
+         success = false;
+      }
+      
+      MDataHandle hDoubleOutput = block.outputValue(aDoubleOutput);
+      hDoubleOutput.set(success ? outputs.doubleOutput : 0.0);
+      
+      block.setClean(plug);
+      
+      return MS::kSuccess;
+   }
+   else if (plug.attribute() == aStringOutput)
+   {
+      if (outputType != OT_string)
+      {
+         if (verbose)
+         {
+            Log::Warning(thisMObject(), "Querying wrong output type");
+         }
+         success = false;
+      }
+      
+      MDataHandle hStringOutput = block.outputValue(aStringOutput);
+      hStringOutput.set(success ? outputs.stringOutput : "");
+      
+      block.setClean(plug);
+      
+      return MS::kSuccess;
+   }
+   else if (plug.attribute() == aIntArrayOutput)
+   {
+      if (outputType != OT_int_array)
+      {
+         if (verbose)
+         {
+            Log::Warning(thisMObject(), "Querying wrong output type");
+         }
+         success = false;
+      }
+      
+      SetArrayOutput(block, aIntArrayOutput, outputs.intArrayOutput, (success ? outputs.intArrayOutput.length() : 0));
+      
+      return MS::kSuccess;
+   }
+   else if (plug.attribute() == aDoubleArrayOutput)
+   {
+      if (outputType != OT_double_array)
+      {
+         if (verbose)
+         {
+            Log::Warning(thisMObject(), "Querying wrong output type");
+         }
+         success = false;
+      }
+      
+      SetArrayOutput(block, aDoubleArrayOutput, outputs.doubleArrayOutput, (success ? outputs.doubleArrayOutput.length() : 0));
+      
+      return MS::kSuccess;
+   }
+   else if (plug.attribute() == aStringArrayOutput)
+   {
+      if (outputType != OT_string_array)
+      {
+         if (verbose)
+         {
+            Log::Warning(thisMObject(), "Querying wrong output type");
          }
+         success = false;
       }
       
-      oss << "]" << std::endl;
+      SetArrayOutput(block, aStringArrayOutput, outputs.stringArrayOutput, (success ? outputs.stringArrayOutput.length() : 0));
+      
+      return MS::kSuccess;
+   }
+   else if (plug.attribute() == aSucceeded)
+   {
+      MDataHandle hSucceeded = block.outputValue(aSucceeded);
+      
+      hSucceeded.set(success);
+      
+      block.setClean(plug);
+      
+      return MS::kSuccess;
+   }
+   else if (plug.attribute() == aErrorString)
+   {
+      MDataHandle hErrorString = block.outputValue(aErrorString);
+      
+      hErrorString.set(outputs.errorString);
+      
+      block.setClean(plug);
+      
+      return MS::kSuccess;
+   }
+   else if (plug.attribute() == aStale)
+   {
+      MDataHandle hStale = block.outputValue(aStale);
+      
+      hStale.set(context.isNormal() && mSchedule.stale);
+      
+      block.setClean(plug);
+      
+      return MS::kSuccess;
    }
    else
    {
-      ToStream<FnAttribute>::OutputSingle(plug, oss, verbose);
-      oss << std::endl;
+      return MS::kUnknownParameter;
    }
 }
 
 // -----------------------------------------------------------------------------
 
-class PyExpr : public MPxNode
+// Deformer variant: the expression gets the whole point buffer at once and
+//   either modifies 'points' in place or returns the displaced points
+class PyExprDeformer : public MPxDeformerNode
 {
 public:
-   
+
    static void *Create();
    static MStatus Initialize();
    
    static MTypeId Id;
    
    static MObject aExpression;
-   static MObject aOutputType;
-   static MObject aEvalOnTimeChanged;
-   static MObject aVerbose;
-   
-   static MObject aIntOutput;
-   static MObject aIntArrayOutput;
-   static MObject aDoubleOutput;
-   static MObject aDoubleArrayOutput;
-   static MObject aStringOutput;
-   static MObject aStringArrayOutput;
+   static MObject aSetupExpression;
+   static MObject aTeardownExpression;
+   static MObject aVerbose;
+   static MObject aTimeBudget;
+   static MObject aRecordTrace;
+   static MObject aArrayLayout;
+   
    static MObject aSucceeded;
    static MObject aErrorString;
-   
-   enum OutputType
-   {
-      OT_int = 0,
-      OT_int_array,
-      OT_double,
-      OT_double_array,
-      OT_string,
-      OT_string_array,
-      OT_undefined
-   };
 
 public:
-   
-   PyExpr();
-   virtual ~PyExpr();
+
+   PyExprDeformer();
+   virtual ~PyExprDeformer();
    
    virtual MStatus setDependentsDirty(const MPlug &plug, MPlugArray &plugArray);
-   virtual MStatus compute(const MPlug &plug, MDataBlock &block);
+   virtual MStatus deform(MDataBlock &block, MItGeometry &iter, const MMatrix &worldMatrix, unsigned int multiIndex);
    virtual void postConstructor();
    
-   virtual bool getInternalValueInContext(const MPlug &plug, MDataHandle &hdl, MDGContext &ctx);
-   virtual bool setInternalValueInContext(const MPlug &plug, const MDataHandle &hdl, MDGContext &ctx);
-   virtual void copyInternalData(MPxNode *other);
-   
-   void evalExpression();
-   
-private:
-   
-   bool evalExpression(const MString &expr, short outputType, bool verbose);
-   
-private:
-   
-   bool mEval;
-   
-   bool mSucceeded;
-   MString mErrorString;
-   int mIntOutput;
-   MIntArray mIntArrayOutput;
-   double mDoubleOutput;
-   MDoubleArray mDoubleArrayOutput;
-   MString mStringOutput;
-   MStringArray mStringArrayOutput;
-   bool mHasTimeChangedCB;
-   MCallbackId mTimeChangedCB;
-};
+   // Run the teardown expression if the setup was run, see NodePreRemoval
+   void teardown();
 
-// -----------------------------------------------------------------------------
+private:
 
-void TimeChanged(MTime &, void *clientData)
-{
-   PyExpr *node = (PyExpr*) clientData;
-   node->evalExpression();
-}
+   PyEvalCodePtr mCode;
+   MessageNameCache mMessageNames;
+   PackBuffers mPackBuffers;
+   PyEvalScopePtr mScope;
+   MString mTeardown;
+   MCallbackId mPreRemovalCB;
+};
 
 // -----------------------------------------------------------------------------
 
-MTypeId PyExpr::Id(PYEXPR_ID);
-MObject PyExpr::aExpression;
-MObject PyExpr::aOutputType;
-MObject PyExpr::aEvalOnTimeChanged;
-MObject PyExpr::aVerbose;
-MObject PyExpr::aIntOutput;
-MObject PyExpr::aIntArrayOutput;
-MObject PyExpr::aDoubleOutput;
-MObject PyExpr::aDoubleArrayOutput;
-MObject PyExpr::aStringOutput;
-MObject PyExpr::aStringArrayOutput;
-MObject PyExpr::aSucceeded;
-MObject PyExpr::aErrorString;
+MTypeId PyExprDeformer::Id(PYEXPR_DEFORMER_ID);
+MObject PyExprDeformer::aExpression;
+MObject PyExprDeformer::aSetupExpression;
+MObject PyExprDeformer::aTeardownExpression;
+MObject PyExprDeformer::aVerbose;
+MObject PyExprDeformer::aTimeBudget;
+MObject PyExprDeformer::aRecordTrace;
+MObject PyExprDeformer::aArrayLayout;
+MObject PyExprDeformer::aSucceeded;
+MObject PyExprDeformer::aErrorString;
 
 // -----------------------------------------------------------------------------
 
-void* PyExpr::Create()
+void* PyExprDeformer::Create()
 {
-   return new PyExpr();
+   return new PyExprDeformer();
 }
 
-MStatus PyExpr::Initialize()
+MStatus PyExprDeformer::Initialize()
 {
    MStatus stat;
    MFnTypedAttribute tattr;
    MFnNumericAttribute nattr;
-   MFnUnitAttribute uattr;
    MFnEnumAttribute eattr;
    
    // --- Inputs ---
@@ -590,59 +4831,29 @@ MStatus PyExpr::Initialize()
    aExpression = tattr.create("expression", "expr", MFnData::kString, MObject::kNullObj, &stat);
    addAttribute(aExpression);
    
-   aOutputType = eattr.create("outputType", "outt", 4, &stat);
-   eattr.addField("int", OT_int);
-   eattr.addField("int[]", OT_int_array);
-   eattr.addField("double", OT_double);
-   eattr.addField("double[]", OT_double_array);
-   eattr.addField("string", OT_string);
-   eattr.addField("string[]", OT_string_array);
-   addAttribute(aOutputType);
+   aSetupExpression = tattr.create("setupExpression", "sexp", MFnData::kString, MObject::kNullObj, &stat);
+   addAttribute(aSetupExpression);
    
-   aEvalOnTimeChanged = nattr.create("evalOnTimeChanged", "evltc", MFnNumericData::kBoolean, 0.0, &stat);
-   nattr.setInternal(true);
-   addAttribute(aEvalOnTimeChanged);
+   aTeardownExpression = tattr.create("teardownExpression", "texp", MFnData::kString, MObject::kNullObj, &stat);
+   addAttribute(aTeardownExpression);
    
    aVerbose = nattr.create("verbose", "verb", MFnNumericData::kBoolean, 0.0, &stat);
    addAttribute(aVerbose);
    
-   // --- Outputs ---
-   
-   aIntOutput = nattr.create("outInt", "oint", MFnNumericData::kLong, 0, &stat);
-   nattr.setWritable(false);
-   nattr.setStorable(false);
-   addAttribute(aIntOutput);
-   
-   aIntArrayOutput = nattr.create("outInts", "oins", MFnNumericData::kLong, 0, &stat);
-   nattr.setArray(true);
-   nattr.setWritable(false);
-   nattr.setStorable(false);
-   nattr.setUsesArrayDataBuilder(true);
-   addAttribute(aIntArrayOutput);
-   
-   aDoubleOutput = nattr.create("outDouble", "odbl", MFnNumericData::kDouble, 0, &stat);
-   nattr.setWritable(false);
-   nattr.setStorable(false);
-   addAttribute(aDoubleOutput);
+   aTimeBudget = nattr.create("timeBudget", "tbgt", MFnNumericData::kDouble, 0.0, &stat);
+   addAttribute(aTimeBudget);
    
-   aDoubleArrayOutput = nattr.create("outDoubles", "odbs", MFnNumericData::kDouble, 0, &stat);
-   nattr.setArray(true);
-   nattr.setWritable(false);
-   nattr.setStorable(false);
-   nattr.setUsesArrayDataBuilder(true);
-   addAttribute(aDoubleArrayOutput);
+   aRecordTrace = nattr.create("recordTrace", "rtrc", MFnNumericData::kBoolean, 0.0, &stat);
+   addAttribute(aRecordTrace);
    
-   aStringOutput = tattr.create("outString", "ostr", MFnData::kString, MObject::kNullObj, &stat);
-   tattr.setWritable(false);
-   tattr.setStorable(false);
-   addAttribute(aStringOutput);
+   aArrayLayout = eattr.create("arrayLayout", "arly", AL_tuples, &stat);
+   eattr.addField("tuples", AL_tuples);
+   eattr.addField("xyz", AL_xyz);
+   eattr.addField("xyzFloat", AL_xyz_float);
+   eattr.addField("planar", AL_planar);
+   addAttribute(aArrayLayout);
    
-   aStringArrayOutput = tattr.create("outStrings", "osts", MFnData::kString, MObject::kNullObj, &stat);
-   tattr.setArray(true);
-   tattr.setWritable(false);
-   tattr.setStorable(false);
-   nattr.setUsesArrayDataBuilder(true);
-   addAttribute(aStringArrayOutput);
+   // --- Outputs ---
    
    aSucceeded = nattr.create("succeeded", "succ", MFnNumericData::kBoolean, 1.0, &stat);
    nattr.setWritable(false);
@@ -654,661 +4865,1085 @@ MStatus PyExpr::Initialize()
    tattr.setStorable(false);
    addAttribute(aErrorString);
    
-   attributeAffects(aExpression, aIntOutput);
-   attributeAffects(aExpression, aIntArrayOutput);
-   attributeAffects(aExpression, aDoubleOutput);
-   attributeAffects(aExpression, aDoubleArrayOutput);
-   attributeAffects(aExpression, aStringOutput);
-   attributeAffects(aExpression, aStringArrayOutput);
-   attributeAffects(aExpression, aSucceeded);
-   attributeAffects(aExpression, aErrorString);
-   
-   attributeAffects(aOutputType, aIntOutput);
-   attributeAffects(aOutputType, aIntArrayOutput);
-   attributeAffects(aOutputType, aDoubleOutput);
-   attributeAffects(aOutputType, aDoubleArrayOutput);
-   attributeAffects(aOutputType, aStringOutput);
-   attributeAffects(aOutputType, aStringArrayOutput);
-   attributeAffects(aOutputType, aSucceeded);
-   attributeAffects(aOutputType, aErrorString);
+   attributeAffects(aExpression, outputGeom);
+   attributeAffects(aSetupExpression, outputGeom);
+   attributeAffects(aVerbose, outputGeom);
+   attributeAffects(aArrayLayout, outputGeom);
    
    return MS::kSuccess;
 }
 
 // -----------------------------------------------------------------------------
 
-PyExpr::PyExpr()
-   : MPxNode()
-   , mEval(true)
-   , mSucceeded(false)
-   , mIntOutput(0)
-   , mDoubleOutput(0.0)
-   , mHasTimeChangedCB(false)
-   , mTimeChangedCB(0)
+PyExprDeformer::PyExprDeformer()
+   : MPxDeformerNode()
+   , mPreRemovalCB(0)
 {
 }
 
-PyExpr::~PyExpr()
+PyExprDeformer::~PyExprDeformer()
 {
-   if (mHasTimeChangedCB)
-   {
-      MMessage::removeCallback(mTimeChangedCB);
-   }
+   MMessage::removeCallback(mPreRemovalCB);
+   
+   Teardown(mScope, mTeardown, false);
 }
 
-void PyExpr::postConstructor()
+void PyExprDeformer::postConstructor()
 {
    setMPSafe(false);
+   
+   MObject oSelf = thisMObject();
+   
+   mPreRemovalCB = MNodeMessage::addNodePreRemovalCallback(oSelf, NodePreRemoval, (void*)this);
 }
 
-MStatus PyExpr::setDependentsDirty(const MPlug &plug, MPlugArray &affectedPlugs)
+void PyExprDeformer::teardown()
 {
-   MObject oAttr = plug.attribute();
+   MObject oSelf = thisMObject();
    
-   MFnAttribute fnAttr(oAttr);
+   mTeardown = MPlug(oSelf, aTeardownExpression).asString();
+   
+   Teardown(mScope, mTeardown, MPlug(oSelf, aVerbose).asBool());
+}
+
+MStatus PyExprDeformer::setDependentsDirty(const MPlug &plug, MPlugArray &affectedPlugs)
+{
+   MFnAttribute fnAttr(plug.attribute());
    
    if (fnAttr.isDynamic())
    {
-      MObject oNode = thisMObject();
+      MPlug pOutputGeom(thisMObject(), outputGeom);
+      affectedPlugs.append(pOutputGeom);
       
-      MDataBlock block = forceCache();
+      unsigned int n = pOutputGeom.numElements();
+      for (unsigned int i=0; i<n; ++i)
+      {
+         affectedPlugs.append(pOutputGeom.elementByPhysicalIndex(i));
+      }
+   }
+   
+   return MS::kSuccess;
+}
+
+MStatus PyExprDeformer::deform(MDataBlock &block, MItGeometry &iter, const MMatrix &worldMatrix, unsigned int multiIndex)
+{
+   MString expr = block.inputValue(aExpression).asString();
+   MString setup = block.inputValue(aSetupExpression).asString();
+   bool verbose = block.inputValue(aVerbose).asBool();
+   double timeBudget = block.inputValue(aTimeBudget).asDouble();
+   bool trace = block.inputValue(aRecordTrace).asBool();
+   float env = block.inputValue(envelope).asFloat();
+   
+   if (env == 0.0f || expr.length() == 0)
+   {
+      return MS::kSuccess;
+   }
+   
+   MObject oSelf = thisMObject();
+   
+   PyEvalSpan span("deform");
+   
+   if (span.active())
+   {
+      span.setArg(MFnDependencyNode(oSelf).name().asChar());
+   }
+   
+   PyEvalSpan marshalSpan("marshal");
+   
+   MPointArray points;
+   iter.allPositions(points);
+   
+   unsigned int count = points.length();
+   
+   std::vector<double> buffer(3 * count);
+   std::vector<float> weights(count, 1.0f);
+   
+   if (count > 0)
+   {
+      PackInterleaved(&(points[0].x), 4, 3, count, &buffer[0]);
+   }
+   
+   unsigned int w = 0;
+   for (iter.reset(); !iter.isDone() && w < count; iter.next(), ++w)
+   {
+      weights[w] = weightValue(block, multiIndex, iter.index());
+   }
+   
+   std::vector<std::string> names;
+   
+   DynamicAttributeNames(oSelf, names);
+   
+   names.push_back("numPoints");
+   names.push_back("points");
+   names.push_back("weights");
+   names.push_back("envelope");
+   names.push_back("geometryIndex");
+   names.push_back("worldMatrix");
+   
+   std::string source = DeclareFunction(names, expr).asChar();
+   
+   if (!mCode || !mCode->matches(source, names))
+   {
+      if (verbose)
+      {
+         Log::Info(thisMObject(), "Declare function:\n" + MString(source.c_str()));
+      }
       
-      MDataHandle hOutputType = block.outputValue(aOutputType);
+      mCode = PyEvalGetCode(source, names);
+   }
+   
+   std::ostringstream oss;
+   StreamContext ctx(verbose, &mMessageNames, &mPackBuffers, block.inputValue(aArrayLayout).asShort());
+   
+   // Only marshal the inputs the expression uses
+   PyEvalAnalyse(mCode);
+   ctx.code = mCode.get();
+   
+   oss << "(";
+   OutputDynamicAttributes(oSelf, oss, ctx);
+   
+   oss << count << ", ";
+   OutputBuffer(oss, "c_double", (count > 0 ? &buffer[0] : 0), 3 * count, true);
+   oss << ", ";
+   OutputBuffer(oss, "c_float", (count > 0 ? &weights[0] : 0), count);
+   oss << ", " << env << ", " << multiIndex << ", ";
+   
+   const MMatrix &M = worldMatrix;
+   oss << "((" << M[0][0] << ", " << M[0][1] << ", " << M[0][2] << ", " << M[0][3] << "),";
+   oss << " (" << M[1][0] << ", " << M[1][1] << ", " << M[1][2] << ", " << M[1][3] << "),";
+   oss << " (" << M[2][0] << ", " << M[2][1] << ", " << M[2][2] << ", " << M[2][3] << "),";
+   oss << " (" << M[3][0] << ", " << M[3][1] << ", " << M[3][2] << ", " << M[3][3] << ")))";
+   
+   PyEvalRequest request;
+   PyEvalResult result;
+   
+   mTeardown = block.inputValue(aTeardownExpression).asString();
+   
+   request.code = mCode;
+   request.scope = UpdateScope(mScope, setup, mTeardown, verbose);
+   request.args = oss.str();
+   request.outputType = PyEval_points;
+   request.verbose = verbose;
+   request.timeBudget = (timeBudget == 0.0 ? Settings::TimeBudget : (timeBudget < 0.0 ? 0.0 : timeBudget));
+   request.trace = (trace || Settings::TraceAll);
+   
+   marshalSpan.end();
+   
+   bool succeeded = PyEvalRun(request, result);
+   MString errorString = result.errorString.c_str();
+   
+   PyEvalSpan writebackSpan("writeback");
+   
+   if (succeeded)
+   {
+      // Returned points replace the ones modified in place
+      size_t n = std::min(buffer.size(), result.doubleArrayOutput.size());
       
-      switch (hOutputType.asShort())
+      for (size_t i=0; i<n; ++i)
       {
-      case OT_int_array:
-         {
-            MPlug pIntArrayOutput(oNode, aIntArrayOutput);
-            affectedPlugs.append(pIntArrayOutput);
-            
-            unsigned int n = pIntArrayOutput.numElements();
-            for (unsigned int i=0; i<n; ++i)
-            {
-               MPlug pIntArrayElem = pIntArrayOutput.elementByPhysicalIndex(i);
-               affectedPlugs.append(pIntArrayElem);
-            }
-         }
-         break;
-      case OT_double_array:
-         {
-            MPlug pDoubleArrayOutput(oNode, aDoubleArrayOutput);
-            affectedPlugs.append(pDoubleArrayOutput);
-            
-            unsigned int n = pDoubleArrayOutput.numElements();
-            for (unsigned int i=0; i<n; ++i)
-            {
-               MPlug pDoubleArrayElem = pDoubleArrayOutput.elementByPhysicalIndex(i);
-               affectedPlugs.append(pDoubleArrayElem);
-            }
-         }
-         break;
-      case OT_string_array:
-         {
-            MPlug pStringArrayOutput(oNode, aStringArrayOutput);
-            affectedPlugs.append(pStringArrayOutput);
-            
-            unsigned int n = pStringArrayOutput.numElements();
-            for (unsigned int i=0; i<n; ++i)
-            {
-               MPlug pStringArrayElem = pStringArrayOutput.elementByPhysicalIndex(i);
-               affectedPlugs.append(pStringArrayElem);
-            }
-         }
-         break;
-      case OT_int:
-         {
-            MPlug pIntOutput(oNode, aIntOutput);
-            affectedPlugs.append(pIntOutput);
-         }
-         break;
-      case OT_double:
-         {
-            MPlug pDoubleOutput(oNode, aDoubleOutput);
-            affectedPlugs.append(pDoubleOutput);
-         }
-         break;
-      case OT_string:
-      default:
-         {
-            MPlug pStringOutput(oNode, aStringOutput);
-            affectedPlugs.append(pStringOutput);
-         }
-         break;
+         buffer[i] = result.doubleArrayOutput[i];
       }
       
-      MPlug pSucceeded(oNode, aSucceeded);
-      affectedPlugs.append(pSucceeded);
+      // Weights are handed to the expression, only envelope is applied here
+      for (unsigned int i=0, j=0; i<count; ++i, j+=3)
+      {
+         MPoint &pnt = points[i];
+         pnt.x += env * (buffer[j] - pnt.x);
+         pnt.y += env * (buffer[j+1] - pnt.y);
+         pnt.z += env * (buffer[j+2] - pnt.z);
+      }
       
-      mEval = true;
-   }
-   else if (oAttr == aExpression || oAttr == aOutputType)
-   {
-      mEval = true;
+      iter.setAllPositions(points);
    }
    
+   MDataHandle hSucceeded = block.outputValue(aSucceeded);
+   hSucceeded.set(succeeded);
+   hSucceeded.setClean();
+   
+   MDataHandle hErrorString = block.outputValue(aErrorString);
+   hErrorString.set(errorString);
+   hErrorString.setClean();
+   
    return MS::kSuccess;
 }
 
-bool PyExpr::getInternalValueInContext(const MPlug &plug, MDataHandle &hdl, MDGContext &ctx)
+// -----------------------------------------------------------------------------
+
+static void NodePreRemoval(MObject &, void *clientData)
 {
-   if (plug == aEvalOnTimeChanged)
+   MPxNode *node = (MPxNode*) clientData;
+   
+   if (node->typeId() == PyExpr::Id)
    {
-      hdl.set(mHasTimeChangedCB);
-      return true;
+      ((PyExpr*) node)->teardown();
    }
-   else
+   else if (node->typeId() == PyExprDeformer::Id)
    {
-      return MPxNode::getInternalValueInContext(plug, hdl, ctx);
+      ((PyExprDeformer*) node)->teardown();
    }
 }
 
-bool PyExpr::setInternalValueInContext(const MPlug &plug, const MDataHandle &hdl, MDGContext &ctx)
+// -----------------------------------------------------------------------------
+
+// pyexprSettings [-q] [-timeBudget ms] [-warmUp on|off] [-interpreters count] [-fuseChains on|off]
+//                [-batchNodes on|off] [-traceFile path] [-traceAll on|off] [-workers count]
+//                [-workerPython path]
+class PyExprSettingsCmd : public MPxCommand
 {
-   MStatus stat = MS::kSuccess;
+public:
    
-   if (plug == aEvalOnTimeChanged)
-   {
-      if (hdl.asBool())
-      {
-         if (!mHasTimeChangedCB)
-         {  
-            // or addForceUpdateCallback
-            mTimeChangedCB = MDGMessage::addTimeChangeCallback(TimeChanged, (void*)this, &stat);
-            
-            if (stat == MS::kSuccess)
-            {
-               mHasTimeChangedCB = true;
-            }
-            else
-            {
-               // failed to add
-               return false;
-            }
-         }
-         else
-         {
-            // already set
-         }
-      }
-      else
-      {
-         if (mHasTimeChangedCB)
-         {
-            if (MMessage::removeCallback(mTimeChangedCB) == MS::kSuccess)
-            {
-               mHasTimeChangedCB = false;
-            }
-            else
-            {
-               // failed to remove
-               return false;
-            }
-         }
-      }
-      
-      return true;
-   }
-   else
-   {
-      return MPxNode::setInternalValueInContext(plug, hdl, ctx);
-   }  
-}
+   static void* Create();
+   static MSyntax NewSyntax();
+   
+   virtual MStatus doIt(const MArgList &args);
+};
 
-void PyExpr::copyInternalData(MPxNode *other)
+void* PyExprSettingsCmd::Create()
 {
-   PyExpr *rhs = (PyExpr*) other;
-   
-   rhs->mEval = mEval;
-   rhs->mSucceeded = mSucceeded;
-   rhs->mErrorString = mErrorString;
-   rhs->mIntOutput = mIntOutput;
-   rhs->mIntArrayOutput = mIntArrayOutput;
-   rhs->mDoubleOutput = mDoubleOutput;
-   rhs->mDoubleArrayOutput = mDoubleArrayOutput;
-   rhs->mStringOutput = mStringOutput;
-   rhs->mStringArrayOutput = mStringArrayOutput;
+   return new PyExprSettingsCmd();
 }
 
-void PyExpr::evalExpression()
+MSyntax PyExprSettingsCmd::NewSyntax()
 {
-   MDataBlock block = forceCache();
-   MObject oSelf = thisMObject();
-   MFnDependencyNode nSelf(oSelf);
-   
-   MDataHandle hOutputType = block.inputValue(aOutputType);
+   MSyntax syntax;
    
-   short outputType = hOutputType.asShort();
+   syntax.enableQuery(true);
+   syntax.enableEdit(false);
+   syntax.addFlag("-tb", "-timeBudget", MSyntax::kDouble);
+   syntax.addFlag("-wu", "-warmUp", MSyntax::kBoolean);
+   syntax.addFlag("-itp", "-interpreters", MSyntax::kLong);
+   syntax.addFlag("-fc", "-fuseChains", MSyntax::kBoolean);
+   syntax.addFlag("-bn", "-batchNodes", MSyntax::kBoolean);
+   syntax.addFlag("-tf", "-traceFile", MSyntax::kString);
+   syntax.addFlag("-ta", "-traceAll", MSyntax::kBoolean);
+   syntax.addFlag("-lf", "-logFile", MSyntax::kString);
+   syntax.addFlag("-lr", "-logRate", MSyntax::kLong);
+   syntax.addFlag("-li", "-logInterval", MSyntax::kDouble);
+   syntax.addFlag("-fb", "-frameBudget", MSyntax::kDouble);
+   syntax.addFlag("-msf", "-maxStaleFrames", MSyntax::kLong);
+   syntax.addFlag("-wk", "-workers", MSyntax::kLong);
+   syntax.addFlag("-wkp", "-workerPython", MSyntax::kString);
    
-   MPlug outPlug;
+   return syntax;
+}
+
+MStatus PyExprSettingsCmd::doIt(const MArgList &args)
+{
+   MStatus stat;
+   MArgDatabase db(syntax(), args, &stat);
    
-   switch (outputType)
+   if (stat != MS::kSuccess)
    {
-   case OT_int:
-      outPlug = nSelf.findPlug("outInt");
-      break;
-   case OT_int_array:
-      outPlug = nSelf.findPlug("outInts");
-      break;
-   case OT_double:
-      outPlug = nSelf.findPlug("outDouble");
-      break;
-   case OT_double_array:
-      outPlug = nSelf.findPlug("outDoubles");
-      break;
-   case OT_string:
-      outPlug = nSelf.findPlug("outString");
-      break;
-   case OT_string_array:
-      outPlug = nSelf.findPlug("outStrings");
-   default:
-      break;
+      return stat;
    }
    
-   if (!outPlug.isNull())
-   {
-      compute(outPlug, block);
-   }
-}
-
-bool PyExpr::evalExpression(const MString &expr, short outputType, bool verbose)
-{
-   if (mEval)
+   if (db.isQuery())
    {
-      MStatus stat;
-      
-      MObject oSelf = thisMObject();
-      MFnDependencyNode nSelf(oSelf);
-      
-      mIntOutput = 0;
-      mDoubleOutput = 0.0;
-      mStringOutput = "";
-      mIntArrayOutput.setLength(0);
-      mDoubleArrayOutput.setLength(0);
-      mStringArrayOutput.setLength(0);
-      
-      std::ostringstream oss;
-      
-      unsigned int count = nSelf.attributeCount();
-      
-      for (unsigned int i=0; i<count; ++i)
+      if (db.isFlagSet("-timeBudget"))
       {
-         MObject oAttr = nSelf.attribute(i);
-         MFnAttribute fnAttr(oAttr);
-         
-         if (!fnAttr.isDynamic())
-         {
-            continue;
-         }
-         
-         if (oAttr.hasFn(MFn::kMessageAttribute))
-         {
-            Output<MFnMessageAttribute>(oSelf, oAttr, oss, verbose);
-         }
-         else if (oAttr.hasFn(MFn::kUnitAttribute))
-         {
-            Output<MFnUnitAttribute>(oSelf, oAttr, oss, verbose);
-         }
-         else if (oAttr.hasFn(MFn::kEnumAttribute))
-         {
-            Output<MFnEnumAttribute>(oSelf, oAttr, oss, verbose);
-         }
-         else if (oAttr.hasFn(MFn::kMatrixAttribute))
-         {
-            Output<MFnMatrixAttribute>(oSelf, oAttr, oss, verbose);
-         }
-         else if (oAttr.hasFn(MFn::kNumericAttribute))
-         {
-            Output<MFnNumericAttribute>(oSelf, oAttr, oss, verbose);
-         }
-         else if (oAttr.hasFn(MFn::kTypedAttribute))
-         {
-            Output<MFnTypedAttribute>(oSelf, oAttr, oss, verbose);
-         }
-         else
-         {
-            if (verbose)
-            {
-               MGlobal::displayWarning("[pyexpr] Unsupported type for attribute \"" + fnAttr.name()  + "\"");
-            }
-         }
+         setResult(Settings::TimeBudget);
       }
-      
-      // Build function declaration
-      
-      // The error string returned by MStatus after an executePythonCommand doesn't contain
-      //   any usefull information
-      // Catch any exception and set a global error string variable
-      // In verbose mode, re-raise the caught exception and let maya handle the output
-      // When not in verbose mode, return a valid default value and set success status
-      //   depending on the global error string content. Empty means no error happened
-      
-      MString func = "_pyexpr_eval_" + nSelf.name() + "()";
-      MString errv = "_pyexpr_err_" + nSelf.name();
-      
-      MString vars = oss.str().c_str();
-      
-      MString decl = errv + " = ''\n";
-      
-      decl += "def " + func + ":\n"
-              "  global " + errv + "\n"
-              "  " + errv + " = ''\n\n"
-              "  try:\n";
-      
-      MString remain = vars + expr;
-      
-      int i = remain.indexW('\n');
-      
-      while (i != -1)
+      else if (db.isFlagSet("-warmUp"))
       {
-         decl += "    " + remain.substringW(0, i);
-         remain = remain.substringW(i + 1, remain.numChars() - 1);
-         i = remain.indexW('\n');
+         setResult(Settings::WarmUp);
       }
-      
-      if (remain.length() > 0)
+      else if (db.isFlagSet("-interpreters"))
       {
-         decl += "    " + remain;
+         // Actually running, may be less than requested
+         setResult((int) PyEvalInterpreters());
       }
-      
-      decl += "\n  except Exception, e:\n"
-              "    " + errv + " = '%s: %s' % (e.__class__.__name__, str(e))\n";
-      
-      if (verbose)
+      else if (db.isFlagSet("-fuseChains"))
       {
-         decl += "    raise e\n";
+         setResult(Settings::FuseChains);
       }
-      else
+      else if (db.isFlagSet("-batchNodes"))
       {
-         switch (outputType)
-         {
-         case OT_int:
-         case OT_double:
-            decl += "    return 0\n";
-            break;
-         case OT_int_array:
-         case OT_double_array:
-         case OT_string_array:
-            decl += "    return []\n";
-            break;
-         case OT_string:
-         default:
-            decl += "    return ''\n";
-         }
+         setResult(Settings::BatchNodes);
+      }
+      else if (db.isFlagSet("-traceFile"))
+      {
+         setResult(MString(PyEvalTraceFile().c_str()));
+      }
+      else if (db.isFlagSet("-traceAll"))
+      {
+         setResult(Settings::TraceAll);
+      }
+      else if (db.isFlagSet("-logFile"))
+      {
+         setResult(Log::File());
+      }
+      else if (db.isFlagSet("-logRate"))
+      {
+         setResult(Log::Rate.load());
+      }
+      else if (db.isFlagSet("-logInterval"))
+      {
+         setResult(Log::Interval.load());
+      }
+      else if (db.isFlagSet("-frameBudget"))
+      {
+         setResult(Settings::FrameBudget);
+      }
+      else if (db.isFlagSet("-maxStaleFrames"))
+      {
+         setResult(Settings::MaxStaleFrames);
+      }
+      else if (db.isFlagSet("-workers"))
+      {
+         // Actually running, may be less than requested
+         setResult((int) PyEvalWorkers());
+      }
+      else if (db.isFlagSet("-workerPython"))
+      {
+         setResult(Settings::WorkerPython);
       }
       
-      if (verbose)
+      return MS::kSuccess;
+   }
+   
+   if (db.isFlagSet("-timeBudget"))
+   {
+      db.getFlagArgument("-timeBudget", 0, Settings::TimeBudget);
+   }
+   
+   if (db.isFlagSet("-warmUp"))
+   {
+      db.getFlagArgument("-warmUp", 0, Settings::WarmUp);
+   }
+   
+   if (db.isFlagSet("-interpreters"))
+   {
+      int count = 0;
+      db.getFlagArgument("-interpreters", 0, count);
+      Settings::Interpreters = std::max(0, count);
+      StartInterpreters();
+   }
+   
+   if (db.isFlagSet("-workerPython"))
+   {
+      db.getFlagArgument("-workerPython", 0, Settings::WorkerPython);
+   }
+   
+   // Started again with the new python if only it is given
+   if (db.isFlagSet("-workers") || (db.isFlagSet("-workerPython") && Settings::Workers > 0))
+   {
+      int count = Settings::Workers;
+      if (db.isFlagSet("-workers"))
       {
-         MGlobal::displayInfo("[pyexpr] Declare function:\n" + decl);
+         db.getFlagArgument("-workers", 0, count);
       }
+      Settings::Workers = std::max(0, count);
+      StartWorkers();
+   }
+   
+   if (db.isFlagSet("-fuseChains"))
+   {
+      db.getFlagArgument("-fuseChains", 0, Settings::FuseChains);
+   }
+   
+   if (db.isFlagSet("-batchNodes"))
+   {
+      db.getFlagArgument("-batchNodes", 0, Settings::BatchNodes);
+   }
+   
+   if (db.isFlagSet("-traceAll"))
+   {
+      db.getFlagArgument("-traceAll", 0, Settings::TraceAll);
+   }
+   
+   if (db.isFlagSet("-frameBudget"))
+   {
+      db.getFlagArgument("-frameBudget", 0, Settings::FrameBudget);
+   }
+   
+   if (db.isFlagSet("-maxStaleFrames"))
+   {
+      int frames = 0;
+      db.getFlagArgument("-maxStaleFrames", 0, frames);
+      Settings::MaxStaleFrames = std::max(0, frames);
+   }
+   
+   if (db.isFlagSet("-logRate"))
+   {
+      int rate = 0;
+      db.getFlagArgument("-logRate", 0, rate);
+      Log::Rate = std::max(0, rate);
+   }
+   
+   if (db.isFlagSet("-logInterval"))
+   {
+      double interval = 0.0;
+      db.getFlagArgument("-logInterval", 0, interval);
+      Log::Interval = std::max(0.0, interval);
+   }
+   
+   if (db.isFlagSet("-logFile"))
+   {
+      MString path;
+      db.getFlagArgument("-logFile", 0, path);
       
-      if (MGlobal::executePythonCommand(decl) == MS::kSuccess)
+      // An empty path writes messages to the script editor again
+      if (!Log::SetFile(path))
       {
-         // Only one-liner have return values
-         
-         switch (outputType)
-         {
-         case OT_int:
-            if (verbose)
-            {
-               MGlobal::displayInfo("[pyexpr] Evaluating int expression");
-            }
-            stat = MGlobal::executePythonCommand(func, mIntOutput);
-            break;
-         case OT_int_array:
-            if (verbose)
-            {
-               MGlobal::displayInfo("[pyexpr] Evaluating int[] expression");
-            }
-            stat = MGlobal::executePythonCommand(func, mIntArrayOutput);
-            break;
-         case OT_double:
-            if (verbose)
-            {
-               MGlobal::displayInfo("[pyexpr] Evaluating double expression");
-            }
-            stat = MGlobal::executePythonCommand(func, mDoubleOutput);
-            break;
-         case OT_double_array:
-            if (verbose)
-            {
-               MGlobal::displayInfo("[pyexpr] Evaluating double[] expression");
-            }
-            stat = MGlobal::executePythonCommand(func, mDoubleArrayOutput);
-            break;
-         case OT_string_array:
-            if (verbose)
-            {
-               MGlobal::displayInfo("[pyexpr] Evaluating string[] expression");
-            }
-            stat = MGlobal::executePythonCommand(func, mStringArrayOutput);
-            break;
-         case OT_string:
-         default:
-            if (verbose)
-            {
-               if (outputType != OT_string)
-               {
-                  MGlobal::displayWarning("[pyexpr] Default output type to 'string'");
-               }
-               
-               MGlobal::displayInfo("[pyexpr] Evaluating string expression");
-            }
-            stat = MGlobal::executePythonCommand(func, mStringOutput);
-         }
+         MGlobal::displayError("[pyexpr] Could not open log file " + path);
+         return MS::kFailure;
       }
+   }
+   
+   if (db.isFlagSet("-traceFile"))
+   {
+      MString path;
+      db.getFlagArgument("-traceFile", 0, path);
       
-      mSucceeded = (stat == MS::kSuccess);
+      // An empty path closes the current trace
+      std::string previous = PyEvalTraceFile();
+      size_t count = PyEvalStopTrace();
       
-      if (!verbose || !mSucceeded)
+      if (previous.length() > 0)
       {
-         mErrorString = MGlobal::executePythonCommandStringResult(errv);
+         MString msg = "[pyexpr] Recorded ";
+         msg += (unsigned int) count;
+         msg += " evaluation(s) to ";
+         msg += previous.c_str();
+         MGlobal::displayInfo(msg);
+      }
+      
+      if (path.length() > 0)
+      {
+         std::string error;
          
-         // Note: when not in verbose mode, error string will only be set if an exception was caught
-         if (mErrorString.length() > 0)
+         if (!PyEvalStartTrace(path.asChar(), error))
          {
-            mSucceeded = false;
+            MGlobal::displayError(MString("[pyexpr] ") + error.c_str());
+            return MS::kFailure;
          }
       }
-      else
-      {
-         // Avoid unnecessary script execution
-         mErrorString = "";
-      }
-      
-      mEval = false;
    }
    
-   return mSucceeded;
+   return MS::kSuccess;
+}
+
+// pyexprStats [-timedOut] [-codeEntries] [-codeReferences] [-codeSharing] [-codeBytes] [-staleNodes] [-workerRestarts]
+//             [-reset] [-refreshStale] [-notifyAsync]
+class PyExprStatsCmd : public MPxCommand
+{
+public:
+   
+   static void* Create();
+   static MSyntax NewSyntax();
+   
+   virtual MStatus doIt(const MArgList &args);
+};
+
+void* PyExprStatsCmd::Create()
+{
+   return new PyExprStatsCmd();
+}
+
+MSyntax PyExprStatsCmd::NewSyntax()
+{
+   MSyntax syntax;
+   
+   syntax.addFlag("-to", "-timedOut");
+   syntax.addFlag("-ce", "-codeEntries");
+   syntax.addFlag("-cr", "-codeReferences");
+   syntax.addFlag("-cs", "-codeSharing");
+   syntax.addFlag("-cb", "-codeBytes");
+   syntax.addFlag("-sn", "-staleNodes");
+   syntax.addFlag("-wr", "-workerRestarts");
+   syntax.addFlag("-r", "-reset");
+   syntax.addFlag("-rs", "-refreshStale");
+   syntax.addFlag("-na", "-notifyAsync");
+   
+   return syntax;
+}
+
+MStatus PyExprStatsCmd::doIt(const MArgList &args)
+{
+   MStatus stat;
+   MArgDatabase db(syntax(), args, &stat);
+   
+   if (stat != MS::kSuccess)
+   {
+      return stat;
+   }
+   
+   PyEvalCodeStats codeStats;
+   
+   PyEvalGetCodeStats(codeStats);
+   
+   if (db.isFlagSet("-timedOut"))
+   {
+      setResult((int) PyEvalTimedOutCount());
+   }
+   else if (db.isFlagSet("-codeEntries"))
+   {
+      setResult((int) codeStats.entries);
+   }
+   else if (db.isFlagSet("-codeReferences"))
+   {
+      setResult((int) codeStats.references);
+   }
+   else if (db.isFlagSet("-codeSharing"))
+   {
+      setResult(codeStats.entries > 0 ? double(codeStats.references) / double(codeStats.entries) : 0.0);
+   }
+   else if (db.isFlagSet("-codeBytes"))
+   {
+      setResult((int) codeStats.bytes);
+   }
+   else if (db.isFlagSet("-staleNodes"))
+   {
+      setResult((int) FrameScheduler::StaleCount());
+   }
+   else if (db.isFlagSet("-workerRestarts"))
+   {
+      setResult((int) PyEvalWorkerRestarts());
+   }
+   
+   if (db.isFlagSet("-reset"))
+   {
+      PyEvalResetTimedOutCount();
+   }
+   
+   if (db.isFlagSet("-refreshStale"))
+   {
+      FrameScheduler::Refresh();
+   }
+   
+   if (db.isFlagSet("-notifyAsync"))
+   {
+      AsyncEvaluator::Notify();
+   }
+   
+   return MS::kSuccess;
+}
+
+// pyexprEvalBatch [-startTime frame] [-endTime frame] [-by step] [-time frame]... [-buffer] node...
+//   -buffer is internal to the pyexpr python module, see pyexpr.evalBatch
+class PyExprEvalBatchCmd : public MPxCommand
+{
+public:
+   
+   static void* Create();
+   static MSyntax NewSyntax();
+   
+   virtual MStatus doIt(const MArgList &args);
+   
+private:
+   
+   static int msNextBuffer;
+};
+
+int PyExprEvalBatchCmd::msNextBuffer = 1;
+
+void* PyExprEvalBatchCmd::Create()
+{
+   return new PyExprEvalBatchCmd();
 }
 
-MStatus PyExpr::compute(const MPlug &plug, MDataBlock &block)
+MSyntax PyExprEvalBatchCmd::NewSyntax()
 {
-   MDataHandle hExpression = block.inputValue(aExpression);
-   MDataHandle hOutputType = block.inputValue(aOutputType);
-   MDataHandle hVerbose = block.inputValue(aVerbose);
+   MSyntax syntax;
+   
+   syntax.addFlag("-st", "-startTime", MSyntax::kDouble);
+   syntax.addFlag("-et", "-endTime", MSyntax::kDouble);
+   syntax.addFlag("-b", "-by", MSyntax::kDouble);
+   syntax.addFlag("-t", "-time", MSyntax::kDouble);
+   syntax.makeFlagMultiUse("-time");
+   syntax.addFlag("-buf", "-buffer");
+   syntax.setObjectType(MSyntax::kStringObjects, 1);
    
-   MString expr = hExpression.asString();
-   bool verbose = hVerbose.asBool();
-   short outputType = hOutputType.asShort();
+   return syntax;
+}
+
+MStatus PyExprEvalBatchCmd::doIt(const MArgList &args)
+{
+   MStatus stat;
+   MArgDatabase db(syntax(), args, &stat);
    
-   bool success = evalExpression(expr, outputType, verbose);
+   if (stat != MS::kSuccess)
+   {
+      return stat;
+   }
    
-   if (plug.attribute() == aIntOutput)
+#if MAYA_API_VERSION < 20190000
+   MGlobal::displayError("[pyexpr] pyexprEvalBatch requires maya 2019 or later");
+   return MS::kFailure;
+#else
+   MStringArray names;
+   std::vector<PyExpr*> nodes;
+   
+   db.getObjects(names);
+   
+   for (unsigned int i=0; i<names.length(); ++i)
    {
-      if (outputType != OT_int)
+      MSelectionList sl;
+      MObject obj;
+      
+      if (sl.add(names[i]) != MS::kSuccess || sl.getDependNode(0, obj) != MS::kSuccess)
       {
-         success = false;
+         MGlobal::displayError("[pyexpr] No node named " + names[i]);
+         return MS::kFailure;
       }
       
-      MDataHandle hIntOutput = block.outputValue(aIntOutput);
-      hIntOutput.set(success ? mIntOutput : 0);
+      MFnDependencyNode node(obj);
       
-      block.setClean(plug);
+      if (node.typeId() != PyExpr::Id || !node.userNode())
+      {
+         MGlobal::displayError("[pyexpr] " + names[i] + " is not a pyexpr node");
+         return MS::kFailure;
+      }
       
-      return MS::kSuccess;
+      names[i] = node.name();
+      nodes.push_back((PyExpr*) node.userNode());
    }
-   else if (plug.attribute() == aDoubleOutput)
+   
+   std::vector<double> frames;
+   
+   if (db.isFlagSet("-time"))
    {
-      if (outputType != OT_double)
+      for (unsigned int i=0; i<db.numberOfFlagUses("-time"); ++i)
       {
-         if (verbose)
-         {
-            MGlobal::displayWarning("[pyexpr] Querying wrong output type");
-         }
-         success = false;
+         MArgList timeArgs;
+         db.getFlagArgumentList("-time", i, timeArgs);
+         frames.push_back(timeArgs.asDouble(0));
       }
-      
-      MDataHandle hDoubleOutput = block.outputValue(aDoubleOutput);
-      hDoubleOutput.set(success ? mDoubleOutput : 0.0);
-      
-      block.setClean(plug);
-      
-      return MS::kSuccess;
    }
-   else if (plug.attribute() == aStringOutput)
+   else
    {
-      if (outputType != OT_string)
+      double start = MAnimControl::currentTime().as(MTime::uiUnit());
+      double end = start;
+      double by = 1.0;
+      
+      if (db.isFlagSet("-startTime"))
       {
-         if (verbose)
-         {
-            MGlobal::displayWarning("[pyexpr] Querying wrong output type");
-         }
-         success = false;
+         db.getFlagArgument("-startTime", 0, start);
+         end = start;
       }
       
-      MDataHandle hStringOutput = block.outputValue(aStringOutput);
-      hStringOutput.set(success ? mStringOutput : "");
+      if (db.isFlagSet("-endTime"))
+      {
+         db.getFlagArgument("-endTime", 0, end);
+      }
       
-      block.setClean(plug);
+      if (db.isFlagSet("-by"))
+      {
+         db.getFlagArgument("-by", 0, by);
+      }
       
-      return MS::kSuccess;
-   }
-   else if (plug.attribute() == aIntArrayOutput)
-   {
-      if (outputType != OT_int_array)
+      if (by <= 0.0)
       {
-         if (verbose)
-         {
-            MGlobal::displayWarning("[pyexpr] Querying wrong output type");
-         }
-         success = false;
+         MGlobal::displayError("[pyexpr] -by must be strictly positive");
+         return MS::kFailure;
       }
       
-      MArrayDataHandle hIntArrayOutput = block.outputArrayValue(aIntArrayOutput);
+      // Tolerate rounding errors on the last frame
+      size_t count = (end >= start ? size_t(floor((end - start) / by + 1e-6)) + 1 : 0);
       
-      MArrayDataBuilder builder(&block, aIntArrayOutput, (success ? mIntArrayOutput.length() : 0));
-         
-      if (success)
+      for (size_t i=0; i<count; ++i)
       {
-         for (unsigned int i=0; i<mIntArrayOutput.length(); ++i)
-         {
-            MDataHandle hIntOutput = builder.addElement(i);
-            hIntOutput.set(mIntArrayOutput[i]);
-         }
+         frames.push_back(start + double(i) * by);
       }
+   }
+   
+   std::vector<double> values;
+   std::vector<size_t> unsupported;
+   
+   size_t failed = PyExpr::EvalBatch(nodes, frames, values, unsupported);
+   
+   if (unsupported.size() > 0)
+   {
+      MString msg = "[pyexpr] ";
       
-      hIntArrayOutput.set(builder);
-      hIntArrayOutput.setAllClean();
+      for (size_t i=0; i<unsupported.size(); ++i)
+      {
+         msg += (i > 0 ? ", " : "");
+         msg += names[(unsigned int) unsupported[i]];
+      }
       
+      msg += ": only int and double outputs are returned, their values are NaN";
+      MGlobal::displayWarning(msg);
+   }
+   
+   if (failed > 0)
+   {
+      MString msg = "[pyexpr] ";
+      msg += (unsigned int) failed;
+      msg += " value(s) could not be evaluated";
+      MGlobal::displayWarning(msg);
+   }
+   
+   if (!db.isFlagSet("-buffer"))
+   {
+      setResult(values.size() > 0 ? MDoubleArray(&values[0], (unsigned int) values.size()) : MDoubleArray());
       return MS::kSuccess;
    }
-   else if (plug.attribute() == aDoubleArrayOutput)
+   
+   // Handed to python as a bytearray with its layout, see pyexpr.evalBatch
+   PyEvalGIL gil;
+   
+   PyObject *data = PyByteArray_FromStringAndSize(values.size() > 0 ? (const char*) &values[0] : "",
+                                                  Py_ssize_t(values.size() * sizeof(double)));
+   PyObject *nodeNames = PyList_New(Py_ssize_t(names.length()));
+   PyObject *times = PyList_New(Py_ssize_t(frames.size()));
+   PyObject *unsupportedNames = PyList_New(Py_ssize_t(unsupported.size()));
+   
+   for (unsigned int i=0; i<names.length(); ++i)
    {
-      if (outputType != OT_double_array)
+#if PY_MAJOR_VERSION >= 3
+      PyList_SetItem(nodeNames, Py_ssize_t(i), PyUnicode_FromString(names[i].asChar()));
+#else
+      PyList_SetItem(nodeNames, Py_ssize_t(i), PyString_FromString(names[i].asChar()));
+#endif
+   }
+   
+   for (size_t i=0; i<frames.size(); ++i)
+   {
+      PyList_SetItem(times, Py_ssize_t(i), PyFloat_FromDouble(frames[i]));
+   }
+   
+   for (size_t i=0; i<unsupported.size(); ++i)
+   {
+      PyObject *name = PyList_GetItem(nodeNames, Py_ssize_t(unsupported[i]));
+      
+      Py_INCREF(name);
+      PyList_SetItem(unsupportedNames, Py_ssize_t(i), name);
+   }
+   
+   PyObject *layout = Py_BuildValue("{s:(nn),s:N,s:N,s:s,s:n,s:N}", "shape", Py_ssize_t(nodes.size()), Py_ssize_t(frames.size()),
+                                    "nodes", nodeNames, "times", times, "format", "d", "failed", Py_ssize_t(failed),
+                                    "unsupported", unsupportedNames);
+   
+   // A single slot, replaced by the next call, so that buffers requested from
+   //   mel and never collected don't accumulate
+   PyObject *globals = PyModule_GetDict(PyImport_AddModule("__main__"));
+   
+   int handle = msNextBuffer++;
+   
+   PyObject *value = Py_BuildValue("(iNN)", handle, data, layout);
+   
+   PyDict_SetItemString(globals, "_pyexpr_batch_buffer", value);
+   
+   Py_DECREF(value);
+   
+   setResult(handle);
+   
+   return MS::kSuccess;
+#endif
+}
+
+// pyexprLog [-flush] [-messages [-node name] [-time]] [-dropped] [-clear]
+class PyExprLogCmd : public MPxCommand
+{
+public:
+   
+   static void* Create();
+   static MSyntax NewSyntax();
+   
+   virtual MStatus doIt(const MArgList &args);
+};
+
+void* PyExprLogCmd::Create()
+{
+   return new PyExprLogCmd();
+}
+
+MSyntax PyExprLogCmd::NewSyntax()
+{
+   MSyntax syntax;
+   
+   syntax.addFlag("-f", "-flush");
+   syntax.addFlag("-m", "-messages");
+   syntax.addFlag("-n", "-node", MSyntax::kString);
+   syntax.addFlag("-t", "-time");
+   syntax.addFlag("-d", "-dropped");
+   syntax.addFlag("-c", "-clear");
+   
+   return syntax;
+}
+
+MStatus PyExprLogCmd::doIt(const MArgList &args)
+{
+   MStatus stat;
+   MArgDatabase db(syntax(), args, &stat);
+   
+   if (stat != MS::kSuccess)
+   {
+      return stat;
+   }
+   
+   // Pending messages are always written first so that queries see them
+   Log::Flush();
+   
+   if (db.isFlagSet("-messages"))
+   {
+      MString node;
+      MStringArray messages;
+      
+      if (db.isFlagSet("-node"))
       {
-         if (verbose)
-         {
-            MGlobal::displayWarning("[pyexpr] Querying wrong output type");
-         }
-         success = false;
+         db.getFlagArgument("-node", 0, node);
       }
       
-      MArrayDataHandle hDoubleArrayOutput = block.outputArrayValue(aDoubleArrayOutput);
+      const std::deque<Log::Line> &lines = Log::Lines();
       
-      MArrayDataBuilder builder(&block, aDoubleArrayOutput, (success ? mDoubleArrayOutput.length() : 0));
-         
-      if (success)
+      for (std::deque<Log::Line>::const_iterator it = lines.begin(); it != lines.end(); ++it)
       {
-         for (unsigned int i=0; i<mDoubleArrayOutput.length(); ++i)
+         if (node.length() == 0 || it->node == node.asChar())
          {
-            MDataHandle hDoubleOutput = builder.addElement(i);
-            hDoubleOutput.set(mDoubleArrayOutput[i]);
+            messages.append(Log::Format(*it, db.isFlagSet("-time")));
          }
       }
       
-      hDoubleArrayOutput.set(builder);
-      hDoubleArrayOutput.setAllClean();
-      
-      return MS::kSuccess;
+      setResult(messages);
    }
-   else if (plug.attribute() == aStringArrayOutput)
+   else if (db.isFlagSet("-dropped"))
    {
-      if (outputType != OT_string_array)
+      setResult((int) Log::Dropped());
+   }
+   
+   if (db.isFlagSet("-clear"))
+   {
+      Log::Clear();
+   }
+   
+   return MS::kSuccess;
+}
+
+// -----------------------------------------------------------------------------
+
+static MCallbackId gTimelineTimeCB = 0;
+
+static void TimelineTimeChanged(MTime &time, void *)
+{
+   PyEvalTimelineMarker("frame", time.as(MTime::uiUnit()));
+}
+
+static void StopTimelineCallbacks()
+{
+   if (gTimelineTimeCB != 0)
+   {
+      MMessage::removeCallback(gTimelineTimeCB);
+      gTimelineTimeCB = 0;
+   }
+}
+
+// pyexprTrace -start [-file path] [-bufferSize events]
+// pyexprTrace -stop [-file path]
+// pyexprTrace -q [-start] [-file]
+class PyExprTraceCmd : public MPxCommand
+{
+public:
+   
+   static void* Create();
+   static MSyntax NewSyntax();
+   
+   virtual MStatus doIt(const MArgList &args);
+   
+private:
+   
+   // File written when recording stops
+   static MString msFile;
+};
+
+MString PyExprTraceCmd::msFile;
+
+void* PyExprTraceCmd::Create()
+{
+   return new PyExprTraceCmd();
+}
+
+MSyntax PyExprTraceCmd::NewSyntax()
+{
+   MSyntax syntax;
+   
+   syntax.enableQuery(true);
+   syntax.enableEdit(false);
+   syntax.addFlag("-st", "-start");
+   syntax.addFlag("-sp", "-stop");
+   syntax.addFlag("-f", "-file", MSyntax::kString);
+   syntax.addFlag("-bs", "-bufferSize", MSyntax::kLong);
+   
+   return syntax;
+}
+
+MStatus PyExprTraceCmd::doIt(const MArgList &args)
+{
+   MStatus stat;
+   MArgDatabase db(syntax(), args, &stat);
+   
+   if (stat != MS::kSuccess)
+   {
+      return stat;
+   }
+   
+   if (db.isQuery())
+   {
+      if (db.isFlagSet("-file"))
       {
-         if (verbose)
-         {
-            MGlobal::displayWarning("[pyexpr] Querying wrong output type");
-         }
-         success = false;
+         setResult(msFile);
       }
-      
-      MArrayDataHandle hStringArrayOutput = block.outputArrayValue(aStringArrayOutput);
-      
-      MArrayDataBuilder builder(&block, aStringArrayOutput, (success ? mStringArrayOutput.length() : 0));
-         
-      if (success)
+      else
       {
-         for (unsigned int i=0; i<mStringArrayOutput.length(); ++i)
-         {
-            MDataHandle hStringOutput = builder.addElement(i);
-            hStringOutput.set(mStringArrayOutput[i]);
-         }
+         setResult(PyEvalTimelineActive());
       }
       
-      hStringArrayOutput.set(builder);
-      hStringArrayOutput.setAllClean();
-      
       return MS::kSuccess;
    }
-   else if (plug.attribute() == aSucceeded)
+   
+   if (db.isFlagSet("-file"))
    {
-      MDataHandle hSucceeded = block.outputValue(aSucceeded);
+      db.getFlagArgument("-file", 0, msFile);
+   }
+   
+   if (db.isFlagSet("-start"))
+   {
+      // Events kept per thread, the oldest ones are dropped
+      int bufferSize = 1 << 16;
       
-      hSucceeded.set(success);
+      if (db.isFlagSet("-bufferSize"))
+      {
+         db.getFlagArgument("-bufferSize", 0, bufferSize);
+      }
       
-      block.setClean(plug);
+      PyEvalTimelineThreadName("main");
+      PyEvalStartTimeline(size_t(std::max(1, bufferSize)));
       
-      return MS::kSuccess;
+      if (gTimelineTimeCB == 0)
+      {
+         gTimelineTimeCB = MDGMessage::addTimeChangeCallback(TimelineTimeChanged, NULL, &stat);
+      }
    }
-   else if (plug.attribute() == aErrorString)
+   else if (db.isFlagSet("-stop"))
    {
-      MDataHandle hErrorString = block.outputValue(aErrorString);
+      if (!PyEvalTimelineActive())
+      {
+         MGlobal::displayWarning("[pyexpr] No trace is being recorded");
+         return MS::kSuccess;
+      }
+      
+      if (msFile.length() == 0)
+      {
+         // Keep recording, the trace can still be stopped with -file
+         MGlobal::displayError("[pyexpr] No trace file set, use -file");
+         return MS::kFailure;
+      }
       
-      hErrorString.set(mErrorString);
+      StopTimelineCallbacks();
       
-      block.setClean(plug);
+      std::string error;
       
-      return MS::kSuccess;
-   }
-   else
-   {
-      return MS::kUnknownParameter;
+      if (!PyEvalStopTimeline(msFile.asChar(), error))
+      {
+         MGlobal::displayError(MString("[pyexpr] ") + error.c_str());
+         return MS::kFailure;
+      }
+      
+      MGlobal::displayInfo("[pyexpr] Timeline written to " + msFile);
    }
+   
+   return MS::kSuccess;
 }
 
 // -----------------------------------------------------------------------------
 
+static MCallbackId gAfterOpenCB = 0;
+static MCallbackId gBeforeSaveCB = 0;
+static MCallbackId gModuleFilesCB = 0;
+static MCallbackId gLogRepeatsCB = 0;
+static MCallbackIdArray gTimeInputCBs;
+
 PLUGIN_EXPORT MStatus initializePlugin(MObject oPlugin)
 {
+   MStatus stat;
    MFnPlugin fnPlugin(oPlugin, "Gaetan Guidet", PYEXPR_VERSION, "2013");
    
-   return fnPlugin.registerNode("pyexpr", PyExpr::Id, PyExpr::Create, PyExpr::Initialize);
+   Settings::Init();
+   
+   if (MGlobal::executePythonCommand(PythonPrelude) != MS::kSuccess)
+   {
+      MGlobal::displayWarning("[pyexpr] Failed to declare python helpers, geometry inputs won't be available");
+   }
+   
+   PyEvalSetPrelude(PythonPrelude);
+   PyEvalSetErrorHandler(LogPythonError);
+   
+   if (Settings::Interpreters > 0)
+   {
+      StartInterpreters();
+   }
+   
+   // After the prelude, that workers run when they start
+   if (Settings::Workers > 0)
+   {
+      StartWorkers();
+   }
+   
+   stat = fnPlugin.registerNode("pyexpr", PyExpr::Id, PyExpr::Create, PyExpr::Initialize);
+   
+   if (stat != MS::kSuccess)
+   {
+      return stat;
+   }
+   
+   stat = fnPlugin.registerNode("pyexprDeformer", PyExprDeformer::Id, PyExprDeformer::Create, PyExprDeformer::Initialize, MPxNode::kDeformerNode);
+   
+   if (stat != MS::kSuccess)
+   {
+      fnPlugin.deregisterNode(PyExpr::Id);
+      return stat;
+   }
+   
+   fnPlugin.registerCommand("pyexprSettings", PyExprSettingsCmd::Create, PyExprSettingsCmd::NewSyntax);
+   fnPlugin.registerCommand("pyexprStats", PyExprStatsCmd::Create, PyExprStatsCmd::NewSyntax);
+   fnPlugin.registerCommand("pyexprTrace", PyExprTraceCmd::Create, PyExprTraceCmd::NewSyntax);
+   fnPlugin.registerCommand("pyexprLog", PyExprLogCmd::Create, PyExprLogCmd::NewSyntax);
+   fnPlugin.registerCommand("pyexprEvalBatch", PyExprEvalBatchCmd::Create, PyExprEvalBatchCmd::NewSyntax);
+   
+   gAfterOpenCB = MSceneMessage::addCallback(MSceneMessage::kAfterOpen, WarmUp);
+   gBeforeSaveCB = MSceneMessage::addCallback(MSceneMessage::kBeforeSave, StoreHistory);
+   gPlaybackCB = MConditionMessage::addConditionCallback("playingBack", PlaybackChanged);
+   gModuleFilesCB = MTimerMessage::addTimerCallback(1.0f, CheckModuleFiles);
+   gLogRepeatsCB = MTimerMessage::addTimerCallback(0.5f, FlushLogRepeats);
+   gTimeInputCBs.append(MSceneMessage::addCallback(MSceneMessage::kAfterOpen, ConnectPendingTimeInputs));
+   gTimeInputCBs.append(MSceneMessage::addCallback(MSceneMessage::kAfterImport, ConnectPendingTimeInputs));
+   gTimeInputCBs.append(MSceneMessage::addCallback(MSceneMessage::kAfterReference, ConnectPendingTimeInputs));
+   // Deferred references loaded later
+   gTimeInputCBs.append(MSceneMessage::addCallback(MSceneMessage::kAfterLoadReference, ConnectPendingTimeInputs));
+   
+   MessageNameCache::AddCallbacks();
+   
+   return stat;
 }
 
 PLUGIN_EXPORT MStatus uninitializePlugin(MObject oPlugin)
 {
    MFnPlugin fnPlugin(oPlugin);
    
+   MMessage::removeCallback(gAfterOpenCB);
+   MMessage::removeCallback(gBeforeSaveCB);
+   MMessage::removeCallback(gPlaybackCB);
+   MMessage::removeCallback(gModuleFilesCB);
+   MMessage::removeCallback(gLogRepeatsCB);
+   MMessage::removeCallbacks(gTimeInputCBs);
+   gTimeInputCBs.clear();
+   MessageNameCache::RemoveCallbacks();
+   StopTimelineCallbacks();
+   
+   AsyncEvaluator::Shutdown();
+   PyEvalShutdown();
+   PyEvalSetErrorHandler(0);
+   
+   // Write the pending messages and close the log file
+   Log::SetFile("");
+   
+   fnPlugin.deregisterCommand("pyexprEvalBatch");
+   fnPlugin.deregisterCommand("pyexprLog");
+   fnPlugin.deregisterCommand("pyexprTrace");
+   fnPlugin.deregisterCommand("pyexprStats");
+   fnPlugin.deregisterCommand("pyexprSettings");
+   fnPlugin.deregisterNode(PyExprDeformer::Id);
+   
    return fnPlugin.deregisterNode(PyExpr::Id);
 }
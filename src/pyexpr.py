@@ -0,0 +1,70 @@
+# Copyright (C) 2015  Gaetan Guidet
+#
+# This file is part of MayaPyExpr.
+#
+# MayaPyExpr is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# MayaPyExpr is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+
+# Python side of the pyexpr plugin commands
+#
+# import pyexpr
+# values, layout = pyexpr.evalBatch(["pyexpr1", "pyexpr2"], 1, 1000)
+# values[1, 9]  # pyexpr2 at frame 10
+# numpy.asarray(values)  # (2, 1000) float64 array, without copy
+
+import maya.cmds as cmds
+
+
+def evalBatch(nodes, startTime=None, endTime=None, by=1.0, times=None):
+  """Evaluate pyexpr nodes at several frames without changing the current time.
+
+  Returns (values, layout): values is a read/write buffer of float64 with shape
+  (len(nodes), len(times)), NaN where the evaluation failed. Only int and double
+  outputs are returned: the nodes with other output types aren't evaluated and
+  their rows are NaN. layout is a dictionary holding the 'shape', the 'nodes'
+  names, the 'times' in frames, the 'format', the 'failed' count of evaluations
+  and the 'unsupported' list of nodes with other output types.
+  """
+  import __main__
+
+  if not isinstance(nodes, (list, tuple)):
+    nodes = [nodes]
+
+  kwargs = {"buffer": True}
+
+  if times is not None:
+    kwargs["time"] = [float(t) for t in times]
+  else:
+    if startTime is not None:
+      kwargs["startTime"] = float(startTime)
+    if endTime is not None:
+      kwargs["endTime"] = float(endTime)
+    kwargs["by"] = float(by)
+
+  handle = cmds.pyexprEvalBatch(*nodes, **kwargs)
+  slot, data, layout = __main__.__dict__.pop("_pyexpr_batch_buffer")
+
+  if slot != handle:
+    raise RuntimeError("pyexprEvalBatch buffer was replaced before it was read")
+
+  try:
+    values = memoryview(data).cast("B").cast(layout["format"], layout["shape"])
+  except (AttributeError, TypeError):
+    # No memoryview.cast (python 2), or an empty shape
+    import ctypes
+    rows, columns = layout["shape"]
+    values = ((ctypes.c_double * columns) * rows).from_buffer(data) if len(data) > 0 else []
+
+  return values, layout
@@ -0,0 +1,738 @@
+/*
+Copyright (C) 2015  Gaetan Guidet
+
+This file is part of MayaPyExpr.
+
+MayaPyExpr is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+MayaPyExpr is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+// Evaluate an expression for every row of a columnar input file, without maya
+//
+// pyexprbatch (-e expression | -f file) [-s setup] [-t type] [-j workers] [-b batch] [-v] input output
+//
+// Each input column is passed to the expression as the argument named after
+//   it, as a dynamic attribute would be. Rows are split between worker
+//   processes, each evaluating its rows in batches in a single interpreter
+//   session. The output file has 3 columns: 'result' of the requested type,
+//   'succeeded' (int) and 'errorString' (string)
+//
+// Columnar files (see pyexprcolumns.py) are little endian:
+//   char[8] "PYEXCOL1", uint64 rows, uint32 columns, uint32 reserved
+//   then for each column:
+//     uint32 type, uint32 name size, uint64 data offset, uint64 data size, name
+//   Column types are PyEvalOutputType values: int (int32 per row), double
+//   (float64 per row) or string (uint64 offsets[rows+1] into the utf-8 data
+//   following them). Data offsets are from the start of the file and aligned
+//   on 8 bytes
+
+#include "pyeval.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+
+struct Column
+{
+   std::string name;
+   unsigned int type;
+   const char *data;
+   uint64_t size;
+};
+
+class ColumnFile
+{
+public:
+
+   ColumnFile()
+      : mFd(-1)
+      , mData(0)
+      , mSize(0)
+      , mRows(0)
+   {
+   }
+   
+   ~ColumnFile()
+   {
+      if (mData)
+      {
+         munmap(mData, mSize);
+      }
+      if (mFd != -1)
+      {
+         close(mFd);
+      }
+   }
+   
+   bool open(const char *path, std::string &error);
+   
+   inline uint64_t rows() const { return mRows; }
+   inline const std::vector<Column>& columns() const { return mColumns; }
+
+private:
+
+   ColumnFile(const ColumnFile&);
+   ColumnFile& operator=(const ColumnFile&);
+   
+   int mFd;
+   void *mData;
+   size_t mSize;
+   uint64_t mRows;
+   std::vector<Column> mColumns;
+};
+
+template <typename T>
+static T Get(const char *ptr)
+{
+   T value;
+   memcpy(&value, ptr, sizeof(T));
+   return value;
+}
+
+bool ColumnFile::open(const char *path, std::string &error)
+{
+   mFd = ::open(path, O_RDONLY);
+   
+   if (mFd == -1)
+   {
+      error = std::string("Could not open '") + path + "'";
+      return false;
+   }
+   
+   struct stat st;
+   
+   if (fstat(mFd, &st) != 0 || st.st_size < 24)
+   {
+      error = std::string("'") + path + "' is not a columnar file";
+      return false;
+   }
+   
+   mSize = size_t(st.st_size);
+   mData = mmap(0, mSize, PROT_READ, MAP_PRIVATE, mFd, 0);
+   
+   if (mData == MAP_FAILED)
+   {
+      mData = 0;
+      error = std::string("Could not map '") + path + "'";
+      return false;
+   }
+   
+   const char *base = (const char*) mData;
+   
+   if (memcmp(base, "PYEXCOL1", 8) != 0)
+   {
+      error = std::string("'") + path + "' is not a columnar file";
+      return false;
+   }
+   
+   mRows = Get<uint64_t>(base + 8);
+   
+   // Every column has at least a byte per row, this also bounds the sizes
+   //   computed from the row count below
+   if (mRows > mSize)
+   {
+      error = std::string("'") + path + "' is truncated";
+      return false;
+   }
+   
+   uint32_t count = Get<uint32_t>(base + 16);
+   size_t pos = 24;
+   
+   for (uint32_t i=0; i<count; ++i)
+   {
+      if (pos + 24 > mSize)
+      {
+         error = "Truncated column table";
+         return false;
+      }
+      
+      Column column;
+      
+      column.type = Get<uint32_t>(base + pos);
+      uint32_t nameSize = Get<uint32_t>(base + pos + 4);
+      uint64_t offset = Get<uint64_t>(base + pos + 8);
+      column.size = Get<uint64_t>(base + pos + 16);
+      
+      pos += 24;
+      
+      if (nameSize > mSize - pos || offset > mSize || column.size > mSize - offset)
+      {
+         error = "Truncated column";
+         return false;
+      }
+      
+      column.name.assign(base + pos, nameSize);
+      column.data = base + offset;
+      
+      pos += nameSize;
+      
+      uint64_t expected = 0;
+      
+      switch (column.type)
+      {
+      case PyEval_int:
+         expected = 4 * mRows;
+         break;
+      case PyEval_double:
+         expected = 8 * mRows;
+         break;
+      case PyEval_string:
+         expected = 8 * (mRows + 1);
+         break;
+      default:
+         error = "Unsupported type for column '" + column.name + "'";
+         return false;
+      }
+      
+      if (column.size < expected)
+      {
+         error = "Column '" + column.name + "' is too small";
+         return false;
+      }
+      
+      if (column.type == PyEval_string)
+      {
+         // Strings are read without further checks, see ColumnValue
+         uint64_t dataSize = column.size - expected;
+         uint64_t prev = Get<uint64_t>(column.data);
+         
+         for (uint64_t r=1; r<=mRows; ++r)
+         {
+            uint64_t next = Get<uint64_t>(column.data + 8 * r);
+            
+            if (next < prev || next > dataSize)
+            {
+               std::ostringstream oss;
+               oss << "Column '" << column.name << "' has invalid string offsets at row " << (r - 1);
+               error = oss.str();
+               return false;
+            }
+            
+            prev = next;
+         }
+         
+         if (prev > dataSize)
+         {
+            error = "Column '" + column.name + "' has invalid string offsets";
+            return false;
+         }
+      }
+      
+      mColumns.push_back(column);
+   }
+   
+   return true;
+}
+
+// Value of column at row, new reference
+static PyObject* ColumnValue(const Column &column, uint64_t rows, uint64_t row)
+{
+   switch (column.type)
+   {
+   case PyEval_int:
+      return PyLong_FromLong(Get<int32_t>(column.data + 4 * row));
+   case PyEval_double:
+      return PyFloat_FromDouble(Get<double>(column.data + 8 * row));
+   default:
+      {
+         // Offsets are checked when the file is opened
+         uint64_t begin = Get<uint64_t>(column.data + 8 * row);
+         uint64_t end = Get<uint64_t>(column.data + 8 * (row + 1));
+         const char *str = column.data + 8 * (rows + 1) + begin;
+         Py_ssize_t len = Py_ssize_t(end - begin);
+#if PY_MAJOR_VERSION >= 3
+         PyObject *value = PyUnicode_DecodeUTF8(str, len, "replace");
+#else
+         PyObject *value = PyString_FromStringAndSize(str, len);
+#endif
+         return value;
+      }
+   }
+}
+
+// -----------------------------------------------------------------------------
+
+struct Options
+{
+   Options()
+      : outputType(PyEval_double)
+      , workers(1)
+      , batch(1024)
+      , verbose(false)
+   {
+   }
+   
+   std::string expression;
+   std::string setup;
+   short outputType;
+   int workers;
+   int batch;
+   bool verbose;
+};
+
+static void PutU32(std::string &out, uint32_t value)
+{
+   out.append((const char*) &value, 4);
+}
+
+// Rows results, appended to out as:
+//   uint8 succeeded, int32 | float64 | uint32 size + utf-8 result, uint32 size + error
+static void AppendResult(const PyEvalResult &result, short outputType, std::string &out)
+{
+   out += char(result.succeeded ? 1 : 0);
+   
+   switch (outputType)
+   {
+   case PyEval_int:
+      {
+         int32_t value = result.intOutput;
+         out.append((const char*) &value, 4);
+      }
+      break;
+   case PyEval_double:
+      out.append((const char*) &result.doubleOutput, 8);
+      break;
+   default:
+      PutU32(out, uint32_t(result.stringOutput.size()));
+      out += result.stringOutput;
+   }
+   
+   PutU32(out, uint32_t(result.errorString.size()));
+   out += result.errorString;
+}
+
+// Evaluate rows [begin, end) and write their results to path
+static bool Evaluate(const ColumnFile &input, uint64_t begin, uint64_t end, const Options &options, const std::string &path)
+{
+   Py_Initialize();
+   
+   std::string out;
+   
+   {
+      const std::vector<Column> &columns = input.columns();
+      std::vector<std::string> params;
+      
+      for (size_t i=0; i<columns.size(); ++i)
+      {
+         params.push_back(columns[i].name);
+      }
+      
+      PyEvalCodePtr code = PyEvalGetCode(PyEvalDeclareFunction(params, options.expression), params);
+      PyEvalScopePtr scope;
+      
+      if (options.setup.length() > 0)
+      {
+         scope = PyEvalScopePtr(new PyEvalScope(options.setup));
+      }
+      
+      std::vector<PyEvalRequest> requests;
+      std::vector<PyEvalResult> results;
+      
+      PyEvalGIL gil;
+      
+      // Arguments of the current batch are handed to the requests through a
+      //   list in __main__, so that they are evaluated from an expression as
+      //   in maya
+      PyObject *globals = PyModule_GetDict(PyImport_AddModule("__main__"));
+      
+      for (uint64_t row=begin; row<end; row+=uint64_t(options.batch))
+      {
+         uint64_t last = std::min(end, row + uint64_t(options.batch));
+         
+         PyObject *batch = PyList_New(Py_ssize_t(last - row));
+         
+         requests.resize(size_t(last - row));
+         
+         for (uint64_t r=row; r<last; ++r)
+         {
+            PyObject *args = PyTuple_New(Py_ssize_t(columns.size()));
+            
+            for (size_t i=0; i<columns.size(); ++i)
+            {
+               PyTuple_SetItem(args, Py_ssize_t(i), ColumnValue(columns[i], input.rows(), r));
+            }
+            
+            PyList_SetItem(batch, Py_ssize_t(r - row), args);
+            
+            PyEvalRequest &request = requests[size_t(r - row)];
+            
+            if (!request.code)
+            {
+               std::ostringstream oss;
+               oss << "_pyexpr_batch_args[" << (r - row) << "]";
+               
+               request.code = code;
+               request.scope = scope;
+               request.args = oss.str();
+               request.outputType = options.outputType;
+               request.verbose = options.verbose;
+            }
+         }
+         
+         PyDict_SetItemString(globals, "_pyexpr_batch_args", batch);
+         Py_DECREF(batch);
+         
+         // Rows share the code, their arguments are evaluated and the function
+         //   called in a single pass
+         PyEvalRunBatch(requests, results);
+         
+         for (size_t i=0; i<results.size(); ++i)
+         {
+            AppendResult(results[i], options.outputType, out);
+         }
+      }
+      
+      PyDict_DelItemString(globals, "_pyexpr_batch_args");
+      PyErr_Clear();
+   }
+   
+   PyEvalShutdown();
+   
+   Py_Finalize();
+   
+   std::ofstream file(path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+   
+   file.write(out.data(), std::streamsize(out.size()));
+   
+   return !file.fail();
+}
+
+// -----------------------------------------------------------------------------
+
+static void PutColumn(std::string &table, std::string &data, uint64_t base, unsigned int type, const std::string &name, const std::string &values)
+{
+   while (data.size() % 8 != 0)
+   {
+      data += '\0';
+   }
+   
+   uint32_t type32 = type;
+   uint32_t nameSize = uint32_t(name.size());
+   uint64_t offset = base + data.size();
+   uint64_t size = values.size();
+   
+   table.append((const char*) &type32, 4);
+   table.append((const char*) &nameSize, 4);
+   table.append((const char*) &offset, 8);
+   table.append((const char*) &size, 8);
+   table += name;
+   
+   data += values;
+}
+
+// Merge the worker results files into the columnar output file
+static bool WriteOutput(const std::vector<std::string> &parts, uint64_t rows, short outputType, const char *path)
+{
+   std::string results, succeeded, errorOffsets, errors, stringOffsets, strings;
+   
+   uint64_t offset = 0;
+   errorOffsets.append((const char*) &offset, 8);
+   stringOffsets.append((const char*) &offset, 8);
+   
+   uint64_t count = 0;
+   
+   for (size_t p=0; p<parts.size(); ++p)
+   {
+      std::ifstream in(parts[p].c_str(), std::ios::in | std::ios::binary);
+      std::ostringstream oss;
+      oss << in.rdbuf();
+      std::string part = oss.str();
+      
+      size_t pos = 0;
+      
+      while (pos < part.size())
+      {
+         int32_t ok = (part[pos] != 0 ? 1 : 0);
+         succeeded.append((const char*) &ok, 4);
+         pos += 1;
+         
+         if (outputType == PyEval_int)
+         {
+            results.append(part, pos, 4);
+            pos += 4;
+         }
+         else if (outputType == PyEval_double)
+         {
+            results.append(part, pos, 8);
+            pos += 8;
+         }
+         else
+         {
+            uint32_t n = Get<uint32_t>(part.data() + pos);
+            strings.append(part, pos + 4, n);
+            offset = strings.size();
+            stringOffsets.append((const char*) &offset, 8);
+            pos += 4 + n;
+         }
+         
+         uint32_t n = Get<uint32_t>(part.data() + pos);
+         errors.append(part, pos + 4, n);
+         offset = errors.size();
+         errorOffsets.append((const char*) &offset, 8);
+         pos += 4 + n;
+         
+         ++count;
+      }
+   }
+   
+   if (count != rows)
+   {
+      std::cerr << "Expected " << rows << " result(s), got " << count << std::endl;
+      return false;
+   }
+   
+   std::string names[3] = {"result", "succeeded", "errorString"};
+   
+   // Header and column table size, to compute the data offsets
+   uint64_t base = 24;
+   for (int i=0; i<3; ++i)
+   {
+      base += 24 + names[i].size();
+   }
+   base = (base + 7) & ~uint64_t(7);
+   
+   std::string table, data;
+   
+   PutColumn(table, data, base, (unsigned int) outputType, names[0], (outputType == PyEval_string ? stringOffsets + strings : results));
+   PutColumn(table, data, base, PyEval_int, names[1], succeeded);
+   PutColumn(table, data, base, PyEval_string, names[2], errorOffsets + errors);
+   
+   std::string header = "PYEXCOL1";
+   uint32_t columns = 3, reserved = 0;
+   header.append((const char*) &rows, 8);
+   header.append((const char*) &columns, 4);
+   header.append((const char*) &reserved, 4);
+   header += table;
+   header.resize(size_t(base), '\0');
+   
+   std::ofstream out(path, std::ios::out | std::ios::binary | std::ios::trunc);
+   
+   out.write(header.data(), std::streamsize(header.size()));
+   out.write(data.data(), std::streamsize(data.size()));
+   
+   return !out.fail();
+}
+
+// -----------------------------------------------------------------------------
+
+static void Usage()
+{
+   std::cout << "pyexprbatch (-e expression | -f file) [-s setup] [-t type] [-j workers] [-b batch] [-v] input output" << std::endl;
+   std::cout << "  -e/--expression : expression body" << std::endl;
+   std::cout << "  -f/--file       : read expression body from file" << std::endl;
+   std::cout << "  -s/--setup      : setup expression, run once per worker" << std::endl;
+   std::cout << "  -t/--type       : output type, int, double or string (double)" << std::endl;
+   std::cout << "  -j/--workers    : number of worker processes (1)" << std::endl;
+   std::cout << "  -b/--batch      : rows evaluated per interpreter session (1024)" << std::endl;
+   std::cout << "  -v/--verbose    : print evaluation errors" << std::endl;
+}
+
+static bool ReadFile(const char *path, std::string &content)
+{
+   std::ifstream in(path, std::ios::in | std::ios::binary);
+   
+   if (!in)
+   {
+      return false;
+   }
+   
+   std::ostringstream oss;
+   oss << in.rdbuf();
+   content = oss.str();
+   
+   return true;
+}
+
+int main(int argc, char **argv)
+{
+   Options options;
+   std::vector<const char*> paths;
+   bool hasExpression = false;
+   
+   for (int i=1; i<argc; ++i)
+   {
+      std::string arg = argv[i];
+      
+      bool hasValue = (i + 1 < argc);
+      
+      if ((arg == "-e" || arg == "--expression") && hasValue)
+      {
+         options.expression = argv[++i];
+         hasExpression = true;
+      }
+      else if ((arg == "-f" || arg == "--file") && hasValue)
+      {
+         if (!ReadFile(argv[++i], options.expression))
+         {
+            std::cerr << "Could not read '" << argv[i] << "'" << std::endl;
+            return 1;
+         }
+         hasExpression = true;
+      }
+      else if ((arg == "-s" || arg == "--setup") && hasValue)
+      {
+         options.setup = argv[++i];
+      }
+      else if ((arg == "-t" || arg == "--type") && hasValue)
+      {
+         std::string type = argv[++i];
+         
+         if (type == "int")
+         {
+            options.outputType = PyEval_int;
+         }
+         else if (type == "double")
+         {
+            options.outputType = PyEval_double;
+         }
+         else if (type == "string")
+         {
+            options.outputType = PyEval_string;
+         }
+         else
+         {
+            std::cerr << "Unsupported output type '" << type << "'" << std::endl;
+            return 1;
+         }
+      }
+      else if ((arg == "-j" || arg == "--workers") && hasValue)
+      {
+         options.workers = std::max(1, atoi(argv[++i]));
+      }
+      else if ((arg == "-b" || arg == "--batch") && hasValue)
+      {
+         options.batch = std::max(1, atoi(argv[++i]));
+      }
+      else if (arg == "-v" || arg == "--verbose")
+      {
+         options.verbose = true;
+      }
+      else if (arg == "-h" || arg == "--help")
+      {
+         Usage();
+         return 0;
+      }
+      else
+      {
+         paths.push_back(argv[i]);
+      }
+   }
+   
+   if (!hasExpression || paths.size() != 2)
+   {
+      Usage();
+      return 1;
+   }
+   
+   ColumnFile input;
+   std::string error;
+   
+   if (!input.open(paths[0], error))
+   {
+      std::cerr << error << std::endl;
+      return 1;
+   }
+   
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+   
+   uint64_t rows = input.rows();
+   uint64_t workers = std::min(uint64_t(options.workers), std::max(uint64_t(1), rows));
+   uint64_t perWorker = (rows + workers - 1) / workers;
+   
+   std::vector<std::string> parts;
+   std::vector<pid_t> pids;
+   
+   for (uint64_t w=0; w<workers; ++w)
+   {
+      std::ostringstream oss;
+      oss << paths[1] << "." << getpid() << "." << w;
+      parts.push_back(oss.str());
+   }
+   
+   bool failed = false;
+   
+   if (workers == 1)
+   {
+      failed = !Evaluate(input, 0, rows, options, parts[0]);
+   }
+   else
+   {
+      // Workers are forked before python is initialized, each runs its own
+      //   interpreter. The input mapping is shared
+      for (uint64_t w=0; w<workers; ++w)
+      {
+         uint64_t begin = std::min(rows, w * perWorker);
+         uint64_t end = std::min(rows, begin + perWorker);
+         
+         pid_t pid = fork();
+         
+         if (pid == 0)
+         {
+            _exit(Evaluate(input, begin, end, options, parts[w]) ? 0 : 1);
+         }
+         else if (pid < 0)
+         {
+            std::cerr << "Could not start worker " << w << std::endl;
+            failed = true;
+            break;
+         }
+         
+         pids.push_back(pid);
+      }
+      
+      for (size_t w=0; w<pids.size(); ++w)
+      {
+         int status = 0;
+         
+         if (waitpid(pids[w], &status, 0) != pids[w] || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+         {
+            std::cerr << "Worker " << w << " failed" << std::endl;
+            failed = true;
+         }
+      }
+   }
+   
+   if (!failed && !WriteOutput(parts, rows, options.outputType, paths[1]))
+   {
+      std::cerr << "Could not write '" << paths[1] << "'" << std::endl;
+      failed = true;
+   }
+   
+   for (size_t w=0; w<parts.size(); ++w)
+   {
+      unlink(parts[w].c_str());
+   }
+   
+   if (failed)
+   {
+      return 1;
+   }
+   
+   double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+   
+   std::cout << "Evaluated " << rows << " row(s) with " << workers << " worker(s) in " << ms << " ms" << std::endl;
+   
+   return 0;
+}
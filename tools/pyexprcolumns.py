@@ -0,0 +1,107 @@
+# Copyright (C) 2015  Gaetan Guidet
+#
+# This file is part of MayaPyExpr.
+#
+# MayaPyExpr is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# MayaPyExpr is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+# Read and write the columnar files used by pyexprbatch (see pyexprbatch.cpp)
+#
+# import pyexprcolumns
+# pyexprcolumns.write("in.col", [("frame", "double", frames), ("name", "string", names)])
+# columns = pyexprcolumns.read("out.col")  # {"result": [...], "succeeded": [...], "errorString": [...]}
+
+import struct
+
+INT = 0
+DOUBLE = 2
+STRING = 4
+
+_types = {"int": INT, "double": DOUBLE, "string": STRING}
+
+
+def _pad(n):
+  return (8 - n % 8) % 8
+
+
+def _encode(typ, values):
+  if typ == INT:
+    return struct.pack("<%di" % len(values), *values)
+  elif typ == DOUBLE:
+    return struct.pack("<%dd" % len(values), *values)
+  else:
+    data = [v.encode("utf-8") if not isinstance(v, bytes) else v for v in values]
+    offsets = [0]
+    for d in data:
+      offsets.append(offsets[-1] + len(d))
+    return struct.pack("<%dQ" % len(offsets), *offsets) + b"".join(data)
+
+
+def write(path, columns):
+  """columns: list of (name, type, values), type being 'int', 'double' or 'string'"""
+  rows = len(columns[0][2]) if columns else 0
+  blobs = []
+  for name, typ, values in columns:
+    if len(values) != rows:
+      raise ValueError("column '%s' has %d value(s), expected %d" % (name, len(values), rows))
+    blobs.append((name.encode("utf-8"), _types.get(typ, typ), _encode(_types.get(typ, typ), values)))
+
+  base = 24 + sum(24 + len(name) for name, _, _ in blobs)
+  base += _pad(base)
+
+  table = b""
+  data = b""
+  for name, typ, blob in blobs:
+    data += b"\0" * _pad(len(data))
+    table += struct.pack("<IIQQ", typ, len(name), base + len(data), len(blob)) + name
+    data += blob
+
+  header = b"PYEXCOL1" + struct.pack("<QII", rows, len(blobs), 0) + table
+  header += b"\0" * (base - len(header))
+
+  with open(path, "wb") as f:
+    f.write(header)
+    f.write(data)
+
+
+def read(path):
+  """Returns a dictionary of column values lists by name"""
+  with open(path, "rb") as f:
+    content = f.read()
+
+  if content[:8] != b"PYEXCOL1":
+    raise ValueError("'%s' is not a columnar file" % path)
+
+  rows, count, _ = struct.unpack_from("<QII", content, 8)
+  columns = {}
+  pos = 24
+
+  for _ in range(count):
+    typ, nameSize, offset, size = struct.unpack_from("<IIQQ", content, pos)
+    pos += 24
+    name = content[pos:pos+nameSize].decode("utf-8")
+    pos += nameSize
+
+    if typ == INT:
+      values = list(struct.unpack_from("<%di" % rows, content, offset))
+    elif typ == DOUBLE:
+      values = list(struct.unpack_from("<%dd" % rows, content, offset))
+    else:
+      offsets = struct.unpack_from("<%dQ" % (rows + 1), content, offset)
+      start = offset + 8 * (rows + 1)
+      values = [content[start+offsets[i]:start+offsets[i+1]].decode("utf-8") for i in range(rows)]
+
+    columns[name] = values
+
+  return columns
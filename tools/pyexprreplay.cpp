@@ -0,0 +1,429 @@
+/*
+Copyright (C) 2015  Gaetan Guidet
+
+This file is part of MayaPyExpr.
+
+MayaPyExpr is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+MayaPyExpr is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+// Replay an evaluation trace recorded by the plugin (pyexprSettings -traceFile)
+//   against the evaluation core, without maya, and report throughput
+//
+// pyexprreplay [-r repeat] [-v] trace
+
+#include "pyeval.h"
+#include <marshal.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+
+struct TraceEval
+{
+   unsigned long long hash;
+   short outputType;
+   unsigned int flags;
+   unsigned long long duration;
+   std::string args;
+};
+
+struct CodeStats
+{
+   CodeStats()
+      : evals(0)
+      , failed(0)
+      , changed(0)
+      , recorded(0.0)
+      , replayed(0.0)
+   {
+   }
+   
+   PyEvalCodePtr code;
+   size_t evals;
+   size_t failed;
+   // Evaluations that succeeded when recorded and failed when replayed, or the
+   //   other way round
+   size_t changed;
+   // Times in milliseconds
+   double recorded;
+   double replayed;
+};
+
+typedef std::map<unsigned long long, CodeStats> Codes;
+
+// Little endian values of a record, see PyEvalStartTrace
+class Reader
+{
+public:
+
+   Reader(const std::string &data, size_t begin, size_t end)
+      : mData(data)
+      , mPos(begin)
+      , mEnd(end)
+      , mFailed(false)
+   {
+   }
+   
+   inline bool failed() const { return mFailed; }
+   
+   unsigned long long get(size_t nbytes)
+   {
+      unsigned long long value = 0;
+      
+      if (mFailed || mPos + nbytes > mEnd)
+      {
+         mFailed = true;
+         return 0;
+      }
+      
+      for (size_t i=0; i<nbytes; ++i)
+      {
+         value |= ((unsigned long long) (unsigned char) mData[mPos+i]) << (8 * i);
+      }
+      
+      mPos += nbytes;
+      
+      return value;
+   }
+   
+   std::string bytes()
+   {
+      size_t n = size_t(get(4));
+      
+      if (mFailed || mPos + n > mEnd)
+      {
+         mFailed = true;
+         return "";
+      }
+      
+      std::string rv = mData.substr(mPos, n);
+      
+      mPos += n;
+      
+      return rv;
+   }
+
+private:
+
+   const std::string &mData;
+   size_t mPos;
+   size_t mEnd;
+   bool mFailed;
+};
+
+static bool ReadTrace(const char *path, Codes &codes, std::vector<TraceEval> &evals)
+{
+   std::ifstream in(path, std::ios::in | std::ios::binary);
+   
+   if (!in)
+   {
+      std::cerr << "Could not open '" << path << "'" << std::endl;
+      return false;
+   }
+   
+   std::ostringstream oss;
+   oss << in.rdbuf();
+   std::string data = oss.str();
+   
+   if (data.size() < 16 || data.compare(0, 8, "PYEXTRC1") != 0)
+   {
+      std::cerr << "'" << path << "' is not a pyexpr trace" << std::endl;
+      return false;
+   }
+   
+   unsigned long version = (unsigned long) Reader(data, 8, 12).get(4);
+   
+   if ((version >> 16) != ((unsigned long) PY_VERSION_HEX >> 16))
+   {
+      std::cerr << "Warning: trace recorded with python " << (version >> 24) << "." << ((version >> 16) & 0xFF)
+                << ", marshalled values may not load" << std::endl;
+   }
+   
+   size_t pos = 16;
+   
+   while (pos < data.size())
+   {
+      size_t size = size_t(Reader(data, pos, data.size()).get(4));
+      
+      if (pos + 4 + size > data.size())
+      {
+         // Recording session ended before the trace was closed
+         std::cerr << "Warning: trace truncated at offset " << pos << std::endl;
+         break;
+      }
+      
+      Reader record(data, pos + 4, pos + 4 + size);
+      
+      unsigned int kind = (unsigned int) record.get(1);
+      unsigned long long hash = record.get(8);
+      
+      if (kind == PyEvalTrace_code)
+      {
+         std::vector<std::string> params(size_t(record.get(4)));
+         
+         for (size_t i=0; i<params.size() && !record.failed(); ++i)
+         {
+            params[i] = record.bytes();
+         }
+         
+         std::string source = record.bytes();
+         
+         if (!record.failed())
+         {
+            codes[hash].code = PyEvalGetCode(source, params);
+         }
+      }
+      else if (kind == PyEvalTrace_eval)
+      {
+         TraceEval eval;
+         
+         eval.hash = hash;
+         eval.outputType = (short) record.get(1);
+         eval.flags = (unsigned int) record.get(1);
+         eval.duration = record.get(8);
+         eval.args = record.bytes();
+         
+         if (!record.failed())
+         {
+            evals.push_back(eval);
+         }
+      }
+      
+      if (record.failed())
+      {
+         std::cerr << "Warning: invalid record at offset " << pos << std::endl;
+      }
+      
+      pos += 4 + size;
+   }
+   
+   return true;
+}
+
+static void Usage()
+{
+   std::cout << "pyexprreplay [-r repeat] [-v] trace" << std::endl;
+   std::cout << "  -r/--repeat  : number of times the trace is replayed (1)" << std::endl;
+   std::cout << "  -v/--verbose : print evaluation errors" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+   const char *path = 0;
+   int repeat = 1;
+   bool verbose = false;
+   
+   for (int i=1; i<argc; ++i)
+   {
+      if (!strcmp(argv[i], "-r") || !strcmp(argv[i], "--repeat"))
+      {
+         if (++i >= argc)
+         {
+            Usage();
+            return 1;
+         }
+         repeat = std::max(1, atoi(argv[i]));
+      }
+      else if (!strcmp(argv[i], "-v") || !strcmp(argv[i], "--verbose"))
+      {
+         verbose = true;
+      }
+      else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help"))
+      {
+         Usage();
+         return 0;
+      }
+      else
+      {
+         path = argv[i];
+      }
+   }
+   
+   if (!path)
+   {
+      Usage();
+      return 1;
+   }
+   
+   Py_Initialize();
+   
+   int status = 0;
+   
+   // Codes must be released before finalizing
+   {
+      Codes codes;
+      std::vector<TraceEval> evals;
+      
+      if (!ReadTrace(path, codes, evals))
+      {
+         status = 1;
+      }
+      else
+      {
+         PyEvalGIL gil;
+         
+         // Arguments are handed to the requests through a list in __main__,
+         //   so that they are evaluated from an expression as in maya
+         PyObject *globals = PyModule_GetDict(PyImport_AddModule("__main__"));
+         PyObject *argsList = PyList_New(0);
+         
+         PyDict_SetItemString(globals, "_pyexpr_replay_args", argsList);
+         
+         std::vector<PyEvalRequest> requests;
+         std::vector<const TraceEval*> recorded;
+         
+         for (size_t i=0; i<evals.size(); ++i)
+         {
+            const TraceEval &eval = evals[i];
+            
+            Codes::iterator it = codes.find(eval.hash);
+            
+            if (it == codes.end() || !it->second.code)
+            {
+               continue;
+            }
+            
+            PyObject *args = PyMarshal_ReadObjectFromString((char*) eval.args.data(), Py_ssize_t(eval.args.size()));
+            
+            if (!args || !PyTuple_Check(args))
+            {
+               PyErr_Clear();
+               Py_XDECREF(args);
+               continue;
+            }
+            
+            std::ostringstream oss;
+            oss << "_pyexpr_replay_args[" << PyList_Size(argsList) << "]";
+            
+            PyList_Append(argsList, args);
+            Py_DECREF(args);
+            
+            PyEvalRequest request;
+            
+            request.code = it->second.code;
+            request.args = oss.str();
+            request.outputType = eval.outputType;
+            request.verbose = verbose;
+            
+            requests.push_back(request);
+            recorded.push_back(&eval);
+         }
+         
+         Py_DECREF(argsList);
+         
+         size_t skipped = evals.size() - requests.size();
+         
+         // Don't time compilation
+         std::vector<PyEvalCodePtr> compile;
+         for (Codes::iterator it = codes.begin(); it != codes.end(); ++it)
+         {
+            compile.push_back(it->second.code);
+         }
+         PyEvalCompile(compile, verbose);
+         
+         double total = 0.0;
+         double totalRecorded = 0.0;
+         PyEvalResult result;
+         
+         for (int r=0; r<repeat; ++r)
+         {
+            for (size_t i=0; i<requests.size(); ++i)
+            {
+               const TraceEval &eval = *(recorded[i]);
+               CodeStats &stats = codes[eval.hash];
+               
+               std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+               
+               bool succeeded = PyEvalRun(requests[i], result);
+               
+               double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+               
+               stats.evals += 1;
+               stats.replayed += ms;
+               stats.recorded += double(eval.duration) / 1000000.0;
+               
+               if (!succeeded)
+               {
+                  stats.failed += 1;
+               }
+               
+               if (succeeded != ((eval.flags & PyEvalTrace_succeeded) != 0))
+               {
+                  stats.changed += 1;
+               }
+               
+               total += ms;
+               totalRecorded += double(eval.duration) / 1000000.0;
+            }
+         }
+         
+         std::cout << path << ": " << codes.size() << " code(s), " << requests.size() << " evaluation(s)";
+         if (skipped > 0)
+         {
+            std::cout << " (" << skipped << " skipped)";
+         }
+         std::cout << ", replayed " << repeat << " time(s)" << std::endl << std::endl;
+         
+         std::cout << std::setw(18) << "code" << std::setw(10) << "evals" << std::setw(8) << "failed"
+                   << std::setw(9) << "changed" << std::setw(14) << "recorded ms" << std::setw(14) << "replayed ms"
+                   << std::setw(12) << "evals/s" << std::endl;
+                   
+         size_t totalEvals = 0;
+         size_t totalFailed = 0;
+         size_t totalChanged = 0;
+         
+         std::cout << std::fixed << std::setprecision(3);
+         
+         for (Codes::iterator it = codes.begin(); it != codes.end(); ++it)
+         {
+            const CodeStats &stats = it->second;
+            
+            if (stats.evals == 0)
+            {
+               continue;
+            }
+            
+            std::cout << std::hex << std::setw(18) << it->first << std::dec << std::setw(10) << stats.evals
+                      << std::setw(8) << stats.failed << std::setw(9) << stats.changed
+                      << std::setw(14) << stats.recorded << std::setw(14) << stats.replayed
+                      << std::setw(12) << std::setprecision(0) << (stats.replayed > 0.0 ? 1000.0 * stats.evals / stats.replayed : 0.0)
+                      << std::setprecision(3) << std::endl;
+                      
+            totalEvals += stats.evals;
+            totalFailed += stats.failed;
+            totalChanged += stats.changed;
+         }
+         
+         std::cout << std::setw(18) << "total" << std::setw(10) << totalEvals << std::setw(8) << totalFailed
+                   << std::setw(9) << totalChanged << std::setw(14) << totalRecorded << std::setw(14) << total
+                   << std::setw(12) << std::setprecision(0) << (total > 0.0 ? 1000.0 * totalEvals / total : 0.0)
+                   << std::endl;
+                   
+         PyDict_DelItemString(globals, "_pyexpr_replay_args");
+      }
+   }
+   
+   PyEvalShutdown();
+   
+   Py_Finalize();
+   
+   return status;
+}